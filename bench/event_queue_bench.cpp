@@ -0,0 +1,156 @@
+/**
+ * Microbenchmark comparing the lock-free eventQueue against the
+ * original mutex/condition_variable queue
+ * @author Owen Capell
+*/
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <condition_variable>
+#include <benchmark/benchmark.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "slab_pool.hpp"
+
+/**
+ * @details
+ * Copy of the original unbounded, mutex-protected eventQueue kept as baseline
+ * (one heap-allocated processed_adv_event per push, as the capture loop did)
+*/
+class legacyEventQueue{
+public:
+	void push(std::shared_ptr<processed_adv_event> p){
+		lock.lock();
+		queue.push(p);
+		lock.unlock();
+
+		cv.notify_one();
+	}
+
+	std::shared_ptr<processed_adv_event> pop(){
+		std::unique_lock<std::mutex> lockGuard(lock);
+		cv.wait(lockGuard, [this]{ return !queue.empty(); });
+
+		std::shared_ptr<processed_adv_event> p = queue.front();
+		queue.pop();
+		return p;
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable cv;
+	std::queue<std::shared_ptr<processed_adv_event>> queue;
+};
+
+/* Events handed across threads per benchmark iteration */
+#define BENCH_BATCH 4096
+
+static std::shared_ptr<processed_adv_event> make_event(legacyEventQueue&){
+	return std::make_shared<processed_adv_event>();
+}
+
+static adv_event_t make_event(eventQueue&){
+	adv_event_t evt = {};
+	evt.data_length = 31;
+	return evt;
+}
+
+template <typename Q>
+static void push_pop_single_thread(benchmark::State& state){
+	Q q;
+	for(auto _ : state){
+		q.push(make_event(q));
+		benchmark::DoNotOptimize(q.pop());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Q, typename Pop>
+static void producer_consumer(benchmark::State& state, Pop pop_fn){
+	Q q;
+	for(auto _ : state){
+		std::thread consumer([&]{
+			for(int i=0; i<BENCH_BATCH; i++){
+				benchmark::DoNotOptimize(pop_fn(q));
+			}
+		});
+		for(int i=0; i<BENCH_BATCH; i++){
+			q.push(make_event(q));
+		}
+		consumer.join();
+	}
+	state.SetItemsProcessed(state.iterations() * BENCH_BATCH);
+}
+
+static void BM_legacy_push_pop(benchmark::State& state){
+	push_pop_single_thread<legacyEventQueue>(state);
+}
+
+static void BM_ring_push_pop(benchmark::State& state){
+	push_pop_single_thread<eventQueue>(state);
+}
+
+static void BM_legacy_producer_consumer(benchmark::State& state){
+	producer_consumer<legacyEventQueue>(state, [](legacyEventQueue& q){ return q.pop(); });
+}
+
+static void BM_ring_producer_consumer(benchmark::State& state){
+	/* Block policy so no events are lost and both queues move the same work */
+	struct blockingQueue : eventQueue{
+		blockingQueue() : eventQueue(EVENT_QUEUE_DEFAULT_CAPACITY, overflowPolicy::block) {}
+	};
+	producer_consumer<blockingQueue>(state, [](blockingQueue& q){ return q.pop(); });
+}
+
+static void BM_ring_producer_consumer_spin(benchmark::State& state){
+	struct blockingQueue : eventQueue{
+		blockingQueue() : eventQueue(EVENT_QUEUE_DEFAULT_CAPACITY, overflowPolicy::block) {}
+	};
+	producer_consumer<blockingQueue>(state, [](blockingQueue& q){ return q.pop_spin(); });
+}
+
+template <typename Alloc, typename Free>
+static void handoff(benchmark::State& state, Alloc alloc_fn, Free free_fn){
+	/* Consumer keeps each record in its own allocation and a second thread frees it */
+	eventQueue q(EVENT_QUEUE_DEFAULT_CAPACITY);
+	spscRing<adv_event_t*> retire(EVENT_QUEUE_DEFAULT_CAPACITY, overflowPolicy::block);
+	adv_event_t evt = make_event(q);
+	for(auto _ : state){
+		std::thread freer([&]{
+			for(int i=0; i<BENCH_BATCH; i++) free_fn(retire.pop());
+		});
+		for(int i=0; i<BENCH_BATCH; i++){
+			q.push(evt);
+			adv_event_t *kept = alloc_fn(q);
+			retire.push(kept);
+		}
+		freer.join();
+	}
+	state.SetItemsProcessed(state.iterations() * BENCH_BATCH);
+}
+
+static void BM_heap_handoff(benchmark::State& state){
+	handoff(state, [](eventQueue& q){
+		adv_event_t *p = new adv_event_t;
+		q.try_pop(*p);
+		return p;
+	}, [](adv_event_t *p){ delete p; });
+}
+
+static void BM_pool_handoff(benchmark::State& state){
+	slabPool pool;
+	handoff(state, [&pool](eventQueue& q){
+		return q.try_pop_pooled(pool).release();
+	}, [&pool](adv_event_t *p){ poolDeleter<adv_event_t>{&pool}(p); });
+	state.counters["high_water"] = (double)pool.stats().high_water;
+}
+
+BENCHMARK(BM_legacy_push_pop);
+BENCHMARK(BM_ring_push_pop);
+BENCHMARK(BM_legacy_producer_consumer)->UseRealTime();
+BENCHMARK(BM_ring_producer_consumer)->UseRealTime();
+BENCHMARK(BM_ring_producer_consumer_spin)->UseRealTime();
+BENCHMARK(BM_heap_handoff)->UseRealTime();
+BENCHMARK(BM_pool_handoff)->UseRealTime();
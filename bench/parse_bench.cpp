@@ -0,0 +1,442 @@
+/**
+ * Microbenchmarks of the parsing utilities and end-to-end throughput
+ * benchmarks fed by the synthetic traffic generator over a socketpair or
+ * replayed from a capture file
+ * @author Owen Capell
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+
+#include "bluetoothdef.hpp"
+#include "hci_schema.hpp"
+#include "utils.hpp"
+#include "event_queue.hpp"
+#include "batch_reader.hpp"
+#include "parse_pipeline.hpp"
+#include "device_table.hpp"
+#include "hex_format.hpp"
+#include "adv_filter.hpp"
+#include "capture_writer.hpp"
+#include "packet_source.hpp"
+#include "traffic_generator.hpp"
+
+/* Packets in the pre-generated corpus the microbenchmarks cycle through */
+#define BENCH_CORPUS 1024
+
+/* Packets pushed through the socketpair per benchmark iteration */
+#define BENCH_PIPELINE_PACKETS 8192
+
+/* Packets in the capture file replayed per benchmark iteration */
+#define BENCH_REPLAY_PACKETS 8192
+
+static std::vector<std::vector<uint8_t>> make_corpus(const traffic_config_t& config = traffic_config_t{}){
+	trafficGenerator gen(config);
+	return gen.corpus(BENCH_CORPUS);
+}
+
+/* First report of an LE Extended Advertising Report packet (type, header, subevent, Num_Reports) */
+static hciView<leExtendedReportItem> first_report(const std::vector<uint8_t>& pkt){
+	hciView<leExtendedReportItem> r;
+	r.bind(pkt.data() + 1 + hciEventHeader::size + 1 + leExtendedAdvertisingReport::size, pkt.data() + pkt.size());
+	return r;
+}
+
+static void BM_addr_to_str(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	size_t i = 0;
+	for(auto _ : state){
+		hciView<leExtendedReportItem> r = first_report(corpus[i++ & (BENCH_CORPUS - 1)]);
+		benchmark::DoNotOptimize(addr_to_str(r.ref<"address">()->address));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_format_address(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	char buf[ADDR_STR_LEN];
+	size_t i = 0;
+	for(auto _ : state){
+		format_address(first_report(corpus[i++ & (BENCH_CORPUS - 1)]).ref<"address">()->address, buf);
+		benchmark::DoNotOptimize(buf);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_parse_address(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	std::vector<std::string> text;
+	for(const std::vector<uint8_t>& pkt : corpus) text.push_back(addr_to_str(first_report(pkt).ref<"address">()->address));
+	bt_dev_addr_t addr;
+	size_t i = 0;
+	for(auto _ : state){
+		const std::string& s = text[i++ & (BENCH_CORPUS - 1)];
+		benchmark::DoNotOptimize(parse_address(s.data(), s.size(), addr));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_hex_dump(benchmark::State& state){
+	/* Raw mode output of one packet; compared against printf("%02x ") per octet */
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	char buf[HCI_EVENT_BUF_SIZE * HEX_DUMP_STRIDE];
+	uint64_t bytes = 0;
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		benchmark::DoNotOptimize(hex_dump(pkt.data(), pkt.size(), buf));
+		bytes += pkt.size();
+	}
+	state.SetBytesProcessed(bytes);
+	state.SetLabel(hex_format_backend());
+}
+
+static void BM_hex_dump_snprintf(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	char buf[HCI_EVENT_BUF_SIZE * HEX_DUMP_STRIDE + 1];
+	uint64_t bytes = 0;
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		for(size_t k=0; k<pkt.size(); k++) snprintf(buf + 3 * k, 4, "%02x ", (unsigned int)pkt[k]);
+		benchmark::DoNotOptimize(buf);
+		bytes += pkt.size();
+	}
+	state.SetBytesProcessed(bytes);
+}
+
+static void BM_event_type(benchmark::State& state){
+	static const uint16_t types[] = {0x0013, 0x0015, 0x0012, 0x0010, 0x001A, 0x001B, 0x0001, 0x0000};
+	size_t i = 0;
+	for(auto _ : state){
+		benchmark::DoNotOptimize(event_type(types[i++ & 7]));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_process_ad(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	const bool verbose = false;
+	size_t i = 0;
+	for(auto _ : state){
+		hciView<leExtendedReportItem> r = first_report(corpus[i++ & (BENCH_CORPUS - 1)]);
+		benchmark::DoNotOptimize(process_ad(r.data(), (uint8_t)r.data_length(), verbose));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_process_extended_advertising_report(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	const bool verbose = false;
+	adv_event_t evt = {};
+	size_t i = 0;
+	for(auto _ : state){
+		process_extended_advertising_report(first_report(corpus[i++ & (BENCH_CORPUS - 1)]), evt, verbose);
+		benchmark::DoNotOptimize(evt);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_report_fields_cast(benchmark::State& state){
+	/* Field reads through the packed struct, the baseline for BM_report_fields_schema */
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		const uint8_t *p = pkt.data() + 1 + sizeof(hci_pack_event_head_t) + sizeof(hci_le_meta_ear_t);
+		if((size_t)(pkt.data() + pkt.size() - p) < sizeof(hci_le_meta_ear_event_t)) continue;
+		const hci_le_meta_ear_event_t *r = (const hci_le_meta_ear_event_t*)p;
+		if((size_t)(pkt.data() + pkt.size() - p) < sizeof(hci_le_meta_ear_event_t) + r->data_length) continue;
+		uint32_t sum = r->event_type + r->address_type + r->advertising_sid + (int8_t)r->rssi +
+			r->periodic_advertising_interval + r->data_length;
+		benchmark::DoNotOptimize(sum);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_report_fields_schema(benchmark::State& state){
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		const uint8_t *p = pkt.data() + 1 + hciEventHeader::size + 1 + leExtendedAdvertisingReport::size;
+		hciView<leExtendedReportItem> r;
+		if(!r.bind(p, pkt.data() + pkt.size())) continue;
+		uint32_t sum = r.get<"event_type">() + r.get<"address_type">() + r.get<"advertising_sid">() + r.get<"rssi">() +
+			r.get<"periodic_advertising_interval">() + r.get<"data_length">();
+		benchmark::DoNotOptimize(sum);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_parse_hci_packet(benchmark::State& state){
+	/* Arg: reports per packet */
+	traffic_config_t config;
+	config.reports_per_packet = (uint32_t)state.range(0);
+	std::vector<std::vector<uint8_t>> corpus = make_corpus(config);
+
+	const bool verbose = false;
+	hci_packet_meta_t meta = {1, HCI_DIR_IN};
+	adv_event_t out[HCI_MAX_REPORTS_PER_EVENT];
+	uint64_t records = 0;
+	uint64_t bytes = 0;
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		records += parse_hci_packet(pkt.data(), pkt.size(), meta, out, HCI_MAX_REPORTS_PER_EVENT, verbose);
+		bytes += pkt.size();
+		benchmark::ClobberMemory();
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(bytes);
+	state.counters["records"] = benchmark::Counter((double)records, benchmark::Counter::kIsRate);
+}
+
+static void BM_parse_hci_packet_filtered(benchmark::State& state){
+	/**
+	 * parse_hci_packet() through a compiled advFilter; the reject paths
+	 * should cost less than a kept report since nothing is copied
+	 * Arg: 0 = empty program (accept all), 1 = reject on a header field,
+	 * 2 = reject after an AD walk (128-bit UUID absent), 3 = legacy_default
+	*/
+
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+
+	advFilterBuilder b;
+	switch(state.range(0)){
+		case 1:
+			b.accept().rssi_min(INT8_MAX).otherwise(filterAction::reject);
+			break;
+		case 2:
+			b.accept().service_uuid128({0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF});
+			b.otherwise(filterAction::reject);
+			break;
+		default:
+			break;
+	}
+	advFilter filter = state.range(0) == 3 ? advFilterBuilder::legacy_default() : b.compile();
+
+	const bool verbose = false;
+	hci_packet_meta_t meta = {1, HCI_DIR_IN};
+	adv_event_t out[HCI_MAX_REPORTS_PER_EVENT];
+	uint64_t records = 0;
+	size_t i = 0;
+	for(auto _ : state){
+		const std::vector<uint8_t>& pkt = corpus[i++ & (BENCH_CORPUS - 1)];
+		records += parse_hci_packet(pkt.data(), pkt.size(), meta, out, HCI_MAX_REPORTS_PER_EVENT, verbose, &filter);
+		benchmark::ClobberMemory();
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.counters["records"] = benchmark::Counter((double)records, benchmark::Counter::kIsRate);
+}
+
+static void BM_socketpair_pipeline(benchmark::State& state){
+	/**
+	 * Generator thread -> SOCK_SEQPACKET socketpair -> batchReader (recvmmsg,
+	 * parse, optional aggregation) -> eventQueue -> consumer
+	 * Args: recvmmsg batch size, aggregation on/off, duplicate ratio (percent)
+	*/
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0){
+		state.SkipWithError("socketpair failed");
+		return;
+	}
+	int sndbuf = 4 * 1024 * 1024;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	traffic_config_t config;
+	config.duplicate_ratio = (double)state.range(2) / 100.0;
+	trafficGenerator gen(config);
+
+	batch_config_t batch;
+	batch.batch_size = (unsigned int)state.range(0);
+	batch.timeout_ms = 100;
+	batchReader reader(sv[1], batch);
+
+	std::unique_ptr<deviceTable> devices;
+	if(state.range(1) != 0) devices = std::make_unique<deviceTable>();
+
+	eventQueue queue(1 << 16);
+	const bool verbose = false;
+	uint64_t records = 0;
+
+	for(auto _ : state){
+		std::thread producer([&]{ gen.feed(sv[0], BENCH_PIPELINE_PACKETS); });
+
+		uint64_t packets = 0;
+		while(packets < BENCH_PIPELINE_PACKETS){
+			int n = reader.read_batch();
+			if(n < 0) break;
+			if(n == 0) continue;
+			packets += (uint64_t)n;
+			reader.publish(queue, verbose, nullptr, devices.get());
+
+			adv_event_t evt;
+			while(queue.try_pop(evt)) records++;
+		}
+		producer.join();
+	}
+
+	state.SetItemsProcessed(state.iterations() * BENCH_PIPELINE_PACKETS);
+	state.SetBytesProcessed(reader.stats().bytes);
+	state.counters["records"] = benchmark::Counter((double)records, benchmark::Counter::kIsRate);
+	state.counters["pkts/syscall"] = reader.packets_per_syscall();
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void BM_parse_pipeline(benchmark::State& state){
+	/**
+	 * Capture-side submit of pre-read batches -> parsePipeline workers ->
+	 * eventQueue; workers = 0 parses inline on the submitting thread instead
+	 * Args: parser workers, reorder on/off
+	*/
+
+	std::vector<std::vector<uint8_t>> corpus = make_corpus();
+	std::vector<hci_packet_t> packets(corpus.size());
+	for(size_t i=0; i<corpus.size(); i++){
+		packets[i].data = corpus[i].data();
+		packets[i].length = corpus[i].size();
+		packets[i].meta = hci_packet_meta_t{};
+	}
+
+	pipeline_config_t config;
+	config.workers = (unsigned int)state.range(0);
+	config.reorder = state.range(1) != 0;
+	config.block_when_full = true;
+
+	eventQueue queue(1 << 16);
+	std::unique_ptr<parsePipeline> pipeline;
+	if(config.workers > 0) pipeline = std::make_unique<parsePipeline>(config, queue);
+
+	const bool verbose = false;
+	std::vector<adv_event_t> records(BATCH_DEFAULT_SIZE * HCI_MAX_REPORTS_PER_EVENT);
+	uint64_t n_records = 0;
+
+	for(auto _ : state){
+		for(size_t i=0; i<packets.size(); i+=BATCH_DEFAULT_SIZE){
+			size_t n = packets.size() - i < BATCH_DEFAULT_SIZE ? packets.size() - i : BATCH_DEFAULT_SIZE;
+			if(pipeline){
+				pipeline->submit(packets.data() + i, n);
+				continue;
+			}
+			size_t staged = 0;
+			for(size_t k=0; k<n; k++){
+				staged += parse_hci_packet(packets[i + k].data, packets[i + k].length, packets[i + k].meta,
+					records.data() + staged, records.size() - staged, verbose, nullptr);
+			}
+			queue.push_batch(records.data(), staged);
+		}
+		if(pipeline) pipeline->flush();
+
+		adv_event_t evt;
+		while(queue.try_pop(evt)) n_records++;
+	}
+
+	state.SetItemsProcessed(state.iterations() * packets.size());
+	state.counters["records"] = benchmark::Counter((double)n_records, benchmark::Counter::kIsRate);
+	if(pipeline) state.counters["stolen"] = (double)pipeline->stats().stolen;
+}
+
+static void BM_file_replay(benchmark::State& state){
+	/**
+	 * Mapped capture file -> captureFileSource (fast pacing) -> drain_source
+	 * (parse, optional aggregation) -> eventQueue -> consumer
+	 * Args: format (0 = btsnoop, 1 = pcap), aggregation on/off
+	*/
+
+	char dir[] = "/tmp/bt_sniff_bench_XXXXXX";
+	if(mkdtemp(dir) == nullptr){
+		state.SkipWithError("mkdtemp failed");
+		return;
+	}
+
+	capture_config_t capture;
+	capture.path_prefix = std::string(dir) + "/replay";
+	capture.format = state.range(0) != 0 ? captureFormat::pcap : captureFormat::btsnoop;
+	{
+		trafficGenerator gen;
+		std::vector<std::vector<uint8_t>> corpus = gen.corpus(BENCH_REPLAY_PACKETS);
+		captureWriter writer(capture);
+		for(size_t i=0; i<corpus.size(); i++){
+			hci_packet_t pkt = {corpus[i].data(), corpus[i].size(), {1000000ull * (i + 1), HCI_DIR_IN}};
+			while(!writer.write(pkt)) std::this_thread::yield();
+		}
+		writer.stop();
+	}
+
+	std::string path = capture.path_prefix + (state.range(0) != 0 ? "_00000.pcap" : "_00000.btsnoop");
+	captureFileSource source(path);
+	std::string cmd = std::string("rm -rf '") + dir + "'";
+	if(system(cmd.c_str()) != 0 || !source.is_open()){
+		state.SkipWithError("capture file not written");
+		return;
+	}
+
+	std::unique_ptr<deviceTable> devices;
+	if(state.range(1) != 0) devices = std::make_unique<deviceTable>();
+
+	eventQueue queue(1 << 16);
+	const bool verbose = false;
+	source_stats_t stats = {};
+	uint64_t bytes = 0;
+	uint64_t records = 0;
+
+	for(auto _ : state){
+		source.rewind();
+		if(drain_source(source, queue, verbose, stats, 0, nullptr, devices.get()) < 0){
+			state.SkipWithError("capture file unreadable");
+			break;
+		}
+		bytes += stats.bytes;
+
+		adv_event_t evt;
+		while(queue.try_pop(evt)) records++;
+	}
+
+	state.SetItemsProcessed(state.iterations() * BENCH_REPLAY_PACKETS);
+	state.SetBytesProcessed(bytes);
+	state.counters["records"] = benchmark::Counter((double)records, benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BM_addr_to_str);
+BENCHMARK(BM_format_address);
+BENCHMARK(BM_parse_address);
+BENCHMARK(BM_hex_dump);
+BENCHMARK(BM_hex_dump_snprintf);
+BENCHMARK(BM_event_type);
+BENCHMARK(BM_process_ad);
+BENCHMARK(BM_process_extended_advertising_report);
+BENCHMARK(BM_report_fields_cast);
+BENCHMARK(BM_report_fields_schema);
+BENCHMARK(BM_parse_hci_packet)->Arg(1)->Arg(3)->Arg(6);
+BENCHMARK(BM_parse_hci_packet_filtered)->ArgName("filter")->DenseRange(0, 3);
+BENCHMARK(BM_socketpair_pipeline)
+	->ArgNames({"batch", "aggregate", "dup%"})
+	->Args({1, 0, 50})
+	->Args({64, 0, 50})
+	->Args({64, 1, 50})
+	->Args({64, 1, 90})
+	->UseRealTime();
+BENCHMARK(BM_file_replay)
+	->ArgNames({"pcap", "aggregate"})
+	->Args({0, 0})
+	->Args({1, 0})
+	->Args({0, 1})
+	->UseRealTime();
+BENCHMARK(BM_parse_pipeline)
+	->ArgNames({"workers", "reorder"})
+	->Args({0, 1})
+	->Args({1, 1})
+	->Args({2, 1})
+	->Args({4, 1})
+	->Args({4, 0})
+	->UseRealTime();
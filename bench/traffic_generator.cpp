@@ -0,0 +1,183 @@
+/**
+ * Implementation of the synthetic HCI advertising traffic generator
+ * @author Owen Capell
+*/
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluetoothdef.hpp"
+#include "traffic_generator.hpp"
+
+/* Largest AD payload that still fits one report in an event */
+#define TRAFFIC_MAX_AD (255 - sizeof(hci_le_meta_ear_t) - sizeof(hci_le_meta_ear_event_t))
+
+/* Company identifier used for the manufacturer data (reserved for testing) */
+#define TRAFFIC_COMPANY_ID 0xFFFF
+
+trafficGenerator::trafficGenerator(const traffic_config_t& config) :
+	config(config), state(config.seed ? config.seed : 1), devices()
+{
+	/**
+	 * Constructor for trafficGenerator
+	 * Draws the device population from the seed
+	 *
+	 * @param config	Device count, report sizes and ratios
+	*/
+
+	if(this->config.devices == 0) this->config.devices = 1;
+	if(this->config.reports_per_packet == 0) this->config.reports_per_packet = 1;
+	if(this->config.ad_min < 3) this->config.ad_min = 3;
+	if(this->config.ad_max > TRAFFIC_MAX_AD) this->config.ad_max = TRAFFIC_MAX_AD;
+	if(this->config.ad_max < this->config.ad_min) this->config.ad_max = this->config.ad_min;
+
+	devices.resize(this->config.devices);
+	for(uint32_t i=0; i<this->config.devices; i++){
+		device_t& d = devices[i];
+		uint64_t r = rand();
+		memcpy(d.address.address, &r, sizeof(d.address.address));
+		d.address_type = (uint8_t)(r >> 56) & 0x01;
+		uint32_t span = (uint32_t)this->config.ad_max - this->config.ad_min + 1;
+		d.ad_length = (uint8_t)(this->config.ad_min + rand() % span);
+		d.name_length = (uint8_t)(4 + rand() % 9);
+		d.sid = (uint8_t)(rand() & 0x0F);
+		d.rssi = (int8_t)(-40 - (int)(rand() % 55));
+		d.counter = 0;
+	}
+}
+
+const traffic_config_t& trafficGenerator::get_config() const{
+	return config;
+}
+
+uint64_t trafficGenerator::rand(){
+	/* xorshift64*: fast, and identical output on every platform */
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1Dull;
+}
+
+double trafficGenerator::uniform(){
+	return (double)(rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+size_t trafficGenerator::build_ad(device_t& dev, uint8_t *out){
+	/**
+	 * Lays out flags, name (shortened to fit) and manufacturer data
+	 *
+	 * @param dev	Advertiser
+	 * @param out	Destination of dev.ad_length octets
+	 * @returns octets written
+	*/
+
+	size_t len = dev.ad_length;
+	size_t pos = 0;
+
+	out[pos++] = 0x02;
+	out[pos++] = 0x01;
+	out[pos++] = 0x06;
+
+	size_t room = len - pos;
+	if(room >= 3){
+		size_t name = dev.name_length;
+		if(name + 2 > room) name = room - 2;
+		out[pos++] = (uint8_t)(name + 1);
+		out[pos++] = 0x09;
+		for(size_t i=0; i<name; i++) out[pos++] = (uint8_t)('a' + (dev.address.address[i % 6] + i) % 26);
+	}
+
+	room = len - pos;
+	if(room >= 6){
+		out[pos++] = (uint8_t)(room - 1);
+		out[pos++] = 0xFF;
+		out[pos++] = TRAFFIC_COMPANY_ID & 0xFF;
+		out[pos++] = TRAFFIC_COMPANY_ID >> 8;
+		out[pos++] = (uint8_t)(dev.counter & 0xFF);
+		out[pos++] = (uint8_t)(dev.counter >> 8);
+		for(size_t i=0; pos < len; i++) out[pos++] = dev.address.address[i % 6];
+	}
+	else{
+		while(pos < len) out[pos++] = 0x00;
+	}
+	return pos;
+}
+
+size_t trafficGenerator::next(uint8_t *buf){
+	/**
+	 * Builds one H4 event holding up to reports_per_packet reports
+	 *
+	 * @param buf	Destination (HCI_EVENT_BUF_SIZE octets)
+	 * @returns packet length
+	*/
+
+	buf[0] = HCI_PACK_EVENT;
+	hci_pack_event_head_t *head = (hci_pack_event_head_t*)(buf + 1);
+	head->event_code = HCI_EVENT_LE_META;
+	hci_le_meta_ear_t *ear = (hci_le_meta_ear_t*)head->data;
+	ear->subevent_code = SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT;
+
+	size_t params = sizeof(hci_le_meta_ear_t);
+	uint8_t reports = 0;
+	while(reports < config.reports_per_packet){
+		device_t& dev = devices[rand() % devices.size()];
+		size_t need = sizeof(hci_le_meta_ear_event_t) + dev.ad_length;
+		if(params + need > 255) break;
+
+		if(uniform() >= config.duplicate_ratio) dev.counter++;
+
+		hci_le_meta_ear_event_t *r = (hci_le_meta_ear_event_t*)(head->data + params);
+		bool nonconn = uniform() < config.nonconn_ratio;
+		r->event_type = nonconn ? 0x0010 : 0x0013;
+		r->address_type = dev.address_type;
+		r->address = dev.address;
+		r->primary_phy = 0x01;
+		r->secondary_phy = 0x00;
+		r->advertising_sid = dev.sid;
+		r->tx_power = 0x7F;
+		r->rssi = (uint8_t)(dev.rssi + (int8_t)(rand() % 5) - 2);
+		r->periodic_advertising_interval = 0;
+		r->direct_address_type = 0;
+		memset(&r->direct_address, 0, sizeof(r->direct_address));
+		r->data_length = (uint8_t)build_ad(dev, r->data);
+
+		params += need;
+		reports++;
+	}
+
+	ear->num_reports = reports;
+	head->param_length = (uint8_t)params;
+	return 1 + sizeof(hci_pack_event_head_t) + params;
+}
+
+std::vector<std::vector<uint8_t>> trafficGenerator::corpus(size_t count){
+	std::vector<std::vector<uint8_t>> packets(count);
+	uint8_t buf[HCI_EVENT_BUF_SIZE];
+	for(size_t i=0; i<count; i++){
+		size_t len = next(buf);
+		packets[i].assign(buf, buf + len);
+	}
+	return packets;
+}
+
+long trafficGenerator::feed(int fd, size_t count){
+	/**
+	 * Streams count packets into fd, one datagram per packet
+	 *
+	 * @param fd	Writing end of a socketpair
+	 * @param count	Packets to write
+	 * @returns packets written, -1 on error
+	*/
+
+	uint8_t buf[HCI_EVENT_BUF_SIZE];
+	for(size_t i=0; i<count; i++){
+		size_t len = next(buf);
+		ssize_t n;
+		do{
+			n = send(fd, buf, len, MSG_NOSIGNAL);
+		} while(n < 0 && errno == EINTR);
+		if(n < 0) return -1;
+	}
+	return (long)count;
+}
@@ -0,0 +1,91 @@
+/**
+ * Header for the deterministic synthetic HCI advertising traffic generator
+ * @author Owen Capell
+*/
+#ifndef TRAFFIC_GENERATOR
+#define TRAFFIC_GENERATOR
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+
+/**
+ * @details
+ * Shape of the generated traffic
+ * @param devices	Distinct advertisers
+ * @param reports_per_packet	Reports per LE Extended Advertising Report event
+ * 								(reduced when the AD data would not fit in one event)
+ * @param ad_min	Smallest AD payload (octets, at least 3)
+ * @param ad_max	Largest AD payload (octets, at most 229)
+ * @param duplicate_ratio	Share of reports repeating the device's previous payload
+ * @param nonconn_ratio	Share of non-connectable legacy reports (dropped by the built-in PDU check)
+ * @param seed	PRNG seed; equal configs produce byte-identical streams
+*/
+typedef struct{
+	uint32_t devices = 256;
+	uint32_t reports_per_packet = 3;
+	uint8_t ad_min = 16;
+	uint8_t ad_max = 31;
+	double duplicate_ratio = 0.5;
+	double nonconn_ratio = 0.1;
+	uint64_t seed = 1;
+} traffic_config_t;
+
+/**
+ * @details
+ * Produces H4 framed HCI LE Meta Extended Advertising Report events
+ * (packet type octet first, as read from a raw HCI socket). Each device
+ * has a fixed address, name and AD size; payloads carry flags, the
+ * complete local name and manufacturer data whose counter changes on
+ * every non-duplicate report. Output depends only on the config, so
+ * benchmark numbers stay comparable across commits.
+*/
+class trafficGenerator{
+public:
+	explicit trafficGenerator(const traffic_config_t& config = traffic_config_t{});
+
+	/**
+	 * @brief
+	 * Writes the next packet into buf (at least HCI_EVENT_BUF_SIZE octets)
+	 * Returns the packet length
+	*/
+	size_t next(uint8_t *buf);
+
+	/**
+	 * @brief
+	 * Pre-generates count packets (keeps generation out of timed loops)
+	*/
+	std::vector<std::vector<uint8_t>> corpus(size_t count);
+
+	/**
+	 * @brief
+	 * Writes count packets to a SOCK_SEQPACKET/SOCK_DGRAM fd (blocking)
+	 * Returns packets written, -1 on error
+	*/
+	long feed(int fd, size_t count);
+
+	const traffic_config_t& get_config() const;
+
+private:
+	typedef struct{
+		bt_dev_addr_t address;
+		uint8_t address_type;
+		uint8_t ad_length;
+		uint8_t name_length;
+		uint8_t sid;
+		int8_t rssi;
+		uint16_t counter;
+	} device_t;
+
+	uint64_t rand();
+	double uniform();
+	size_t build_ad(device_t& dev, uint8_t *out);
+
+	traffic_config_t config;
+	uint64_t state;
+	std::vector<device_t> devices;
+};
+
+#endif
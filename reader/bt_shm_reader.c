@@ -0,0 +1,309 @@
+/**
+ * Implementation of the C ABI shared-memory ring reader
+ * @author Owen Capell
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shm_ring_layout.h"
+#include "bt_shm_reader.h"
+
+/* Longest single futex sleep; bounds how late a dead producer is noticed */
+#define BT_SHM_WAIT_SLICE_MS 250
+
+/* Polls of the tail before a reader goes to sleep */
+#define BT_SHM_SPIN_LIMIT 256
+
+#define LOAD_ACQ(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RLX(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+struct bt_shm_reader{
+	int fd;
+	void *base;
+	size_t length;
+	bt_shm_control_t *control;
+	const uint8_t *records;
+	uint64_t mask;
+	uint64_t cursor;
+	int held;
+	uint64_t held_seq;
+	bt_shm_consumer_t *slot;
+	uint64_t n_read;
+	uint64_t n_lag;
+};
+
+static uint64_t monotonic_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t realtime_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static const bt_shm_record_t* record_at(const bt_shm_reader_t *r, uint64_t pos){
+	return (const bt_shm_record_t*)(r->records + (pos & r->mask) * BT_SHM_RECORD_SIZE);
+}
+
+static void publish_progress(bt_shm_reader_t *r){
+	/* Cursor and lag are informational for the producer's statistics */
+	if(r->slot == NULL) return;
+	STORE_RLX(&r->slot->cursor, r->cursor);
+	STORE_RLX(&r->slot->lag, r->n_lag);
+}
+
+static bt_shm_reader_t* attach(int fd){
+	/**
+	 * Maps the segment behind fd, validates the layout and claims a
+	 * consumer slot (readers beyond BT_SHM_MAX_CONSUMERS run without one)
+	 *
+	 * @param fd	Descriptor of the segment (owned by the reader on success)
+	 * @returns reader, NULL on failure (errno set)
+	*/
+
+	struct stat st;
+	if(fstat(fd, &st) < 0) return NULL;
+	if((size_t)st.st_size < sizeof(bt_shm_control_t)){
+		errno = ENODATA;
+		return NULL;
+	}
+
+	size_t length = (size_t)st.st_size;
+	void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED) return NULL;
+
+	bt_shm_control_t *control = (bt_shm_control_t*)base;
+	if(LOAD_ACQ(&control->magic) != BT_SHM_MAGIC || control->version != BT_SHM_VERSION ||
+		control->record_size != BT_SHM_RECORD_SIZE || control->capacity == 0 ||
+		(control->capacity & (control->capacity - 1)) != 0 ||
+		control->data_offset + (uint64_t)control->capacity * BT_SHM_RECORD_SIZE > length){
+		munmap(base, length);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	bt_shm_reader_t *r = (bt_shm_reader_t*)calloc(1, sizeof(bt_shm_reader_t));
+	if(r == NULL){
+		munmap(base, length);
+		return NULL;
+	}
+	r->fd = fd;
+	r->base = base;
+	r->length = length;
+	r->control = control;
+	r->records = (const uint8_t*)base + control->data_offset;
+	r->mask = control->capacity - 1;
+	r->cursor = LOAD_ACQ(&control->tail);
+
+	uint32_t self = (uint32_t)getpid();
+	for(size_t i=0; i<BT_SHM_MAX_CONSUMERS; i++){
+		uint32_t expected = 0;
+		if(__atomic_compare_exchange_n(&control->consumers[i].pid, &expected, self, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			r->slot = &control->consumers[i];
+			STORE_RLX(&r->slot->sleeping, 0);
+			STORE_RLX(&r->slot->attached_ns, realtime_ns());
+			break;
+		}
+	}
+	publish_progress(r);
+	return r;
+}
+
+bt_shm_reader_t* bt_shm_open(const char *name){
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if(fd < 0) return NULL;
+	bt_shm_reader_t *r = attach(fd);
+	if(r == NULL){
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return r;
+}
+
+bt_shm_reader_t* bt_shm_open_fd(int fd){
+	int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if(own < 0) return NULL;
+	bt_shm_reader_t *r = attach(own);
+	if(r == NULL){
+		int err = errno;
+		close(own);
+		errno = err;
+	}
+	return r;
+}
+
+void bt_shm_close(bt_shm_reader_t *reader){
+	if(reader == NULL) return;
+	if(reader->slot != NULL){
+		STORE_RLX(&reader->slot->sleeping, 0);
+		__atomic_store_n(&reader->slot->pid, 0, __ATOMIC_RELEASE);
+	}
+	munmap(reader->base, reader->length);
+	close(reader->fd);
+	free(reader);
+}
+
+const bt_shm_record_t* bt_shm_peek(bt_shm_reader_t *r){
+	/**
+	 * Finds the next record still intact in the ring. A reader that was
+	 * lapped resumes at the oldest record and counts what it missed
+	 *
+	 * @param r	Reader
+	 * @returns record in the mapping, NULL if caught up
+	*/
+
+	uint64_t capacity = r->mask + 1;
+	while(1){
+		uint64_t tail = LOAD_ACQ(&r->control->tail);
+		if(r->cursor >= tail){
+			r->held = 0;
+			return NULL;
+		}
+
+		if(tail - r->cursor > capacity){
+			r->n_lag += tail - capacity - r->cursor;
+			r->cursor = tail - capacity;
+		}
+
+		const bt_shm_record_t *rec = record_at(r, r->cursor);
+		uint64_t seq = LOAD_ACQ(&rec->seq);
+		if(seq != r->cursor + 1){
+			/* Overwritten since tail was read (or lost when a producer crashed mid-write) */
+			r->n_lag++;
+			r->cursor++;
+			continue;
+		}
+
+		r->held = 1;
+		r->held_seq = seq;
+		return rec;
+	}
+}
+
+int bt_shm_release(bt_shm_reader_t *r){
+	/**
+	 * Seqlock check of the held record, then advance
+	 *
+	 * @param r	Reader
+	 * @returns 1 if the record was intact, 0 otherwise
+	*/
+
+	if(!r->held) return 0;
+	r->held = 0;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	int ok = LOAD_RLX(&record_at(r, r->cursor)->seq) == r->held_seq;
+	r->cursor++;
+	if(ok) r->n_read++;
+	else r->n_lag++;
+	publish_progress(r);
+	return ok;
+}
+
+size_t bt_shm_read(bt_shm_reader_t *r, bt_shm_record_t *out, size_t max){
+	/**
+	 * Copying read of up to max records
+	 *
+	 * @param r	Reader
+	 * @param out	Destination array
+	 * @param max	Capacity of out
+	 * @returns records copied
+	*/
+
+	size_t n = 0;
+	while(n < max){
+		const bt_shm_record_t *rec = bt_shm_peek(r);
+		if(rec == NULL) break;
+		memcpy(&out[n], rec, sizeof(bt_shm_record_t));
+		if(bt_shm_release(r)) n++;
+	}
+	return n;
+}
+
+int bt_shm_producer_alive(const bt_shm_reader_t *r){
+	if(LOAD_ACQ(&r->control->state) != BT_SHM_STATE_RUNNING) return 0;
+	uint64_t beat = LOAD_ACQ(&r->control->heartbeat_ns);
+	uint64_t now = monotonic_ns();
+	return now < beat || now - beat < BT_SHM_PRODUCER_TIMEOUT_NS;
+}
+
+int bt_shm_wait(bt_shm_reader_t *r, int timeout_ms){
+	/**
+	 * Spins briefly, then sleeps on the shared futex in slices so a
+	 * producer that died without closing the ring is still noticed
+	 *
+	 * @param r	Reader
+	 * @param timeout_ms	Longest wait, -1 for no limit
+	 * @returns BT_SHM_READY, BT_SHM_TIMEOUT, BT_SHM_CLOSED or BT_SHM_DEAD
+	*/
+
+	bt_shm_control_t *c = r->control;
+	for(int i=0; i<BT_SHM_SPIN_LIMIT; i++){
+		if(LOAD_ACQ(&c->tail) > r->cursor) return BT_SHM_READY;
+	}
+
+	uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : monotonic_ns() + (uint64_t)timeout_ms * 1000000ull;
+	while(1){
+		if(LOAD_ACQ(&c->tail) > r->cursor) return BT_SHM_READY;
+		uint32_t state = LOAD_ACQ(&c->state);
+		if(state == BT_SHM_STATE_CLOSED) return BT_SHM_CLOSED;
+		if(!bt_shm_producer_alive(r)) return BT_SHM_DEAD;
+
+		uint64_t now = monotonic_ns();
+		if(now >= deadline) return BT_SHM_TIMEOUT;
+		uint64_t slice = (uint64_t)BT_SHM_WAIT_SLICE_MS * 1000000ull;
+		if(deadline - now < slice) slice = deadline - now;
+
+		/* Register as a sleeper before the final check so a publish cannot slip between */
+		uint32_t word = LOAD_ACQ(&c->futex);
+		__atomic_fetch_add(&c->sleepers, 1, __ATOMIC_SEQ_CST);
+		if(r->slot != NULL) STORE_RLX(&r->slot->sleeping, 1);
+		if(__atomic_load_n(&c->tail, __ATOMIC_SEQ_CST) <= r->cursor &&
+			LOAD_ACQ(&c->state) == BT_SHM_STATE_RUNNING){
+			struct timespec ts = {(time_t)(slice / 1000000000ull), (long)(slice % 1000000000ull)};
+			syscall(SYS_futex, &c->futex, FUTEX_WAIT, word, &ts, NULL, 0);
+		}
+		if(r->slot != NULL) STORE_RLX(&r->slot->sleeping, 0);
+		__atomic_fetch_sub(&c->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void bt_shm_rewind(bt_shm_reader_t *r){
+	uint64_t tail = LOAD_ACQ(&r->control->tail);
+	uint64_t capacity = r->mask + 1;
+	r->cursor = tail > capacity ? tail - capacity : 0;
+	r->held = 0;
+	publish_progress(r);
+}
+
+void bt_shm_stats(const bt_shm_reader_t *r, bt_shm_reader_stats_t *out){
+	uint64_t tail = LOAD_ACQ(&r->control->tail);
+	out->read = r->n_read;
+	out->lag = r->n_lag;
+	out->backlog = tail > r->cursor ? tail - r->cursor : 0;
+	out->generation = LOAD_ACQ(&r->control->generation);
+}
+
+uint32_t bt_shm_version(const bt_shm_reader_t *r){
+	return r->control->version;
+}
+
+uint32_t bt_shm_record_size(void){
+	return BT_SHM_RECORD_SIZE;
+}
@@ -0,0 +1,120 @@
+/**
+ * C ABI reader for the bt_sniff shared-memory record ring
+ * (usable from C, C++ and FFI bindings such as Python ctypes/cffi)
+ * @author Owen Capell
+*/
+#ifndef BT_SHM_READER
+#define BT_SHM_READER
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm_ring_layout.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return values of bt_shm_wait() */
+#define BT_SHM_READY    1
+#define BT_SHM_TIMEOUT  0
+#define BT_SHM_CLOSED  -1
+#define BT_SHM_DEAD    -2
+
+/**
+ * @details
+ * Opaque reader handle; one per thread
+*/
+typedef struct bt_shm_reader bt_shm_reader_t;
+
+/**
+ * @details
+ * Reader-side counters
+ * @param read	Records returned to the caller
+ * @param lag	Records missed because the producer lapped this reader
+ * @param backlog	Published records not read yet
+ * @param generation	Producer generation (changes when a producer restarts)
+*/
+typedef struct{
+	uint64_t read;
+	uint64_t lag;
+	uint64_t backlog;
+	uint64_t generation;
+} bt_shm_reader_stats_t;
+
+/**
+ * @brief
+ * Attaches to the ring published under a POSIX shared memory name
+ * (e.g. "/bt_sniff"), starting at the next record. NULL on failure (errno set)
+*/
+bt_shm_reader_t* bt_shm_open(const char *name);
+
+/**
+ * @brief
+ * Attaches to a ring passed as a descriptor (memfd); the descriptor is duplicated
+*/
+bt_shm_reader_t* bt_shm_open_fd(int fd);
+
+/**
+ * @brief
+ * Detaches and frees the handle
+*/
+void bt_shm_close(bt_shm_reader_t *reader);
+
+/**
+ * @brief
+ * Next record, read in place (zero copy); NULL if none is available.
+ * Call bt_shm_release() when done; the producer may overwrite the record
+ * meanwhile, which bt_shm_release() reports
+*/
+const bt_shm_record_t* bt_shm_peek(bt_shm_reader_t *reader);
+
+/**
+ * @brief
+ * Advances past the record returned by bt_shm_peek()
+ * Returns 1 if the record was intact while it was read, 0 if it was overwritten
+*/
+int bt_shm_release(bt_shm_reader_t *reader);
+
+/**
+ * @brief
+ * Copies up to max intact records into out; returns the number copied
+ * (one call per batch keeps FFI overhead low)
+*/
+size_t bt_shm_read(bt_shm_reader_t *reader, bt_shm_record_t *out, size_t max);
+
+/**
+ * @brief
+ * Blocks until a record is available or timeout_ms elapses (-1 = forever)
+ * Returns BT_SHM_READY, BT_SHM_TIMEOUT, BT_SHM_CLOSED (producer closed the
+ * ring and everything was read) or BT_SHM_DEAD (producer stopped heartbeating)
+*/
+int bt_shm_wait(bt_shm_reader_t *reader, int timeout_ms);
+
+/**
+ * @brief
+ * Skips to the oldest record still in the ring (counts nothing as lag)
+*/
+void bt_shm_rewind(bt_shm_reader_t *reader);
+
+/**
+ * @brief
+ * 1 if a producer is attached and heartbeating, 0 otherwise
+*/
+int bt_shm_producer_alive(const bt_shm_reader_t *reader);
+
+void bt_shm_stats(const bt_shm_reader_t *reader, bt_shm_reader_stats_t *out);
+
+/**
+ * @brief
+ * Layout version of the attached ring (BT_SHM_VERSION) and record size,
+ * for bindings that mirror bt_shm_record_t
+*/
+uint32_t bt_shm_version(const bt_shm_reader_t *reader);
+uint32_t bt_shm_record_size(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
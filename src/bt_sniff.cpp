@@ -7,7 +7,10 @@
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -17,17 +20,65 @@
 #include "bluetoothdef.hpp"
 #include "utils.hpp"
 #include "event_queue.hpp"
+#include "batch_reader.hpp"
+#include "packet_source.hpp"
+#include "capture_writer.hpp"
+#include "output_sink.hpp"
+#include "event_broadcast.hpp"
+#include "hci_filter_spec.hpp"
+#include "event_loop.hpp"
+#include "hci_command.hpp"
+#include "metrics.hpp"
+#include "le_meta.hpp"
 
-BT_Sniff::BT_Sniff()
+/* recvmmsg() batches read per readiness event before yielding to other fds */
+#define BT_SNIFF_MAX_BATCHES_PER_WAKE 8
+
+/* service_socket() rounds spent draining the socket when a capture ends */
+#define BT_SNIFF_MAX_DRAIN_WAKES 8
+
+/* How often outstanding HCI commands are checked for a lost response */
+#define BT_SNIFF_COMMAND_EXPIRY_NS 100000000ull
+
+/* Longest time a finishing capture waits for its queued HCI commands to be answered */
+#define BT_SNIFF_COMMAND_FLUSH_NS 1000000000ull
+
+BT_Sniff::BT_Sniff() : BT_Sniff(-1){
+    /**
+     * Constructor for BT_Sniff object on the default adapter
+    */
+}
+
+BT_Sniff::BT_Sniff(int dev_id) : BT_Sniff(dev_id, -1){
+    /**
+     * Constructor for BT_Sniff object on a specific adapter
+     *
+     * @param dev_id    hci_dev index of the adapter, -1 for hci_get_route()
+    */
+}
+
+BT_Sniff::BT_Sniff(int dev_id, int fd)
     : device_id(-1), socket_fd(-1), initialized(false),
-    is_scanning(false), scan_ready(false)
+    is_scanning(false), stop_requested(false), scan_loop(nullptr), loop_mutex(), owns_loop(false),
+    scan_queue(nullptr), scan_taps(), scan_raw(false), duration_timer(-1), idle_timer(-1), command_timer(-1),
+    last_activity(0), scan_exit(scanExit::none),
+    scan_ready(false), batch_reader(), reader_mutex(), batch_totals(),
+    read_to_parse(), parse_time(), capture_writer(nullptr), output_sinks(nullptr), verbose_sinks(), raw_sinks(), broadcast(nullptr), shm_ring(nullptr),
+    adv_filter(nullptr),
+    device_table(), reassembler(), pipeline_enabled(false), pipeline_config(), parse_pipeline(), pipeline_totals(), command_channel(), periodic_sync(),
+    metrics_registry(nullptr), metrics_labels(),
+    rx_packets(0), rx_bytes(0), filter_baseline()
     {
     /**
      * Constructor for BT_Sniff object
-     * Calls private initialize function upoin initilization
+     * Calls private initialize function upoin initilization, or adopts
+     * fd when one is given
+     * 
+     * @param dev_id    hci_dev index of the adapter, -1 for hci_get_route()
+     * @param fd    Socket opened by the caller (-1 = open one on dev_id)
     */
   
-    int status = initialize();
+    int status = fd < 0 ? initialize(dev_id) : adopt(dev_id, fd);
     if(status < 0){
         std::cerr << "Initilizaiton Error" << std::endl <<
             errno << std::endl;
@@ -35,6 +86,9 @@ BT_Sniff::BT_Sniff()
     else{
         initialized = true;
     }
+
+    /* Commands on an unusable adapter fail with HCI_COMMAND_SEND_FAILED */
+    if(!command_channel) command_channel = std::make_unique<hciCommandChannel>(-1);
 }
 
 BT_Sniff::~BT_Sniff(){
@@ -48,17 +102,59 @@ BT_Sniff::~BT_Sniff(){
     }
 }
 
-int BT_Sniff::initialize(){
+static int collect_adapter(int dd, int dev_id, long arg){
+    /* hci_for_each_dev() callback; returning 0 continues the walk */
+    (void)dd;
+    reinterpret_cast<std::vector<int>*>(arg)->push_back(dev_id);
+    return 0;
+}
+
+std::unique_ptr<BT_Sniff> BT_Sniff::from_socket(int fd, int dev_id){
+    /**
+     * Builds a sniffer on a socket the caller opened, e.g. an
+     * HCI_CHANNEL_USER socket, or one end of a socketpair replaying
+     * recorded traffic. No filter or socket option is applied
+     *
+     * @param fd    Socket delivering H4 framed HCI packets; owned by the instance
+     * @param dev_id    hci_dev index reported by get_device_id() (-1 = none)
+     * @returns the sniffer (check is_initialized())
+    */
+
+    return std::unique_ptr<BT_Sniff>(new BT_Sniff(dev_id, fd));
+}
+
+std::vector<int> BT_Sniff::list_adapters(){
+    /**
+     * Enumerates adapters that are up, e.g. to open one BT_Sniff per
+     * controller
+     * 
+     * @returns hci_dev indices in kernel order
+    */
+
+    std::vector<int> ids;
+    hci_for_each_dev(HCI_UP, collect_adapter, reinterpret_cast<long>(&ids));
+    return ids;
+}
+
+int BT_Sniff::get_device_id() const{
+    return device_id;
+}
+
+bool BT_Sniff::is_initialized() const{
+    return initialized;
+}
+
+int BT_Sniff::initialize(int dev_id){
     /**
      * Initializes relevant fields for BT_Sniff object
      * Finds Bluetooth device (adapter), opens and binds HCI socket
      * 
-     * @param: None
+     * @param dev_id    hci_dev index of the adapter, -1 for hci_get_route()
      * @returns: 0 on success, -1 on failure
     */
 
     /* Get Bluetooth device/adapter (not assuming it is 0) */
-    device_id = hci_get_route(NULL);
+    device_id = dev_id < 0 ? hci_get_route(NULL) : dev_id;
     struct hci_dev_info dev_info;
     if (hci_devinfo(device_id, &dev_info) < 0){
         std::cerr << "Error getting device id" << std::endl <<
@@ -66,30 +162,39 @@ int BT_Sniff::initialize(){
         return -1;
     }
 
-    /* Need raw socket for sniffing; HCI is standard protocol */
-    socket_fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    /* Need raw socket for sniffing; HCI is standard protocol (non-blocking, driven by epoll) */
+    socket_fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, BTPROTO_HCI);
     if (socket_fd < 0){
         std::cerr << "Error opening socket" << std::endl << 
             errno << std::endl;
         return -1;
     }
 
-    /* Configure to capture all packets and events */
-    struct hci_filter filter;
-    hci_filter_clear(&filter);
-    hci_filter_all_ptypes(&filter);
-    hci_filter_all_events(&filter);
-
-    /* Apply filter */
-    if(setsockopt(socket_fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0){
+    /* Configure to capture all packets and events (narrow with set_filter()) */
+    if(set_filter(hciFilterSpec().all()) < 0){
         std::cerr << "Error applying HCI filter on socket" << std::endl <<
             errno << std::endl;
+        close(socket_fd);
+        socket_fd = -1;
         return -1;
     }
 
-    /**
-     * TODO: Add setsockopt() calls to enable timestamping and HCI directionality
-    */
+    /* Attach direction and kernel receive time to every packet (ancillary data) */
+    int opt = 1;
+    if(setsockopt(socket_fd, SOL_HCI, HCI_DATA_DIR, &opt, sizeof(opt)) < 0){
+        std::cerr << "Error enabling HCI directionality on socket" << std::endl <<
+            errno << std::endl;
+        close(socket_fd);
+        socket_fd = -1;
+        return -1;
+    }
+    if(setsockopt(socket_fd, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt)) < 0){
+        std::cerr << "Error enabling HCI timestamps on socket" << std::endl <<
+            errno << std::endl;
+        close(socket_fd);
+        socket_fd = -1;
+        return -1;
+    }
 
     /* Bind socket with the bluetooth device */
     struct sockaddr_hci addr = {};
@@ -97,84 +202,752 @@ int BT_Sniff::initialize(){
     addr.hci_dev =  device_id;
     addr.hci_channel = HCI_CHANNEL_RAW;
     if(bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
-        close(socket_fd);
         std::cerr << "Error binding socket to device" << std::endl <<
             errno << std::endl;
+        close(socket_fd);
+        socket_fd = -1;
         return -1;
     }
 
+    command_channel = std::make_unique<hciCommandChannel>(socket_fd);
+
+    scan_ready = true;
     return 0;
 }
 
 
+int BT_Sniff::adopt(int dev_id, int fd){
+    /**
+     * Takes over a socket opened by the caller
+     *
+     * @param dev_id    hci_dev index reported by get_device_id()
+     * @param fd    Socket to capture from (switched to non-blocking)
+     * @returns: 0 on success, -1 on failure
+    */
+
+    device_id = dev_id;
+    socket_fd = fd;
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+        std::cerr << "Error making socket non-blocking" << std::endl <<
+            errno << std::endl;
+        close(socket_fd);
+        socket_fd = -1;
+        return -1;
+    }
+
+    command_channel = std::make_unique<hciCommandChannel>(socket_fd);
+
+    scan_ready = true;
+    return 0;
+}
+
 int BT_Sniff::start_le_scan(
-    eventQueue& usr_queue, const bool& verbose, const bool& raw){
+    eventQueue& usr_queue, const bool& verbose, const bool& raw,
+    const scan_limits_t& limits){
     /**
      * Begins capturing packets in scan loop
      * Atomically enqueues processed data into provided user-space queue
-     * 
-     * @param usr_queue Reference to (atomic) eventQueue to enqueue pointers to
-     * processed_adv_event structs
-     * @param lock  std::mutex reference to perform atomic queue actions
+     * Runs a private epoll loop on the calling thread until stopCapture(),
+     * the duration limit or the idle timeout
+     *
+     * @param usr_queue Reference to (lock-free) eventQueue to enqueue
+     * adv_event_t records into (by value, no allocation)
      * @param verbose Boolean flag to enable packet capture from printing to stdout
      * @param raw   Boolean flag to enable output of raw packet capture data
+     * @param limits    Idle timeout and scan duration (0 = unlimited)
      * @returns 0 on successful capture loop completion, -1 on error
     */
 
-    unsigned char buf[HCI_MAX_EVENT_SIZE];
-    while(true){
-       int len = read(socket_fd, buf, sizeof(buf));
-       if(len < 0){
-        std::cerr << "Error reading socket" << std::endl <<
-            errno << std::endl;
+    scan_raw = raw;
+    int status = start_le_scan_batched(usr_queue, batch_config_t{}, verbose, limits);
+    scan_raw = false;
+    return status;
+}
+
+int BT_Sniff::start_le_scan_batched(
+    eventQueue& usr_queue, const batch_config_t& config, const bool& verbose,
+    const scan_limits_t& limits){
+    /**
+     * Begins capturing packets in batched scan loop
+     * Each readiness event drains the socket with recvmmsg() (up to
+     * config.batch_size packets per call) and publishes all parsed
+     * records in one step
+     *
+     * @param usr_queue Reference to (lock-free) eventQueue to enqueue records into
+     * @param config    Batch size and buffer size (timeout_ms is unused)
+     * @param verbose Boolean flag to enable packet capture from printing to stdout
+     * @param limits    Idle timeout and scan duration (0 = unlimited)
+     * @returns 0 on successful capture loop completion, -1 on error
+    */
+
+    eventLoop loop;
+    if(!loop.is_open()) return -1;
+
+    owns_loop = true;
+    if(attach(loop, usr_queue, config, verbose, limits) < 0){
+        owns_loop = false;
+        return -1;
+    }
+
+    int status = loop.run();
+    if(status < 0){
+        /* Loop failed underneath us; make sure the socket is released */
+        finish_scan(scanExit::error);
+    }
+    owns_loop = false;
+    if(status < 0) return -1;
+    return scan_exit.load(std::memory_order_acquire) == scanExit::error ? -1 : 0;
+}
+
+int BT_Sniff::attach(
+    eventLoop& loop, eventQueue& usr_queue, const batch_config_t& config,
+    const bool& verbose, const scan_limits_t& limits){
+    /**
+     * Registers the (non-blocking) socket on loop so capture can run
+     * inside an existing event-driven service. Must be called on the
+     * loop thread (or before the loop runs). The capture ends with
+     * stopCapture(), a limit, or a socket error; see last_scan_exit()
+     *
+     * @param loop  Event loop to register on
+     * @param usr_queue Queue to publish records into
+     * @param config    Batch size and buffer size (timeout_ms is unused)
+     * @param verbose   Boolean flag to print decoded reports (stdout text sink on its own thread)
+     * @param limits    Idle timeout and scan duration (0 = unlimited)
+     * @returns 0 on success, -1 if not ready, already scanning or on failure
+    */
+
+    if(!scan_ready || is_scanning.load(std::memory_order_acquire)) return -1;
+
+    batch_config_t cfg = config;
+    cfg.timeout_ms = 0;
+    {
+        std::lock_guard<std::mutex> lock(reader_mutex);
+        batch_totals = capture_totals_locked();
+        pipeline_totals = pipeline_totals_locked();
+        parse_pipeline.reset();
+        batch_reader = std::make_unique<batchReader>(socket_fd, cfg);
+        batch_reader->set_latency(&read_to_parse, &parse_time);
+    }
+    scan_queue = &usr_queue;
+
+    /* Verbose output and raw dumps are formatted and written by sink threads, never on the capture path */
+    verbose_sinks.reset();
+    if(verbose && output_sinks == nullptr){
+        std::vector<std::unique_ptr<outputSink>> out;
+        out.push_back(make_sink(sinkFormat::text, STDOUT_FILENO));
+        verbose_sinks = std::make_unique<sinkWriter>(std::move(out));
+    }
+    raw_sinks.reset();
+    if(scan_raw){
+        std::vector<std::unique_ptr<outputSink>> out;
+        out.push_back(make_sink(sinkFormat::text, STDOUT_FILENO));
+        raw_sinks = std::make_unique<sinkWriter>(std::move(out));
+    }
+    scan_taps.sinks = output_sinks != nullptr ? output_sinks : verbose_sinks.get();
+    scan_taps.broadcast = broadcast;
+    scan_taps.shm = shm_ring;
+
+    if(pipeline_enabled){
+        /* One slot per read batch */
+        pipeline_config_t pcfg = pipeline_config;
+        pcfg.frames_per_slot = cfg.batch_size;
+        pcfg.frame_size = cfg.buffer_size;
+        /* Fragments must reach the reassembler in capture order */
+        if(reassembler) pcfg.reorder = true;
+        auto pipeline = std::make_unique<parsePipeline>(
+            pcfg, usr_queue, adv_filter, device_table.get(), &scan_taps, reassembler.get());
+        pipeline->set_latency(&read_to_parse, &parse_time);
+        std::lock_guard<std::mutex> lock(reader_mutex);
+        parse_pipeline = std::move(pipeline);
+    }
+    last_activity = monotonic_ns();
+    duration_timer = -1;
+    idle_timer = -1;
+    command_timer = -1;
+
+    if(loop.add_fd(socket_fd, EPOLLIN, [this](uint32_t events){
+        if(events & (EPOLLERR | EPOLLHUP)){
+            finish_scan(scanExit::error);
+            return;
+        }
+        if(service_socket() < 0){
+            std::cerr << "Error reading socket" << std::endl <<
+                errno << std::endl;
+            finish_scan(scanExit::error);
+        }
+    }) < 0){
         return -1;
-       }
-
-        std::shared_ptr<processed_adv_event> usr_evt = std::make_shared<processed_adv_event>();
-        /**
-         * Manual filtering of HCI_EVENT_LE_META 
-         * TODO: Add advanced filtering logic
-        */
-        if((unsigned int)buf[0] == HCI_PACK_EVENT){
-            hci_pack_event_head_t *packet = (hci_pack_event_head_t *)(buf + 1);
-
-            if(packet->event_code == HCI_EVENT_LE_META){
-                /* Assuming the meta event will be an extended advertising report */
-                hci_le_meta_ear_t *meta = (hci_le_meta_ear_t*)packet->data;
-
-				/* Skip if not extended advertising report */
-                if(meta->subevent_code != SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT) continue;
-
-                hci_le_meta_ear_event_t *event = (hci_le_meta_ear_event_t*)meta->event_start;
-
-                for(uint8_t i=0; i<meta->num_reports; ++i){
-                    uint16_t evt = event->event_type;
-                    /* Manual filter of event PDU */
-                    if(evt!=ADV_NONCONN_IND && evt!=ADV_DIRECT_IND){
-                        process_extended_advertising_report(event, usr_evt, verbose);
-                        usr_evt->event = evt;
-                        usr_queue.push(usr_evt);
-                    }
-                    event = event + sizeof(event);
-                }
+    }
+
+    if(limits.duration_ms != 0){
+        duration_timer = loop.add_timer((uint64_t)limits.duration_ms * 1000000ull, 0, [this](){
+            duration_timer = -1;
+            finish_scan(scanExit::duration);
+        });
+    }
+    if(limits.idle_timeout_ms != 0){
+        /* Check a few times per timeout instead of re-arming on every packet */
+        uint64_t idle_ns = (uint64_t)limits.idle_timeout_ms * 1000000ull;
+        uint64_t tick = idle_ns / 4 > 1000000ull ? idle_ns / 4 : 1000000ull;
+        idle_timer = loop.add_timer(tick, tick, [this, idle_ns](){
+            if(monotonic_ns() - last_activity >= idle_ns) finish_scan(scanExit::idle);
+        });
+    }
+
+    command_timer = loop.add_timer(BT_SNIFF_COMMAND_EXPIRY_NS, BT_SNIFF_COMMAND_EXPIRY_NS, [this](){
+        uint64_t now = monotonic_ns();
+        command_channel->expire(now);
+        if(periodic_sync) periodic_sync->tick(now);
+    });
+
+    scan_exit.store(scanExit::none, std::memory_order_relaxed);
+    is_scanning.store(true, std::memory_order_release);
+
+    bool stop_pending;
+    {
+        std::lock_guard<std::mutex> lock(loop_mutex);
+        scan_loop = &loop;
+        stop_pending = stop_requested;
+    }
+    if(stop_pending) loop.post([this](){ finish_scan(scanExit::stopped); });
+    return 0;
+}
+
+int BT_Sniff::service_socket(bool track_syncs){
+    /**
+     * Reads batches until the socket is empty, bounded per wake-up so
+     * other fds on the same loop are not starved (epoll is level-triggered,
+     * anything left over wakes the loop again)
+     *
+     * @param track_syncs   Hand packets to the periodic sync manager
+     * @returns packets read, -1 on error
+    */
+
+    int total = 0;
+    for(int round=0; round<BT_SNIFF_MAX_BATCHES_PER_WAKE; round++){
+        int n = batch_reader->read_batch();
+        if(n < 0) return -1;
+        if(n == 0) break;
+        total += n;
+
+        batch_stats_t bs = batch_reader->stats();
+        rx_packets.store(bs.packets, std::memory_order_relaxed);
+        rx_bytes.store(bs.bytes, std::memory_order_relaxed);
+
+        if(periodic_sync && track_syncs){
+            for(size_t i=0; i<batch_reader->batch_count(); i++){
+                periodic_sync->handle_event(batch_reader->packet(i), batch_reader->packet_length(i),
+                    batch_reader->packet_meta(i));
             }
         }
-        
-        if(raw){
-            std::cout << std::endl << "Raw packet data: " << std::endl;
-            for (int i = 0; i < len; i++) {
-                printf("%02x ", (unsigned int)buf[i]);
+
+        /* Command responses are rare; only look for them while a command is outstanding */
+        if(command_channel->busy()){
+            for(size_t i=0; i<batch_reader->batch_count(); i++){
+                command_channel->handle_event(batch_reader->packet(i), batch_reader->packet_length(i));
             }
-            std::cout << std::endl; 
         }
-        
+
+        if(capture_writer != nullptr || raw_sinks){
+            for(size_t i=0; i<batch_reader->batch_count(); i++){
+                hci_packet_t pkt = {batch_reader->packet(i), batch_reader->packet_length(i),
+                    batch_reader->packet_meta(i)};
+                if(capture_writer != nullptr) capture_writer->write(pkt);
+                /* Dumped by the sink thread; the capture thread only copies the packet */
+                if(raw_sinks) raw_sinks->push_raw(pkt.data, pkt.length);
+            }
+        }
+
+        /* With a pipeline the capture thread only copies frames; workers parse and publish */
+        if(parse_pipeline) parse_pipeline->submit(*batch_reader);
+        else batch_reader->publish(*scan_queue, false, adv_filter, device_table.get(), &scan_taps, reassembler.get());
+
+        /* A short batch means the socket queue is empty */
+        if((unsigned int)n < batch_reader->get_config().batch_size) break;
     }
+
+    if(total > 0) last_activity = monotonic_ns();
+    return total;
 }
 
-int BT_Sniff::stopCapture(){
+void BT_Sniff::flush_commands(){
+    /**
+     * Keeps reading the socket until every queued HCI command has been
+     * written and answered, or BT_SNIFF_COMMAND_FLUSH_NS has passed.
+     * The channel sends one command per credit, and credits come back
+     * with the completions read here. Records read meanwhile are
+     * published as usual; the stopped sync manager does not see them,
+     * so no new sync is started
+    */
+
+    uint64_t deadline = monotonic_ns() + BT_SNIFF_COMMAND_FLUSH_NS;
+    while(command_channel->busy()){
+        uint64_t now = monotonic_ns();
+        if(now >= deadline) break;
+
+        struct pollfd pfd = {socket_fd, POLLIN, 0};
+        int wait_ms = (int)((deadline - now + 999999) / 1000000);
+        int ready = poll(&pfd, 1, wait_ms);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready <= 0 || (pfd.revents & (POLLERR | POLLHUP))) break;
+        if(service_socket(false) < 0) break;
+    }
+}
+
+void BT_Sniff::finish_scan(scanExit reason){
+    /**
+     * Ends the capture on the loop thread: publishes whatever is still
+     * queued on the socket, unregisters socket and timers, and stops the
+     * loop if start_le_scan*() created it (idempotent)
+     *
+     * @param reason    Recorded for last_scan_exit()
+    */
+
+    eventLoop *loop;
+    {
+        std::lock_guard<std::mutex> lock(loop_mutex);
+        loop = scan_loop;
+        scan_loop = nullptr;
+        stop_requested = false;
+    }
+    if(loop == nullptr) return;
+
+    if(reason != scanExit::error){
+        for(int round=0; round<BT_SNIFF_MAX_DRAIN_WAKES; round++){
+            if(service_socket() <= 0) break;
+        }
+    }
+
+    /* After the drain, so nothing read there starts a new sync; the controller stops reporting */
+    if(periodic_sync){
+        periodic_sync->stop();
+        if(reason != scanExit::error) flush_commands();
+    }
+
+    loop->remove_fd(socket_fd);
+    if(duration_timer >= 0) loop->cancel_timer(duration_timer);
+    if(idle_timer >= 0) loop->cancel_timer(idle_timer);
+    if(command_timer >= 0) loop->cancel_timer(command_timer);
+    duration_timer = -1;
+    idle_timer = -1;
+    command_timer = -1;
+
+    /* Everything read must reach the queue and the taps before the capture counts as finished */
+    if(parse_pipeline) parse_pipeline->stop();
+
+    /* Chains left open now would never see their last fragment */
+    if(reassembler) reassembler->clear();
+
+    /* Flush verbose output before reporting the capture as finished */
+    if(verbose_sinks) verbose_sinks->stop();
+    if(raw_sinks) raw_sinks->stop();
+
+    scan_exit.store(reason, std::memory_order_release);
+    is_scanning.store(false, std::memory_order_release);
+    if(owns_loop) loop->stop();
+}
+
+scanExit BT_Sniff::last_scan_exit() const{
+    return scan_exit.load(std::memory_order_acquire);
+}
+
+batch_stats_t BT_Sniff::get_batch_stats() const{
+    /**
+     * Statistics of the batched capture loop (zeros if never started)
+     * 
+     * @returns batch_stats_t snapshot
+    */
+
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    if(!batch_reader) return batch_stats_t{};
+    return batch_reader->stats();
+}
+
+void BT_Sniff::set_capture_writer(captureWriter *writer){
     /**
-     * Dummy implementation
+     * Attaches (or detaches with nullptr) a disk writer that receives every
+     * raw packet read by the capture loops. The writer is not owned.
+     * 
+     * @param writer    captureWriter to feed, or nullptr
     */
 
+    capture_writer = writer;
+}
+
+void BT_Sniff::set_output_sinks(sinkWriter *sinks){
+    /**
+     * Attaches (or detaches with nullptr) a sinkWriter that receives a copy
+     * of every record published by the capture loops, after filtering and
+     * aggregation. Takes the place of verbose mode's stdout output. Set it
+     * before starting a capture loop; the writer is not owned and must
+     * only be fed by this instance (single producer).
+     * 
+     * @param sinks sinkWriter to feed, or nullptr
+    */
+
+    output_sinks = sinks;
+}
+
+void BT_Sniff::set_broadcast(eventBroadcast *ring){
+    /**
+     * Attaches (or detaches with nullptr) a broadcast ring that receives
+     * every record the capture loops publish, after filtering and
+     * aggregation, so several consumers can share this capture. Gating
+     * subscribers can stall the capture; lossy ones cannot. Set it before
+     * starting a capture loop; the ring is not owned and this instance
+     * must be its only producer.
+     * 
+     * @param ring  eventBroadcast to feed, or nullptr
+    */
+
+    broadcast = ring;
+}
+
+void BT_Sniff::set_shm_ring(shmRingWriter *ring){
+    /**
+     * Attaches (or detaches with nullptr) a shared-memory ring that other
+     * processes read through the bt_shm_reader library. The ring never
+     * waits for its readers, so it cannot stall the capture. Set it before
+     * starting a capture loop; the writer is not owned and this instance
+     * must be its only producer.
+     * 
+     * @param ring  shmRingWriter to feed, or nullptr
+    */
+
+    shm_ring = ring;
+}
+
+void BT_Sniff::set_adv_filter(const advFilter *filter){
+    /**
+     * Installs a compiled userspace report filter. It runs on the raw
+     * report fields, so rejected reports are never copied or formatted.
+     * Set it before starting a capture loop; the filter is not owned.
+     *
+     * @param filter    advFilter built with advFilterBuilder, or nullptr
+    */
+
+    adv_filter = filter;
+}
+
+void BT_Sniff::enable_aggregation(const device_table_config_t& config){
+    /**
+     * Creates the per-device table. From then on the capture loops only
+     * queue new-device, changed-payload and periodic summary records.
+     * Call before starting a capture loop.
+     *
+     * @param config    Table capacity, summary interval, eviction age
+    */
+
+    device_table = std::make_unique<deviceTable>(config);
+}
+
+void BT_Sniff::enable_reassembly(const reassembly_config_t& config){
+    /**
+     * Creates the fragment reassembler. From then on the capture loops
+     * queue one record per extended advertisement instead of one per
+     * fragment, and the report filter sees whole payloads. A parse
+     * pipeline is switched to in-order publication. Payloads longer than
+     * a record keep whole AD structures and are marked truncated.
+     * Call once, before starting a capture loop. If register_metrics()
+     * was called already, the reassembler's metrics are added to that registry.
+     *
+     * @param config    Chains in progress, payload limit and timeout
+    */
+
+    reassembler = std::make_unique<extReassembler>(config);
+    if(metrics_registry != nullptr) reassembler->register_metrics(*metrics_registry, metrics_labels);
+}
+
+reassembly_stats_t BT_Sniff::get_reassembly_stats() const{
+    if(!reassembler) return reassembly_stats_t{};
+    return reassembler->stats();
+}
+
+void BT_Sniff::enable_periodic_sync(const periodic_sync_config_t& config, periodic_callback_t callback){
+    /**
+     * Creates the periodic sync manager. While a capture is attached it
+     * syncs to trains announced in extended reports (scanning must be
+     * extended, see commands()), and callback receives one reassembled
+     * payload per periodic advertising event on the capture thread.
+     * Periodic report fragments still reach the queue as before.
+     * Call once, before starting a capture loop. If register_metrics()
+     * was called already, the manager's metrics are added to that registry.
+     *
+     * @param config    Sync limit, timeouts, retry policy and advertiser filter
+     * @param callback  Receives reassembled payloads
+    */
+
+    periodic_sync = std::make_unique<periodicSyncManager>(*command_channel, config, std::move(callback));
+    if(metrics_registry != nullptr) periodic_sync->register_metrics(*metrics_registry, metrics_labels);
+}
+
+periodic_sync_stats_t BT_Sniff::get_periodic_sync_stats() const{
+    if(!periodic_sync) return periodic_sync_stats_t{};
+    return periodic_sync->stats();
+}
+
+void BT_Sniff::enable_parse_pipeline(const pipeline_config_t& config){
+    /**
+     * Makes the next capture loops hand raw frames to a parsePipeline:
+     * the loop thread only reads and copies, and config.workers (pinned
+     * to config.cpus) decode, filter, aggregate and publish. With
+     * config.reorder the queue sees records in capture order, as without
+     * the pipeline. Slot size follows the capture's batch configuration.
+     * Call before starting a capture loop.
+     *
+     * @param config    Workers, pinning, arena size and ordering
+    */
+
+    pipeline_config = config;
+    pipeline_enabled = true;
+}
+
+pipeline_stats_t BT_Sniff::get_pipeline_stats() const{
+    /**
+     * Statistics of the parse pipeline of the current (or last) capture
+     * 
+     * @returns pipeline_stats_t snapshot
+    */
+
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    if(!parse_pipeline) return pipeline_stats_t{};
+    return parse_pipeline->stats();
+}
+
+const deviceTable* BT_Sniff::get_device_table() const{
+    /**
+     * Read-only access to the aggregation table (stats() is thread-safe)
+     *
+     * @returns deviceTable, or nullptr if aggregation is disabled
+    */
+
+    return device_table.get();
+}
+
+int BT_Sniff::set_filter(const hciFilterSpec& spec){
+    /**
+     * Applies the kernel filter computed from spec to the socket and
+     * resets the baseline used by get_filter_savings()
+     * 
+     * @param spec  Subscriptions (packet types, events, opcode)
+     * @returns 0 on success, -1 on failure
+    */
+
+    hci_sock_filter_t filter = spec.compile();
+    static_assert(sizeof(hci_sock_filter_t) == sizeof(struct hci_filter),
+        "hci_sock_filter_t must match struct hci_filter");
+    if(setsockopt(socket_fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0){
+        return -1;
+    }
+
+    filter_baseline = filter_savings_t{};
+    read_device_counters(filter_baseline.device_packets, filter_baseline.device_bytes);
+    filter_baseline.delivered_packets = rx_packets.load(std::memory_order_relaxed);
+    filter_baseline.delivered_bytes = rx_bytes.load(std::memory_order_relaxed);
+    return 0;
+}
+
+filter_savings_t BT_Sniff::get_filter_savings() const{
+    /**
+     * Compares the adapter's own counters (everything an all-events filter
+     * would have delivered) against what reached the capture loop
+     * 
+     * @returns filter_savings_t since the last set_filter()
+    */
+
+    filter_savings_t s = {};
+    uint64_t packets = 0, bytes = 0;
+    if(read_device_counters(packets, bytes) < 0) return s;
+
+    s.device_packets = packets - filter_baseline.device_packets;
+    s.device_bytes = bytes - filter_baseline.device_bytes;
+    s.delivered_packets = rx_packets.load(std::memory_order_relaxed) - filter_baseline.delivered_packets;
+    s.delivered_bytes = rx_bytes.load(std::memory_order_relaxed) - filter_baseline.delivered_bytes;
+    s.saved_wakeups = s.device_packets > s.delivered_packets ? s.device_packets - s.delivered_packets : 0;
+    s.saved_bytes = s.device_bytes > s.delivered_bytes ? s.device_bytes - s.delivered_bytes : 0;
+    return s;
+}
+
+int BT_Sniff::read_device_counters(uint64_t& packets, uint64_t& bytes) const{
+    /**
+     * Reads the adapter statistics maintained by the kernel
+     * Raw sockets see both directions, so tx counters are included
+     * 
+     * @param packets   Set to events + ACL + SCO received, commands + ACL + SCO sent
+     * @param bytes     Set to bytes received + sent
+     * @returns 0 on success, -1 on failure
+    */
+
+    struct hci_dev_info dev_info;
+    if(hci_devinfo(device_id, &dev_info) < 0) return -1;
+
+    const struct hci_dev_stats& st = dev_info.stat;
+    packets = (uint64_t)st.evt_rx + st.acl_rx + st.sco_rx + st.cmd_tx + st.acl_tx + st.sco_tx;
+    bytes = (uint64_t)st.byte_rx + st.byte_tx;
     return 0;
-}
\ No newline at end of file
+}
+
+batch_stats_t BT_Sniff::capture_totals_locked() const{
+    /**
+     * Adds the current reader's statistics to those of earlier captures
+     * 
+     * @returns cumulative batch_stats_t (last_* fields from the current reader)
+    */
+
+    batch_stats_t t = batch_totals;
+    if(!batch_reader) return t;
+
+    batch_stats_t cur = batch_reader->stats();
+    if(parse_pipeline){
+        /* Workers parse and publish instead of the reader */
+        pipeline_stats_t ps = parse_pipeline->stats();
+        cur.parsed += ps.parsed;
+        cur.events += ps.events;
+    }
+    t.syscalls += cur.syscalls;
+    t.packets += cur.packets;
+    t.bytes += cur.bytes;
+    t.events += cur.events;
+    t.parsed += cur.parsed;
+    t.errors += cur.errors;
+    t.truncated += cur.truncated;
+    t.last_packets = cur.last_packets;
+    t.last_bytes = cur.last_bytes;
+    if(cur.max_packets > t.max_packets) t.max_packets = cur.max_packets;
+    return t;
+}
+
+pipeline_stats_t BT_Sniff::pipeline_totals_locked() const{
+    /**
+     * Adds the current pipeline's counters to those of earlier captures,
+     * so exported counters keep growing although each capture builds a
+     * new pipeline
+     * 
+     * @returns cumulative pipeline_stats_t (in_flight from the current pipeline)
+    */
+
+    pipeline_stats_t t = pipeline_totals;
+    t.in_flight = 0;
+    if(!parse_pipeline) return t;
+
+    pipeline_stats_t cur = parse_pipeline->stats();
+    t.frames += cur.frames;
+    t.dropped += cur.dropped;
+    t.truncated += cur.truncated;
+    t.slots += cur.slots;
+    t.stolen += cur.stolen;
+    t.parsed += cur.parsed;
+    t.events += cur.events;
+    t.held += cur.held;
+    t.overflowed += cur.overflowed;
+    t.in_flight = cur.in_flight;
+    if(cur.max_in_flight > t.max_in_flight) t.max_in_flight = cur.max_in_flight;
+    return t;
+}
+
+void BT_Sniff::register_metrics(metricsRegistry& registry, const std::string& labels){
+    /**
+     * Registers sampled metrics; the capture path keeps counting exactly
+     * as before and the registry reads the counters on demand
+     * 
+     * @param registry  Registry to add to
+     * @param labels    Label pairs identifying the adapter, e.g. adapter="hci0"
+    */
+
+    struct counter_def_t{
+        const char *name;
+        const char *help;
+        uint64_t batch_stats_t::*field;
+    };
+    static const counter_def_t counters[] = {
+        {"bt_sniff_packets_total", "HCI packets read from the socket", &batch_stats_t::packets},
+        {"bt_sniff_bytes_total", "HCI bytes read from the socket", &batch_stats_t::bytes},
+        {"bt_sniff_syscalls_total", "recvmmsg() calls that returned packets", &batch_stats_t::syscalls},
+        {"bt_sniff_records_parsed_total", "Advertising records decoded (after filtering)", &batch_stats_t::parsed},
+        {"bt_sniff_records_published_total", "Records accepted by the event queue", &batch_stats_t::events},
+        {"bt_sniff_truncated_total", "Packets larger than the read buffer", &batch_stats_t::truncated},
+        {"bt_sniff_read_errors_total", "Failed socket reads", &batch_stats_t::errors},
+    };
+
+    for(const counter_def_t& c : counters){
+        uint64_t batch_stats_t::*field = c.field;
+        registry.counter_fn(c.name, c.help, labels, [this, field](){
+            std::lock_guard<std::mutex> lock(reader_mutex);
+            return capture_totals_locked().*field;
+        });
+    }
+
+    registry.gauge_fn("bt_sniff_scanning", "1 while a capture loop is attached", labels,
+        [this](){ return is_scanning.load(std::memory_order_relaxed) ? 1.0 : 0.0; });
+    registry.counter_fn("bt_sniff_hci_commands_sent_total", "HCI commands written", labels,
+        [this](){ return command_channel->stats().sent; });
+    registry.counter_fn("bt_sniff_hci_command_timeouts_total", "HCI commands that never got a response", labels,
+        [this](){ return command_channel->stats().timeouts; });
+    /* The pipeline is rebuilt for every capture, so its counters are exported from here */
+    struct pipeline_counter_def_t{
+        const char *name;
+        const char *help;
+        uint64_t pipeline_stats_t::*field;
+    };
+    static const pipeline_counter_def_t pipeline_counters[] = {
+        {"bt_sniff_pipeline_frames_total", "Frames handed to the parse pipeline", &pipeline_stats_t::frames},
+        {"bt_sniff_pipeline_dropped_total", "Frames dropped because every pipeline slot was in flight", &pipeline_stats_t::dropped},
+        {"bt_sniff_pipeline_held_total", "Parsed slots held back to keep capture order", &pipeline_stats_t::held},
+        {"bt_sniff_pipeline_stolen_total", "Pipeline slots parsed by a worker other than the one they were queued for", &pipeline_stats_t::stolen},
+        {"bt_sniff_pipeline_overflowed_total", "Pipeline slots whose records spilled out of the arena", &pipeline_stats_t::overflowed},
+    };
+
+    for(const pipeline_counter_def_t& c : pipeline_counters){
+        uint64_t pipeline_stats_t::*field = c.field;
+        registry.counter_fn(c.name, c.help, labels, [this, field](){
+            std::lock_guard<std::mutex> lock(reader_mutex);
+            return pipeline_totals_locked().*field;
+        });
+    }
+    registry.gauge_fn("bt_sniff_pipeline_in_flight", "Parse pipeline slots queued or being parsed", labels,
+        [this](){ return (double)get_pipeline_stats().in_flight; });
+    registry.gauge_fn("bt_sniff_pipeline_max_in_flight", "Most parse pipeline slots in flight at once", labels,
+        [this](){
+            std::lock_guard<std::mutex> lock(reader_mutex);
+            return (double)pipeline_totals_locked().max_in_flight;
+        });
+    registry.histogram("bt_sniff_read_to_parse_seconds", "Kernel receive to end of parsing", labels, read_to_parse);
+    registry.histogram("bt_sniff_parse_time_seconds", "Parse time per packet (batch average)", labels, parse_time);
+
+    /* Components register their own metrics, here or once enabled */
+    metrics_registry = &registry;
+    metrics_labels = labels;
+    if(reassembler) reassembler->register_metrics(registry, labels);
+    if(periodic_sync) periodic_sync->register_metrics(registry, labels);
+
+    /* Decoder counters are process-wide */
+    registry.counter_fn("bt_sniff_reports_decoded_total", "Advertising reports decoded, all adapters", "",
+        [](){ return get_le_meta_stats().reports; });
+    registry.counter_fn("bt_sniff_reports_filtered_total", "Advertising reports rejected by the report filter, all adapters", "",
+        [](){ return get_le_meta_stats().rejected; });
+}
+
+hciCommandChannel& BT_Sniff::commands(){
+    return *command_channel;
+}
+
+int BT_Sniff::stopCapture(){
+    /**
+     * Asks the capture loop to finish. Safe from any thread: the request
+     * is posted to the loop's eventfd, so the loop wakes immediately,
+     * drains what the socket still holds and returns. A request made
+     * before a loop is attached makes that loop return at once
+     * 
+     * @returns 0 if a capture loop was running, -1 otherwise
+    */
+
+    eventLoop *loop;
+    {
+        std::lock_guard<std::mutex> lock(loop_mutex);
+        stop_requested = true;
+        loop = scan_loop;
+        if(loop != nullptr) loop->post([this](){ finish_scan(scanExit::stopped); });
+    }
+    return loop != nullptr ? 0 : -1;
+}
@@ -6,25 +6,209 @@
 #define BT_SNIFF
 
 #include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
 #include "bluetoothdef.hpp"
 #include "event_queue.hpp"
+#include "batch_reader.hpp"
+#include "parse_pipeline.hpp"
+#include "capture_writer.hpp"
+#include "output_sink.hpp"
+#include "event_broadcast.hpp"
+#include "shm_ring.hpp"
+#include "hci_filter_spec.hpp"
+#include "adv_filter.hpp"
+#include "device_table.hpp"
+#include "event_loop.hpp"
+#include "hci_command.hpp"
+#include "periodic_sync.hpp"
+#include "ext_reassembly.hpp"
+#include "metrics.hpp"
+#include "latency_histogram.hpp"
+
+/**
+ * @details
+ * Limits applied to a capture loop
+ * @param idle_timeout_ms	Stop when no packet arrived for this long (0 = never)
+ * @param duration_ms	Stop after this long (0 = never)
+*/
+typedef struct{
+    uint32_t idle_timeout_ms = 0;
+    uint32_t duration_ms = 0;
+} scan_limits_t;
+
+/**
+ * @details
+ * Why the most recent capture loop ended
+*/
+enum class scanExit{
+    none,
+    stopped,
+    duration,
+    idle,
+    error
+};
 
 class BT_Sniff{
 public:
     BT_Sniff();
+
+    /**
+     * @brief Opens a specific adapter (hci_dev index, -1 for the default route)
+    */
+    explicit BT_Sniff(int dev_id);
     ~BT_Sniff();
 
     /**
-     * @brief Starts the capture loop
+     * @brief Captures from a socket opened elsewhere (user channel, replay socketpair); takes ownership of fd
+    */
+    static std::unique_ptr<BT_Sniff> from_socket(int fd, int dev_id = -1);
+
+    /**
+     * @brief Lists the hci_dev indices of all adapters that are up
+    */
+    static std::vector<int> list_adapters();
+
+    /**
+     * @brief Adapter (hci_dev index) this instance is bound to
+    */
+    int get_device_id() const;
+
+    /**
+     * @brief True if the socket was opened and bound
+    */
+    bool is_initialized() const;
+
+    /**
+     * @brief Runs the capture loop on the calling thread until stopped or a limit is hit
+    */
+    int start_le_scan(
+        eventQueue& usr_queue, const bool& verbose, const bool& raw,
+        const scan_limits_t& limits = scan_limits_t{});
+
+    /**
+     * @brief Same as start_le_scan() with explicit recvmmsg batching
+    */
+    int start_le_scan_batched(
+        eventQueue& usr_queue, const batch_config_t& config, const bool& verbose,
+        const scan_limits_t& limits = scan_limits_t{});
+
+    /**
+     * @brief Registers the socket (and limit timers) on a caller-owned event loop
+    */
+    int attach(
+        eventLoop& loop, eventQueue& usr_queue, const batch_config_t& config,
+        const bool& verbose, const scan_limits_t& limits = scan_limits_t{});
+
+    /**
+     * @brief Why the most recent capture loop ended
+    */
+    scanExit last_scan_exit() const;
+
+    /**
+     * @brief Returns statistics of the batched capture loop
+    */
+    batch_stats_t get_batch_stats() const;
+
+    /**
+     * @brief Records every raw packet through writer (nullptr to disable)
+    */
+    void set_capture_writer(captureWriter *writer);
+
+    /**
+     * @brief Copies every published record to sinks (nullptr to disable); replaces
+     * the stdout text output of verbose mode
+    */
+    void set_output_sinks(sinkWriter *sinks);
+
+    /**
+     * @brief Also publishes every record to a multi-subscriber broadcast (nullptr to disable)
+    */
+    void set_broadcast(eventBroadcast *broadcast);
+
+    /**
+     * @brief Also publishes every record to a cross-process shared-memory ring (nullptr to disable)
     */
-    int start_le_scan(eventQueue& usr_queue, const bool& verbose, const bool& raw);
+    void set_shm_ring(shmRingWriter *ring);
     
     /**
-     * @brief Stops the capture loop
+     * @brief Installs the tightest kernel filter for the subscriptions in spec
+    */
+    int set_filter(const hciFilterSpec& spec);
+
+    /**
+     * @brief Wake-ups and bytes the kernel filter saved since set_filter()
+    */
+    filter_savings_t get_filter_savings() const;
+
+    /**
+     * @brief Filters reports in userspace before they are queued (nullptr for the built-in PDU check)
+    */
+    void set_adv_filter(const advFilter *filter);
+
+    /**
+     * @brief Coalesces duplicate reports per device before they are queued
+    */
+    void enable_aggregation(const device_table_config_t& config);
+
+    /**
+     * @brief Aggregation table (nullptr unless enable_aggregation() was called)
+    */
+    const deviceTable* get_device_table() const;
+
+    /**
+     * @brief Joins fragmented extended advertising reports into one record
+     * per advertisement before they are filtered, aggregated and queued
+    */
+    void enable_reassembly(const reassembly_config_t& config);
+
+    /**
+     * @brief Statistics of the fragment reassembler (zeros if not enabled)
+    */
+    reassembly_stats_t get_reassembly_stats() const;
+
+    /**
+     * @brief Moves parsing off the capture thread onto a pool of parser threads
+    */
+    void enable_parse_pipeline(const pipeline_config_t& config);
+
+    /**
+     * @brief Statistics of the current capture's parse pipeline (zeros if not enabled)
+    */
+    pipeline_stats_t get_pipeline_stats() const;
+
+    /**
+     * @brief Command channel on the capture socket; responses are consumed
+     * while a capture is attached (the kernel filter must pass command_responses())
+    */
+    hciCommandChannel& commands();
+
+    /**
+     * @brief Follows periodic advertising trains announced in extended reports
+     * through the controller and delivers their reassembled payloads to callback
+    */
+    void enable_periodic_sync(const periodic_sync_config_t& config, periodic_callback_t callback);
+
+    /**
+     * @brief Statistics of the periodic sync manager (zeros if not enabled)
+    */
+    periodic_sync_stats_t get_periodic_sync_stats() const;
+
+    /**
+     * @brief Exposes capture counters, parse latency and command statistics
+     * in registry, plus those of the reassembler and periodic sync manager,
+     * now or when they are enabled (this instance must outlive the registration)
+    */
+    void register_metrics(metricsRegistry& registry, const std::string& labels = "");
+
+    /**
+     * @brief Stops the capture loop after draining queued packets (thread-safe)
     */
     int stopCapture();
 
@@ -47,17 +231,195 @@ private:
     /**
      * @brief Boolean flag to indicate if scanning is ongoing
     */
-    bool is_scanning;
+    std::atomic<bool> is_scanning;
+
+    /**
+     * @brief Set by stopCapture(); a loop attached afterwards returns at once
+    */
+    bool stop_requested;
+
+    /**
+     * @brief Event loop the socket is registered on (nullptr when idle)
+    */
+    eventLoop *scan_loop;
+
+    /**
+     * @brief Guards scan_loop and stop_requested against stopCapture()
+    */
+    std::mutex loop_mutex;
+
+    /**
+     * @brief True if scan_loop was created by start_le_scan*() and must be stopped
+    */
+    bool owns_loop;
+
+    /**
+     * @brief State of the attached capture loop (loop thread only)
+    */
+    eventQueue *scan_queue;
+    publish_taps_t scan_taps;
+    bool scan_raw;
+    int duration_timer;
+    int idle_timer;
+    int command_timer;
+    uint64_t last_activity;
+    std::atomic<scanExit> scan_exit;
 
     /**
      * @brief Boolean flag to indicate if ready to start scanning
     */
     bool scan_ready;
 
+    /**
+     * @brief Reader used by the batched capture loop
+    */
+    std::unique_ptr<batchReader> batch_reader;
+
+    /**
+     * @brief Guards batch_reader replacement against statistics readers
+    */
+    mutable std::mutex reader_mutex;
+
+    /**
+     * @brief Statistics of readers from earlier captures (for monotonic metrics)
+    */
+    batch_stats_t batch_totals;
+
+    /**
+     * @brief Kernel receive to end of parsing, and parse time per packet
+    */
+    latencyHistogram read_to_parse;
+    latencyHistogram parse_time;
+
+    /**
+     * @brief Optional disk writer fed by the capture loops (not owned)
+    */
+    captureWriter *capture_writer;
+
+    /**
+     * @brief Optional record sinks fed by the capture loops (not owned)
+    */
+    sinkWriter *output_sinks;
+
+    /**
+     * @brief stdout text sink used by verbose captures without output_sinks
+    */
+    std::unique_ptr<sinkWriter> verbose_sinks;
+
+    /**
+     * @brief stdout text sink dumping raw packets (start_le_scan() raw mode);
+     * separate from verbose_sinks because records may be published from
+     * parse pipeline threads while raw packets come from the capture thread
+    */
+    std::unique_ptr<sinkWriter> raw_sinks;
+
+    /**
+     * @brief Optional broadcast ring fed by the capture loops (not owned)
+    */
+    eventBroadcast *broadcast;
+
+    /**
+     * @brief Optional shared-memory ring fed by the capture loops (not owned)
+    */
+    shmRingWriter *shm_ring;
+
+    /**
+     * @brief Optional compiled report filter applied by the capture loops (not owned)
+    */
+    const advFilter *adv_filter;
+
+    /**
+     * @brief Optional per-device aggregation table used by the capture loops
+    */
+    std::unique_ptr<deviceTable> device_table;
+
+    /**
+     * @brief Optional extended advertising fragment reassembler used by the capture loops
+    */
+    std::unique_ptr<extReassembler> reassembler;
+
+    /**
+     * @brief Parse pipeline settings (used when pipeline_enabled), the
+     * pipeline of the current capture (replaced under reader_mutex) and
+     * the counters of the pipelines of earlier captures
+    */
+    bool pipeline_enabled;
+    pipeline_config_t pipeline_config;
+    std::unique_ptr<parsePipeline> parse_pipeline;
+    pipeline_stats_t pipeline_totals;
+
+    /**
+     * @brief Command Complete/Status correlation for commands sent on socket_fd
+    */
+    std::unique_ptr<hciCommandChannel> command_channel;
+
+    /**
+     * @brief Optional periodic advertising sync manager on command_channel
+    */
+    std::unique_ptr<periodicSyncManager> periodic_sync;
+
+    /**
+     * @brief Registry given to register_metrics() (not owned), so components
+     * enabled afterwards register their own metrics there
+    */
+    metricsRegistry *metrics_registry;
+    std::string metrics_labels;
+
+    /**
+     * @brief Packets and bytes delivered to the capture loops
+    */
+    std::atomic<uint64_t> rx_packets;
+    std::atomic<uint64_t> rx_bytes;
+
+    /**
+     * @brief Adapter and delivery counters when the filter was applied
+    */
+    filter_savings_t filter_baseline;
+
+    /**
+     * @brief Reads everything queued on the socket and publishes it
+    */
+    int service_socket(bool track_syncs = true);
+
+    /**
+     * @brief Waits (bounded) for queued HCI commands, e.g. the Terminate Syncs of a finishing capture
+    */
+    void flush_commands();
+
+    /**
+     * @brief Statistics of every capture so far (reader_mutex held)
+    */
+    batch_stats_t capture_totals_locked() const;
+
+    /**
+     * @brief Parse pipeline counters of every capture so far (reader_mutex held)
+    */
+    pipeline_stats_t pipeline_totals_locked() const;
+
+    /**
+     * @brief Drains the socket, unregisters it and records why the loop ended
+    */
+    void finish_scan(scanExit reason);
+
+    /**
+     * @brief Reads adapter packet/byte counters (both directions)
+    */
+    int read_device_counters(uint64_t& packets, uint64_t& bytes) const;
+
+    /**
+     * @brief Opens dev_id, or adopts fd when it is not -1
+    */
+    BT_Sniff(int dev_id, int fd);
+
     /**
      * @brief Inner function that initializes and binds the socket and sets data fields
     */
-    int initialize();
+    int initialize(int dev_id);
+
+    /**
+     * @brief Takes over a caller's socket instead of opening one
+    */
+    int adopt(int dev_id, int fd);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+/**
+ * Implementation details for the multi-adapter captureManager
+ * @author Owen Capell
+*/
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+#include "capture_manager.hpp"
+#include "bt_sniff.hpp"
+#include "event_queue.hpp"
+#include "stream_merger.hpp"
+#include "metrics.hpp"
+
+captureManager::captureManager(const capture_manager_config_t& config)
+    : config(config), adapters(), merger(config.merge), merge_thread(),
+    merging(false), verbose(false), started(false)
+    {
+    /**
+     * Constructor for captureManager
+     * Opens every selected adapter; adapters that fail to open are skipped
+     *
+     * @param config    Adapters, CPU pinning, queue and merge settings
+    */
+
+    std::vector<int> ids = config.adapters.empty() ? BT_Sniff::list_adapters() : config.adapters;
+    for(size_t i=0; i<ids.size() && adapters.size()<ADV_MAX_ADAPTERS; i++){
+        std::unique_ptr<BT_Sniff> sniffer = std::make_unique<BT_Sniff>(ids[i]);
+        if(!sniffer->is_initialized()){
+            std::cerr << "Error opening adapter hci" << ids[i] << std::endl;
+            continue;
+        }
+        add_adapter(std::move(sniffer), i);
+    }
+}
+
+captureManager::captureManager(const capture_manager_config_t& config, std::vector<std::unique_ptr<BT_Sniff>> sniffers)
+    : config(config), adapters(), merger(config.merge), merge_thread(),
+    merging(false), verbose(false), started(false)
+    {
+    /**
+     * Constructor for captureManager over sniffers the caller opened
+     * (e.g. BT_Sniff::from_socket()); config.adapters is ignored and
+     * sniffers that are not initialized are skipped
+     *
+     * @param config    CPU pinning, queue and merge settings
+     * @param sniffers  One sniffer per adapter, in input order
+    */
+
+    for(size_t i=0; i<sniffers.size() && adapters.size()<ADV_MAX_ADAPTERS; i++){
+        if(!sniffers[i] || !sniffers[i]->is_initialized()) continue;
+        add_adapter(std::move(sniffers[i]), i);
+    }
+}
+
+captureManager::~captureManager(){
+    /**
+     * Destructor for captureManager
+    */
+
+    stop();
+}
+
+void captureManager::add_adapter(std::unique_ptr<BT_Sniff> sniffer, size_t i){
+    /**
+     * Gives an opened sniffer its queue and CPU
+     *
+     * @param sniffer   Initialized sniffer
+     * @param i Position in the selection (indexes config.cpus)
+    */
+
+    adapter_t a;
+    a.sniffer = std::move(sniffer);
+    a.queue = std::make_unique<eventQueue>(config.queue_capacity);
+    a.cpu = i < config.cpus.size() ? config.cpus[i] : -1;
+    adapters.push_back(std::move(a));
+}
+
+void captureManager::pin_self(int cpu){
+    /**
+     * Pins the calling thread to cpu (no-op for cpu < 0)
+     *
+     * @param cpu   CPU index
+    */
+
+    if(cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+        std::cerr << "Error pinning capture thread to CPU " << cpu << std::endl;
+    }
+}
+
+int captureManager::start(eventQueue& out, const bool& verbose_flag){
+    /**
+     * Starts the pipeline: each adapter runs the batched capture loop on
+     * its own (pinned) thread into its own SPSC queue; the merge thread
+     * is the single consumer of those queues and the single producer of out
+     *
+     * @param out   Merged, time-ordered output queue
+     * @param verbose_flag  Boolean flag to print decoded reports
+     * @returns number of adapters started, -1 if none or already started
+    */
+
+    if(started || adapters.empty()) return -1;
+    verbose = verbose_flag;
+
+    if(merger.input_count() == 0){
+        for(adapter_t& a : adapters){
+            merger.add_input(*a.queue, (uint8_t)a.sniffer->get_device_id());
+        }
+    }
+
+    for(adapter_t& a : adapters){
+        BT_Sniff *sniffer = a.sniffer.get();
+        eventQueue *queue = a.queue.get();
+        int cpu = a.cpu;
+        a.thread = std::thread([this, sniffer, queue, cpu](){
+            pin_self(cpu);
+            sniffer->start_le_scan_batched(*queue, config.batch, verbose);
+        });
+    }
+
+    merging.store(true, std::memory_order_release);
+    merge_thread = std::thread([this, &out](){
+        pin_self(config.merger_cpu);
+        merger.run(out, merging);
+    });
+
+    started = true;
+    return (int)adapters.size();
+}
+
+void captureManager::stop(){
+    /**
+     * Stops capture threads first so the merge stage can drain everything
+     * they queued, then stops the merger (idempotent)
+    */
+
+    if(!started) return;
+
+    for(adapter_t& a : adapters) a.sniffer->stopCapture();
+    for(adapter_t& a : adapters){
+        if(a.thread.joinable()) a.thread.join();
+    }
+
+    merging.store(false, std::memory_order_release);
+    if(merge_thread.joinable()) merge_thread.join();
+    started = false;
+}
+
+size_t captureManager::adapter_count() const{
+    return adapters.size();
+}
+
+BT_Sniff& captureManager::adapter(size_t i){
+    return *adapters[i].sniffer;
+}
+
+std::vector<adapter_stats_t> captureManager::stats() const{
+    /**
+     * Per-adapter snapshot
+     *
+     * @returns one adapter_stats_t per opened adapter
+    */
+
+    std::vector<adapter_stats_t> s;
+    for(const adapter_t& a : adapters){
+        adapter_stats_t st;
+        st.dev_id = a.sniffer->get_device_id();
+        st.cpu = a.cpu;
+        st.batch = a.sniffer->get_batch_stats();
+        st.queued = a.queue->size();
+        st.dropped = a.queue->dropped();
+        s.push_back(st);
+    }
+    return s;
+}
+
+merge_stats_t captureManager::merge_stats() const{
+    return merger.stats();
+}
+
+void captureManager::register_metrics(metricsRegistry& registry){
+    /**
+     * Registers per-adapter capture and queue metrics plus merge counters
+     * (the manager must outlive the registration)
+     *
+     * @param registry  Registry to add to
+    */
+
+    for(adapter_t& a : adapters){
+        std::string labels = "adapter=\"hci" + std::to_string(a.sniffer->get_device_id()) + "\"";
+        a.sniffer->register_metrics(registry, labels);
+        a.queue->register_metrics(registry, labels);
+    }
+
+    registry.counter_fn("bt_sniff_merge_records_total", "Records published by the merge stage", "",
+        [this](){ return merger.stats().merged; });
+    registry.counter_fn("bt_sniff_merge_folded_total", "Cross-adapter duplicates folded", "",
+        [this](){ return merger.stats().folded; });
+    registry.counter_fn("bt_sniff_merge_late_total", "Records older than the reorder window", "",
+        [this](){ return merger.stats().late; });
+    registry.counter_fn("bt_sniff_merge_dropped_total", "Merged records the output queue rejected", "",
+        [this](){ return merger.stats().dropped; });
+}
@@ -0,0 +1,124 @@
+/**
+ * Header/Interface for multi-adapter capture (one thread and queue per controller)
+ * @author Owen Capell
+*/
+#ifndef CAPTURE_MANAGER
+#define CAPTURE_MANAGER
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bt_sniff.hpp"
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "batch_reader.hpp"
+#include "stream_merger.hpp"
+#include "metrics.hpp"
+
+/**
+ * @details
+ * Configuration for captureManager
+ * @param adapters	hci_dev indices to open (empty = every adapter that is up)
+ * @param cpus	CPU per adapter thread, in adapter order (missing or -1 = not pinned)
+ * @param merger_cpu	CPU for the merge thread (-1 = not pinned)
+ * @param queue_capacity	Per-adapter queue capacity
+ * @param batch	recvmmsg batching of each adapter
+ * @param merge	Reorder window and cross-adapter deduplication
+*/
+typedef struct{
+    std::vector<int> adapters;
+    std::vector<int> cpus;
+    int merger_cpu = -1;
+    size_t queue_capacity = EVENT_QUEUE_DEFAULT_CAPACITY;
+    batch_config_t batch;
+    merge_config_t merge;
+} capture_manager_config_t;
+
+/**
+ * @details
+ * Per-adapter statistics
+ * @param dev_id	hci_dev index
+ * @param cpu	CPU the capture thread is pinned to (-1 = not pinned)
+ * @param batch	recvmmsg statistics of the capture thread
+ * @param queued	Records currently waiting in the adapter queue
+ * @param dropped	Records the adapter queue dropped (merger behind)
+*/
+typedef struct{
+    int dev_id;
+    int cpu;
+    batch_stats_t batch;
+    size_t queued;
+    uint64_t dropped;
+} adapter_stats_t;
+
+class captureManager{
+public:
+    /**
+     * @brief Opens one raw HCI socket per selected adapter (no threads yet)
+    */
+    explicit captureManager(const capture_manager_config_t& config);
+
+    /**
+     * @brief Runs sniffers opened by the caller instead (user channels, replay sockets)
+    */
+    captureManager(const capture_manager_config_t& config, std::vector<std::unique_ptr<BT_Sniff>> sniffers);
+
+    /**
+     * @brief Stops and joins all threads
+    */
+    ~captureManager();
+
+    captureManager(const captureManager&) = delete;
+    captureManager& operator=(const captureManager&) = delete;
+
+    /**
+     * @brief Starts one capture thread per adapter and the merge thread feeding out
+    */
+    int start(eventQueue& out, const bool& verbose);
+
+    /**
+     * @brief Stops capture, flushes the merge stage and joins all threads
+    */
+    void stop();
+
+    /**
+     * @brief Number of adapters opened successfully
+    */
+    size_t adapter_count() const;
+
+    /**
+     * @brief Sniffer of adapter i, e.g. to set filters before start()
+    */
+    BT_Sniff& adapter(size_t i);
+
+    std::vector<adapter_stats_t> stats() const;
+    merge_stats_t merge_stats() const;
+
+    /**
+     * @brief Registers every adapter (labelled adapter="hciN"), its queue and the merge stage
+    */
+    void register_metrics(metricsRegistry& registry);
+
+private:
+    typedef struct{
+        std::unique_ptr<BT_Sniff> sniffer;
+        std::unique_ptr<eventQueue> queue;
+        std::thread thread;
+        int cpu;
+    } adapter_t;
+
+    void add_adapter(std::unique_ptr<BT_Sniff> sniffer, size_t i);
+    static void pin_self(int cpu);
+
+    capture_manager_config_t config;
+    std::vector<adapter_t> adapters;
+    streamMerger merger;
+    std::thread merge_thread;
+    std::atomic<bool> merging;
+    bool verbose;
+    bool started;
+};
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * Tests of the AD iterator and typed decoders on truncated and malformed input
+ * @author Owen Capell
+*/
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "ad_parser.hpp"
+
+/* Flags, 16-bit UUID list, complete name and Apple manufacturer data */
+static const std::vector<uint8_t> WELL_FORMED = {
+	0x02, AD_TYPE_FLAGS, 0x06,
+	0x05, AD_TYPE_UUID16_COMPLETE, 0x0F, 0x18, 0xAA, 0xFE,
+	0x04, AD_TYPE_NAME_COMPLETE, 'b', 't', 's',
+	0x05, AD_TYPE_MANUFACTURER, 0x4C, 0x00, 0x01, 0x02
+};
+
+/* iBeacon: company 0x004C, type 0x02, length 0x15, UUID, major, minor, power */
+static std::vector<uint8_t> ibeacon_payload(){
+	std::vector<uint8_t> p = {0x1A, AD_TYPE_MANUFACTURER, 0x4C, 0x00, 0x02, 0x15};
+	for(uint8_t i=0; i<16; i++) p.push_back(i);
+	p.insert(p.end(), {0x12, 0x34, 0x56, 0x78, 0xC5});
+	return p;
+}
+
+/* Copy into an allocation of exactly length octets, so over-reads hit the end of the block */
+static std::unique_ptr<uint8_t[]> exact_copy(const std::vector<uint8_t>& src, size_t length){
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[length == 0 ? 1 : length]);
+	if(length != 0) memcpy(buf.get(), src.data(), length);
+	return buf;
+}
+
+TEST(AdIterator, WalksWellFormedPayload){
+	adRange range(WELL_FORMED.data(), WELL_FORMED.size());
+	std::vector<uint8_t> types;
+	for(ad_field_t f : range) types.push_back(f.type);
+
+	std::vector<uint8_t> expected = {AD_TYPE_FLAGS, AD_TYPE_UUID16_COMPLETE, AD_TYPE_NAME_COMPLETE, AD_TYPE_MANUFACTURER};
+	EXPECT_EQ(types, expected);
+	EXPECT_FALSE(range.malformed());
+	EXPECT_EQ(ad_flags(range), std::optional<uint8_t>(0x06));
+	EXPECT_EQ(ad_name(range), "bts");
+	EXPECT_TRUE(ad_has_uuid16(range, SERVICE_UUID_EDDYSTONE));
+	auto m = ad_manufacturer(range);
+	ASSERT_TRUE(m.has_value());
+	EXPECT_EQ(m->company_id, COMPANY_ID_APPLE);
+	EXPECT_EQ(m->data.size(), 2u);
+}
+
+TEST(AdIterator, SkipsZeroLengthPadding){
+	std::vector<uint8_t> p = {0x00, 0x00, 0x02, AD_TYPE_FLAGS, 0x1A, 0x00, 0x00};
+	adRange range(p.data(), p.size());
+	size_t fields = 0;
+	for(ad_field_t f : range){
+		EXPECT_EQ(f.type, AD_TYPE_FLAGS);
+		fields++;
+	}
+	EXPECT_EQ(fields, 1u);
+	EXPECT_FALSE(range.malformed());
+}
+
+TEST(AdIterator, StopsAtLengthOverrunningPayload){
+	/* Second structure claims 10 octets but only 3 follow */
+	std::vector<uint8_t> p = {0x02, AD_TYPE_FLAGS, 0x06, 0x0A, AD_TYPE_NAME_COMPLETE, 'a', 'b'};
+	std::unique_ptr<uint8_t[]> buf = exact_copy(p, p.size());
+	adRange range(buf.get(), p.size());
+
+	size_t fields = 0;
+	for(ad_field_t f : range){
+		EXPECT_EQ(f.type, AD_TYPE_FLAGS);
+		fields++;
+	}
+	EXPECT_EQ(fields, 1u);
+	EXPECT_TRUE(range.malformed());
+	EXPECT_TRUE(ad_name(range).empty());
+}
+
+TEST(AdIterator, LengthOctetAloneAtEndIsMalformed){
+	std::vector<uint8_t> p = {0x02, AD_TYPE_FLAGS, 0x06, 0x03};
+	std::unique_ptr<uint8_t[]> buf = exact_copy(p, p.size());
+	adRange range(buf.get(), p.size());
+	for(ad_field_t f : range) (void)f;
+	EXPECT_TRUE(range.malformed());
+}
+
+TEST(AdIterator, EveryTruncationStaysInBounds){
+	/* Cut the payload at every length: fields must lie inside the cut, and any cut inside a structure is malformed */
+	std::vector<size_t> boundaries = {0};
+	for(size_t off=0; off < WELL_FORMED.size(); off += (size_t)WELL_FORMED[off] + 1){
+		boundaries.push_back(off + (size_t)WELL_FORMED[off] + 1);
+	}
+
+	for(size_t length=0; length <= WELL_FORMED.size(); length++){
+		std::unique_ptr<uint8_t[]> buf = exact_copy(WELL_FORMED, length);
+		adRange range(buf.get(), length);
+		size_t fields = 0;
+		for(ad_field_t f : range){
+			EXPECT_GE(f.data.data(), buf.get() + 2);
+			EXPECT_LE(f.data.data() + f.data.size(), buf.get() + length);
+			fields++;
+		}
+
+		bool on_boundary = std::find(boundaries.begin(), boundaries.end(), length) != boundaries.end();
+		EXPECT_EQ(range.malformed(), !on_boundary) << "length " << length;
+		if(on_boundary){
+			EXPECT_EQ(fields, (size_t)(std::find(boundaries.begin(), boundaries.end(), length) - boundaries.begin()));
+		}
+
+		/* Typed decoders only see whole structures */
+		ad_flags(range);
+		ad_name(range);
+		ad_appearance(range);
+		ad_manufacturer(range);
+		ad_service_uuids(range, nullptr, 0);
+	}
+}
+
+TEST(AdDecoders, RejectShortStructures){
+	/* Each structure is one octet shorter than its decoder needs */
+	std::vector<uint8_t> flags = {0x01, AD_TYPE_FLAGS};
+	EXPECT_FALSE(ad_flags(adRange(flags.data(), flags.size())).has_value());
+
+	std::vector<uint8_t> tx = {0x01, AD_TYPE_TX_POWER};
+	EXPECT_FALSE(ad_tx_power(adRange(tx.data(), tx.size())).has_value());
+
+	std::vector<uint8_t> appearance = {0x02, AD_TYPE_APPEARANCE, 0x41};
+	EXPECT_FALSE(ad_appearance(adRange(appearance.data(), appearance.size())).has_value());
+
+	std::vector<uint8_t> manufacturer = {0x02, AD_TYPE_MANUFACTURER, 0x4C};
+	EXPECT_FALSE(ad_manufacturer(adRange(manufacturer.data(), manufacturer.size())).has_value());
+
+	ad_field_t service = {AD_TYPE_SERVICE_DATA128, std::span<const uint8_t>(WELL_FORMED.data(), 15)};
+	EXPECT_FALSE(ad_service_data(service).has_value());
+	ad_field_t not_service = {AD_TYPE_FLAGS, std::span<const uint8_t>(WELL_FORMED.data(), 4)};
+	EXPECT_FALSE(ad_service_data(not_service).has_value());
+}
+
+TEST(AdDecoders, IgnorePartialUuids){
+	/* Two whole 16-bit UUIDs and one stray octet */
+	std::vector<uint8_t> p = {0x06, AD_TYPE_UUID16_INCOMPLETE, 0x0F, 0x18, 0x0A, 0x18, 0xFF};
+	adRange range(p.data(), p.size());
+	bt_uuid_t uuids[4];
+	EXPECT_EQ(ad_service_uuids(range, uuids, 4), 2u);
+	EXPECT_EQ(uuids[1].length, 2);
+	EXPECT_EQ(uuids[1].value[0], 0x0A);
+	EXPECT_FALSE(ad_has_uuid16(range, 0xFF00));
+}
+
+TEST(AdDecoders, FindsUuidsInListsOfTheirWidth){
+	/* One 32-bit UUID and one 128-bit UUID with a stray octet */
+	std::vector<uint8_t> p = {0x05, AD_TYPE_UUID32_INCOMPLETE, 0x78, 0x56, 0x34, 0x12, 0x12, AD_TYPE_UUID128_COMPLETE};
+	for(uint8_t i=0; i<17; i++) p.push_back(i);
+	adRange range(p.data(), p.size());
+	uint8_t uuid128[16];
+	for(uint8_t i=0; i<16; i++) uuid128[i] = i;
+
+	EXPECT_TRUE(ad_has_uuid32(range, 0x12345678));
+	EXPECT_FALSE(ad_has_uuid32(range, 0x00010203));
+	EXPECT_TRUE(ad_has_uuid128(range, uuid128));
+	EXPECT_FALSE(ad_has_uuid16(range, 0x5678));
+	uuid128[0] = 0xFF;
+	EXPECT_FALSE(ad_has_uuid128(range, uuid128));
+}
+
+TEST(AdDecoders, IbeaconNeedsWholeFrame){
+	std::vector<uint8_t> p = ibeacon_payload();
+	auto b = ad_ibeacon(adRange(p.data(), p.size()));
+	ASSERT_TRUE(b.has_value());
+	EXPECT_EQ(b->major, 0x1234);
+	EXPECT_EQ(b->minor, 0x5678);
+	EXPECT_EQ(b->tx_power, (int8_t)0xC5);
+	EXPECT_EQ(b->uuid.size(), 16u);
+
+	/* One octet short, with the AD length still consistent */
+	p.pop_back();
+	p[0]--;
+	EXPECT_FALSE(ad_ibeacon(adRange(p.data(), p.size())).has_value());
+
+	/* Wrong iBeacon length octet */
+	p = ibeacon_payload();
+	p[5] = 0x14;
+	EXPECT_FALSE(ad_ibeacon(adRange(p.data(), p.size())).has_value());
+}
+
+TEST(AdDecoders, EddystoneFramesNeedTheirLength){
+	/* Minimum service data length (after UUID) of each frame type */
+	const std::pair<uint8_t, size_t> frames[] = {
+		{EDDYSTONE_UID, 18}, {EDDYSTONE_URL, 3}, {EDDYSTONE_TLM, 14}, {EDDYSTONE_EID, 10}
+	};
+	for(auto [type, need] : frames){
+		for(size_t length : {need - 1, need}){
+			std::vector<uint8_t> p = {(uint8_t)(length + 3), AD_TYPE_SERVICE_DATA16, 0xAA, 0xFE, type};
+			p.resize(p.size() + length - 1, 0x00);
+			auto e = ad_eddystone(adRange(p.data(), p.size()));
+			EXPECT_EQ(e.has_value(), length == need) << "frame " << (int)type << " length " << length;
+		}
+	}
+
+	std::vector<uint8_t> empty = {0x03, AD_TYPE_SERVICE_DATA16, 0xAA, 0xFE};
+	EXPECT_FALSE(ad_eddystone(adRange(empty.data(), empty.size())).has_value());
+}
+
+TEST(AdDecoders, MsCdpNeedsWholeFrame){
+	std::vector<uint8_t> p = {0x1B, AD_TYPE_MANUFACTURER, 0x06, 0x00, 0x01, 0x29, 0x00, 0x00};
+	p.resize(p.size() + 20, 0x11);
+	auto c = ad_ms_cdp(adRange(p.data(), p.size()));
+	ASSERT_TRUE(c.has_value());
+	EXPECT_EQ(c->version, 1);
+	EXPECT_EQ(c->device_type, 9);
+
+	p.pop_back();
+	p[0]--;
+	EXPECT_FALSE(ad_ms_cdp(adRange(p.data(), p.size())).has_value());
+}
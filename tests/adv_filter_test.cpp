@@ -0,0 +1,177 @@
+/**
+ * Tests of the compiled advertising report filter: rule order, jumps,
+ * the default action, UUID conditions and address set growth
+ * @author Owen Capell
+*/
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "adv_filter.hpp"
+
+/* Addresses inserted by the growth test; well past the initial slot count */
+#define TEST_SET_SIZE 1000
+
+/* 128-bit UUID used by the tests, little endian as broadcast */
+static const std::array<uint8_t, 16> TEST_UUID128 = {
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static bt_dev_addr_t make_address(uint32_t n){
+	bt_dev_addr_t address = {};
+	address.address[0] = (uint8_t)n;
+	address.address[1] = (uint8_t)(n >> 8);
+	address.address[2] = (uint8_t)(n >> 16);
+	address.address[5] = 0xC0;
+	return address;
+}
+
+/* 16, 32 and 128-bit complete UUID lists and a complete name */
+static std::vector<uint8_t> uuid_payload(){
+	std::vector<uint8_t> p = {
+		0x03, AD_TYPE_UUID16_COMPLETE, 0x0F, 0x18,
+		0x05, AD_TYPE_UUID32_COMPLETE, 0x78, 0x56, 0x34, 0x12,
+		0x11, AD_TYPE_UUID128_COMPLETE
+	};
+	for(uint8_t octet : TEST_UUID128) p.push_back(octet);
+	for(uint8_t octet : std::initializer_list<uint8_t>{0x04, AD_TYPE_NAME_COMPLETE, 'b', 't', 's'}) p.push_back(octet);
+	return p;
+}
+
+static adv_report_view_t make_view(const bt_dev_addr_t *address, int8_t rssi, const std::vector<uint8_t>& data){
+	adv_report_view_t report = {};
+	report.address = address;
+	report.address_type = 0;
+	report.event = ADV_IND;
+	report.rssi = rssi;
+	report.data = data.data();
+	report.data_length = (uint16_t)data.size();
+	return report;
+}
+
+TEST(AdvFilter, EmptyFilterAcceptsEverything){
+	advFilter filter = advFilterBuilder().compile();
+	std::vector<uint8_t> data;
+	bt_dev_addr_t address = make_address(1);
+	EXPECT_EQ(filter.program_size(), 0u);
+	EXPECT_TRUE(filter.matches(make_view(&address, -60, data)));
+	EXPECT_TRUE(filter.matches(make_view(nullptr, -60, data)));
+}
+
+TEST(AdvFilter, FirstMatchingRuleDecides){
+	bt_dev_addr_t known = make_address(1);
+	bt_dev_addr_t other = make_address(2);
+	advFilterBuilder b;
+	b.accept().address_in({known});
+	b.reject().rssi_max(-80);
+	b.accept().rssi_max(-90);
+	advFilter filter = b.compile();
+
+	std::vector<uint8_t> data;
+	/* Rule 1 wins over rule 2 although both hold */
+	EXPECT_TRUE(filter.matches(make_view(&known, -95, data)));
+	/* Rule 2 wins over rule 3 */
+	EXPECT_FALSE(filter.matches(make_view(&other, -95, data)));
+	/* No rule holds: default accept */
+	EXPECT_TRUE(filter.matches(make_view(&other, -40, data)));
+}
+
+TEST(AdvFilter, FailingConditionJumpsToTheNextRule){
+	bt_dev_addr_t address = make_address(1);
+	advFilterBuilder b;
+	b.reject().name_prefix("bts").rssi_min(-50);
+	b.accept().name_prefix("bts");
+	b.otherwise(filterAction::reject);
+	advFilter filter = b.compile();
+
+	/* Two conditions + rule_end, then one condition + rule_end */
+	EXPECT_EQ(filter.program_size(), 5u);
+
+	std::vector<uint8_t> data = uuid_payload();
+	/* rssi_min was sorted first; its failure skips the rest of rule 1 */
+	EXPECT_TRUE(filter.matches(make_view(&address, -70, data)));
+	EXPECT_FALSE(filter.matches(make_view(&address, -40, data)));
+
+	std::vector<uint8_t> unnamed = {0x02, AD_TYPE_FLAGS, 0x06};
+	EXPECT_FALSE(filter.matches(make_view(&address, -70, unnamed)));
+}
+
+TEST(AdvFilter, DefaultActionAppliesWhenNoRuleMatches){
+	bt_dev_addr_t address = make_address(1);
+	std::vector<uint8_t> data;
+
+	advFilterBuilder allow;
+	allow.accept().rssi_min(-50).otherwise(filterAction::reject);
+	advFilter filter = allow.compile();
+	EXPECT_TRUE(filter.matches(make_view(&address, -40, data)));
+	EXPECT_FALSE(filter.matches(make_view(&address, -70, data)));
+
+	/* Conditions before any accept()/reject() form an accept rule */
+	advFilterBuilder implicit;
+	implicit.rssi_min(-50).otherwise(filterAction::reject);
+	filter = implicit.compile();
+	EXPECT_TRUE(filter.matches(make_view(&address, -40, data)));
+	EXPECT_FALSE(filter.matches(make_view(&address, -70, data)));
+}
+
+TEST(AdvFilter, MatchesServiceUuidsOfEachWidth){
+	bt_dev_addr_t address = make_address(1);
+	std::vector<uint8_t> data = uuid_payload();
+	adv_report_view_t report = make_view(&address, -60, data);
+
+	EXPECT_TRUE(advFilterBuilder().service_uuid16(0x180F).otherwise(filterAction::reject).compile().matches(report));
+	EXPECT_TRUE(advFilterBuilder().service_uuid32(0x12345678).otherwise(filterAction::reject).compile().matches(report));
+	EXPECT_TRUE(advFilterBuilder().service_uuid128(TEST_UUID128).otherwise(filterAction::reject).compile().matches(report));
+
+	EXPECT_FALSE(advFilterBuilder().service_uuid16(0x180A).otherwise(filterAction::reject).compile().matches(report));
+	EXPECT_FALSE(advFilterBuilder().service_uuid32(0x00000000).otherwise(filterAction::reject).compile().matches(report));
+	std::array<uint8_t, 16> other = TEST_UUID128;
+	other[15] ^= 0xFF;
+	EXPECT_FALSE(advFilterBuilder().service_uuid128(other).otherwise(filterAction::reject).compile().matches(report));
+
+	/* A UUID only matches lists of its own width */
+	EXPECT_FALSE(advFilterBuilder().service_uuid32(0x0000180F).otherwise(filterAction::reject).compile().matches(report));
+}
+
+TEST(AdvFilter, LegacyDefaultDropsNonConnectableAndDirected){
+	advFilter filter = advFilterBuilder::legacy_default();
+	bt_dev_addr_t address = make_address(1);
+	std::vector<uint8_t> data;
+	adv_report_view_t report = make_view(&address, -60, data);
+
+	EXPECT_TRUE(filter.matches(report));
+	report.event = ADV_NONCONN_IND;
+	EXPECT_FALSE(filter.matches(report));
+	report.event = ADV_DIRECT_IND;
+	EXPECT_FALSE(filter.matches(report));
+}
+
+TEST(AddressSet, GrowsAndKeepsEveryMember){
+	addressSet set;
+	for(uint32_t i=0; i<TEST_SET_SIZE; i++) set.insert(make_address(i));
+	/* Duplicates are not counted twice */
+	for(uint32_t i=0; i<TEST_SET_SIZE; i+=7) set.insert(make_address(i));
+	EXPECT_EQ(set.size(), (size_t)TEST_SET_SIZE);
+
+	for(uint32_t i=0; i<TEST_SET_SIZE; i++) EXPECT_TRUE(set.contains(make_address(i))) << i;
+	for(uint32_t i=TEST_SET_SIZE; i<2 * TEST_SET_SIZE; i++) EXPECT_FALSE(set.contains(make_address(i))) << i;
+}
+
+TEST(AdvFilter, LargeAddressSetsFilterByMembership){
+	std::vector<bt_dev_addr_t> allowed;
+	for(uint32_t i=0; i<TEST_SET_SIZE; i+=2) allowed.push_back(make_address(i));
+	advFilterBuilder b;
+	b.accept().address_in(allowed);
+	b.otherwise(filterAction::reject);
+	advFilter filter = b.compile();
+
+	std::vector<uint8_t> data;
+	for(uint32_t i=0; i<TEST_SET_SIZE; i++){
+		bt_dev_addr_t address = make_address(i);
+		EXPECT_EQ(filter.matches(make_view(&address, -60, data)), i % 2 == 0) << i;
+	}
+	/* Reports without an address are never members */
+	EXPECT_FALSE(filter.matches(make_view(nullptr, -60, data)));
+}
@@ -0,0 +1,136 @@
+/**
+ * Tests of the batched (recvmmsg) reader over a socketpair
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "utils.hpp"
+#include "event_queue.hpp"
+#include "batch_reader.hpp"
+#include "traffic_generator.hpp"
+
+/* Packets queued on the socket; several times the batch size so draining takes many calls */
+#define TEST_PACKETS 300
+
+/* Batch size that does not divide TEST_PACKETS, so the last batch is partial */
+#define TEST_BATCH 64
+
+class BatchReaderTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+		int sndbuf = 4 * 1024 * 1024;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+		traffic_config_t traffic;
+		traffic.nonconn_ratio = 0.0;
+		trafficGenerator gen(traffic);
+		corpus = gen.corpus(TEST_PACKETS);
+		for(const std::vector<uint8_t>& pkt : corpus){
+			ASSERT_EQ(write(sv[0], pkt.data(), pkt.size()), (ssize_t)pkt.size());
+		}
+	}
+
+	void TearDown() override{
+		close(sv[0]);
+		close(sv[1]);
+	}
+
+	/* Records the corpus decodes to when parsed one packet at a time */
+	size_t expected_records() const{
+		const bool verbose = false;
+		hci_packet_meta_t meta = {0, HCI_DIR_IN};
+		adv_event_t out[HCI_MAX_REPORTS_PER_EVENT];
+		size_t n = 0;
+		for(const std::vector<uint8_t>& pkt : corpus){
+			n += parse_hci_packet(pkt.data(), pkt.size(), meta, out, HCI_MAX_REPORTS_PER_EVENT, verbose);
+		}
+		return n;
+	}
+
+	int sv[2];
+	std::vector<std::vector<uint8_t>> corpus;
+};
+
+TEST_F(BatchReaderTest, DrainsEveryQueuedPacket){
+	batch_config_t config;
+	config.batch_size = TEST_BATCH;
+	config.timeout_ms = 0;
+	batchReader reader(sv[1], config);
+
+	size_t packets = 0;
+	size_t bytes = 0;
+	size_t calls = 0;
+	int n;
+	while((n = reader.read_batch()) > 0){
+		ASSERT_LE(n, TEST_BATCH);
+		ASSERT_EQ(reader.batch_count(), (size_t)n);
+		for(int i=0; i<n; i++){
+			const std::vector<uint8_t>& pkt = corpus[packets + i];
+			ASSERT_EQ(reader.packet_length(i), pkt.size());
+			ASSERT_EQ(memcmp(reader.packet(i), pkt.data(), pkt.size()), 0);
+			bytes += pkt.size();
+		}
+		packets += n;
+		calls++;
+	}
+	ASSERT_EQ(n, 0);
+	EXPECT_EQ(packets, (size_t)TEST_PACKETS);
+	EXPECT_EQ(calls, (size_t)(TEST_PACKETS + TEST_BATCH - 1) / TEST_BATCH);
+
+	/* Nothing left on the socket */
+	uint8_t probe;
+	EXPECT_LT(recv(sv[1], &probe, sizeof(probe), MSG_DONTWAIT), 0);
+
+	batch_stats_t stats = reader.stats();
+	EXPECT_EQ(stats.packets, (uint64_t)TEST_PACKETS);
+	EXPECT_EQ(stats.bytes, (uint64_t)bytes);
+	EXPECT_EQ(stats.syscalls, (uint64_t)calls);
+	EXPECT_EQ(stats.max_packets, (uint64_t)TEST_BATCH);
+	EXPECT_EQ(stats.last_packets, (uint64_t)(TEST_PACKETS % TEST_BATCH));
+	EXPECT_EQ(stats.errors, 0u);
+	EXPECT_EQ(stats.truncated, 0u);
+}
+
+TEST_F(BatchReaderTest, PublishesEveryRecord){
+	batch_config_t config;
+	config.batch_size = TEST_BATCH;
+	config.timeout_ms = 0;
+	batchReader reader(sv[1], config);
+	eventQueue queue(8192);
+	const bool verbose = false;
+
+	size_t packets = 0;
+	int n;
+	while((n = reader.drain(queue, verbose)) > 0) packets += n;
+	ASSERT_EQ(n, 0);
+	EXPECT_EQ(packets, (size_t)TEST_PACKETS);
+
+	size_t expected = expected_records();
+	ASSERT_GT(expected, (size_t)TEST_PACKETS);
+	EXPECT_EQ(reader.stats().events, (uint64_t)expected);
+
+	size_t popped = 0;
+	adv_event_t evt;
+	while(queue.try_pop(evt)) popped++;
+	EXPECT_EQ(popped, expected);
+}
+
+TEST_F(BatchReaderTest, ShortBuffersAreCountedAsTruncated){
+	batch_config_t config;
+	config.batch_size = TEST_BATCH;
+	config.timeout_ms = 0;
+	config.buffer_size = 16;
+	batchReader reader(sv[1], config);
+
+	size_t packets = 0;
+	int n;
+	while((n = reader.read_batch()) > 0) packets += n;
+	EXPECT_EQ(packets, (size_t)TEST_PACKETS);
+	EXPECT_EQ(reader.stats().truncated, (uint64_t)TEST_PACKETS);
+}
@@ -0,0 +1,183 @@
+/**
+ * Tests of the broadcast ring: gating back-pressure, lossy lapping and
+ * several subscribers reading one sequence
+ * @author Owen Capell
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "broadcast_ring.hpp"
+
+/* Small ring, so the producer laps or waits quickly */
+#define TEST_CAPACITY 8
+
+/* Elements pushed by the threaded tests */
+#define TEST_ELEMENTS 100000
+
+/* Element whose halves must agree; a torn read breaks the pair */
+typedef struct{
+	uint64_t value;
+	uint64_t check;
+} test_item_t;
+
+static test_item_t make_item(uint64_t v){
+	return test_item_t{v, ~v};
+}
+
+TEST(BroadcastRing, GatingSubscriberBlocksTheProducer){
+	broadcastRing<uint64_t> ring(TEST_CAPACITY);
+	int id = ring.subscribe(broadcastPolicy::gating);
+	ASSERT_GE(id, 0);
+
+	std::atomic<bool> done(false);
+	std::thread producer([&](){
+		for(uint64_t v=0; v<3 * TEST_CAPACITY; v++) ring.push(v);
+		done.store(true);
+	});
+
+	/* The producer fills the ring, then waits for the subscriber */
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	EXPECT_EQ(ring.published(), (uint64_t)TEST_CAPACITY);
+	EXPECT_FALSE(done.load());
+	EXPECT_GE(ring.producer_stalls(), 1u);
+	EXPECT_EQ(ring.subscriber_stats(id).backlog, (uint64_t)TEST_CAPACITY);
+
+	/* Nothing is lost: every element arrives in order */
+	uint64_t expected = 0;
+	while(expected < 3 * TEST_CAPACITY){
+		uint64_t v;
+		if(!ring.try_read(id, v)) continue;
+		ASSERT_EQ(v, expected);
+		expected++;
+	}
+	producer.join();
+	EXPECT_EQ(ring.subscriber_stats(id).lag, 0u);
+}
+
+TEST(BroadcastRing, UnsubscribeReleasesAGatedProducer){
+	broadcastRing<uint64_t> ring(TEST_CAPACITY);
+	int id = ring.subscribe(broadcastPolicy::gating);
+
+	std::thread producer([&](){
+		for(uint64_t v=0; v<2 * TEST_CAPACITY; v++) ring.push(v);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	ring.unsubscribe(id);
+	producer.join();
+	EXPECT_EQ(ring.published(), 2u * TEST_CAPACITY);
+	EXPECT_FALSE(ring.subscriber_stats(id).active);
+}
+
+TEST(BroadcastRing, LossySubscriberIsLappedAndResyncs){
+	broadcastRing<uint64_t> ring(TEST_CAPACITY);
+	int id = ring.subscribe(broadcastPolicy::lossy);
+
+	/* Never waits: 20 elements over 8 slots */
+	for(uint64_t v=0; v<20; v++) ring.push(v);
+	EXPECT_EQ(ring.producer_stalls(), 0u);
+
+	/* Resumes at the oldest element still held */
+	std::vector<uint64_t> got;
+	uint64_t v;
+	while(ring.try_read(id, v)) got.push_back(v);
+	std::vector<uint64_t> expected = {12, 13, 14, 15, 16, 17, 18, 19};
+	EXPECT_EQ(got, expected);
+	EXPECT_EQ(ring.subscriber_stats(id).lag, 12u);
+
+	/* And carries on without loss once it keeps up */
+	ring.push(20);
+	ASSERT_TRUE(ring.try_read(id, v));
+	EXPECT_EQ(v, 20u);
+	EXPECT_EQ(ring.subscriber_stats(id).lag, 12u);
+}
+
+TEST(BroadcastRing, LossyReadOverwrittenInPlaceIsReported){
+	broadcastRing<uint64_t> ring(TEST_CAPACITY);
+	int id = ring.subscribe(broadcastPolicy::lossy);
+	ring.push(1);
+
+	const uint64_t *v = ring.peek(id);
+	ASSERT_NE(v, nullptr);
+	EXPECT_EQ(*v, 1u);
+
+	/* A full lap rewrites the slot under the reader */
+	for(uint64_t k=0; k<TEST_CAPACITY; k++) ring.push(100 + k);
+	EXPECT_FALSE(ring.release(id));
+	EXPECT_EQ(ring.subscriber_stats(id).lag, 1u);
+}
+
+TEST(BroadcastRing, LossyReaderNeverSeesATornElement){
+	broadcastRing<test_item_t> ring(TEST_CAPACITY);
+	int id = ring.subscribe(broadcastPolicy::lossy);
+
+	std::atomic<bool> done(false);
+	std::thread producer([&](){
+		for(uint64_t v=0; v<TEST_ELEMENTS; v++) ring.push(make_item(v));
+		done.store(true);
+	});
+
+	uint64_t read = 0;
+	uint64_t last = 0;
+	test_item_t item;
+	while(true){
+		bool finished = done.load();
+		if(ring.try_read(id, item)){
+			ASSERT_EQ(item.check, ~item.value);
+			if(read > 0) ASSERT_GT(item.value, last);
+			last = item.value;
+			read++;
+			continue;
+		}
+		if(finished) break;
+	}
+	producer.join();
+
+	/* Every element was either read intact or counted as lag */
+	EXPECT_EQ(read + ring.subscriber_stats(id).lag, (uint64_t)TEST_ELEMENTS);
+}
+
+TEST(BroadcastRing, SubscribersSeeTheSameSequence){
+	broadcastRing<test_item_t> ring(64, 4);
+	int gated[3];
+	for(int& id : gated) id = ring.subscribe(broadcastPolicy::gating);
+	int even = ring.subscribe(broadcastPolicy::gating, [](const test_item_t& t){ return t.value % 2 == 0; });
+	EXPECT_EQ(ring.subscribe(), -1);
+
+	std::vector<std::vector<uint64_t>> seen(4);
+	std::vector<std::thread> readers;
+	for(int r=0; r<4; r++){
+		int id = r < 3 ? gated[r] : even;
+		readers.emplace_back([&ring, &seen, r, id](){
+			const test_item_t *t;
+			while((t = ring.wait(id)) != nullptr){
+				if(t->check == ~t->value) seen[r].push_back(t->value);
+				ring.release(id);
+			}
+		});
+	}
+
+	std::vector<test_item_t> batch;
+	for(uint64_t v=0; v<TEST_ELEMENTS; v++){
+		batch.push_back(make_item(v));
+		if(batch.size() == 32){
+			ring.push_batch(batch.data(), batch.size());
+			batch.clear();
+		}
+	}
+	ring.push_batch(batch.data(), batch.size());
+	ring.close();
+	for(std::thread& t : readers) t.join();
+
+	for(int r=0; r<3; r++){
+		ASSERT_EQ(seen[r].size(), (size_t)TEST_ELEMENTS) << "subscriber " << r;
+		for(uint64_t v=0; v<TEST_ELEMENTS; v++) ASSERT_EQ(seen[r][v], v) << "subscriber " << r;
+		EXPECT_EQ(ring.subscriber_stats(gated[r]).lag, 0u);
+	}
+	ASSERT_EQ(seen[3].size(), (size_t)TEST_ELEMENTS / 2);
+	for(size_t i=0; i<seen[3].size(); i++) ASSERT_EQ(seen[3][i], 2 * i);
+	EXPECT_EQ(ring.subscriber_stats(even).filtered, (uint64_t)TEST_ELEMENTS / 2);
+}
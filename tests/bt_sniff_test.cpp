@@ -0,0 +1,238 @@
+/**
+ * Tests of the BT_Sniff capture loop lifecycle over a socketpair
+ * @author Owen Capell
+*/
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bt_sniff.hpp"
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "metrics.hpp"
+#include "traffic_generator.hpp"
+
+/* Start/stop rounds; enough for the stop to land on either side of attach() */
+#define TEST_ROUNDS 200
+
+/* Packets waiting on the socket when the capture is asked to stop */
+#define TEST_PACKETS 100
+
+/* Periodic trains the simulated controller syncs to */
+#define TEST_TRAINS 3
+
+class BTSniffTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+		sniffer = BT_Sniff::from_socket(sv[1]);
+		ASSERT_TRUE(sniffer->is_initialized());
+	}
+
+	void TearDown() override{
+		sniffer.reset();
+		close(sv[0]);
+	}
+
+	int sv[2];
+	std::unique_ptr<BT_Sniff> sniffer;
+};
+
+TEST_F(BTSniffTest, StopBeforeStartEndsTheCapture){
+	/* No loop yet; the request is kept for the capture about to start */
+	EXPECT_EQ(sniffer->stopCapture(), -1);
+
+	eventQueue queue(64);
+	const bool verbose = false;
+	EXPECT_EQ(sniffer->start_le_scan_batched(queue, batch_config_t{}, verbose), 0);
+	EXPECT_EQ(sniffer->last_scan_exit(), scanExit::stopped);
+}
+
+TEST_F(BTSniffTest, StartThenImmediateStopAlwaysReturns){
+	eventQueue queue(64);
+	const bool verbose = false;
+	for(int round=0; round<TEST_ROUNDS; round++){
+		int status = -1;
+		std::thread capture([&](){ status = sniffer->start_le_scan_batched(queue, batch_config_t{}, verbose); });
+		sniffer->stopCapture();
+		capture.join();
+		ASSERT_EQ(status, 0) << "round " << round;
+		ASSERT_EQ(sniffer->last_scan_exit(), scanExit::stopped) << "round " << round;
+	}
+}
+
+TEST_F(BTSniffTest, StopDrainsQueuedPackets){
+	traffic_config_t traffic;
+	traffic.nonconn_ratio = 0.0;
+	trafficGenerator gen(traffic);
+	ASSERT_EQ(gen.feed(sv[0], TEST_PACKETS), TEST_PACKETS);
+
+	eventQueue queue(8192);
+	const bool verbose = false;
+	sniffer->stopCapture();
+	ASSERT_EQ(sniffer->start_le_scan_batched(queue, batch_config_t{}, verbose), 0);
+
+	EXPECT_EQ(sniffer->get_batch_stats().packets, (uint64_t)TEST_PACKETS);
+	EXPECT_GT(queue.size(), (size_t)TEST_PACKETS);
+}
+
+static double sample(const metricsRegistry& registry, const std::string& name){
+	for(const metric_sample_t& m : registry.snapshot()){
+		if(m.name == name) return m.value;
+	}
+	return -1.0;
+}
+
+TEST_F(BTSniffTest, PipelineCountersAddUpAcrossCaptures){
+	/* Each capture builds a new pipeline; the exported counters must not restart */
+	metricsRegistry registry;
+	sniffer->enable_parse_pipeline(pipeline_config_t{});
+	sniffer->register_metrics(registry);
+
+	traffic_config_t traffic;
+	traffic.nonconn_ratio = 0.0;
+	trafficGenerator gen(traffic);
+	eventQueue queue(16384);
+	const bool verbose = false;
+	for(int capture=1; capture<=2; capture++){
+		ASSERT_EQ(gen.feed(sv[0], TEST_PACKETS), TEST_PACKETS);
+		sniffer->stopCapture();
+		ASSERT_EQ(sniffer->start_le_scan_batched(queue, batch_config_t{}, verbose), 0);
+		EXPECT_EQ(sample(registry, "bt_sniff_pipeline_frames_total"), (double)(capture * TEST_PACKETS));
+	}
+	EXPECT_EQ(sample(registry, "bt_sniff_pipeline_dropped_total"), 0.0);
+	EXPECT_GE(sample(registry, "bt_sniff_pipeline_held_total"), 0.0);
+	EXPECT_EQ(sample(registry, "bt_sniff_packets_total"), (double)(2 * TEST_PACKETS));
+}
+
+/**
+ * @details
+ * Minimal controller on the far end of the socketpair: answers Create
+ * Sync with Command Status and a Sync Established event, and Terminate
+ * Sync / Create Sync Cancel with Command Complete, one credit at a time
+*/
+class fakeController{
+public:
+	explicit fakeController(int fd) : fd(fd), running(true), next_handle(0x40), terminated(), thread([this](){ run(); }){}
+
+	~fakeController(){
+		running.store(false);
+		thread.join();
+	}
+
+	void advertise(uint8_t last_octet, uint8_t sid, uint16_t interval){
+		/* Extended report announcing a periodic train */
+		uint8_t params[1 + sizeof(hci_le_meta_ear_event_t)] = {1};
+		hci_le_meta_ear_event_t *report = (hci_le_meta_ear_event_t*)(params + 1);
+		report->event_type = 0;
+		report->address_type = 1;
+		memset(&report->address, last_octet, sizeof(report->address));
+		report->advertising_sid = sid;
+		report->rssi = (uint8_t)-60;
+		report->tx_power = 127;
+		report->periodic_advertising_interval = interval;
+		report->data_length = 0;
+		send_le(SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT, params, sizeof(params));
+	}
+
+	std::set<uint16_t> terminated_handles(){
+		std::lock_guard<std::mutex> lock(mutex);
+		return terminated;
+	}
+
+private:
+	void run(){
+		uint8_t cmd[HCI_EVENT_BUF_SIZE];
+		while(running.load()){
+			struct pollfd pfd = {fd, POLLIN, 0};
+			if(poll(&pfd, 1, 5) <= 0) continue;
+			ssize_t n = recv(fd, cmd, sizeof(cmd), 0);
+			if(n < 4 || cmd[0] != HCI_PACK_COMMAND) continue;
+
+			uint16_t opcode = (uint16_t)(cmd[1] | (cmd[2] << 8));
+			const uint8_t *params = cmd + 4;
+			if(opcode == HCI_CMD_LE_PERIODIC_ADVERTISING_CREATE_SYNC){
+				hci_le_periodic_create_sync_t create;
+				memcpy(&create, params, sizeof(create));
+				send_status(opcode);
+
+				hci_le_meta_periodic_sync_established_t est = {};
+				est.status = HCI_STATUS_SUCCESS;
+				est.sync_handle = next_handle++;
+				est.advertising_sid = create.advertising_sid;
+				est.advertiser_address_type = create.advertiser_address_type;
+				est.advertiser_address = create.advertiser_address;
+				est.periodic_advertising_interval = 800;
+				send_le(SUBEVT_HCI_LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED, &est, sizeof(est));
+			}
+			else if(opcode == HCI_CMD_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC){
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					terminated.insert((uint16_t)(params[0] | (params[1] << 8)));
+				}
+				send_complete(opcode);
+			}
+			else{
+				send_complete(opcode);
+			}
+		}
+	}
+
+	void send_le(uint8_t subevent, const void *params, size_t length){
+		std::vector<uint8_t> pkt = {HCI_PACK_EVENT, HCI_EVENT_LE_META, (uint8_t)(length + 1), subevent};
+		pkt.insert(pkt.end(), (const uint8_t*)params, (const uint8_t*)params + length);
+		ASSERT_EQ(send(fd, pkt.data(), pkt.size(), 0), (ssize_t)pkt.size());
+	}
+
+	void send_status(uint16_t opcode){
+		uint8_t pkt[] = {HCI_PACK_EVENT, HCI_EVENT_COMMAND_STATUS, 4, HCI_STATUS_SUCCESS, 1, (uint8_t)opcode, (uint8_t)(opcode >> 8)};
+		ASSERT_EQ(send(fd, pkt, sizeof(pkt), 0), (ssize_t)sizeof(pkt));
+	}
+
+	void send_complete(uint16_t opcode){
+		uint8_t pkt[] = {HCI_PACK_EVENT, HCI_EVENT_COMMAND_COMPLETE, 4, 1, (uint8_t)opcode, (uint8_t)(opcode >> 8), HCI_STATUS_SUCCESS};
+		ASSERT_EQ(send(fd, pkt, sizeof(pkt), 0), (ssize_t)sizeof(pkt));
+	}
+
+	int fd;
+	std::atomic<bool> running;
+	uint16_t next_handle;
+	std::mutex mutex;
+	std::set<uint16_t> terminated;
+	std::thread thread;
+};
+
+TEST_F(BTSniffTest, StopTerminatesEverySyncedTrain){
+	periodic_sync_config_t config;
+	config.max_syncs = TEST_TRAINS;
+	sniffer->enable_periodic_sync(config, nullptr);
+
+	fakeController controller(sv[0]);
+	eventQueue queue(1024);
+	const bool verbose = false;
+	int status = -1;
+	std::thread capture([&](){ status = sniffer->start_le_scan_batched(queue, batch_config_t{}, verbose); });
+
+	for(int i=0; i<TEST_TRAINS; i++) controller.advertise((uint8_t)(0xA0 + i), 1, 800);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(sniffer->get_periodic_sync_stats().synced < TEST_TRAINS && std::chrono::steady_clock::now() < deadline){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ASSERT_EQ(sniffer->get_periodic_sync_stats().synced, (uint64_t)TEST_TRAINS);
+
+	/* One credit: each Terminate Sync waits for the previous one's completion */
+	sniffer->stopCapture();
+	capture.join();
+	EXPECT_EQ(status, 0);
+	EXPECT_EQ(controller.terminated_handles(), (std::set<uint16_t>{0x40, 0x41, 0x42}));
+	EXPECT_FALSE(sniffer->commands().busy());
+}
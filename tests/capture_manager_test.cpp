@@ -0,0 +1,89 @@
+/**
+ * Tests of the captureManager start/stop lifecycle over socketpairs
+ * @author Owen Capell
+*/
+#include <memory>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bt_sniff.hpp"
+#include "capture_manager.hpp"
+#include "event_queue.hpp"
+#include "traffic_generator.hpp"
+
+/* Adapters simulated by socketpairs */
+#define TEST_ADAPTERS 3
+
+/* Start/stop rounds; enough for stops to land before some threads attach */
+#define TEST_ROUNDS 100
+
+/* Packets queued on each socket before a capture */
+#define TEST_PACKETS 50
+
+class CaptureManagerTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		std::vector<std::unique_ptr<BT_Sniff>> sniffers;
+		for(int i=0; i<TEST_ADAPTERS; i++){
+			int sv[2];
+			ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+			peers.push_back(sv[0]);
+			sniffers.push_back(BT_Sniff::from_socket(sv[1], i));
+		}
+		manager = std::make_unique<captureManager>(capture_manager_config_t{}, std::move(sniffers));
+		ASSERT_EQ(manager->adapter_count(), (size_t)TEST_ADAPTERS);
+	}
+
+	void TearDown() override{
+		manager.reset();
+		for(int fd : peers) close(fd);
+	}
+
+	std::vector<int> peers;
+	std::unique_ptr<captureManager> manager;
+};
+
+TEST_F(CaptureManagerTest, StartThenImmediateStopAlwaysReturns){
+	eventQueue out(1024);
+	const bool verbose = false;
+	for(int round=0; round<TEST_ROUNDS; round++){
+		ASSERT_EQ(manager->start(out, verbose), TEST_ADAPTERS) << "round " << round;
+		manager->stop();
+	}
+	EXPECT_EQ(out.size(), 0u);
+}
+
+TEST_F(CaptureManagerTest, StopDeliversEveryQueuedRecord){
+	for(int fd : peers){
+		traffic_config_t traffic;
+		traffic.nonconn_ratio = 0.0;
+		trafficGenerator gen(traffic);
+		ASSERT_EQ(gen.feed(fd, TEST_PACKETS), TEST_PACKETS);
+	}
+
+	eventQueue out(16384);
+	const bool verbose = false;
+	ASSERT_EQ(manager->start(out, verbose), TEST_ADAPTERS);
+	manager->stop();
+
+	uint64_t published = 0;
+	for(const adapter_stats_t& s : manager->stats()){
+		EXPECT_EQ(s.batch.packets, (uint64_t)TEST_PACKETS);
+		EXPECT_EQ(s.queued, 0u);
+		EXPECT_EQ(s.dropped, 0u);
+		published += s.batch.events;
+	}
+	EXPECT_GT(published, (uint64_t)TEST_ADAPTERS * TEST_PACKETS);
+	EXPECT_EQ(manager->merge_stats().merged, published);
+	EXPECT_EQ(out.size(), published);
+}
+
+TEST_F(CaptureManagerTest, DestructorStopsARunningCapture){
+	eventQueue out(1024);
+	const bool verbose = false;
+	ASSERT_EQ(manager->start(out, verbose), TEST_ADAPTERS);
+	manager.reset();
+	SUCCEED();
+}
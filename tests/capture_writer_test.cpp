@@ -0,0 +1,115 @@
+/**
+ * Tests of the asynchronous capture writer's accounting and output files
+ * @author Owen Capell
+*/
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "capture_writer.hpp"
+#include "packet_source.hpp"
+#include "traffic_generator.hpp"
+
+/* Frames written per test */
+#define TEST_FRAMES 50
+
+class CaptureWriterTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		char tmpl[] = "/tmp/bt_sniff_capture_XXXXXX";
+		ASSERT_NE(mkdtemp(tmpl), nullptr);
+		dir = tmpl;
+
+		trafficGenerator gen;
+		corpus = gen.corpus(TEST_FRAMES);
+	}
+
+	void TearDown() override{
+		std::string cmd = "rm -rf '" + dir + "'";
+		ASSERT_EQ(system(cmd.c_str()), 0);
+	}
+
+	void write_corpus(captureWriter& writer){
+		for(size_t i=0; i<corpus.size(); i++){
+			hci_packet_t pkt = {corpus[i].data(), corpus[i].size(), {1000000ull * (i + 1), HCI_DIR_IN}};
+			ASSERT_TRUE(writer.write(pkt));
+		}
+	}
+
+	std::string dir;
+	std::vector<std::vector<uint8_t>> corpus;
+};
+
+TEST_F(CaptureWriterTest, WritesAReplayableFile){
+	capture_config_t config;
+	config.path_prefix = dir + "/cap";
+	{
+		captureWriter writer(config);
+		write_corpus(writer);
+		writer.stop();
+
+		capture_stats_t stats = writer.stats();
+		EXPECT_EQ(stats.frames, (uint64_t)TEST_FRAMES);
+		EXPECT_EQ(stats.written, (uint64_t)TEST_FRAMES);
+		EXPECT_EQ(stats.dropped, 0u);
+		EXPECT_EQ(stats.files, 1u);
+		EXPECT_EQ(stats.errors, 0u);
+	}
+
+	captureFileSource source(dir + "/cap_00000.btsnoop");
+	ASSERT_TRUE(source.is_open());
+	hci_packet_t pkt;
+	size_t n = 0;
+	while(source.next(pkt) == 1){
+		ASSERT_LT(n, corpus.size());
+		ASSERT_EQ(std::vector<uint8_t>(pkt.data, pkt.data + pkt.length), corpus[n]);
+		EXPECT_EQ(pkt.meta.timestamp, 1000000ull * (n + 1));
+		n++;
+	}
+	EXPECT_EQ(n, (size_t)TEST_FRAMES);
+}
+
+TEST_F(CaptureWriterTest, UnwritablePathDropsAndCountsEveryFrame){
+	capture_config_t config;
+	config.path_prefix = dir + "/missing/cap";
+	captureWriter writer(config);
+	write_corpus(writer);
+	writer.stop();
+
+	/* One failed open for the whole burst, not one per frame */
+	capture_stats_t stats = writer.stats();
+	EXPECT_EQ(stats.frames, (uint64_t)TEST_FRAMES);
+	EXPECT_EQ(stats.written, 0u);
+	EXPECT_EQ(stats.dropped, (uint64_t)TEST_FRAMES);
+	EXPECT_EQ(stats.files, 0u);
+	EXPECT_EQ(stats.errors, 1u);
+}
+
+TEST_F(CaptureWriterTest, RotatesBySize){
+	capture_config_t config;
+	config.path_prefix = dir + "/cap";
+	config.format = captureFormat::pcap;
+	config.rotate_bytes = 1024;
+	captureWriter writer(config);
+	write_corpus(writer);
+	writer.stop();
+
+	capture_stats_t stats = writer.stats();
+	EXPECT_EQ(stats.written, (uint64_t)TEST_FRAMES);
+	EXPECT_GT(stats.files, 1u);
+
+	size_t replayed = 0;
+	for(uint64_t i=0; i<stats.files; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "/cap_%05u.pcap", (unsigned)i);
+		captureFileSource source(dir + name);
+		ASSERT_TRUE(source.is_open()) << name;
+		hci_packet_t pkt;
+		while(source.next(pkt) == 1) replayed++;
+	}
+	EXPECT_EQ(replayed, (size_t)TEST_FRAMES);
+}
@@ -0,0 +1,207 @@
+/**
+ * Tests of the device aggregation table: insert, update, backward-shift
+ * erase and the aging sweep
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "device_table.hpp"
+
+/* Devices are forgotten 1 us after they were last heard */
+#define TEST_MAX_AGE_NS 1000ull
+
+/* Fill-and-sweep rounds of the backward-shift test */
+#define TEST_ROUNDS 200
+
+static adv_event_t make_report(uint32_t device, uint64_t timestamp, int8_t rssi, uint8_t payload){
+	/* Complete extended report whose one AD structure (flags) carries payload */
+	adv_event_t evt;
+	memset(&evt, 0, sizeof(evt));
+	evt.subevent = SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT;
+	evt.timestamp = timestamp;
+	memcpy(evt.address.address, &device, sizeof(device));
+	evt.address.address[5] = 0xC0;
+	evt.event = ADV_IND;
+	evt.rssi = rssi;
+	evt.data_status = ADV_DATA_COMPLETE;
+	evt.data_length = 3;
+	evt.data[0] = 0x02;
+	evt.data[1] = AD_TYPE_FLAGS;
+	evt.data[2] = payload;
+	return evt;
+}
+
+static device_table_config_t test_config(size_t capacity){
+	device_table_config_t config;
+	config.capacity = capacity;
+	config.summary_interval_ns = 0;
+	config.max_age_ns = TEST_MAX_AGE_NS;
+	return config;
+}
+
+static size_t offer(deviceTable& table, std::vector<adv_event_t>& records){
+	size_t kept = table.coalesce(records.data(), records.size());
+	records.resize(kept);
+	return kept;
+}
+
+TEST(DeviceTable, InsertsEachDeviceOnce){
+	deviceTable table(test_config(64));
+	std::vector<adv_event_t> records = {
+		make_report(1, 10, -60, 0x06),
+		make_report(2, 11, -70, 0x06),
+		make_report(1, 12, -55, 0x06),
+		make_report(3, 13, -80, 0x06),
+	};
+
+	ASSERT_EQ(offer(table, records), 3u);
+	for(const adv_event_t& evt : records) EXPECT_EQ(evt.aggregate, ADV_AGG_NEW);
+	EXPECT_EQ(table.size(), 3u);
+
+	/* Address type is part of the key */
+	adv_event_t random = make_report(1, 14, -60, 0x06);
+	random.address_type = 1;
+	std::vector<adv_event_t> more = {random};
+	EXPECT_EQ(offer(table, more), 1u);
+	EXPECT_EQ(table.size(), 4u);
+
+	const device_entry_t *e = table.find(make_report(1, 0, 0, 0).address, 0);
+	ASSERT_NE(e, nullptr);
+	EXPECT_EQ(e->first_seen, 10u);
+	EXPECT_EQ(e->last_seen, 12u);
+	EXPECT_EQ(e->count, 2u);
+	EXPECT_EQ(table.find(make_report(4, 0, 0, 0).address, 0), nullptr);
+
+	device_table_stats_t stats = table.stats();
+	EXPECT_EQ(stats.reports, 5u);
+	EXPECT_EQ(stats.new_devices, 4u);
+	EXPECT_EQ(stats.devices, 4u);
+}
+
+TEST(DeviceTable, EmitsChangedPayloadsWithTheFoldedReports){
+	deviceTable table(test_config(64));
+	std::vector<adv_event_t> records = {
+		make_report(1, 10, -60, 0x06),
+		make_report(1, 11, -50, 0x06),
+		make_report(1, 12, -75, 0x06),
+		make_report(1, 13, -65, 0x1A),
+	};
+
+	ASSERT_EQ(offer(table, records), 2u);
+	EXPECT_EQ(records[0].aggregate, ADV_AGG_NEW);
+	EXPECT_EQ(records[0].report_count, 1u);
+
+	/* The change carries the two suppressed reports and its own */
+	EXPECT_EQ(records[1].aggregate, ADV_AGG_CHANGED);
+	EXPECT_EQ(records[1].timestamp, 13u);
+	EXPECT_EQ(records[1].report_count, 3u);
+	EXPECT_EQ(records[1].rssi_min, -75);
+	EXPECT_EQ(records[1].rssi_max, -50);
+	EXPECT_EQ(table.stats().changed, 1u);
+
+	/* A scan response is hashed apart from the advertising data */
+	adv_event_t response = make_report(1, 14, -60, 0x1A);
+	response.event |= 0x0008;
+	records = {response, make_report(1, 15, -60, 0x1A)};
+	EXPECT_EQ(offer(table, records), 0u);
+}
+
+TEST(DeviceTable, EmitsSummariesAtTheInterval){
+	device_table_config_t config = test_config(64);
+	config.summary_interval_ns = 100;
+	config.max_age_ns = 1000000;
+	deviceTable table(config);
+
+	std::vector<adv_event_t> records;
+	for(uint64_t t=0; t<=250; t+=10) records.push_back(make_report(1, 1000 + t, -60, 0x06));
+	ASSERT_EQ(offer(table, records), 3u);
+	EXPECT_EQ(records[0].aggregate, ADV_AGG_NEW);
+	EXPECT_EQ(records[1].aggregate, ADV_AGG_SUMMARY);
+	EXPECT_EQ(records[1].timestamp, 1100u);
+	EXPECT_EQ(records[1].report_count, 10u);
+	EXPECT_EQ(records[2].timestamp, 1200u);
+	EXPECT_EQ(table.stats().summaries, 2u);
+}
+
+TEST(DeviceTable, SweepEvictsDevicesByAge){
+	deviceTable table(test_config(64));
+	std::vector<adv_event_t> records;
+	for(uint32_t d=1; d<=10; d++) records.push_back(make_report(d, d * 10, -60, 0x06));
+	ASSERT_EQ(offer(table, records), 10u);
+
+	/* Cutoff 55: devices heard at 10..50 go */
+	EXPECT_EQ(table.sweep(TEST_MAX_AGE_NS + 55), 5u);
+	EXPECT_EQ(table.size(), 5u);
+	for(uint32_t d=1; d<=10; d++){
+		EXPECT_EQ(table.find(make_report(d, 0, 0, 0).address, 0) != nullptr, d > 5) << d;
+	}
+	EXPECT_EQ(table.stats().evicted, 5u);
+	EXPECT_EQ(table.stats().devices, 5u);
+
+	/* Nothing is old enough before max_age has passed */
+	EXPECT_EQ(table.sweep(TEST_MAX_AGE_NS / 2), 0u);
+	EXPECT_EQ(table.size(), 5u);
+}
+
+TEST(DeviceTable, EraseKeepsEveryOtherEntryReachable){
+	/* Small table near its load limit, so probe runs are long and wrap around */
+	std::mt19937 rng(7);
+	for(int round=0; round<TEST_ROUNDS; round++){
+		deviceTable table(test_config(16));
+		size_t fill = table.capacity() * 3 / 4;
+
+		std::vector<uint32_t> devices;
+		std::vector<adv_event_t> records;
+		for(size_t i=0; i<fill; i++){
+			uint32_t d = (uint32_t)rng();
+			devices.push_back(d);
+			records.push_back(make_report(d, 1 + rng() % 100, -60, 0x06));
+		}
+		std::vector<adv_event_t> batch = records;
+		ASSERT_EQ(offer(table, batch), fill);
+
+		uint64_t cutoff = 1 + rng() % 100;
+		size_t old = 0;
+		for(const adv_event_t& evt : records) old += evt.timestamp < cutoff;
+		ASSERT_EQ(table.sweep(TEST_MAX_AGE_NS + cutoff), old) << "round " << round;
+		ASSERT_EQ(table.size(), fill - old);
+
+		size_t visited = 0;
+		table.for_each([&](const device_entry_t& e){
+			EXPECT_GE(e.last_seen, cutoff);
+			visited++;
+		});
+		EXPECT_EQ(visited, fill - old);
+		for(size_t i=0; i<fill; i++){
+			bool kept = records[i].timestamp >= cutoff;
+			EXPECT_EQ(table.find(records[i].address, 0) != nullptr, kept) << "round " << round << " device " << devices[i];
+		}
+	}
+}
+
+TEST(DeviceTable, FullTableEvictsTheAgedOrPassesReportsThrough){
+	deviceTable table(test_config(16));
+	size_t fill = table.capacity() * 3 / 4;
+	std::vector<adv_event_t> records;
+	for(uint32_t d=1; d<=fill; d++) records.push_back(make_report(d, d, -60, 0x06));
+	ASSERT_EQ(offer(table, records), fill);
+
+	/* Full and nothing aged: the newcomer is kept but not tracked */
+	records = {make_report(100, fill + 1, -60, 0x06)};
+	ASSERT_EQ(offer(table, records), 1u);
+	EXPECT_EQ(records[0].aggregate, ADV_AGG_RAW);
+	EXPECT_EQ(table.stats().overflow, 1u);
+	EXPECT_EQ(table.size(), fill);
+
+	/* Once the others have aged out, it makes room for itself */
+	records = {make_report(100, TEST_MAX_AGE_NS + fill + 1, -60, 0x06)};
+	ASSERT_EQ(offer(table, records), 1u);
+	EXPECT_EQ(records[0].aggregate, ADV_AGG_NEW);
+	EXPECT_EQ(table.size(), 1u);
+	EXPECT_EQ(table.stats().evicted, fill);
+}
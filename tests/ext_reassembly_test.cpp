@@ -0,0 +1,199 @@
+/**
+ * Tests of extended advertising report reassembly: interleaving, eviction and timeout
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "ext_reassembly.hpp"
+
+/* Chain timeout used by every test (10 ms) */
+#define TEST_TIMEOUT_NS 10000000ull
+
+static adv_event_t make_fragment(uint64_t timestamp, uint8_t device, uint8_t status, uint8_t fill, uint8_t length){
+	/* Extended report fragment of device; the payload is fill repeated, so each fragment is recognisable */
+	adv_event_t evt;
+	memset(&evt, 0, sizeof(evt));
+	evt.subevent = SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT;
+	evt.timestamp = timestamp;
+	evt.address.address[0] = device;
+	evt.advertising_sid = 1;
+	evt.data_status = status;
+	evt.data_length = length;
+	memset(evt.data, fill, length);
+	return evt;
+}
+
+static reassembly_config_t test_config(size_t slots){
+	reassembly_config_t config;
+	config.slots = slots;
+	config.timeout_ns = TEST_TIMEOUT_NS;
+	return config;
+}
+
+static size_t run(extReassembler& reassembler, std::vector<adv_event_t>& records){
+	size_t kept = reassembler.reassemble(records.data(), records.size(), nullptr);
+	records.resize(kept);
+	return kept;
+}
+
+TEST(ExtReassembly, JoinsInterleavedChainsOfTwoAdvertisers){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1100, 2, ADV_DATA_INCOMPLETE, 0xB1, 4),
+		make_fragment(1200, 1, ADV_DATA_INCOMPLETE, 0xA2, 3),
+		make_fragment(1300, 2, ADV_DATA_COMPLETE, 0xB2, 4),
+		make_fragment(1400, 1, ADV_DATA_COMPLETE, 0xA3, 3),
+	};
+
+	ASSERT_EQ(run(reassembler, records), 2u);
+
+	/* Emitted at the final fragment, stamped with the first */
+	EXPECT_EQ(records[0].address.address[0], 2);
+	EXPECT_EQ(records[0].timestamp, 1100u);
+	EXPECT_EQ(records[0].data_status, ADV_DATA_COMPLETE);
+	ASSERT_EQ(records[0].data_length, 8);
+	EXPECT_EQ(records[0].data[0], 0xB1);
+	EXPECT_EQ(records[0].data[7], 0xB2);
+
+	EXPECT_EQ(records[1].address.address[0], 1);
+	EXPECT_EQ(records[1].timestamp, 1000u);
+	ASSERT_EQ(records[1].data_length, 9);
+	EXPECT_EQ(records[1].data[0], 0xA1);
+	EXPECT_EQ(records[1].data[3], 0xA2);
+	EXPECT_EQ(records[1].data[8], 0xA3);
+
+	reassembly_stats_t stats = reassembler.stats();
+	EXPECT_EQ(stats.completed, 2u);
+	EXPECT_EQ(stats.fragments, 5u);
+	EXPECT_EQ(stats.pending, 0u);
+}
+
+TEST(ExtReassembly, PassesUnfragmentedReportsThrough){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1100, 2, ADV_DATA_COMPLETE, 0xB1, 5),
+		make_fragment(1200, 1, ADV_DATA_COMPLETE, 0xA2, 3),
+	};
+
+	ASSERT_EQ(run(reassembler, records), 2u);
+	EXPECT_EQ(records[0].address.address[0], 2);
+	EXPECT_EQ(records[0].data_length, 5);
+	EXPECT_EQ(records[1].data_length, 6);
+	EXPECT_EQ(reassembler.stats().completed, 1u);
+}
+
+TEST(ExtReassembly, MarksChainsTheControllerTruncated){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1100, 1, ADV_DATA_TRUNCATED, 0xA2, 3),
+	};
+
+	ASSERT_EQ(run(reassembler, records), 1u);
+	EXPECT_EQ(records[0].data_status, ADV_DATA_TRUNCATED);
+	EXPECT_EQ(records[0].data_length, 6);
+	EXPECT_EQ(reassembler.stats().truncated, 1u);
+}
+
+TEST(ExtReassembly, EvictsTheOldestChainAndDropsItsTail){
+	extReassembler reassembler(test_config(2));
+
+	/* Three advertisers in the same wheel tick, two slots: the first opened goes */
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1100, 2, ADV_DATA_INCOMPLETE, 0xB1, 3),
+		make_fragment(1200, 3, ADV_DATA_INCOMPLETE, 0xC1, 3),
+		make_fragment(1300, 1, ADV_DATA_INCOMPLETE, 0xA2, 3),
+		make_fragment(1400, 1, ADV_DATA_COMPLETE, 0xA3, 3),
+		make_fragment(1500, 2, ADV_DATA_COMPLETE, 0xB2, 3),
+		make_fragment(1600, 3, ADV_DATA_COMPLETE, 0xC2, 3),
+	};
+
+	ASSERT_EQ(run(reassembler, records), 2u);
+	EXPECT_EQ(records[0].address.address[0], 2);
+	EXPECT_EQ(records[0].data_length, 6);
+	EXPECT_EQ(records[1].address.address[0], 3);
+	EXPECT_EQ(records[1].data_length, 6);
+
+	reassembly_stats_t stats = reassembler.stats();
+	EXPECT_EQ(stats.evicted, 1u);
+	EXPECT_EQ(stats.orphaned, 2u);
+	EXPECT_EQ(stats.dropped_bytes, 6u);
+	EXPECT_EQ(stats.pending, 0u);
+
+	/* The tail ended the orphan: the advertiser's next advertisement is whole again */
+	records = {
+		make_fragment(2000, 1, ADV_DATA_INCOMPLETE, 0xA4, 3),
+		make_fragment(2100, 1, ADV_DATA_COMPLETE, 0xA5, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 1u);
+	EXPECT_EQ(records[0].data_length, 6);
+	EXPECT_EQ(records[0].data[0], 0xA4);
+}
+
+TEST(ExtReassembly, ExpiresStaleChainsAndDropsLateTails){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 0u);
+	EXPECT_EQ(reassembler.stats().pending, 1u);
+
+	/* Another advertiser moves the clock past the timeout, then the late tail shows up */
+	uint64_t late = 1000 + 2 * TEST_TIMEOUT_NS;
+	records = {
+		make_fragment(late, 2, ADV_DATA_COMPLETE, 0xB1, 4),
+		make_fragment(late + 100, 1, ADV_DATA_COMPLETE, 0xA2, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 1u);
+	EXPECT_EQ(records[0].address.address[0], 2);
+
+	reassembly_stats_t stats = reassembler.stats();
+	EXPECT_EQ(stats.expired, 1u);
+	EXPECT_EQ(stats.orphaned, 1u);
+	EXPECT_EQ(stats.pending, 0u);
+	EXPECT_EQ(stats.completed, 0u);
+}
+
+TEST(ExtReassembly, ForgetsOrphansAfterTheTimeout){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1000 + 2 * TEST_TIMEOUT_NS, 2, ADV_DATA_COMPLETE, 0xB1, 4),
+	};
+	ASSERT_EQ(run(reassembler, records), 1u);
+
+	/* Long after the drop, a complete report of the same advertiser is its own */
+	records = {
+		make_fragment(1000 + 4 * TEST_TIMEOUT_NS, 1, ADV_DATA_COMPLETE, 0xA2, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 1u);
+	EXPECT_EQ(reassembler.stats().orphaned, 0u);
+}
+
+TEST(ExtReassembly, ClearCountsOpenChainsAsExpired){
+	extReassembler reassembler(test_config(4));
+	std::vector<adv_event_t> records = {
+		make_fragment(1000, 1, ADV_DATA_INCOMPLETE, 0xA1, 3),
+		make_fragment(1100, 2, ADV_DATA_INCOMPLETE, 0xB1, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 0u);
+
+	reassembler.clear();
+	reassembly_stats_t stats = reassembler.stats();
+	EXPECT_EQ(stats.expired, 2u);
+	EXPECT_EQ(stats.pending, 0u);
+
+	/* A new capture starts clean: no tails are held against it */
+	records = {
+		make_fragment(1200, 1, ADV_DATA_COMPLETE, 0xA2, 3),
+	};
+	ASSERT_EQ(run(reassembler, records), 1u);
+	EXPECT_EQ(reassembler.stats().orphaned, 0u);
+}
@@ -0,0 +1,171 @@
+/**
+ * Tests that the table/SIMD formatters match the stringstream and printf
+ * formatting they replaced, byte for byte
+ * @author Owen Capell
+*/
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "hex_format.hpp"
+#include "utils.hpp"
+
+/* Longest input tried; covers the scalar head, every vector width and scalar tails */
+#define TEST_MAX_LENGTH 300
+
+/* Random inputs per length */
+#define TEST_ROUNDS 8
+
+static std::string reference_address(const uint8_t *addr){
+	/* addr_to_str() before hex_format.hpp */
+	std::stringstream ss;
+	ss << std::hex << std::setfill('0');
+	for(int i=5; i>=0; i--){
+		ss << std::hex << std::setw(2) << static_cast<int>(addr[i]);
+		ss << ":";
+	}
+	std::string address = ss.str();
+	address.pop_back();
+	std::transform(address.begin(), address.end(), address.begin(), toupper);
+	return address;
+}
+
+static std::string reference_dump(const uint8_t *data, size_t len){
+	/* Raw capture dump before hex_format.hpp: printf("%02x ") per octet */
+	std::string out;
+	char octet[4];
+	for(size_t k=0; k<len; k++){
+		snprintf(octet, sizeof(octet), "%02x ", (unsigned int)data[k]);
+		out += octet;
+	}
+	return out;
+}
+
+static std::string reference_encode(const uint8_t *data, size_t len, bool upper){
+	std::string out;
+	char octet[3];
+	for(size_t k=0; k<len; k++){
+		snprintf(octet, sizeof(octet), upper ? "%02X" : "%02x", (unsigned int)data[k]);
+		out += octet;
+	}
+	return out;
+}
+
+class HexFormatTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		RecordProperty("backend", hex_format_backend());
+	}
+
+	/* Random octets, plus every octet value so each table entry is used */
+	std::vector<uint8_t> input(size_t len, unsigned round){
+		std::vector<uint8_t> data(len);
+		if(round == 0){
+			for(size_t i=0; i<len; i++) data[i] = (uint8_t)i;
+		}
+		else{
+			for(uint8_t& b : data) b = (uint8_t)rng();
+		}
+		return data;
+	}
+
+	std::mt19937 rng{1};
+};
+
+TEST_F(HexFormatTest, AddressMatchesStringstream){
+	for(unsigned round=0; round<512; round++){
+		uint8_t addr[6];
+		for(uint8_t& b : addr) b = (uint8_t)rng();
+		if(round < 256) std::fill(addr, addr + 6, (uint8_t)round);
+
+		char out[ADDR_STR_LEN + 1];
+		memset(out, '#', sizeof(out));
+		format_address(addr, out);
+		EXPECT_EQ(out[ADDR_STR_LEN], '#');
+		EXPECT_EQ(std::string(out, ADDR_STR_LEN), reference_address(addr));
+		EXPECT_EQ(addr_to_str(addr), reference_address(addr));
+	}
+}
+
+TEST_F(HexFormatTest, DumpMatchesPrintf){
+	for(size_t len=0; len<=TEST_MAX_LENGTH; len++){
+		for(unsigned round=0; round<TEST_ROUNDS; round++){
+			std::vector<uint8_t> data = input(len, round);
+			/* Guard octets catch writes past the documented size */
+			std::string out(len * HEX_DUMP_STRIDE + 8, '#');
+			size_t n = hex_dump(data.data(), len, out.data());
+			ASSERT_EQ(n, len * HEX_DUMP_STRIDE) << "length " << len;
+			ASSERT_EQ(out.substr(0, n), reference_dump(data.data(), len)) << "length " << len;
+			ASSERT_EQ(out.substr(n), std::string(8, '#')) << "length " << len;
+		}
+	}
+}
+
+TEST_F(HexFormatTest, EncodeMatchesPrintf){
+	for(bool upper : {false, true}){
+		for(size_t len=0; len<=TEST_MAX_LENGTH; len++){
+			for(unsigned round=0; round<TEST_ROUNDS; round++){
+				std::vector<uint8_t> data = input(len, round);
+				std::string out(2 * len + 8, '#');
+				size_t n = hex_encode(data.data(), len, out.data(), upper);
+				ASSERT_EQ(n, 2 * len) << "length " << len;
+				ASSERT_EQ(out.substr(0, n), reference_encode(data.data(), len, upper)) << "length " << len;
+				ASSERT_EQ(out.substr(n), std::string(8, '#')) << "length " << len;
+			}
+		}
+	}
+}
+
+TEST_F(HexFormatTest, UnalignedInputsMatch){
+	/* SIMD loads must not depend on the alignment of the input */
+	std::vector<uint8_t> data = input(TEST_MAX_LENGTH + 32, 1);
+	for(size_t offset=1; offset<32; offset++){
+		const uint8_t *p = data.data() + offset;
+		std::string out(TEST_MAX_LENGTH * HEX_DUMP_STRIDE, '#');
+		hex_dump(p, TEST_MAX_LENGTH, out.data());
+		ASSERT_EQ(out, reference_dump(p, TEST_MAX_LENGTH)) << "offset " << offset;
+	}
+}
+
+TEST_F(HexFormatTest, ParseAddressRoundTrips){
+	for(unsigned round=0; round<256; round++){
+		bt_dev_addr_t addr;
+		for(uint8_t& b : addr.address) b = (uint8_t)rng();
+		std::string text = reference_address(addr.address);
+
+		bt_dev_addr_t parsed = {};
+		ASSERT_TRUE(parse_address(text.c_str(), text.size(), parsed));
+		EXPECT_EQ(memcmp(parsed.address, addr.address, 6), 0);
+
+		/* Lower case and '-' separators are accepted too */
+		std::transform(text.begin(), text.end(), text.begin(), tolower);
+		std::replace(text.begin(), text.end(), ':', '-');
+		ASSERT_TRUE(parse_address(text.c_str(), text.size(), parsed));
+		EXPECT_EQ(memcmp(parsed.address, addr.address, 6), 0);
+	}
+
+	bt_dev_addr_t parsed;
+	for(const char *bad : {"", "AA:BB:CC:DD:EE", "AA:BB:CC:DD:EE:FF:00", "AA:BB:CC:DD:EE:FG", "AABBCCDDEEFF0"}){
+		EXPECT_FALSE(parse_address(bad, strlen(bad), parsed)) << bad;
+	}
+}
+
+TEST_F(HexFormatTest, ParseAddressList){
+	const char *text = "AA:BB:CC:DD:EE:FF, 11:22:33:44:55:66\n\t01-02-03-04-05-06";
+	std::vector<bt_dev_addr_t> out;
+	ASSERT_EQ(parse_address_list(text, strlen(text), out), 3);
+	EXPECT_EQ(out[0].address[0], 0xFF);
+	EXPECT_EQ(out[1].address[5], 0x11);
+	EXPECT_EQ(out[2].address[0], 0x06);
+
+	const char *bad = "AA:BB:CC:DD:EE:FF, nope";
+	EXPECT_EQ(parse_address_list(bad, strlen(bad), out), -1);
+}
@@ -0,0 +1,50 @@
+/**
+ * Tests of the LE Meta report decoders on malformed report lengths
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "le_meta.hpp"
+
+/* Appends one legacy report (ADV_IND) with data_length octets of AD data */
+static void add_legacy_report(std::vector<uint8_t>& params, uint8_t last_octet, uint8_t data_length){
+	params.insert(params.end(), {LEGACY_ADV_IND, 0x00, last_octet, 0x22, 0x33, 0x44, 0x55, 0x66, data_length});
+	params.resize(params.size() + data_length, 0xAB);
+	params.push_back((uint8_t)-60);
+}
+
+TEST(LegacyReports, OversizedDataLengthIsSkipped){
+	/* Num_Reports, then a report over the legacy limit between two valid ones */
+	std::vector<uint8_t> params = {3};
+	add_legacy_report(params, 0x01, 3);
+	add_legacy_report(params, 0x02, 255);
+	add_legacy_report(params, 0x03, LEGACY_ADV_MAX_DATA);
+
+	const bool verbose = false;
+	hci_packet_meta_t meta = {0, HCI_DIR_IN};
+	adv_event_t out[4];
+	memset(out, 0, sizeof(out));
+	size_t n = decode_legacy_reports(params.data(), params.size(), meta, out, 4, verbose, nullptr);
+
+	ASSERT_EQ(n, 2u);
+	EXPECT_EQ(out[0].address.address[0], 0x01);
+	EXPECT_EQ(out[0].data_length, 3);
+	EXPECT_EQ(out[1].address.address[0], 0x03);
+	EXPECT_EQ(out[1].data_length, LEGACY_ADV_MAX_DATA);
+	EXPECT_EQ(out[1].rssi, -60);
+}
+
+TEST(LegacyReports, TruncatedReportEndsWalk){
+	std::vector<uint8_t> params = {2};
+	add_legacy_report(params, 0x01, 5);
+	add_legacy_report(params, 0x02, 20);
+	params.resize(params.size() - 2);
+
+	const bool verbose = false;
+	hci_packet_meta_t meta = {0, HCI_DIR_IN};
+	adv_event_t out[2];
+	EXPECT_EQ(decode_legacy_reports(params.data(), params.size(), meta, out, 2, verbose, nullptr), 1u);
+}
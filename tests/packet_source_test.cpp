@@ -0,0 +1,238 @@
+/**
+ * Tests of the packet sources: btsnoop and pcap fixtures and a socketpair
+ * replayed through drain_source
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <endian.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "packet_source.hpp"
+#include "utils.hpp"
+#include "traffic_generator.hpp"
+
+/* Packets in each fixture */
+#define TEST_PACKETS 200
+
+/* Microseconds between the btsnoop epoch (0 AD) and the Unix epoch */
+#define TEST_BTSNOOP_EPOCH_US 0x00e03ab44a676000ull
+
+/* Spacing of the fixture timestamps (1 ms) */
+#define TEST_STEP_NS 1000000ull
+
+static void put_be32(std::vector<uint8_t>& out, uint32_t v){
+	v = htobe32(v);
+	const uint8_t *p = (const uint8_t*)&v;
+	out.insert(out.end(), p, p + sizeof(v));
+}
+
+static void put_be64(std::vector<uint8_t>& out, uint64_t v){
+	v = htobe64(v);
+	const uint8_t *p = (const uint8_t*)&v;
+	out.insert(out.end(), p, p + sizeof(v));
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t v, bool swapped){
+	if(swapped) v = __builtin_bswap32(v);
+	const uint8_t *p = (const uint8_t*)&v;
+	out.insert(out.end(), p, p + sizeof(v));
+}
+
+static void put_u16(std::vector<uint8_t>& out, uint16_t v, bool swapped){
+	if(swapped) v = __builtin_bswap16(v);
+	const uint8_t *p = (const uint8_t*)&v;
+	out.insert(out.end(), p, p + sizeof(v));
+}
+
+static std::vector<uint8_t> btsnoop_file(const std::vector<std::vector<uint8_t>>& corpus, uint32_t link_type){
+	/* H1 (1001) records leave out the packet type octet; flags say it was a received event */
+	std::vector<uint8_t> out = {'b', 't', 's', 'n', 'o', 'o', 'p', 0};
+	put_be32(out, 1);
+	put_be32(out, link_type);
+	for(size_t i=0; i<corpus.size(); i++){
+		size_t skip = link_type == BTSNOOP_TYPE_HCI_UNENCAP ? 1 : 0;
+		uint32_t len = (uint32_t)(corpus[i].size() - skip);
+		put_be32(out, len);
+		put_be32(out, len);
+		put_be32(out, 0x03);
+		put_be32(out, 0);
+		put_be64(out, TEST_BTSNOOP_EPOCH_US + (i + 1) * TEST_STEP_NS / 1000);
+		out.insert(out.end(), corpus[i].begin() + skip, corpus[i].end());
+	}
+	return out;
+}
+
+static std::vector<uint8_t> pcap_file(const std::vector<std::vector<uint8_t>>& corpus, bool nanosecond, bool swapped){
+	/* LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR, written in the given byte order */
+	std::vector<uint8_t> out;
+	put_u32(out, nanosecond ? 0xa1b23c4d : 0xa1b2c3d4, swapped);
+	put_u16(out, 2, swapped);
+	put_u16(out, 4, swapped);
+	put_u32(out, 0, swapped);
+	put_u32(out, 0, swapped);
+	put_u32(out, 65535, swapped);
+	put_u32(out, LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR, swapped);
+	for(size_t i=0; i<corpus.size(); i++){
+		uint64_t ts = (i + 1) * TEST_STEP_NS;
+		uint32_t len = (uint32_t)corpus[i].size() + 4;
+		put_u32(out, (uint32_t)(ts / 1000000000ull), swapped);
+		put_u32(out, (uint32_t)(nanosecond ? ts % 1000000000ull : ts % 1000000000ull / 1000), swapped);
+		put_u32(out, len, swapped);
+		put_u32(out, len, swapped);
+		put_be32(out, 1);
+		out.insert(out.end(), corpus[i].begin(), corpus[i].end());
+	}
+	return out;
+}
+
+class PacketSourceTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		char tmpl[] = "/tmp/bt_sniff_source_XXXXXX";
+		ASSERT_NE(mkdtemp(tmpl), nullptr);
+		dir = tmpl;
+
+		trafficGenerator gen;
+		corpus = gen.corpus(TEST_PACKETS);
+
+		/* What a live capture of the corpus would publish */
+		const bool verbose = false;
+		hci_packet_meta_t meta = {0, HCI_DIR_IN};
+		adv_event_t records[HCI_MAX_REPORTS_PER_EVENT];
+		expected_events = 0;
+		expected_bytes = 0;
+		for(const std::vector<uint8_t>& pkt : corpus){
+			expected_events += parse_hci_packet(pkt.data(), pkt.size(), meta, records, HCI_MAX_REPORTS_PER_EVENT, verbose);
+			expected_bytes += pkt.size();
+		}
+		ASSERT_GT(expected_events, 0u);
+	}
+
+	void TearDown() override{
+		std::string cmd = "rm -rf '" + dir + "'";
+		ASSERT_EQ(system(cmd.c_str()), 0);
+	}
+
+	std::string fixture(const std::string& name, const std::vector<uint8_t>& contents){
+		std::string path = dir + "/" + name;
+		FILE *f = fopen(path.c_str(), "wb");
+		EXPECT_NE(f, nullptr);
+		if(f == nullptr) return path;
+		EXPECT_EQ(fwrite(contents.data(), 1, contents.size(), f), contents.size());
+		fclose(f);
+		return path;
+	}
+
+	void expect_replay(const std::string& path, bool btsnoop){
+		captureFileSource source(path);
+		ASSERT_TRUE(source.is_open());
+		EXPECT_EQ(source.is_btsnoop(), btsnoop);
+
+		/* Every packet comes back byte for byte, stamped with its recorded time */
+		hci_packet_t pkt;
+		size_t n = 0;
+		while(source.next(pkt) == 1){
+			ASSERT_LT(n, corpus.size());
+			ASSERT_EQ(std::vector<uint8_t>(pkt.data, pkt.data + pkt.length), corpus[n]);
+			EXPECT_EQ(pkt.meta.timestamp, (n + 1) * TEST_STEP_NS);
+			EXPECT_EQ(pkt.meta.direction, HCI_DIR_IN);
+			n++;
+		}
+		EXPECT_EQ(n, corpus.size());
+
+		/* And drain_source publishes what a live capture would */
+		source.rewind();
+		eventQueue queue(TEST_PACKETS * HCI_MAX_REPORTS_PER_EVENT);
+		const bool verbose = false;
+		source_stats_t stats;
+		EXPECT_EQ(drain_source(source, queue, verbose, stats), 0);
+		EXPECT_EQ(stats.packets, (uint64_t)TEST_PACKETS);
+		EXPECT_EQ(stats.bytes, expected_bytes);
+		EXPECT_EQ(stats.events, expected_events);
+		EXPECT_EQ(queue.size(), expected_events);
+	}
+
+	std::string dir;
+	std::vector<std::vector<uint8_t>> corpus;
+	uint64_t expected_events;
+	uint64_t expected_bytes;
+};
+
+TEST_F(PacketSourceTest, ReplaysBtsnoopH4){
+	expect_replay(fixture("h4.btsnoop", btsnoop_file(corpus, BTSNOOP_TYPE_HCI_UART)), true);
+}
+
+TEST_F(PacketSourceTest, ReplaysBtsnoopH1RebuildingThePacketType){
+	expect_replay(fixture("h1.btsnoop", btsnoop_file(corpus, BTSNOOP_TYPE_HCI_UNENCAP)), true);
+}
+
+TEST_F(PacketSourceTest, ReplaysMicrosecondPcap){
+	expect_replay(fixture("us.pcap", pcap_file(corpus, false, false)), false);
+}
+
+TEST_F(PacketSourceTest, ReplaysByteSwappedNanosecondPcap){
+	expect_replay(fixture("ns_swapped.pcap", pcap_file(corpus, true, true)), false);
+}
+
+TEST_F(PacketSourceTest, StopsAfterMaxPackets){
+	captureFileSource source(fixture("h4.btsnoop", btsnoop_file(corpus, BTSNOOP_TYPE_HCI_UART)));
+	eventQueue queue(TEST_PACKETS * HCI_MAX_REPORTS_PER_EVENT);
+	const bool verbose = false;
+	source_stats_t stats;
+	EXPECT_EQ(drain_source(source, queue, verbose, stats, 10), 0);
+	EXPECT_EQ(stats.packets, 10u);
+}
+
+TEST_F(PacketSourceTest, TruncatedFileEndsWithAnError){
+	std::vector<uint8_t> contents = pcap_file(corpus, false, false);
+	contents.resize(contents.size() - 3);
+	captureFileSource source(fixture("truncated.pcap", contents));
+	ASSERT_TRUE(source.is_open());
+
+	eventQueue queue(TEST_PACKETS * HCI_MAX_REPORTS_PER_EVENT);
+	const bool verbose = false;
+	source_stats_t stats;
+	EXPECT_EQ(drain_source(source, queue, verbose, stats), -1);
+	EXPECT_EQ(stats.packets, (uint64_t)TEST_PACKETS - 1);
+}
+
+TEST_F(PacketSourceTest, RejectsFilesThatAreNotCaptures){
+	std::vector<uint8_t> contents(64, 0x5A);
+	captureFileSource garbage(fixture("garbage.bin", contents));
+	EXPECT_FALSE(garbage.is_open());
+
+	captureFileSource missing(dir + "/missing.btsnoop");
+	EXPECT_FALSE(missing.is_open());
+	hci_packet_t pkt;
+	EXPECT_EQ(missing.next(pkt), -1);
+}
+
+TEST_F(PacketSourceTest, SocketSourceDrainsASocketpair){
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+	int sndbuf = 4 * 1024 * 1024;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	/* Same seed as the corpus, so the socket carries the same packets */
+	trafficGenerator gen;
+	ASSERT_EQ(gen.feed(sv[0], TEST_PACKETS), TEST_PACKETS);
+	close(sv[0]);
+
+	hciSocketSource source(sv[1]);
+	eventQueue queue(TEST_PACKETS * HCI_MAX_REPORTS_PER_EVENT);
+	const bool verbose = false;
+	source_stats_t stats;
+	EXPECT_EQ(drain_source(source, queue, verbose, stats), 0);
+	EXPECT_EQ(stats.packets, (uint64_t)TEST_PACKETS);
+	EXPECT_EQ(stats.bytes, expected_bytes);
+	EXPECT_EQ(stats.events, expected_events);
+	close(sv[1]);
+}
@@ -0,0 +1,109 @@
+/**
+ * Tests of the parse pipeline's publication order and frame accounting
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "packet_source.hpp"
+#include "parse_pipeline.hpp"
+#include "utils.hpp"
+#include "traffic_generator.hpp"
+
+/* Packets submitted per test */
+#define TEST_PACKETS 4096
+
+/* Frames per slot; small, so many slots are in flight at once */
+#define TEST_FRAMES_PER_SLOT 2
+
+/* Submission rounds of the ordering test */
+#define TEST_ROUNDS 5
+
+class ParsePipelineTest : public ::testing::Test{
+protected:
+	void SetUp() override{
+		trafficGenerator gen;
+		corpus = gen.corpus(TEST_PACKETS);
+		packets.resize(corpus.size());
+		for(size_t i=0; i<corpus.size(); i++){
+			/* The timestamp numbers the packet */
+			packets[i] = hci_packet_t{corpus[i].data(), corpus[i].size(), {i + 1, HCI_DIR_IN}};
+		}
+	}
+
+	static pipeline_config_t test_config(){
+		pipeline_config_t config;
+		config.workers = 4;
+		config.frames_per_slot = TEST_FRAMES_PER_SLOT;
+		config.slots = 16;
+		return config;
+	}
+
+	std::vector<std::vector<uint8_t>> corpus;
+	std::vector<hci_packet_t> packets;
+};
+
+TEST_F(ParsePipelineTest, ReorderPublishesInCaptureOrder){
+	/* What parsing on the capture thread would publish, in order */
+	const bool verbose = false;
+	std::vector<adv_event_t> expected;
+	adv_event_t records[HCI_MAX_REPORTS_PER_EVENT];
+	for(const hci_packet_t& pkt : packets){
+		size_t n = parse_hci_packet(pkt.data, pkt.length, pkt.meta, records, HCI_MAX_REPORTS_PER_EVENT, verbose);
+		expected.insert(expected.end(), records, records + n);
+	}
+	ASSERT_GT(expected.size(), (size_t)TEST_PACKETS);
+
+	pipeline_config_t config = test_config();
+	config.reorder = true;
+	config.block_when_full = true;
+
+	for(int round=0; round<TEST_ROUNDS; round++){
+		eventQueue queue(expected.size());
+		parsePipeline pipeline(config, queue);
+		for(size_t i=0; i<packets.size(); i+=TEST_FRAMES_PER_SLOT){
+			ASSERT_EQ(pipeline.submit(packets.data() + i, TEST_FRAMES_PER_SLOT), (size_t)TEST_FRAMES_PER_SLOT);
+		}
+		pipeline.flush();
+
+		pipeline_stats_t stats = pipeline.stats();
+		EXPECT_EQ(stats.frames, (uint64_t)TEST_PACKETS);
+		EXPECT_EQ(stats.dropped, 0u);
+		EXPECT_EQ(stats.events, expected.size());
+
+		adv_event_t evt;
+		size_t n = 0;
+		while(queue.try_pop(evt)){
+			ASSERT_LT(n, expected.size());
+			ASSERT_EQ(evt.timestamp, expected[n].timestamp) << "round " << round << " record " << n;
+			ASSERT_EQ(memcmp(&evt.address, &expected[n].address, sizeof(evt.address)), 0) << "round " << round << " record " << n;
+			n++;
+		}
+		EXPECT_EQ(n, expected.size());
+	}
+}
+
+TEST_F(ParsePipelineTest, FullArenaDropsAndCountsFrames){
+	/* One worker, two slots and no waiting: the capture side outruns parsing */
+	pipeline_config_t config = test_config();
+	config.workers = 1;
+	config.slots = 2;
+	config.block_when_full = false;
+
+	eventQueue queue(TEST_PACKETS * HCI_MAX_REPORTS_PER_EVENT);
+	parsePipeline pipeline(config, queue);
+	size_t accepted = 0;
+	for(size_t i=0; i<packets.size(); i+=TEST_FRAMES_PER_SLOT){
+		accepted += pipeline.submit(packets.data() + i, TEST_FRAMES_PER_SLOT);
+	}
+	pipeline.flush();
+
+	pipeline_stats_t stats = pipeline.stats();
+	EXPECT_EQ(stats.frames, accepted);
+	EXPECT_EQ(stats.frames + stats.dropped, (uint64_t)TEST_PACKETS);
+	EXPECT_EQ(stats.in_flight, 0u);
+}
@@ -0,0 +1,273 @@
+/**
+ * Tests of the shared-memory record ring through the C reader: round trip,
+ * lapping, the seqlock check on release and a restarted producer
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "shm_ring.hpp"
+#include "bt_shm_reader.h"
+
+/* Small ring, so the producer laps the reader quickly */
+#define TEST_CAPACITY 16
+
+/* Records pushed by the threaded test */
+#define TEST_RECORDS 200000
+
+/* Records pushed per batch by the threaded test */
+#define TEST_BATCH 32
+
+static std::string test_name(const char *suffix){
+	/* One segment per test and process, so parallel runs do not collide */
+	return "/bt_sniff_test_" + std::to_string(getpid()) + "_" + suffix;
+}
+
+static shm_ring_config_t test_config(const std::string& name){
+	shm_ring_config_t config;
+	config.name = name;
+	config.capacity = TEST_CAPACITY;
+	config.unlink_on_close = true;
+	return config;
+}
+
+static adv_event_t make_event(uint64_t n){
+	/* Every payload octet is derived from the timestamp; a torn record breaks the pattern */
+	adv_event_t evt;
+	memset(&evt, 0, sizeof(evt));
+	evt.subevent = SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT;
+	evt.timestamp = n;
+	memcpy(evt.address.address, &n, sizeof(evt.address.address));
+	evt.event = ADV_IND;
+	evt.rssi = -(int8_t)(n % 100);
+	evt.data_length = BT_SHM_MAX_DATA;
+	for(size_t i=0; i<BT_SHM_MAX_DATA; i++) evt.data[i] = (uint8_t)(n + i);
+	return evt;
+}
+
+static bool intact(const bt_shm_record_t& rec){
+	if(rec.data_length != BT_SHM_MAX_DATA) return false;
+	for(size_t i=0; i<BT_SHM_MAX_DATA; i++){
+		if(rec.data[i] != (uint8_t)(rec.timestamp + i)) return false;
+	}
+	return memcmp(rec.address, &rec.timestamp, sizeof(rec.address)) == 0;
+}
+
+TEST(ShmRing, RoundTripThroughANamedSegment){
+	shmRingWriter writer(test_config(test_name("round_trip")));
+	ASSERT_TRUE(writer.is_open());
+	bt_shm_reader_t *reader = bt_shm_open(writer.get_name().c_str());
+	ASSERT_NE(reader, nullptr);
+	EXPECT_EQ(bt_shm_version(reader), (uint32_t)BT_SHM_VERSION);
+	EXPECT_EQ(bt_shm_record_size(), (uint32_t)BT_SHM_RECORD_SIZE);
+	EXPECT_EQ(writer.stats().consumers, 1u);
+	EXPECT_EQ(bt_shm_wait(reader, 0), BT_SHM_TIMEOUT);
+
+	for(uint64_t n=0; n<10; n++) writer.push(make_event(n));
+	EXPECT_EQ(bt_shm_wait(reader, 0), BT_SHM_READY);
+
+	bt_shm_record_t out[TEST_CAPACITY];
+	ASSERT_EQ(bt_shm_read(reader, out, TEST_CAPACITY), 10u);
+	for(uint64_t n=0; n<10; n++){
+		EXPECT_EQ(out[n].seq, n + 1);
+		EXPECT_EQ(out[n].timestamp, n);
+		EXPECT_EQ(out[n].rssi, -(int8_t)(n % 100));
+		EXPECT_TRUE(intact(out[n])) << n;
+	}
+
+	bt_shm_reader_stats_t stats;
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.read, 10u);
+	EXPECT_EQ(stats.lag, 0u);
+	EXPECT_EQ(stats.backlog, 0u);
+
+	/* Closed and drained: the reader is told to stop */
+	writer.close();
+	EXPECT_EQ(bt_shm_wait(reader, -1), BT_SHM_CLOSED);
+	EXPECT_FALSE(bt_shm_producer_alive(reader));
+	bt_shm_close(reader);
+}
+
+TEST(ShmRing, RoundTripThroughAMemfd){
+	shm_ring_config_t config = test_config("");
+	shmRingWriter writer(config);
+	ASSERT_TRUE(writer.is_open());
+	bt_shm_reader_t *reader = bt_shm_open_fd(writer.get_fd());
+	ASSERT_NE(reader, nullptr);
+	EXPECT_TRUE(bt_shm_producer_alive(reader));
+
+	std::vector<adv_event_t> batch;
+	for(uint64_t n=0; n<5; n++) batch.push_back(make_event(n));
+	writer.push_batch(batch.data(), batch.size());
+
+	const bt_shm_record_t *rec;
+	uint64_t n = 0;
+	while((rec = bt_shm_peek(reader)) != nullptr){
+		EXPECT_EQ(rec->timestamp, n);
+		EXPECT_TRUE(intact(*rec));
+		EXPECT_EQ(bt_shm_release(reader), 1);
+		n++;
+	}
+	EXPECT_EQ(n, 5u);
+	bt_shm_close(reader);
+}
+
+TEST(ShmRing, LappedReaderResumesAtTheOldestRecord){
+	shmRingWriter writer(test_config(test_name("lap")));
+	bt_shm_reader_t *reader = bt_shm_open(writer.get_name().c_str());
+	ASSERT_NE(reader, nullptr);
+
+	/* 40 records over 16 slots: the first 24 are gone */
+	for(uint64_t n=0; n<40; n++) writer.push(make_event(n));
+
+	bt_shm_record_t out[TEST_CAPACITY];
+	ASSERT_EQ(bt_shm_read(reader, out, TEST_CAPACITY), (size_t)TEST_CAPACITY);
+	for(uint64_t i=0; i<TEST_CAPACITY; i++){
+		EXPECT_EQ(out[i].timestamp, 24 + i);
+		EXPECT_TRUE(intact(out[i]));
+	}
+	bt_shm_reader_stats_t stats;
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.lag, 24u);
+	EXPECT_EQ(stats.read, (uint64_t)TEST_CAPACITY);
+
+	/* Rewinding re-reads what is still held without counting lag */
+	bt_shm_rewind(reader);
+	ASSERT_EQ(bt_shm_read(reader, out, TEST_CAPACITY), (size_t)TEST_CAPACITY);
+	EXPECT_EQ(out[0].timestamp, 24u);
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.lag, 24u);
+	bt_shm_close(reader);
+}
+
+TEST(ShmRing, ReleaseReportsARecordOverwrittenWhileHeld){
+	shmRingWriter writer(test_config(test_name("seqlock")));
+	bt_shm_reader_t *reader = bt_shm_open(writer.get_name().c_str());
+	ASSERT_NE(reader, nullptr);
+	writer.push(make_event(1));
+
+	const bt_shm_record_t *rec = bt_shm_peek(reader);
+	ASSERT_NE(rec, nullptr);
+	EXPECT_EQ(rec->timestamp, 1u);
+
+	/* A full lap rewrites the slot under the reader */
+	for(uint64_t n=0; n<TEST_CAPACITY; n++) writer.push(make_event(100 + n));
+	EXPECT_EQ(bt_shm_release(reader), 0);
+
+	bt_shm_reader_stats_t stats;
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.read, 0u);
+	EXPECT_EQ(stats.lag, 1u);
+
+	/* The next peek carries on with the oldest intact record */
+	rec = bt_shm_peek(reader);
+	ASSERT_NE(rec, nullptr);
+	EXPECT_EQ(rec->timestamp, 100u);
+	EXPECT_EQ(bt_shm_release(reader), 1);
+	bt_shm_close(reader);
+}
+
+TEST(ShmRing, ConcurrentReaderNeverReturnsATornRecord){
+	shmRingWriter writer(test_config(test_name("concurrent")));
+	bt_shm_reader_t *reader = bt_shm_open(writer.get_name().c_str());
+	ASSERT_NE(reader, nullptr);
+
+	uint64_t read = 0;
+	bool ordered = true;
+	bool torn = false;
+	std::thread consumer([&](){
+		bt_shm_record_t out[TEST_BATCH];
+		uint64_t last = 0;
+		while(true){
+			size_t n = bt_shm_read(reader, out, TEST_BATCH);
+			for(size_t i=0; i<n; i++){
+				if(!intact(out[i]) || out[i].seq != out[i].timestamp + 1) torn = true;
+				if(read > 0 && out[i].timestamp <= last) ordered = false;
+				last = out[i].timestamp;
+				read++;
+			}
+			if(n == 0 && bt_shm_wait(reader, -1) != BT_SHM_READY) break;
+		}
+	});
+
+	std::vector<adv_event_t> batch;
+	for(uint64_t n=0; n<TEST_RECORDS; n++){
+		batch.push_back(make_event(n));
+		if(batch.size() == TEST_BATCH){
+			writer.push_batch(batch.data(), batch.size());
+			batch.clear();
+		}
+	}
+	writer.push_batch(batch.data(), batch.size());
+	writer.close();
+	consumer.join();
+
+	EXPECT_FALSE(torn);
+	EXPECT_TRUE(ordered);
+
+	/* Every record was either read intact or counted as lag */
+	bt_shm_reader_stats_t stats;
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.read, read);
+	EXPECT_EQ(read + stats.lag, (uint64_t)TEST_RECORDS);
+	bt_shm_close(reader);
+}
+
+TEST(ShmRing, RestartedProducerContinuesTheSequence){
+	std::string name = test_name("restart");
+	shm_ring_config_t config = test_config(name);
+	config.unlink_on_close = false;
+
+	bt_shm_reader_t *reader;
+	bt_shm_reader_stats_t stats;
+	{
+		shmRingWriter writer(config);
+		ASSERT_TRUE(writer.is_open());
+		reader = bt_shm_open(name.c_str());
+		ASSERT_NE(reader, nullptr);
+		for(uint64_t n=0; n<5; n++) writer.push(make_event(n));
+	}
+
+	/* The reader drains what the old producer left, then sees it closed */
+	bt_shm_record_t out[TEST_CAPACITY];
+	EXPECT_EQ(bt_shm_read(reader, out, TEST_CAPACITY), 5u);
+	EXPECT_EQ(bt_shm_wait(reader, 0), BT_SHM_CLOSED);
+	bt_shm_stats(reader, &stats);
+	uint64_t generation = stats.generation;
+
+	/* The new producer reattaches to the segment and continues the tail */
+	config.unlink_on_close = true;
+	shmRingWriter writer(config);
+	ASSERT_TRUE(writer.is_open());
+	EXPECT_EQ(writer.stats().published, 5u);
+	EXPECT_TRUE(bt_shm_producer_alive(reader));
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.generation, generation + 1);
+
+	for(uint64_t n=5; n<8; n++) writer.push(make_event(n));
+	EXPECT_EQ(bt_shm_wait(reader, 0), BT_SHM_READY);
+	ASSERT_EQ(bt_shm_read(reader, out, TEST_CAPACITY), 3u);
+	for(uint64_t i=0; i<3; i++){
+		EXPECT_EQ(out[i].seq, 6 + i);
+		EXPECT_EQ(out[i].timestamp, 5 + i);
+	}
+	bt_shm_stats(reader, &stats);
+	EXPECT_EQ(stats.lag, 0u);
+	bt_shm_close(reader);
+
+	/* A reader attaching after the restart starts at the tail too */
+	bt_shm_reader_t *late = bt_shm_open(name.c_str());
+	ASSERT_NE(late, nullptr);
+	EXPECT_EQ(bt_shm_read(late, out, TEST_CAPACITY), 0u);
+	writer.push(make_event(8));
+	ASSERT_EQ(bt_shm_read(late, out, TEST_CAPACITY), 1u);
+	EXPECT_EQ(out[0].seq, 9u);
+	bt_shm_close(late);
+}
@@ -0,0 +1,242 @@
+/**
+ * Tests of the slab pool: return-to-owner frees, releasing the cache of an
+ * exited thread, exhaustion and the shared-list fallback
+ * @author Owen Capell
+*/
+#include <atomic>
+#include <cstdint>
+#include <set>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "slab_pool.hpp"
+
+/* Blocks in the test pools */
+#define TEST_CAPACITY 64
+
+/* Blocks a thread cache refills at a time */
+#define TEST_CACHE 8
+
+/* Blocks passed between threads by the stress test */
+#define TEST_HANDOFFS 20000
+
+static slab_pool_config_t test_config(size_t capacity){
+	slab_pool_config_t config;
+	config.block_size = 64;
+	config.capacity = capacity;
+	config.cache_size = TEST_CACHE;
+	return config;
+}
+
+static void spin_until(const std::atomic<int>& value, int target){
+	while(value.load() < target) std::this_thread::yield();
+}
+
+TEST(SlabPool, RemoteFreeReturnsBlocksToTheirOwner){
+	slabPool pool(test_config(TEST_CAPACITY));
+
+	/* Empty this thread's cache so its next refill must come from somewhere */
+	std::set<void*> mine;
+	for(int i=0; i<TEST_CACHE; i++) mine.insert(pool.alloc());
+	ASSERT_EQ(mine.size(), (size_t)TEST_CACHE);
+	EXPECT_EQ(mine.count(nullptr), 0u);
+
+	std::thread other([&](){
+		for(void *p : mine) pool.free(p);
+	});
+	other.join();
+
+	slab_pool_stats_t stats = pool.stats();
+	EXPECT_EQ(stats.remote_frees, (uint64_t)TEST_CACHE);
+	EXPECT_EQ(stats.in_use, 0u);
+	/* Freeing never claims a cache for the freeing thread */
+	EXPECT_EQ(stats.threads, 1u);
+
+	/* The owner gets its own blocks back rather than new ones from the shared list */
+	std::set<void*> again;
+	for(int i=0; i<TEST_CACHE; i++) again.insert(pool.alloc());
+	EXPECT_EQ(again, mine);
+	for(void *p : again) pool.free(p);
+	EXPECT_EQ(pool.stats().remote_frees, (uint64_t)TEST_CACHE);
+}
+
+TEST(SlabPool, ExitingThreadReleasesItsCache){
+	slabPool pool(test_config(TEST_CAPACITY));
+	std::atomic<int> step(0);
+
+	std::thread worker([&](){
+		void *p = pool.alloc();
+		pool.free(p);
+		step.store(1);
+		spin_until(step, 2);
+	});
+	spin_until(step, 1);
+
+	/* The live worker parks a refill's worth of blocks */
+	slab_pool_stats_t stats = pool.stats();
+	EXPECT_EQ(stats.threads, 1u);
+	EXPECT_EQ(stats.cached, (uint64_t)TEST_CACHE);
+
+	step.store(2);
+	worker.join();
+	stats = pool.stats();
+	EXPECT_EQ(stats.threads, 0u);
+	EXPECT_EQ(stats.cached, 0u);
+
+	/* Every block is reachable again */
+	std::vector<void*> all;
+	for(int i=0; i<TEST_CAPACITY; i++) all.push_back(pool.alloc());
+	for(void *p : all) EXPECT_NE(p, nullptr);
+	EXPECT_EQ(pool.stats().exhausted, 0u);
+	for(void *p : all) pool.free(p);
+}
+
+TEST(SlabPool, BlocksFreedAfterTheirOwnerExitedAreRecovered){
+	slabPool pool(test_config(TEST_CAPACITY));
+
+	/* A thread takes every block and exits while they are still in use */
+	std::vector<void*> blocks;
+	std::thread owner([&](){
+		for(int i=0; i<TEST_CAPACITY; i++) blocks.push_back(pool.alloc());
+	});
+	owner.join();
+	for(void *p : blocks) ASSERT_NE(p, nullptr);
+	EXPECT_EQ(pool.stats().threads, 0u);
+
+	/* Their frees land on the dead thread's remote list */
+	for(void *p : blocks) pool.free(p);
+	EXPECT_EQ(pool.stats().remote_frees, (uint64_t)TEST_CAPACITY);
+
+	std::set<void*> recovered;
+	for(int i=0; i<TEST_CAPACITY; i++) recovered.insert(pool.alloc());
+	EXPECT_EQ(recovered.size(), (size_t)TEST_CAPACITY);
+	EXPECT_EQ(recovered.count(nullptr), 0u);
+	EXPECT_EQ(pool.stats().exhausted, 0u);
+	for(void *p : recovered) pool.free(p);
+}
+
+TEST(SlabPool, ExhaustedPoolReturnsNullAndCounts){
+	slabPool pool(test_config(TEST_CAPACITY));
+	std::vector<void*> all;
+	for(int i=0; i<TEST_CAPACITY; i++){
+		void *p = pool.alloc();
+		ASSERT_NE(p, nullptr);
+		EXPECT_TRUE(pool.owns(p));
+		all.push_back(p);
+	}
+
+	EXPECT_EQ(pool.alloc(), nullptr);
+	EXPECT_EQ(pool.alloc(), nullptr);
+	slab_pool_stats_t stats = pool.stats();
+	EXPECT_EQ(stats.exhausted, 2u);
+	EXPECT_EQ(stats.in_use, (uint64_t)TEST_CAPACITY);
+	EXPECT_EQ(stats.high_water, (uint64_t)TEST_CAPACITY);
+	EXPECT_EQ(stats.allocs, (uint64_t)TEST_CAPACITY);
+
+	/* One free makes room for exactly one more */
+	pool.free(all.back());
+	all.back() = pool.alloc();
+	EXPECT_NE(all.back(), nullptr);
+	EXPECT_EQ(pool.alloc(), nullptr);
+
+	for(void *p : all) pool.free(p);
+	stats = pool.stats();
+	EXPECT_EQ(stats.in_use, 0u);
+	EXPECT_EQ(stats.high_water, (uint64_t)TEST_CAPACITY);
+
+	/* Objects that do not fit a block are refused without touching the pool */
+	slabPool small(test_config(TEST_CAPACITY));
+	pooled_event_t evt = pool_make<adv_event_t>(small);
+	EXPECT_FALSE(evt);
+	EXPECT_EQ(small.stats().allocs, 0u);
+	pool_ptr<uint64_t> v = pool_make<uint64_t>(small, 42u);
+	ASSERT_TRUE(v);
+	EXPECT_EQ(*v, 42u);
+}
+
+TEST(SlabPool, ThreadsBeyondTheCacheLimitUseTheSharedList){
+	slabPool pool(test_config(SLAB_POOL_MAX_THREADS * TEST_CACHE * 2));
+	std::atomic<int> ready(0);
+	std::atomic<int> release(0);
+
+	/* Every cache is claimed and held */
+	std::vector<std::thread> holders;
+	for(int t=0; t<SLAB_POOL_MAX_THREADS; t++){
+		holders.emplace_back([&](){
+			void *p = pool.alloc();
+			ready.fetch_add(1);
+			spin_until(release, 1);
+			pool.free(p);
+		});
+	}
+	spin_until(ready, SLAB_POOL_MAX_THREADS);
+	EXPECT_EQ(pool.stats().threads, (uint32_t)SLAB_POOL_MAX_THREADS);
+
+	/* One more thread still allocates, straight from the shared list */
+	std::thread extra([&](){
+		void *p = pool.alloc();
+		EXPECT_NE(p, nullptr);
+		EXPECT_TRUE(pool.owns(p));
+		pool.free(p);
+	});
+	extra.join();
+	slab_pool_stats_t stats = pool.stats();
+	EXPECT_EQ(stats.threads, (uint32_t)SLAB_POOL_MAX_THREADS);
+	EXPECT_EQ(stats.allocs, (uint64_t)SLAB_POOL_MAX_THREADS + 1);
+	EXPECT_EQ(stats.remote_frees, 0u);
+
+	release.store(1);
+	for(std::thread& t : holders) t.join();
+	stats = pool.stats();
+	EXPECT_EQ(stats.threads, 0u);
+	EXPECT_EQ(stats.in_use, 0u);
+	EXPECT_EQ(stats.cached, 0u);
+}
+
+TEST(SlabPool, ProducerAndConsumerNeverShareABlock){
+	/* A block handed out twice would be retagged before the consumer reads it */
+	slabPool pool(test_config(TEST_CAPACITY));
+	spscRing<uint64_t*> handoff(TEST_CAPACITY);
+	std::atomic<bool> done(false);
+	bool corrupt = false;
+
+	std::thread consumer([&](){
+		uint64_t expected = 0;
+		while(true){
+			bool finished = done.load();
+			uint64_t *p;
+			if(handoff.try_pop(p)){
+				if(*p != expected++) corrupt = true;
+				pool.free(p);
+				continue;
+			}
+			if(finished) break;
+		}
+	});
+
+	uint64_t failed = 0;
+	for(uint64_t n=0; n<TEST_HANDOFFS;){
+		uint64_t *p = (uint64_t*)pool.alloc();
+		if(p == nullptr){
+			/* Every block is with the consumer; it will return some */
+			failed++;
+			std::this_thread::yield();
+			continue;
+		}
+		*p = n;
+		while(!handoff.push(p)) std::this_thread::yield();
+		n++;
+	}
+	done.store(true);
+	consumer.join();
+
+	EXPECT_FALSE(corrupt);
+	slab_pool_stats_t stats = pool.stats();
+	EXPECT_EQ(stats.in_use, 0u);
+	EXPECT_EQ(stats.allocs, (uint64_t)TEST_HANDOFFS);
+	EXPECT_EQ(stats.remote_frees, (uint64_t)TEST_HANDOFFS);
+	EXPECT_EQ(stats.exhausted, failed);
+	EXPECT_LE(stats.high_water, (uint64_t)TEST_CAPACITY);
+}
@@ -0,0 +1,188 @@
+/**
+ * Tests of the k-way stream merger over plain event queues
+ * @author Owen Capell
+*/
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "stream_merger.hpp"
+
+/* Reorder window used by every test (1 ms) */
+#define TEST_WINDOW_NS 1000000ull
+
+static adv_event_t make_event(uint64_t timestamp, uint8_t device, int8_t rssi, uint8_t payload){
+	/* Extended report from device whose one-octet payload identifies the over-the-air report */
+	adv_event_t evt;
+	memset(&evt, 0, sizeof(evt));
+	evt.timestamp = timestamp;
+	evt.address.address[0] = device;
+	evt.event = ADV_IND;
+	evt.rssi = rssi;
+	evt.advertising_sid = 0xFF;
+	evt.data_length = 1;
+	evt.data[0] = payload;
+	return evt;
+}
+
+static std::vector<adv_event_t> drain(eventQueue& queue){
+	std::vector<adv_event_t> out;
+	adv_event_t evt;
+	while(queue.try_pop(evt)) out.push_back(evt);
+	return out;
+}
+
+static merge_config_t test_config(bool dedup){
+	merge_config_t config;
+	config.reorder_window_ns = TEST_WINDOW_NS;
+	config.dedup = dedup;
+	config.dedup_window_ns = TEST_WINDOW_NS;
+	return config;
+}
+
+TEST(StreamMerger, MergesInputsByTimestamp){
+	eventQueue a(64), b(64), c(64), out(64);
+	streamMerger merger(test_config(false));
+	ASSERT_EQ(merger.add_input(a, 10), 0);
+	ASSERT_EQ(merger.add_input(b, 11), 1);
+	ASSERT_EQ(merger.add_input(c, 12), 2);
+
+	/* Each queue is ordered on its own; together they interleave */
+	for(uint64_t t : {100, 400, 700}) a.push(make_event(t, 1, -60, (uint8_t)t));
+	for(uint64_t t : {200, 500, 800}) b.push(make_event(t, 2, -60, (uint8_t)t));
+	for(uint64_t t : {300, 600, 900}) c.push(make_event(t, 3, -60, (uint8_t)t));
+
+	EXPECT_EQ(merger.step(out, UINT64_MAX), 9u);
+	std::vector<adv_event_t> merged = drain(out);
+	ASSERT_EQ(merged.size(), 9u);
+	for(size_t i=0; i<merged.size(); i++){
+		EXPECT_EQ(merged[i].timestamp, (uint64_t)(i + 1) * 100);
+		EXPECT_EQ(merged[i].adapter_id, 10 + i % 3);
+		EXPECT_EQ(merged[i].adapter_mask, 1u << (i % 3));
+		EXPECT_EQ(merged[i].adapter_rssi[i % 3], -60);
+	}
+	EXPECT_EQ(merger.stats().merged, 9u);
+	EXPECT_EQ(merger.stats().late, 0u);
+}
+
+TEST(StreamMerger, EmptyInputHoldsRecordsForTheReorderWindow){
+	eventQueue a(64), b(64), out(64);
+	streamMerger merger(test_config(false));
+	merger.add_input(a, 0);
+	merger.add_input(b, 1);
+
+	uint64_t t0 = 10 * TEST_WINDOW_NS;
+	a.push(make_event(t0, 1, -60, 1));
+
+	/* b might still deliver something older */
+	EXPECT_EQ(merger.step(out, t0 + TEST_WINDOW_NS / 2), 0u);
+	EXPECT_EQ(out.size(), 0u);
+
+	/* Once b has a head, the older of the two goes first without waiting */
+	b.push(make_event(t0 - 100, 2, -60, 2));
+	EXPECT_EQ(merger.step(out, t0 + TEST_WINDOW_NS / 2), 1u);
+	EXPECT_EQ(drain(out)[0].timestamp, t0 - 100);
+
+	/* b is empty again: a's record waits until it leaves the window */
+	EXPECT_EQ(merger.step(out, t0 + TEST_WINDOW_NS / 2), 0u);
+	EXPECT_EQ(merger.step(out, t0 + TEST_WINDOW_NS), 1u);
+	EXPECT_EQ(drain(out)[0].timestamp, t0);
+}
+
+TEST(StreamMerger, CountsRecordsOlderThanOneAlreadyEmitted){
+	eventQueue a(64), b(64), out(64);
+	streamMerger merger(test_config(false));
+	merger.add_input(a, 0);
+	merger.add_input(b, 1);
+
+	a.push(make_event(5000, 1, -60, 1));
+	merger.step(out, UINT64_MAX);
+	b.push(make_event(1000, 2, -60, 2));
+	merger.step(out, UINT64_MAX);
+
+	EXPECT_EQ(drain(out).size(), 2u);
+	EXPECT_EQ(merger.stats().late, 1u);
+}
+
+TEST(StreamMerger, DedupFoldsOneReportHeardByTwoAdapters){
+	eventQueue a(64), b(64), out(64);
+	streamMerger merger(test_config(true));
+	merger.add_input(a, 4);
+	merger.add_input(b, 5);
+
+	a.push(make_event(1000, 1, -70, 7));
+	b.push(make_event(1500, 1, -50, 7));
+
+	merger.step(out, UINT64_MAX);
+	std::vector<adv_event_t> merged = drain(out);
+	ASSERT_EQ(merged.size(), 1u);
+	EXPECT_EQ(merged[0].timestamp, 1000u);
+	EXPECT_EQ(merged[0].adapter_mask, 0x03);
+	EXPECT_EQ(merged[0].adapter_rssi[0], -70);
+	EXPECT_EQ(merged[0].adapter_rssi[1], -50);
+
+	/* The strongest adapter becomes the primary source */
+	EXPECT_EQ(merged[0].rssi, -50);
+	EXPECT_EQ(merged[0].adapter_id, 5);
+	EXPECT_EQ(merger.stats().folded, 1u);
+	EXPECT_EQ(merger.stats().merged, 1u);
+}
+
+TEST(StreamMerger, DedupKeepsDistinctReports){
+	eventQueue a(64), b(64), out(64);
+	streamMerger merger(test_config(true));
+	merger.add_input(a, 0);
+	merger.add_input(b, 1);
+
+	/* Different payload, same adapter twice, and a repeat outside the window */
+	a.push(make_event(1000, 1, -70, 7));
+	b.push(make_event(1100, 1, -70, 8));
+	a.push(make_event(1200, 1, -70, 8));
+	b.push(make_event(1000 + 3 * TEST_WINDOW_NS, 1, -70, 7));
+
+	merger.step(out, UINT64_MAX);
+	std::vector<adv_event_t> merged = drain(out);
+	ASSERT_EQ(merged.size(), 3u);
+	EXPECT_EQ(merged[0].adapter_mask, 0x01);
+	EXPECT_EQ(merged[1].adapter_mask, 0x03);
+	EXPECT_EQ(merged[2].adapter_mask, 0x02);
+	EXPECT_EQ(merger.stats().folded, 1u);
+}
+
+TEST(StreamMerger, DedupReleasesOnlyClosedWindows){
+	eventQueue a(64), out(64);
+	streamMerger merger(test_config(true));
+	merger.add_input(a, 0);
+
+	uint64_t t0 = 10 * TEST_WINDOW_NS;
+	a.push(make_event(t0, 1, -70, 7));
+
+	/* Emitted by the merge, but held while a duplicate could still arrive */
+	EXPECT_EQ(merger.step(out, t0), 0u);
+	EXPECT_EQ(merger.step(out, t0 + 2 * TEST_WINDOW_NS), 1u);
+	EXPECT_EQ(drain(out).size(), 1u);
+}
+
+TEST(StreamMerger, FullOutputIsCountedAsDropped){
+	eventQueue a(64), out(4);
+	streamMerger merger(test_config(false));
+	merger.add_input(a, 0);
+	for(uint64_t t=1; t<=10; t++) a.push(make_event(t, 1, -60, (uint8_t)t));
+
+	merger.step(out, UINT64_MAX);
+	merge_stats_t stats = merger.stats();
+	EXPECT_EQ(stats.merged + stats.dropped, 10u);
+	EXPECT_EQ(stats.merged, out.size());
+	EXPECT_GT(stats.dropped, 0u);
+}
+
+TEST(StreamMerger, RejectsInputsBeyondTheAdapterLimit){
+	std::vector<eventQueue> queues(ADV_MAX_ADAPTERS + 1);
+	streamMerger merger;
+	for(int i=0; i<ADV_MAX_ADAPTERS; i++) EXPECT_EQ(merger.add_input(queues[i], (uint8_t)i), i);
+	EXPECT_EQ(merger.add_input(queues[ADV_MAX_ADAPTERS], 0), -1);
+	EXPECT_EQ(merger.input_count(), (size_t)ADV_MAX_ADAPTERS);
+}
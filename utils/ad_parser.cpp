@@ -0,0 +1,285 @@
+/**
+ * Typed decoders for Advertising Data (AD) structures
+ * @author Owen Capell
+*/
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "ad_parser.hpp"
+
+static uint16_t le16(const uint8_t *p){
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const uint8_t *p){
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t be16(const uint8_t *p){
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t be32(const uint8_t *p){
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t uuid_width(uint8_t type){
+	/**
+	 * Width in octets of the UUIDs in a service UUID list type
+	 *
+	 * @param type	AD type
+	 * @returns 2, 4, 16, or 0 if type is not a UUID list
+	*/
+
+	switch(type){
+		case AD_TYPE_UUID16_INCOMPLETE:
+		case AD_TYPE_UUID16_COMPLETE:
+			return 2;
+		case AD_TYPE_UUID32_INCOMPLETE:
+		case AD_TYPE_UUID32_COMPLETE:
+			return 4;
+		case AD_TYPE_UUID128_INCOMPLETE:
+		case AD_TYPE_UUID128_COMPLETE:
+			return 16;
+		default:
+			return 0;
+	}
+}
+
+std::optional<uint8_t> ad_flags(const adRange& range){
+	/**
+	 * Decodes the Flags structure
+	 *
+	 * @param range	AD payload
+	 * @returns flags octet, nullopt if absent or empty
+	*/
+
+	auto f = range.find(AD_TYPE_FLAGS);
+	if(!f || f->data.size() < 1) return std::nullopt;
+	return f->data[0];
+}
+
+std::string_view ad_name(const adRange& range){
+	/**
+	 * Finds the local name, preferring the complete name
+	 *
+	 * @param range	AD payload
+	 * @returns view into the payload, empty if no name is present
+	*/
+
+	std::string_view shortened;
+	for(ad_field_t f : range){
+		if(f.type == AD_TYPE_NAME_COMPLETE){
+			return std::string_view((const char*)f.data.data(), f.data.size());
+		}
+		if(f.type == AD_TYPE_NAME_SHORT && shortened.empty()){
+			shortened = std::string_view((const char*)f.data.data(), f.data.size());
+		}
+	}
+	return shortened;
+}
+
+std::optional<int8_t> ad_tx_power(const adRange& range){
+	auto f = range.find(AD_TYPE_TX_POWER);
+	if(!f || f->data.size() < 1) return std::nullopt;
+	return (int8_t)f->data[0];
+}
+
+std::optional<uint16_t> ad_appearance(const adRange& range){
+	auto f = range.find(AD_TYPE_APPEARANCE);
+	if(!f || f->data.size() < 2) return std::nullopt;
+	return le16(f->data.data());
+}
+
+size_t ad_service_uuids(const adRange& range, bt_uuid_t *out, size_t max_out){
+	/**
+	 * Collects UUIDs from every 16, 32 and 128-bit service UUID list
+	 * Trailing octets that do not form a whole UUID are ignored
+	 *
+	 * @param range	AD payload
+	 * @param out	Array to copy UUIDs into (may be nullptr to count)
+	 * @param max_out	Capacity of out
+	 * @returns number of UUIDs present
+	*/
+
+	size_t n = 0;
+	for(ad_field_t f : range){
+		uint8_t width = uuid_width(f.type);
+		if(width == 0) continue;
+		for(size_t off=0; off + width <= f.data.size(); off += width){
+			if(out != nullptr && n < max_out){
+				out[n].length = width;
+				memcpy(out[n].value, f.data.data() + off, width);
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+bool ad_has_uuid16(const adRange& range, uint16_t uuid){
+	for(ad_field_t f : range){
+		if(uuid_width(f.type) != 2) continue;
+		for(size_t off=0; off + 2 <= f.data.size(); off += 2){
+			if(le16(f.data.data() + off) == uuid) return true;
+		}
+	}
+	return false;
+}
+
+bool ad_has_uuid32(const adRange& range, uint32_t uuid){
+	for(ad_field_t f : range){
+		if(uuid_width(f.type) != 4) continue;
+		for(size_t off=0; off + 4 <= f.data.size(); off += 4){
+			if(le32(f.data.data() + off) == uuid) return true;
+		}
+	}
+	return false;
+}
+
+bool ad_has_uuid128(const adRange& range, const uint8_t *uuid){
+	for(ad_field_t f : range){
+		if(uuid_width(f.type) != 16) continue;
+		for(size_t off=0; off + 16 <= f.data.size(); off += 16){
+			if(memcmp(f.data.data() + off, uuid, 16) == 0) return true;
+		}
+	}
+	return false;
+}
+
+std::optional<service_data_t> ad_service_data(const ad_field_t& field){
+	/**
+	 * Splits a Service Data structure into UUID and payload
+	 *
+	 * @param field	AD structure of type 0x16, 0x20 or 0x21
+	 * @returns service_data_t, nullopt if the type or length is wrong
+	*/
+
+	uint8_t width;
+	switch(field.type){
+		case AD_TYPE_SERVICE_DATA16: width = 2; break;
+		case AD_TYPE_SERVICE_DATA32: width = 4; break;
+		case AD_TYPE_SERVICE_DATA128: width = 16; break;
+		default: return std::nullopt;
+	}
+	if(field.data.size() < width) return std::nullopt;
+
+	service_data_t sd;
+	sd.uuid.length = width;
+	memcpy(sd.uuid.value, field.data.data(), width);
+	sd.data = field.data.subspan(width);
+	return sd;
+}
+
+std::optional<service_data_t> ad_service_data16(const adRange& range, uint16_t uuid){
+	for(ad_field_t f : range){
+		if(f.type != AD_TYPE_SERVICE_DATA16 || f.data.size() < 2) continue;
+		if(le16(f.data.data()) == uuid) return ad_service_data(f);
+	}
+	return std::nullopt;
+}
+
+std::optional<manufacturer_data_t> ad_manufacturer(const adRange& range){
+	/**
+	 * Decodes the first Manufacturer Specific Data structure
+	 *
+	 * @param range	AD payload
+	 * @returns company identifier and payload view, nullopt if absent
+	*/
+
+	auto f = range.find(AD_TYPE_MANUFACTURER);
+	if(!f || f->data.size() < 2) return std::nullopt;
+	return manufacturer_data_t{le16(f->data.data()), f->data.subspan(2)};
+}
+
+std::optional<ibeacon_t> ad_ibeacon(const adRange& range){
+	/**
+	 * Decodes an iBeacon: Apple company id, type 0x02, length 0x15,
+	 * 16 octet UUID, major, minor (big endian), measured power
+	 *
+	 * @param range	AD payload
+	 * @returns ibeacon_t, nullopt if not an iBeacon
+	*/
+
+	auto m = ad_manufacturer(range);
+	if(!m || m->company_id != COMPANY_ID_APPLE) return std::nullopt;
+	const std::span<const uint8_t> d = m->data;
+	if(d.size() < 23 || d[0] != 0x02 || d[1] != 0x15) return std::nullopt;
+
+	ibeacon_t b;
+	b.uuid = d.subspan(2, 16);
+	b.major = be16(d.data() + 18);
+	b.minor = be16(d.data() + 20);
+	b.tx_power = (int8_t)d[22];
+	return b;
+}
+
+std::optional<eddystone_t> ad_eddystone(const adRange& range){
+	/**
+	 * Decodes an Eddystone UID, URL, TLM (unencrypted) or EID frame
+	 *
+	 * @param range	AD payload
+	 * @returns eddystone_t, nullopt if not a (well formed) Eddystone frame
+	*/
+
+	auto sd = ad_service_data16(range, SERVICE_UUID_EDDYSTONE);
+	if(!sd || sd->data.size() < 1) return std::nullopt;
+	const std::span<const uint8_t> d = sd->data;
+
+	eddystone_t e = {};
+	e.frame_type = d[0];
+	switch(e.frame_type){
+		case EDDYSTONE_UID:
+			if(d.size() < 18) return std::nullopt;
+			e.tx_power = (int8_t)d[1];
+			e.namespace_id = d.subspan(2, 10);
+			e.instance_id = d.subspan(12, 6);
+			break;
+		case EDDYSTONE_URL:
+			if(d.size() < 3) return std::nullopt;
+			e.tx_power = (int8_t)d[1];
+			e.url_scheme = d[2];
+			e.url = d.subspan(3);
+			break;
+		case EDDYSTONE_TLM:
+			if(d.size() < 14 || d[1] != 0x00) return std::nullopt;
+			e.tlm_version = d[1];
+			e.battery_mv = be16(d.data() + 2);
+			e.temperature = (int16_t)be16(d.data() + 4);
+			e.adv_count = be32(d.data() + 6);
+			e.uptime = be32(d.data() + 10);
+			break;
+		case EDDYSTONE_EID:
+			if(d.size() < 10) return std::nullopt;
+			e.tx_power = (int8_t)d[1];
+			e.eid = d.subspan(2, 8);
+			break;
+		default:
+			return std::nullopt;
+	}
+	return e;
+}
+
+std::optional<ms_cdp_t> ad_ms_cdp(const adRange& range){
+	/**
+	 * Decodes a Microsoft Connected Devices Platform beacon:
+	 * scenario, version/device type, version/flags, reserved, salt, hash
+	 *
+	 * @param range	AD payload
+	 * @returns ms_cdp_t, nullopt if not a CDP beacon
+	*/
+
+	auto m = ad_manufacturer(range);
+	if(!m || m->company_id != COMPANY_ID_MICROSOFT) return std::nullopt;
+	const std::span<const uint8_t> d = m->data;
+	if(d.size() < 24) return std::nullopt;
+
+	ms_cdp_t c;
+	c.scenario_type = d[0];
+	c.version = (uint8_t)(d[1] >> 5);
+	c.device_type = (uint8_t)(d[1] & 0x1F);
+	c.flags = (uint8_t)(d[2] & 0x1F);
+	c.salt = d.subspan(4, 4);
+	c.device_hash = d.subspan(8, 16);
+	return c;
+}
@@ -0,0 +1,306 @@
+/**
+ * Header for zero-copy, bounds-checked Advertising Data (AD) parsing
+ * @author Owen Capell
+*/
+#ifndef AD_PARSER
+#define AD_PARSER
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string_view>
+
+#include "bluetoothdef.hpp"
+
+/**
+ * @details
+ * One AD structure, viewed in place (no copy)
+ * @param type	AD type
+ * @param data	AD payload (length - 1 octets)
+*/
+typedef struct{
+	uint8_t type;
+	std::span<const uint8_t> data;
+} ad_field_t;
+
+/**
+ * @details
+ * Bluetooth UUID in little-endian (over-the-air) byte order
+ * @param length	2, 4 or 16
+ * @param value		UUID octets, first length octets valid
+*/
+typedef struct{
+	uint8_t length;
+	uint8_t value[16];
+} bt_uuid_t;
+
+/**
+ * @details
+ * Service Data AD structure (0x16, 0x20, 0x21)
+ * @param uuid	Service UUID the data belongs to
+ * @param data	Service-specific payload
+*/
+typedef struct{
+	bt_uuid_t uuid;
+	std::span<const uint8_t> data;
+} service_data_t;
+
+/**
+ * @details
+ * Manufacturer Specific Data AD structure (0xFF)
+ * @param company_id	Bluetooth SIG company identifier
+ * @param data	Manufacturer payload following the company identifier
+*/
+typedef struct{
+	uint16_t company_id;
+	std::span<const uint8_t> data;
+} manufacturer_data_t;
+
+/**
+ * @details
+ * Apple iBeacon frame (manufacturer data, company 0x004C, type 0x02 0x15)
+ * @param uuid	Proximity UUID (16 octets, big endian as broadcast)
+ * @param major	Major value
+ * @param minor	Minor value
+ * @param tx_power	Calibrated RSSI at 1 m
+*/
+typedef struct{
+	std::span<const uint8_t> uuid;
+	uint16_t major;
+	uint16_t minor;
+	int8_t tx_power;
+} ibeacon_t;
+
+/* Eddystone frame types */
+#define EDDYSTONE_UID   0x00
+#define EDDYSTONE_URL   0x10
+#define EDDYSTONE_TLM   0x20
+#define EDDYSTONE_EID   0x30
+
+/**
+ * @details
+ * Eddystone frame (service data for UUID 0xFEAA)
+ * @param frame_type	EDDYSTONE_UID, _URL, _TLM or _EID
+ * @param tx_power	Calibrated TX power at 0 m (UID, URL, EID)
+ * @param namespace_id	UID namespace (10 octets)
+ * @param instance_id	UID instance (6 octets)
+ * @param url_scheme	URL scheme prefix code
+ * @param url	Encoded URL remainder
+ * @param eid	Ephemeral identifier (8 octets)
+ * @param tlm_version	TLM version
+ * @param battery_mv	TLM battery voltage (mV)
+ * @param temperature	TLM temperature (8.8 fixed point, degrees C)
+ * @param adv_count	TLM advertising PDU count
+ * @param uptime	TLM time since power-on (0.1 s)
+*/
+typedef struct{
+	uint8_t frame_type;
+	int8_t tx_power;
+	std::span<const uint8_t> namespace_id;
+	std::span<const uint8_t> instance_id;
+	uint8_t url_scheme;
+	std::span<const uint8_t> url;
+	std::span<const uint8_t> eid;
+	uint8_t tlm_version;
+	uint16_t battery_mv;
+	int16_t temperature;
+	uint32_t adv_count;
+	uint32_t uptime;
+} eddystone_t;
+
+/**
+ * @details
+ * Microsoft Connected Devices Platform beacon (manufacturer 0x0006)
+ * @param scenario_type	Scenario type (0x01 = Bluetooth)
+ * @param version	Beacon version
+ * @param device_type	Device type
+ * @param flags	Version-and-flags octet low bits
+ * @param salt	Random salt (4 octets)
+ * @param device_hash	Device hash (16 octets)
+*/
+typedef struct{
+	uint8_t scenario_type;
+	uint8_t version;
+	uint8_t device_type;
+	uint8_t flags;
+	std::span<const uint8_t> salt;
+	std::span<const uint8_t> device_hash;
+} ms_cdp_t;
+
+/**
+ * @details
+ * Forward iterator over AD structures. Never reads past the end of the
+ * buffer: a structure whose length overruns it ends iteration and marks
+ * the range malformed. Zero-length structures (padding) are skipped.
+*/
+class adIterator{
+public:
+	adIterator() : cur(nullptr), end(nullptr), bad(nullptr) {}
+	adIterator(const uint8_t *begin, const uint8_t *end, bool *bad)
+		: cur(begin), end(end), bad(bad) { settle(); }
+
+	ad_field_t operator*() const{
+		return ad_field_t{cur[1], std::span<const uint8_t>(cur + 2, (size_t)cur[0] - 1)};
+	}
+
+	adIterator& operator++(){
+		cur += (size_t)cur[0] + 1;
+		settle();
+		return *this;
+	}
+
+	bool operator==(const adIterator& other) const{ return cur == other.cur; }
+	bool operator!=(const adIterator& other) const{ return cur != other.cur; }
+
+private:
+	void settle(){
+		/* Skip padding; stop (and flag) on a structure that overruns */
+		while(cur != nullptr && cur < end && cur[0] == 0) cur++;
+		if(cur == nullptr || cur >= end){
+			cur = nullptr;
+			return;
+		}
+		if((size_t)(end - cur) < (size_t)cur[0] + 1){
+			if(bad != nullptr) *bad = true;
+			cur = nullptr;
+		}
+	}
+
+	const uint8_t *cur;
+	const uint8_t *end;
+	bool *bad;
+};
+
+/**
+ * @details
+ * Non-owning, non-allocating view of an AD payload
+ * Decoding is lazy: callers pull only the fields they need
+*/
+class adRange{
+public:
+	explicit adRange(std::span<const uint8_t> payload) : payload(payload), bad(false) {}
+	adRange(const uint8_t *data, size_t length) : payload(data, length), bad(false) {}
+
+	adIterator begin() const{ return adIterator(payload.data(), payload.data() + payload.size(), &bad); }
+	adIterator end() const{ return adIterator(); }
+
+	/**
+	 * @brief
+	 * First structure of the given type, if any
+	*/
+	std::optional<ad_field_t> find(uint8_t type) const{
+		for(ad_field_t f : *this){
+			if(f.type == type) return f;
+		}
+		return std::nullopt;
+	}
+
+	/**
+	 * @brief
+	 * True once iteration met a length field overrunning the payload
+	*/
+	bool malformed() const{ return bad; }
+
+	std::span<const uint8_t> bytes() const{ return payload; }
+
+private:
+	std::span<const uint8_t> payload;
+	mutable bool bad;
+};
+
+/**
+ * @brief
+ * View over the AD payload carried by a record
+*/
+inline adRange ad_range(const adv_event_t& evt){
+	return adRange(evt.data, evt.data_length);
+}
+
+/**
+ * @brief
+ * Flags (0x01)
+*/
+std::optional<uint8_t> ad_flags(const adRange& range);
+
+/**
+ * @brief
+ * Complete (0x09) or, failing that, shortened (0x08) local name
+ * Empty view if neither is present
+*/
+std::string_view ad_name(const adRange& range);
+
+/**
+ * @brief
+ * TX Power Level (0x0A)
+*/
+std::optional<int8_t> ad_tx_power(const adRange& range);
+
+/**
+ * @brief
+ * Appearance (0x19)
+*/
+std::optional<uint16_t> ad_appearance(const adRange& range);
+
+/**
+ * @brief
+ * Copies service UUIDs from every 16/32/128-bit list into out
+ * Returns the number of UUIDs found (may exceed max_out)
+*/
+size_t ad_service_uuids(const adRange& range, bt_uuid_t *out, size_t max_out);
+
+/**
+ * @brief
+ * True if a 16-bit service UUID list contains uuid
+*/
+bool ad_has_uuid16(const adRange& range, uint16_t uuid);
+
+/**
+ * @brief
+ * True if a 32-bit service UUID list contains uuid
+*/
+bool ad_has_uuid32(const adRange& range, uint32_t uuid);
+
+/**
+ * @brief
+ * True if a 128-bit service UUID list contains uuid (16 octets, little endian as broadcast)
+*/
+bool ad_has_uuid128(const adRange& range, const uint8_t *uuid);
+
+/**
+ * @brief
+ * Decodes a Service Data structure (0x16, 0x20, 0x21)
+*/
+std::optional<service_data_t> ad_service_data(const ad_field_t& field);
+
+/**
+ * @brief
+ * First Service Data structure whose UUID is the 16-bit uuid
+*/
+std::optional<service_data_t> ad_service_data16(const adRange& range, uint16_t uuid);
+
+/**
+ * @brief
+ * First Manufacturer Specific Data structure
+*/
+std::optional<manufacturer_data_t> ad_manufacturer(const adRange& range);
+
+/**
+ * @brief
+ * iBeacon frame if the manufacturer data is one
+*/
+std::optional<ibeacon_t> ad_ibeacon(const adRange& range);
+
+/**
+ * @brief
+ * Eddystone frame if the service data is one
+*/
+std::optional<eddystone_t> ad_eddystone(const adRange& range);
+
+/**
+ * @brief
+ * Microsoft CDP beacon if the manufacturer data is one
+*/
+std::optional<ms_cdp_t> ad_ms_cdp(const adRange& range);
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * Implementation of the compiled userspace advertising report filter
+ * @author Owen Capell
+*/
+#include <algorithm>
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "adv_filter.hpp"
+#include "ad_parser.hpp"
+
+/* Empty slot marker; addresses are 48 bits so this can never be a key */
+#define ADDRESS_SET_EMPTY UINT64_MAX
+
+/* Initial slot count of an addressSet (power of two) */
+#define ADDRESS_SET_MIN_SLOTS 16
+
+addressSet::addressSet() :
+	slots(ADDRESS_SET_MIN_SLOTS, ADDRESS_SET_EMPTY), count(0)
+{
+	/**
+	 * Constructor for addressSet
+	*/
+
+}
+
+uint64_t addressSet::key_of(const bt_dev_addr_t& address){
+	uint64_t key = 0;
+	memcpy(&key, address.address, sizeof(address.address));
+	return key;
+}
+
+static size_t hash_key(uint64_t key, size_t mask){
+	/* Fibonacci hashing spreads sequential OUIs/NICs across slots */
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+}
+
+void addressSet::insert(const bt_dev_addr_t& address){
+	/**
+	 * Adds address; keeps load factor under 1/2 so probes stay short
+	 *
+	 * @param address	Address to add
+	*/
+
+	if((count + 1) * 2 > slots.size()) grow();
+
+	uint64_t key = key_of(address);
+	size_t mask = slots.size() - 1;
+	for(size_t i = hash_key(key, mask); ; i = (i + 1) & mask){
+		if(slots[i] == key) return;
+		if(slots[i] == ADDRESS_SET_EMPTY){
+			slots[i] = key;
+			count++;
+			return;
+		}
+	}
+}
+
+bool addressSet::contains(const bt_dev_addr_t& address) const{
+	uint64_t key = key_of(address);
+	size_t mask = slots.size() - 1;
+	for(size_t i = hash_key(key, mask); ; i = (i + 1) & mask){
+		if(slots[i] == key) return true;
+		if(slots[i] == ADDRESS_SET_EMPTY) return false;
+	}
+}
+
+size_t addressSet::size() const{
+	return count;
+}
+
+void addressSet::grow(){
+	std::vector<uint64_t> old;
+	old.swap(slots);
+	slots.assign(old.size() * 2, ADDRESS_SET_EMPTY);
+	size_t mask = slots.size() - 1;
+	for(uint64_t key : old){
+		if(key == ADDRESS_SET_EMPTY) continue;
+		size_t i = hash_key(key, mask);
+		while(slots[i] != ADDRESS_SET_EMPTY) i = (i + 1) & mask;
+		slots[i] = key;
+	}
+}
+
+bool advFilter::eval(const filter_insn_t& insn, const adv_report_view_t& report) const{
+	/**
+	 * Evaluates a single condition
+	 *
+	 * @param insn	Condition instruction
+	 * @param report	Report under test
+	 * @returns true if the condition holds
+	*/
+
+	switch(insn.op){
+		case filterOp::address_type:
+			return report.address != nullptr && report.address_type == insn.a;
+		case filterOp::rssi_min:
+			return report.rssi >= insn.b;
+		case filterOp::rssi_max:
+			return report.rssi <= insn.b;
+		case filterOp::event_mask:
+			return (report.event & insn.a) == (uint16_t)insn.b;
+		case filterOp::address_in:
+			return report.address != nullptr && address_sets[insn.index].contains(*report.address);
+		case filterOp::address_not_in:
+			return report.address == nullptr || !address_sets[insn.index].contains(*report.address);
+		case filterOp::service_uuid16:
+			return ad_has_uuid16(adRange(report.data, report.data_length), insn.a);
+		case filterOp::service_uuid32:
+			return ad_has_uuid32(adRange(report.data, report.data_length), (uint32_t)insn.b);
+		case filterOp::service_uuid128:
+			return ad_has_uuid128(adRange(report.data, report.data_length), uuids[insn.index].data());
+		case filterOp::manufacturer:{
+			auto m = ad_manufacturer(adRange(report.data, report.data_length));
+			return m && m->company_id == insn.a;
+		}
+		case filterOp::name_prefix:
+			return ad_name(adRange(report.data, report.data_length)).starts_with(prefixes[insn.index]);
+		default:
+			return true;
+	}
+}
+
+bool advFilter::matches(const adv_report_view_t& report) const{
+	/**
+	 * Runs the flat program. A failing condition jumps straight to the
+	 * next rule; reaching a rule_end means every condition held
+	 *
+	 * @param report	Raw report view
+	 * @returns true if the report should be kept
+	*/
+
+	size_t pc = 0;
+	size_t n = program.size();
+	while(pc < n){
+		const filter_insn_t& insn = program[pc];
+		if(insn.op == filterOp::rule_end) return insn.action == filterAction::accept;
+		if(eval(insn, report)){
+			pc++;
+		}
+		else{
+			pc = insn.next_rule;
+		}
+	}
+	return default_action == filterAction::accept;
+}
+
+size_t advFilter::program_size() const{
+	return program.size();
+}
+
+advFilterBuilder::advFilterBuilder() :
+	rules(), sets(), uuids(), prefixes(), default_action(filterAction::accept)
+{
+	/**
+	 * Constructor for advFilterBuilder
+	 * With no rules the compiled filter accepts everything
+	*/
+
+}
+
+advFilterBuilder& advFilterBuilder::accept(){
+	rules.push_back(rule_t{filterAction::accept, {}});
+	return *this;
+}
+
+advFilterBuilder& advFilterBuilder::reject(){
+	rules.push_back(rule_t{filterAction::reject, {}});
+	return *this;
+}
+
+advFilterBuilder& advFilterBuilder::add(filter_insn_t insn){
+	/* Conditions before any accept()/reject() form an implicit accept rule */
+	if(rules.empty()) accept();
+	rules.back().conditions.push_back(insn);
+	return *this;
+}
+
+advFilterBuilder& advFilterBuilder::address_in(const std::vector<bt_dev_addr_t>& addresses){
+	sets.push_back(addresses);
+	return add(filter_insn_t{filterOp::address_in, filterAction::accept, 0, 0, (uint32_t)(sets.size() - 1), 0});
+}
+
+advFilterBuilder& advFilterBuilder::address_not_in(const std::vector<bt_dev_addr_t>& addresses){
+	sets.push_back(addresses);
+	return add(filter_insn_t{filterOp::address_not_in, filterAction::accept, 0, 0, (uint32_t)(sets.size() - 1), 0});
+}
+
+advFilterBuilder& advFilterBuilder::address_type(uint8_t type){
+	return add(filter_insn_t{filterOp::address_type, filterAction::accept, type, 0, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::rssi_min(int8_t dbm){
+	return add(filter_insn_t{filterOp::rssi_min, filterAction::accept, 0, dbm, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::rssi_max(int8_t dbm){
+	return add(filter_insn_t{filterOp::rssi_max, filterAction::accept, 0, dbm, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::event_mask(uint16_t mask, uint16_t value){
+	return add(filter_insn_t{filterOp::event_mask, filterAction::accept, mask, value, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::service_uuid16(uint16_t uuid){
+	return add(filter_insn_t{filterOp::service_uuid16, filterAction::accept, uuid, 0, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::service_uuid32(uint32_t uuid){
+	return add(filter_insn_t{filterOp::service_uuid32, filterAction::accept, 0, (int32_t)uuid, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::service_uuid128(const std::array<uint8_t, 16>& uuid){
+	uuids.push_back(uuid);
+	return add(filter_insn_t{filterOp::service_uuid128, filterAction::accept, 0, 0, (uint32_t)(uuids.size() - 1), 0});
+}
+
+advFilterBuilder& advFilterBuilder::manufacturer(uint16_t company_id){
+	return add(filter_insn_t{filterOp::manufacturer, filterAction::accept, company_id, 0, 0, 0});
+}
+
+advFilterBuilder& advFilterBuilder::name_prefix(const std::string& prefix){
+	prefixes.push_back(prefix);
+	return add(filter_insn_t{filterOp::name_prefix, filterAction::accept, 0, 0, (uint32_t)(prefixes.size() - 1), 0});
+}
+
+advFilterBuilder& advFilterBuilder::otherwise(filterAction action){
+	default_action = action;
+	return *this;
+}
+
+advFilter advFilterBuilder::compile() const{
+	/**
+	 * Flattens rules into one instruction vector. Each rule's conditions
+	 * are sorted by cost (header fields, then hash lookups, then AD walks)
+	 * and followed by a rule_end; next_rule jump targets are resolved here
+	 *
+	 * @returns advFilter ready for matches()
+	*/
+
+	advFilter f;
+	f.default_action = default_action;
+	f.uuids = uuids;
+	f.prefixes = prefixes;
+	for(const std::vector<bt_dev_addr_t>& set : sets){
+		addressSet s;
+		for(const bt_dev_addr_t& a : set) s.insert(a);
+		f.address_sets.push_back(std::move(s));
+	}
+
+	for(const rule_t& rule : rules){
+		std::vector<filter_insn_t> conds = rule.conditions;
+		std::stable_sort(conds.begin(), conds.end(),
+			[](const filter_insn_t& x, const filter_insn_t& y){ return x.op < y.op; });
+
+		uint32_t next = (uint32_t)(f.program.size() + conds.size() + 1);
+		for(filter_insn_t c : conds){
+			c.next_rule = next;
+			f.program.push_back(c);
+		}
+		f.program.push_back(filter_insn_t{filterOp::rule_end, rule.action, 0, 0, 0, next});
+	}
+
+	return f;
+}
+
+advFilter advFilterBuilder::legacy_default(){
+	advFilterBuilder b;
+	b.reject().event_mask(0xFFFF, ADV_NONCONN_IND);
+	b.reject().event_mask(0xFFFF, ADV_DIRECT_IND);
+	return b.compile();
+}
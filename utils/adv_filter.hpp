@@ -0,0 +1,201 @@
+/**
+ * Header for the compiled userspace advertising report filter
+ * @author Owen Capell
+*/
+#ifndef ADV_FILTER
+#define ADV_FILTER
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+
+/**
+ * @details
+ * Raw view of one report handed to the filter before any copy
+ * @param address	Advertiser address (nullptr if the report has none)
+ * @param address_type	Raw address type
+ * @param event	Event type in the Extended Report encoding
+ * @param rssi	RSSI in dBm
+ * @param data	AD payload
+ * @param data_length	Octets of AD payload (a reassembled payload may exceed one report)
+*/
+typedef struct{
+	const bt_dev_addr_t *address;
+	uint8_t address_type;
+	uint16_t event;
+	int8_t rssi;
+	const uint8_t *data;
+	uint16_t data_length;
+} adv_report_view_t;
+
+/**
+ * @details
+ * Outcome of a matching rule
+*/
+enum class filterAction : uint8_t{
+	accept,
+	reject
+};
+
+/**
+ * @details
+ * Opcodes of the flat filter program
+*/
+enum class filterOp : uint8_t{
+	address_type,
+	rssi_min,
+	rssi_max,
+	event_mask,
+	address_in,
+	address_not_in,
+	service_uuid16,
+	service_uuid32,
+	service_uuid128,
+	manufacturer,
+	name_prefix,
+	rule_end
+};
+
+/**
+ * @details
+ * One instruction of the flat filter program
+ * @param op	Condition (or rule_end carrying the action)
+ * @param action	Action of the rule (rule_end only)
+ * @param a	First operand (type, mask, uuid, company id)
+ * @param b	Second operand (rssi threshold, masked value, 32-bit uuid)
+ * @param index	Address set, 128-bit uuid or name prefix index
+ * @param next_rule	Instruction index of the next rule (jump on failure)
+*/
+typedef struct{
+	filterOp op;
+	filterAction action;
+	uint16_t a;
+	int32_t b;
+	uint32_t index;
+	uint32_t next_rule;
+} filter_insn_t;
+
+/**
+ * @details
+ * Open-addressing hash set of 48-bit addresses (O(1) membership)
+*/
+class addressSet{
+public:
+	addressSet();
+
+	void insert(const bt_dev_addr_t& address);
+	bool contains(const bt_dev_addr_t& address) const;
+	size_t size() const;
+
+private:
+	static uint64_t key_of(const bt_dev_addr_t& address);
+	void grow();
+
+	std::vector<uint64_t> slots;
+	size_t count;
+};
+
+class advFilter{
+public:
+	/**
+	 * @brief
+	 * Evaluates the program: the first rule whose conditions all hold
+	 * decides, otherwise the default action applies
+	*/
+	bool matches(const adv_report_view_t& report) const;
+
+	/**
+	 * @brief
+	 * Number of instructions (including rule terminators)
+	*/
+	size_t program_size() const;
+
+private:
+	friend class advFilterBuilder;
+
+	bool eval(const filter_insn_t& insn, const adv_report_view_t& report) const;
+
+	std::vector<filter_insn_t> program;
+	std::vector<addressSet> address_sets;
+	std::vector<std::array<uint8_t, 16>> uuids;
+	std::vector<std::string> prefixes;
+	filterAction default_action = filterAction::accept;
+};
+
+/**
+ * @details
+ * Builder for advFilter. accept()/reject() start a new rule; the
+ * condition methods that follow are ANDed into that rule. Rules are
+ * tried in order. Conditions are reordered cheapest-first on compile,
+ * so AD walks only happen once the header fields already matched.
+ * Service UUIDs match lists of their own width only: a 16-bit UUID
+ * spelled out in a 128-bit list is not found by service_uuid16().
+*/
+class advFilterBuilder{
+public:
+	advFilterBuilder();
+
+	advFilterBuilder& accept();
+	advFilterBuilder& reject();
+
+	advFilterBuilder& address_in(const std::vector<bt_dev_addr_t>& addresses);
+	advFilterBuilder& address_not_in(const std::vector<bt_dev_addr_t>& addresses);
+	advFilterBuilder& address_type(uint8_t type);
+	advFilterBuilder& rssi_min(int8_t dbm);
+	advFilterBuilder& rssi_max(int8_t dbm);
+
+	/**
+	 * @brief
+	 * Requires (event & mask) == value
+	*/
+	advFilterBuilder& event_mask(uint16_t mask, uint16_t value);
+
+	advFilterBuilder& service_uuid16(uint16_t uuid);
+	advFilterBuilder& service_uuid32(uint32_t uuid);
+
+	/**
+	 * @brief
+	 * 128-bit UUID in little-endian (over-the-air) octet order
+	*/
+	advFilterBuilder& service_uuid128(const std::array<uint8_t, 16>& uuid);
+	advFilterBuilder& manufacturer(uint16_t company_id);
+	advFilterBuilder& name_prefix(const std::string& prefix);
+
+	/**
+	 * @brief
+	 * Action when no rule matches (accept by default)
+	*/
+	advFilterBuilder& otherwise(filterAction action);
+
+	/**
+	 * @brief
+	 * Flattens the rules into an advFilter program
+	*/
+	advFilter compile() const;
+
+	/**
+	 * @brief
+	 * Filter equivalent to the historical hard-coded check: drop
+	 * ADV_NONCONN_IND and ADV_DIRECT_IND legacy PDUs
+	*/
+	static advFilter legacy_default();
+
+private:
+	typedef struct{
+		filterAction action;
+		std::vector<filter_insn_t> conditions;
+	} rule_t;
+
+	advFilterBuilder& add(filter_insn_t insn);
+
+	std::vector<rule_t> rules;
+	std::vector<std::vector<bt_dev_addr_t>> sets;
+	std::vector<std::array<uint8_t, 16>> uuids;
+	std::vector<std::string> prefixes;
+	filterAction default_action;
+};
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * Implementation of batched (recvmmsg) HCI packet reader
+ * @author Owen Capell
+*/
+#include <iostream>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "bluetoothdef.hpp"
+#include "batch_reader.hpp"
+#include "event_queue.hpp"
+#include "utils.hpp"
+
+/* Records staged per batch, in multiples of the batch size */
+#define BATCH_RECORDS_PER_PACKET 4
+
+/* Room for the HCI direction and timestamp control messages */
+#define BATCH_CONTROL_SIZE (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timeval)))
+
+batchReader::batchReader(int fd, const batch_config_t& config) :
+	fd(fd), config(config), buffers(), msgs(), iovecs(), controls(), records(), stamps(), n_batch(0),
+	h_read_to_parse(nullptr), h_parse_time(nullptr),
+	n_syscalls(0), n_packets(0), n_bytes(0), n_events(0), n_parsed(0), n_errors(0), n_truncated(0),
+	n_last_packets(0), n_last_bytes(0), n_max_packets(0)
+{
+	/**
+	 * Constructor for batchReader
+	 * Preallocates every buffer so the capture loop never allocates
+	 *
+	 * @param fd	Socket to drain; must preserve packet boundaries
+	 * @param config	Batch size, timeout and per-packet buffer size
+	*/
+
+	if(this->config.batch_size == 0) this->config.batch_size = 1;
+	if(this->config.buffer_size == 0) this->config.buffer_size = HCI_EVENT_BUF_SIZE;
+
+	size_t n = this->config.batch_size;
+	buffers.resize(n * this->config.buffer_size);
+	msgs.resize(n);
+	iovecs.resize(n);
+	controls.resize(n * BATCH_CONTROL_SIZE);
+	records.resize(n * BATCH_RECORDS_PER_PACKET + HCI_MAX_REPORTS_PER_EVENT);
+	stamps.resize(n);
+
+	for(size_t i=0; i<n; i++){
+		iovecs[i].iov_base = buffers.data() + i * this->config.buffer_size;
+		iovecs[i].iov_len = this->config.buffer_size;
+		msgs[i] = {};
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = controls.data() + i * BATCH_CONTROL_SIZE;
+	}
+}
+
+int batchReader::read_batch(){
+	/**
+	 * Waits for the first packet (poll) then drains everything queued on
+	 * the socket, up to batch_size, with a single non-blocking recvmmsg()
+	 *
+	 * @returns number of packets read, 0 on timeout, -1 on error
+	*/
+
+	n_batch = 0;
+
+	/* With timeout 0 readiness comes from the caller (e.g. epoll); skip the poll */
+	if(config.timeout_ms != 0){
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, config.timeout_ms);
+		if(ready < 0){
+			if(errno == EINTR) return 0;
+			n_errors.fetch_add(1, std::memory_order_relaxed);
+			return -1;
+		}
+		if(ready == 0) return 0;
+	}
+
+	for(size_t i=0; i<config.batch_size; i++){
+		msgs[i].msg_hdr.msg_flags = 0;
+		msgs[i].msg_hdr.msg_controllen = BATCH_CONTROL_SIZE;
+	}
+
+	int n = recvmmsg(fd, msgs.data(), config.batch_size, MSG_DONTWAIT, NULL);
+	if(n < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+		n_errors.fetch_add(1, std::memory_order_relaxed);
+		return -1;
+	}
+	if(n == 0) return 0;
+
+	uint64_t bytes = 0;
+	uint64_t truncated = 0;
+	for(int i=0; i<n; i++){
+		bytes += msgs[i].msg_len;
+		if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) truncated++;
+	}
+
+	n_batch = (size_t)n;
+	n_syscalls.fetch_add(1, std::memory_order_relaxed);
+	n_packets.fetch_add(n, std::memory_order_relaxed);
+	n_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	n_truncated.fetch_add(truncated, std::memory_order_relaxed);
+	n_last_packets.store(n, std::memory_order_relaxed);
+	n_last_bytes.store(bytes, std::memory_order_relaxed);
+	if((uint64_t)n > n_max_packets.load(std::memory_order_relaxed)){
+		n_max_packets.store(n, std::memory_order_relaxed);
+	}
+
+	return n;
+}
+
+size_t publish_records(eventQueue& usr_queue, adv_event_t *records, size_t count, const publish_taps_t *taps){
+	/**
+	 * Hands records to the queue and every tap
+	 *
+	 * @param usr_queue	Queue to publish records into
+	 * @param records	Records to publish
+	 * @param count	Number of records
+	 * @param taps	Additional consumers (nullptr = none)
+	 * @returns number of records accepted by the queue
+	*/
+
+	size_t accepted = usr_queue.push_batch(records, count);
+	if(taps != nullptr){
+		if(taps->sinks != nullptr) taps->sinks->push_batch(records, count);
+		if(taps->broadcast != nullptr) taps->broadcast->push_batch(records, count);
+		if(taps->shm != nullptr) taps->shm->push_batch(records, count);
+	}
+	return accepted;
+}
+
+size_t batchReader::publish(
+	eventQueue& usr_queue, const bool& verbose,
+	const advFilter *filter, deviceTable *devices, const publish_taps_t *taps,
+	extReassembler *reassembler){
+	/**
+	 * Parses every packet of the last batch into the staging records and
+	 * hands them to the queue with push_batch() (one consumer wake-up)
+	 *
+	 * @param usr_queue	Queue to publish records into
+	 * @param verbose	Boolean flag to print decoded reports
+	 * @param filter	Compiled report filter (nullptr = built-in PDU check)
+	 * @param devices	Aggregation table (nullptr = publish every report)
+	 * @param taps	Sinks and rings fed the same records (nullptr = none)
+	 * @param reassembler	Fragment reassembly (nullptr = publish fragments as they come)
+	 * @returns number of records accepted by the queue
+	*/
+
+	const advFilter *decode_filter = reassembler != nullptr ? reassembler->decode_filter(filter) : filter;
+	size_t staged = 0;
+	size_t accepted = 0;
+	uint64_t parsed = 0;
+
+	/* Two clock reads per batch, only when latency is being recorded */
+	bool timed = h_read_to_parse != nullptr || h_parse_time != nullptr;
+	uint64_t parse_start = timed ? realtime_ns() : 0;
+
+	for(size_t i=0; i<n_batch; i++){
+		if(records.size() - staged < HCI_MAX_REPORTS_PER_EVENT){
+			accepted += publish_records(usr_queue, records.data(), staged, taps);
+			staged = 0;
+		}
+		hci_packet_meta_t meta = packet_meta(i);
+		stamps[i] = meta.timestamp;
+		size_t n = parse_hci_packet(packet(i), packet_length(i), meta,
+			records.data() + staged, records.size() - staged, verbose, decode_filter);
+		parsed += n;
+		if(reassembler != nullptr) n = reassembler->reassemble(records.data() + staged, n, filter);
+		if(devices != nullptr) n = devices->coalesce(records.data() + staged, n);
+		staged += n;
+	}
+
+	if(timed && n_batch > 0){
+		uint64_t parse_end = realtime_ns();
+		if(h_parse_time != nullptr && parse_end > parse_start){
+			h_parse_time->record((parse_end - parse_start) / n_batch);
+		}
+		if(h_read_to_parse != nullptr){
+			for(size_t i=0; i<n_batch; i++){
+				if(stamps[i] != 0 && parse_end > stamps[i]) h_read_to_parse->record(parse_end - stamps[i]);
+			}
+		}
+	}
+
+	if(staged > 0){
+		accepted += publish_records(usr_queue, records.data(), staged, taps);
+	}
+
+	n_parsed.fetch_add(parsed, std::memory_order_relaxed);
+	n_events.fetch_add(accepted, std::memory_order_relaxed);
+	return accepted;
+}
+
+int batchReader::drain(eventQueue& usr_queue, const bool& verbose, const advFilter *filter){
+	/**
+	 * Reads one batch and publishes it
+	 *
+	 * @param usr_queue	Queue to publish records into
+	 * @param verbose	Boolean flag to print decoded reports
+	 * @param filter	Compiled report filter (nullptr = built-in PDU check)
+	 * @returns number of packets read, 0 on timeout, -1 on error
+	*/
+
+	int n = read_batch();
+	if(n > 0) publish(usr_queue, verbose, filter);
+	return n;
+}
+
+void batchReader::set_latency(latencyHistogram *read_to_parse, latencyHistogram *parse_time){
+	h_read_to_parse = read_to_parse;
+	h_parse_time = parse_time;
+}
+
+const uint8_t* batchReader::packet(size_t i) const{
+	return buffers.data() + i * config.buffer_size;
+}
+
+size_t batchReader::packet_length(size_t i) const{
+	size_t len = msgs[i].msg_len;
+	return len < config.buffer_size ? len : config.buffer_size;
+}
+
+hci_packet_meta_t batchReader::packet_meta(size_t i) const{
+	/**
+	 * Decodes the ancillary data received with packet i
+	 *
+	 * @param i	Index of the packet within the last batch
+	 * @returns timestamp (kernel, or now if absent) and direction
+	*/
+
+	hci_packet_meta_t meta;
+	parse_hci_cmsg(&msgs[i].msg_hdr, meta);
+	return meta;
+}
+
+size_t batchReader::batch_count() const{
+	return n_batch;
+}
+
+batch_stats_t batchReader::stats() const{
+	/**
+	 * Takes a relaxed snapshot of the reader statistics
+	 *
+	 * @returns batch_stats_t copy
+	*/
+
+	batch_stats_t s;
+	s.syscalls = n_syscalls.load(std::memory_order_relaxed);
+	s.packets = n_packets.load(std::memory_order_relaxed);
+	s.bytes = n_bytes.load(std::memory_order_relaxed);
+	s.events = n_events.load(std::memory_order_relaxed);
+	s.parsed = n_parsed.load(std::memory_order_relaxed);
+	s.errors = n_errors.load(std::memory_order_relaxed);
+	s.truncated = n_truncated.load(std::memory_order_relaxed);
+	s.last_packets = n_last_packets.load(std::memory_order_relaxed);
+	s.last_bytes = n_last_bytes.load(std::memory_order_relaxed);
+	s.max_packets = n_max_packets.load(std::memory_order_relaxed);
+	return s;
+}
+
+double batchReader::packets_per_syscall() const{
+	uint64_t calls = n_syscalls.load(std::memory_order_relaxed);
+	if(calls == 0) return 0.0;
+	return (double)n_packets.load(std::memory_order_relaxed) / (double)calls;
+}
+
+const batch_config_t& batchReader::get_config() const{
+	return config;
+}
@@ -0,0 +1,194 @@
+/**
+ * Header for batched (recvmmsg) HCI packet reader
+ * @author Owen Capell
+*/
+#ifndef BATCH_READER
+#define BATCH_READER
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "adv_filter.hpp"
+#include "device_table.hpp"
+#include "ext_reassembly.hpp"
+#include "output_sink.hpp"
+#include "event_broadcast.hpp"
+#include "shm_ring.hpp"
+#include "latency_histogram.hpp"
+
+/* Default number of packets drained per recvmmsg() call */
+#define BATCH_DEFAULT_SIZE 64
+
+/**
+ * @details
+ * Configuration for batched capture
+ * @param batch_size	Maximum packets drained per syscall
+ * @param timeout_ms	Time to wait for the first packet of a batch (-1 blocks forever,
+ * 					0 reads without waiting, for use under an event loop)
+ * @param buffer_size	Size of each preallocated packet buffer
+*/
+typedef struct{
+	unsigned int batch_size = BATCH_DEFAULT_SIZE;
+	int timeout_ms = -1;
+	size_t buffer_size = HCI_EVENT_BUF_SIZE;
+} batch_config_t;
+
+/**
+ * @details
+ * Consumers fed every published record besides the queue (nullptr = none; not owned)
+ * @param sinks	Output sink writer
+ * @param broadcast	Multi-subscriber in-process ring
+ * @param shm	Shared-memory ring read by other processes
+*/
+typedef struct{
+	sinkWriter *sinks = nullptr;
+	eventBroadcast *broadcast = nullptr;
+	shmRingWriter *shm = nullptr;
+} publish_taps_t;
+
+/**
+ * @brief
+ * Pushes count records to usr_queue and every tap in taps (nullptr = none)
+ * Returns number of records accepted by the queue
+*/
+size_t publish_records(eventQueue& usr_queue, adv_event_t *records, size_t count, const publish_taps_t *taps);
+
+/**
+ * @details
+ * Snapshot of batched capture statistics
+ * @param syscalls	Number of recvmmsg() calls that returned packets
+ * @param packets	Total packets received
+ * @param bytes		Total bytes received
+ * @param events	Total records published to the queue
+ * @param parsed	Records decoded (after filtering, before aggregation)
+ * @param errors	recvmmsg() calls that failed
+ * @param truncated	Packets larger than buffer_size (truncated)
+ * @param last_packets	Packets in the most recent batch
+ * @param last_bytes	Bytes in the most recent batch
+ * @param max_packets	Largest batch seen
+*/
+typedef struct{
+	uint64_t syscalls;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t events;
+	uint64_t parsed;
+	uint64_t errors;
+	uint64_t truncated;
+	uint64_t last_packets;
+	uint64_t last_bytes;
+	uint64_t max_packets;
+} batch_stats_t;
+
+class batchReader{
+public:
+	/**
+	 * @brief
+	 * Reader draining fd (raw HCI socket or any datagram stand-in)
+	*/
+	batchReader(int fd, const batch_config_t& config);
+
+	batchReader(const batchReader&) = delete;
+	batchReader& operator=(const batchReader&) = delete;
+
+	/**
+	 * @brief
+	 * Waits up to timeout_ms then drains up to batch_size packets
+	 * Returns number of packets read, 0 on timeout, -1 on error
+	*/
+	int read_batch();
+
+	/**
+	 * @brief
+	 * Parses the last batch and publishes all records in one step
+	 * devices (optional) coalesces duplicate reports before publishing
+	 * taps (optional) receive every published record as well
+	 * reassembler (optional) joins fragmented extended reports first and
+	 * applies filter to whole payloads
+	 * Returns number of records accepted by the queue
+	*/
+	size_t publish(
+		eventQueue& usr_queue, const bool& verbose,
+		const advFilter *filter = nullptr, deviceTable *devices = nullptr,
+		const publish_taps_t *taps = nullptr, extReassembler *reassembler = nullptr);
+
+	/**
+	 * @brief
+	 * read_batch() followed by publish()
+	 * Returns number of packets read, 0 on timeout, -1 on error
+	*/
+	int drain(eventQueue& usr_queue, const bool& verbose, const advFilter *filter = nullptr);
+
+	/**
+	 * @brief
+	 * Histograms publish() records into (nullptr disables; not owned):
+	 * kernel receive to end of parsing, and parse time per packet
+	*/
+	void set_latency(latencyHistogram *read_to_parse, latencyHistogram *parse_time);
+
+	/**
+	 * @brief
+	 * Access raw packets of the last batch
+	*/
+	const uint8_t* packet(size_t i) const;
+	size_t packet_length(size_t i) const;
+
+	/**
+	 * @brief
+	 * Kernel timestamp and direction of packet i of the last batch
+	*/
+	hci_packet_meta_t packet_meta(size_t i) const;
+	size_t batch_count() const;
+
+	/**
+	 * @brief
+	 * Effective configuration (batch_size and buffer_size clamped)
+	*/
+	const batch_config_t& get_config() const;
+
+	/**
+	 * @brief
+	 * Snapshot of cumulative and per-batch statistics
+	 * Safe to call from other threads
+	*/
+	batch_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Average packets delivered per syscall
+	*/
+	double packets_per_syscall() const;
+
+private:
+	int fd;
+	batch_config_t config;
+
+	/* Preallocated buffers and recvmmsg() descriptors */
+	std::vector<uint8_t> buffers;
+	std::vector<struct mmsghdr> msgs;
+	std::vector<struct iovec> iovecs;
+	std::vector<uint8_t> controls;
+	std::vector<adv_event_t> records;
+	std::vector<uint64_t> stamps;
+	size_t n_batch;
+
+	latencyHistogram *h_read_to_parse;
+	latencyHistogram *h_parse_time;
+
+	std::atomic<uint64_t> n_syscalls;
+	std::atomic<uint64_t> n_packets;
+	std::atomic<uint64_t> n_bytes;
+	std::atomic<uint64_t> n_events;
+	std::atomic<uint64_t> n_parsed;
+	std::atomic<uint64_t> n_errors;
+	std::atomic<uint64_t> n_truncated;
+	std::atomic<uint64_t> n_last_packets;
+	std::atomic<uint64_t> n_last_bytes;
+	std::atomic<uint64_t> n_max_packets;
+};
+
+#endif
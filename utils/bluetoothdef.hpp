@@ -5,9 +5,14 @@
 #ifndef BLUETOOTHDEF
 #define BLUETOOTHDEF
 
+#include <cstdint>
+#include <string>
+
 /**
  * @details
  * Struct to encapsulate the processed advertising event
+ * Built on demand from an adv_event_t (see format_adv_event) when a
+ * consumer wants strings; never produced on the capture path
  * @param event	Type of event (corresponding to PDU enum)
  * @param event_s	Processed string describing event (PDU)
  * @param addresss	Processed string of the device address (: sep Hex)
@@ -20,10 +25,7 @@ typedef struct{
     std::string name;
 } processed_adv_event;
 
-/**
- * TODO:
- * Move HCI definitions into separate file
-*/
+/* HCI event and report layouts are declared in hci_schema.hpp */
 
 /**
  * @details
@@ -35,6 +37,87 @@ typedef struct{
 	uint8_t address[6];
 } __attribute__ ((packed)) bt_dev_addr_t;
 
+/* Data status of a report (Extended event_type bits 5-6, Periodic data_status) */
+#define ADV_DATA_COMPLETE   0x00
+#define ADV_DATA_INCOMPLETE 0x01
+#define ADV_DATA_TRUNCATED  0x02
+
+/* Why a record was emitted (raw report, or a deviceTable coalescing decision) */
+#define ADV_AGG_RAW     0x00
+#define ADV_AGG_NEW     0x01
+#define ADV_AGG_CHANGED 0x02
+#define ADV_AGG_SUMMARY 0x03
+
+/* Adapters a merged record can carry per-adapter RSSI for */
+#define ADV_MAX_ADAPTERS 8
+
+/* RSSI value meaning "not heard by this adapter" */
+#define ADV_RSSI_UNAVAILABLE 127
+
+/* Maximum AD payload carried inline by an adv_event_t (one extended report) */
+#define ADV_EVENT_MAX_DATA 229
+
+/* Largest AD payload of a legacy advertising PDU; longer legacy reports are malformed */
+#define LEGACY_ADV_MAX_DATA 31
+
+/**
+ * @details
+ * Fixed-size, allocation-free record for one advertising report
+ * This is the primary event type passed by value through eventQueue;
+ * strings are only produced when a consumer asks (format_adv_event)
+ * @param timestamp	Kernel receive time in nanoseconds (CLOCK_REALTIME);
+ * 					host read time if the socket has no HCI_TIME_STAMP
+ * @param enqueue_time	Time the record was handed to eventQueue (CLOCK_REALTIME)
+ * @param direction	HCI_DIR_IN (controller to host), HCI_DIR_OUT or HCI_DIR_UNKNOWN
+ * @param subevent	LE Meta subevent the report came from (0x02, 0x0B, 0x0D, 0x0F)
+ * @param data_status	ADV_DATA_COMPLETE, ADV_DATA_INCOMPLETE or ADV_DATA_TRUNCATED
+ * @param sync_handle	Periodic advertising sync handle (periodic reports only)
+ * @param address	Raw Bluetooth Device Address of advertiser
+ * @param address_type	Raw address type
+ * @param event	Raw event_type field (corresponding to PDU enum)
+ * @param rssi	Received Signal Strength Indicator (dBm)
+ * @param tx_power	Transmit power level (dBm, 127 if unavailable)
+ * @param primary_phy	Primary physical channel
+ * @param secondary_phy	Secondary physical channel
+ * @param advertising_sid	Advertising set identifier
+ * @param periodic_advertising_interval	Periodic advertising interval
+ * @param aggregate	ADV_AGG_RAW, or the deviceTable reason (NEW, CHANGED, SUMMARY)
+ * @param report_count	Reports coalesced into this record since the device's previous one
+ * @param rssi_min	Lowest RSSI over those reports (aggregated records only)
+ * @param rssi_max	Highest RSSI over those reports (aggregated records only)
+ * @param adapter_id	Adapter (hci_dev index) that received the report (set by streamMerger)
+ * @param adapter_mask	Bit i set if adapter slot i heard the report (merged records)
+ * @param adapter_rssi	RSSI per adapter slot, ADV_RSSI_UNAVAILABLE if not heard
+ * @param data_length	Number of valid octets in data
+ * @param data	AD payload (bounded copy)
+*/
+typedef struct{
+	uint64_t timestamp;
+	uint64_t enqueue_time;
+	uint8_t direction;
+	uint8_t subevent;
+	uint8_t data_status;
+	uint16_t sync_handle;
+	bt_dev_addr_t address;
+	uint8_t address_type;
+	uint16_t event;
+	int8_t rssi;
+	int8_t tx_power;
+	uint8_t primary_phy;
+	uint8_t secondary_phy;
+	uint8_t advertising_sid;
+	uint16_t periodic_advertising_interval;
+	uint8_t aggregate;
+	uint32_t report_count;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	uint8_t adapter_id;
+	uint8_t adapter_mask;
+	int8_t adapter_rssi[ADV_MAX_ADAPTERS];
+	uint8_t data_length;
+	uint8_t data[ADV_EVENT_MAX_DATA];
+} adv_event_t;
+
 /**
  * @details
  * Typedef to store Advertising/Scan Response Data
@@ -48,6 +131,28 @@ typedef struct{
 	uint8_t data[];
 } __attribute__ ((packed)) ad_data_t;
 
+/* AD Types (Assigned Numbers, Generic Access Profile) */
+#define AD_TYPE_FLAGS               0x01
+#define AD_TYPE_UUID16_INCOMPLETE   0x02
+#define AD_TYPE_UUID16_COMPLETE     0x03
+#define AD_TYPE_UUID32_INCOMPLETE   0x04
+#define AD_TYPE_UUID32_COMPLETE     0x05
+#define AD_TYPE_UUID128_INCOMPLETE  0x06
+#define AD_TYPE_UUID128_COMPLETE    0x07
+#define AD_TYPE_NAME_SHORT          0x08
+#define AD_TYPE_NAME_COMPLETE       0x09
+#define AD_TYPE_TX_POWER            0x0A
+#define AD_TYPE_SERVICE_DATA16      0x16
+#define AD_TYPE_APPEARANCE          0x19
+#define AD_TYPE_SERVICE_DATA32      0x20
+#define AD_TYPE_SERVICE_DATA128     0x21
+#define AD_TYPE_MANUFACTURER        0xFF
+
+/* Company identifiers and service UUIDs with dedicated decoders */
+#define COMPANY_ID_MICROSOFT        0x0006
+#define COMPANY_ID_APPLE            0x004C
+#define SERVICE_UUID_EDDYSTONE      0xFEAA
+
 
 /* Bluetooth Core Specifications, Version 5.3, Vol 4, Parte E */
 
@@ -59,6 +164,35 @@ typedef struct{
 #define HCI_PACK_ISODATA    0x05
 #define HCI_PACK_VENDOR     0xff
 
+/* Largest HCI event packet (type octet + header + 255 octets of parameters) */
+#define HCI_EVENT_BUF_SIZE  260
+
+/* Upper bound on advertising reports carried by one LE Meta event */
+#define HCI_MAX_REPORTS_PER_EVENT 25
+
+/* HCI socket options and ancillary data (mirrors BlueZ SOL_HCI values) */
+#define HCI_SOCKOPT_LEVEL       0
+#define HCI_SOCKOPT_DATA_DIR    1
+#define HCI_SOCKOPT_TIME_STAMP  3
+#define HCI_SOCKOPT_CMSG_DIR    0x0001
+#define HCI_SOCKOPT_CMSG_TSTAMP 0x0002
+
+/* Packet direction reported through HCI_SOCKOPT_CMSG_DIR */
+#define HCI_DIR_OUT     0x00
+#define HCI_DIR_IN      0x01
+#define HCI_DIR_UNKNOWN 0xFF
+
+/**
+ * @details
+ * Per-packet metadata recovered from the socket ancillary data
+ * @param timestamp	Kernel receive time in nanoseconds (CLOCK_REALTIME)
+ * @param direction	HCI_DIR_IN, HCI_DIR_OUT or HCI_DIR_UNKNOWN
+*/
+typedef struct{
+	uint64_t timestamp;
+	uint8_t direction;
+} hci_packet_meta_t;
+
 /* HCI Event Types */
 #define HCI_EVENT_INQUIRY_COMPLETE        0x01
 #define HCI_EVENT_INQUIRY_RESULT          0x02
@@ -75,10 +209,12 @@ typedef struct{
 #define HCI_EVENT_READ_REMOTE_VERSION_INFO_COMPLETE	0x0C
 #define HCI_EVENT_QOS_SETUP_COMPLETE	0x0D
 #define HCI_EVENT_COMMAND_COMPLETE		0x0E
+#define HCI_EVENT_COMMAND_STATUS		0x0F
 #define HCI_EVENT_LE_META	0x3E /* LE Controller Specific Event */
 /**
- * TODO: Finish adding HCI Events
- * Page 2186 Bluetooth Core Specifications v 5.3
+ * The remaining events (Page 2186 Bluetooth Core Specifications v 5.3)
+ * are named, and where their parameters are needed laid out, in
+ * hci_schema.hpp; decoders read packets through its views
 */
 
 /* LE Meta Event Subcodes */
@@ -94,6 +230,13 @@ typedef struct{
 #define SUBEVT_HCI_LE_ADVERTISING_SET_TERMINATED	0x12
 #define SUBEVT_HCI_LE_SCAN_REQUEST_RECEIVED		0x13
 
+/* LE Advertising Report (legacy, 0x02) event types */
+#define LEGACY_ADV_IND          0x00
+#define LEGACY_ADV_DIRECT_IND   0x01
+#define LEGACY_ADV_SCAN_IND     0x02
+#define LEGACY_ADV_NONCONN_IND  0x03
+#define LEGACY_SCAN_RSP         0x04
+
 /* LE Extended Advertising Report Legacy PDUs */
 enum LE_EAR_LEG_PDU{
 	ADV_IND = 0b0010011,
@@ -132,6 +275,201 @@ typedef struct{
 	uint8_t ret[];
 } __attribute__ ((packed)) hci_event_command_complete_t;
 
+/**
+ * @details
+ * Typedef to parse event parameters from HCI Event Command Status
+ * Follows specifications 7.7.15 (Page 2191)
+ * @param status	0x00 if the command is pending, otherwise an HCI error code
+ * @param num_hci_command_packets	Number of HCI Command packets allowed to be sent from Host to Controller
+ * @param command_op	Opcode of command that caused the event
+*/
+typedef struct{
+	uint8_t status;
+	uint8_t num_hci_command_packets;
+	uint16_t command_op;
+} __attribute__ ((packed)) hci_event_command_status_t;
+
+/* HCI Commands (Vol 4, Part E, 7.8 LE Controller Commands) */
+
+/* Opcode = OGF (6 bits) << 10 | OCF (10 bits) */
+#define HCI_OPCODE(ogf, ocf) ((uint16_t)(((ogf) << 10) | (ocf)))
+#define HCI_OGF_LE_CTL 0x08
+
+#define HCI_CMD_LE_READ_FILTER_ACCEPT_LIST_SIZE       HCI_OPCODE(HCI_OGF_LE_CTL, 0x000F)
+#define HCI_CMD_LE_CLEAR_FILTER_ACCEPT_LIST           HCI_OPCODE(HCI_OGF_LE_CTL, 0x0010)
+#define HCI_CMD_LE_ADD_DEVICE_TO_FILTER_ACCEPT_LIST   HCI_OPCODE(HCI_OGF_LE_CTL, 0x0011)
+#define HCI_CMD_LE_REMOVE_DEVICE_FROM_FILTER_ACCEPT_LIST HCI_OPCODE(HCI_OGF_LE_CTL, 0x0012)
+#define HCI_CMD_LE_SET_EXTENDED_SCAN_PARAMETERS       HCI_OPCODE(HCI_OGF_LE_CTL, 0x0041)
+#define HCI_CMD_LE_SET_EXTENDED_SCAN_ENABLE           HCI_OPCODE(HCI_OGF_LE_CTL, 0x0042)
+#define HCI_CMD_LE_PERIODIC_ADVERTISING_CREATE_SYNC   HCI_OPCODE(HCI_OGF_LE_CTL, 0x0044)
+#define HCI_CMD_LE_PERIODIC_ADVERTISING_CREATE_SYNC_CANCEL HCI_OPCODE(HCI_OGF_LE_CTL, 0x0045)
+#define HCI_CMD_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC HCI_OPCODE(HCI_OGF_LE_CTL, 0x0046)
+
+/* HCI status codes (Vol 1, Part F) the host reacts to */
+#define HCI_STATUS_SUCCESS                  0x00
+#define HCI_STATUS_MEMORY_CAPACITY_EXCEEDED 0x07
+#define HCI_STATUS_COMMAND_DISALLOWED       0x0C
+#define HCI_STATUS_LIMITED_RESOURCES        0x0D
+#define HCI_STATUS_SYNC_TIMEOUT             0x3E /* Connection Failed to be Established / Synchronization Timeout */
+#define HCI_STATUS_CANCELLED_BY_HOST        0x44
+
+/* Largest command parameter block */
+#define HCI_MAX_COMMAND_PARAMS 255
+
+/* Scanning_Filter_Policy (7.8.64) */
+#define SCAN_FILTER_BASIC_UNFILTERED    0x00
+#define SCAN_FILTER_BASIC_FILTERED      0x01 /* Only devices on the Filter Accept List */
+#define SCAN_FILTER_EXTENDED_UNFILTERED 0x02
+#define SCAN_FILTER_EXTENDED_FILTERED   0x03
+
+/* Scanning_PHYs bits (7.8.64) */
+#define SCAN_PHY_1M    0x01
+#define SCAN_PHY_CODED 0x04
+
+/* LE_Scan_Type (7.8.64) */
+#define SCAN_TYPE_PASSIVE 0x00
+#define SCAN_TYPE_ACTIVE  0x01
+
+/* Filter_Duplicates (7.8.65) */
+#define SCAN_DUPLICATES_DISABLED       0x00
+#define SCAN_DUPLICATES_ENABLED        0x01
+#define SCAN_DUPLICATES_RESET_PERIODIC 0x02
+
+/**
+ * @details
+ * Typedef to build the header of an HCI Command packet (after the packet type octet)
+ * Follows specifications 5.4.1 (Page 1872)
+ * @param opcode	OGF/OCF opcode
+ * @param param_length	Length of parameters
+ * @param data	Command parameters
+*/
+typedef struct{
+	uint16_t opcode;
+	uint8_t param_length;
+	uint8_t data[];
+} __attribute__ ((packed)) hci_pack_command_head_t;
+
+/**
+ * @details
+ * Per-PHY parameters of LE Set Extended Scan Parameters
+ * Follows specifications 7.8.64 (Page 2526)
+ * @param scan_type	SCAN_TYPE_PASSIVE or SCAN_TYPE_ACTIVE
+ * @param scan_interval	Time between scan starts (0.625 ms units)
+ * @param scan_window	Scan duration per interval (0.625 ms units, <= interval)
+*/
+typedef struct{
+	uint8_t scan_type;
+	uint16_t scan_interval;
+	uint16_t scan_window;
+} __attribute__ ((packed)) hci_le_ext_scan_phy_t;
+
+/**
+ * @details
+ * Fixed part of LE Set Extended Scan Parameters; one hci_le_ext_scan_phy_t
+ * follows for every bit set in scanning_phys
+ * @param own_address_type	Address type used in scan requests
+ * @param scanning_filter_policy	SCAN_FILTER_*
+ * @param scanning_phys	SCAN_PHY_* bits
+*/
+typedef struct{
+	uint8_t own_address_type;
+	uint8_t scanning_filter_policy;
+	uint8_t scanning_phys;
+} __attribute__ ((packed)) hci_le_ext_scan_params_head_t;
+
+/**
+ * @details
+ * Parameters of LE Set Extended Scan Enable
+ * Follows specifications 7.8.65 (Page 2530)
+ * @param enable	0x00 disable, 0x01 enable
+ * @param filter_duplicates	SCAN_DUPLICATES_*
+ * @param duration	Scan duration (10 ms units, 0 = until disabled)
+ * @param period	Time between scan starts (1.28 s units, 0 = continuous)
+*/
+typedef struct{
+	uint8_t enable;
+	uint8_t filter_duplicates;
+	uint16_t duration;
+	uint16_t period;
+} __attribute__ ((packed)) hci_le_ext_scan_enable_t;
+
+/**
+ * @details
+ * Parameters of LE Add/Remove Device To/From Filter Accept List
+ * Follows specifications 7.8.16 (Page 2432)
+ * @param address_type	0x00 public, 0x01 random, 0xFF anonymous advertisements
+ * @param address	Device address
+*/
+typedef struct{
+	uint8_t address_type;
+	bt_dev_addr_t address;
+} __attribute__ ((packed)) hci_le_filter_accept_list_entry_t;
+
+/* Largest extended advertising payload (AUX_ADV_IND + AUX_CHAIN_IND chain) */
+#define EXT_ADV_MAX_DATA 1650
+
+/* Largest periodic advertising payload (AUX_SYNC_IND + AUX_CHAIN_IND chain) */
+#define PERIODIC_ADV_MAX_DATA 1650
+
+/* Sync_CTE_Type: sync regardless of Constant Tone Extension */
+#define PERIODIC_SYNC_CTE_ANY 0x00
+
+/**
+ * @details
+ * Parameters of LE Periodic Advertising Create Sync
+ * Follows specifications 7.8.67 (Page 2535)
+ * @param options	Bit 0: use the Periodic Advertiser List, bit 1: reporting initially disabled
+ * @param advertising_sid	Advertising set identifier of the train
+ * @param advertiser_address_type	0x00 public, 0x01 random
+ * @param advertiser_address	Address of the advertiser
+ * @param skip	Periodic events that may be skipped after a successful receive
+ * @param sync_timeout	Sync lost after this long without a packet (10 ms units)
+ * @param sync_cte_type	Constant Tone Extension types not to sync to
+*/
+typedef struct{
+	uint8_t options;
+	uint8_t advertising_sid;
+	uint8_t advertiser_address_type;
+	bt_dev_addr_t advertiser_address;
+	uint16_t skip;
+	uint16_t sync_timeout;
+	uint8_t sync_cte_type;
+} __attribute__ ((packed)) hci_le_periodic_create_sync_t;
+
+/**
+ * @details
+ * Typedef to parse HCI LE Periodic Advertising Sync Established (follows subevent code)
+ * Follows Specifications 7.7.65.14 (Page 2276)
+ * @param status	HCI_STATUS_SUCCESS, or why the sync failed
+ * @param sync_handle	Handle of the train in later reports
+ * @param advertising_sid	Advertising set identifier
+ * @param advertiser_address_type	Address type of the advertiser
+ * @param advertiser_address	Address of the advertiser
+ * @param advertiser_phy	PHY of the train
+ * @param periodic_advertising_interval	Interval (1.25 ms units)
+ * @param advertiser_clock_accuracy	Advertiser's clock accuracy
+*/
+typedef struct{
+	uint8_t status;
+	uint16_t sync_handle;
+	uint8_t advertising_sid;
+	uint8_t advertiser_address_type;
+	bt_dev_addr_t advertiser_address;
+	uint8_t advertiser_phy;
+	uint16_t periodic_advertising_interval;
+	uint8_t advertiser_clock_accuracy;
+} __attribute__ ((packed)) hci_le_meta_periodic_sync_established_t;
+
+/**
+ * @details
+ * Typedef to parse HCI LE Periodic Advertising Sync Lost (follows subevent code)
+ * Follows Specifications 7.7.65.16 (Page 2280)
+ * @param sync_handle	Handle of the lost train
+*/
+typedef struct{
+	uint16_t sync_handle;
+} __attribute__ ((packed)) hci_le_meta_periodic_sync_lost_t;
+
 /* HCI LE Meta Extended Advertising Report (EAR) Definitions */
 
 /**
@@ -182,4 +520,69 @@ typedef struct{
 	uint8_t data[];
 } __attribute__ ((packed)) hci_le_meta_ear_event_t;
 
+/* Extended Advertising Report event_type bits */
+#define EAR_EVT_LEGACY          0x0010
+#define EAR_EVT_DATA_STATUS(e)  (((e) >> 5) & 0x03)
+
+/**
+ * @details
+ * Typedef to parse one HCI LE Advertising Report (legacy)
+ * Follows Specifications 7.7.65.2 (Page 2236)
+ * Reports follow each other; each is followed by a 1 octet RSSI after data
+ * @param event_type	LEGACY_* event type
+ * @param address_type	Description of address type
+ * @param address		Bluetooth Device Address of advertiser
+ * @param data_length	Length of advertising data (0-31)
+ * @param data		Advertising data, then RSSI
+*/
+typedef struct{
+	uint8_t event_type;
+	uint8_t address_type;
+	bt_dev_addr_t address;
+	uint8_t data_length;
+	uint8_t data[];
+} __attribute__ ((packed)) hci_le_meta_adv_report_t;
+
+/**
+ * @details
+ * Typedef to parse one HCI LE Directed Advertising Report
+ * Follows Specifications 7.7.65.11 (Page 2263)
+ * @param event_type	Always 0x01 (ADV_DIRECT_IND)
+ * @param address_type	Description of address type
+ * @param address		Bluetooth Device Address of advertiser
+ * @param direct_address_type	Type of the target address
+ * @param direct_address	Target (our) address
+ * @param rssi	Received Signal Strength Indicator
+*/
+typedef struct{
+	uint8_t event_type;
+	uint8_t address_type;
+	bt_dev_addr_t address;
+	uint8_t direct_address_type;
+	bt_dev_addr_t direct_address;
+	uint8_t rssi;
+} __attribute__ ((packed)) hci_le_meta_direct_report_t;
+
+/**
+ * @details
+ * Typedef to parse HCI LE Periodic Advertising Report (follows subevent code)
+ * Follows Specifications 7.7.65.15 (Page 2278)
+ * @param sync_handle	Handle of the periodic advertising train
+ * @param tx_power	Transmit power level
+ * @param rssi	Received Signal Strength Indicator
+ * @param cte_type	Constant Tone Extension type
+ * @param data_status	0 complete, 1 incomplete (more to come), 2 truncated
+ * @param data_length	Length of data
+ * @param data		Periodic advertising data
+*/
+typedef struct{
+	uint16_t sync_handle;
+	uint8_t tx_power;
+	uint8_t rssi;
+	uint8_t cte_type;
+	uint8_t data_status;
+	uint8_t data_length;
+	uint8_t data[];
+} __attribute__ ((packed)) hci_le_meta_periodic_report_t;
+
 #endif
\ No newline at end of file
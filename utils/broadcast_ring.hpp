@@ -0,0 +1,453 @@
+/**
+ * Header-only, bounded single-producer/multi-subscriber broadcast ring
+ * @author Owen Capell
+*/
+#ifndef BROADCAST_RING
+#define BROADCAST_RING
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+#include "spsc_ring.hpp"
+
+/* Default number of subscriber slots */
+#define BROADCAST_DEFAULT_SUBSCRIBERS 16
+
+/**
+ * @details
+ * What the producer does about a subscriber that falls a full ring behind
+ * @param gating	Producer waits for the subscriber (slowest-consumer gating)
+ * @param lossy		Producer overwrites; the subscriber skips ahead and counts the lag
+*/
+enum class broadcastPolicy{
+	gating,
+	lossy
+};
+
+/**
+ * @details
+ * Snapshot of one subscriber
+ * @param active	Subscription is open
+ * @param policy	gating or lossy
+ * @param cursor	Next sequence number the subscriber reads
+ * @param backlog	Published elements the subscriber has not read yet
+ * @param lag	Elements a lossy subscriber missed because they were overwritten
+ * @param filtered	Elements skipped by the subscriber's filter
+*/
+typedef struct{
+	bool active;
+	broadcastPolicy policy;
+	uint64_t cursor;
+	uint64_t backlog;
+	uint64_t lag;
+	uint64_t filtered;
+} broadcast_subscriber_t;
+
+/**
+ * @details
+ * Disruptor-style ring: the producer writes each element once into a
+ * slot and advances a shared sequence; every subscriber owns a cursor
+ * and reads slots in place (peek()/release()), so N consumers see the
+ * same element with no copy and no reference counting.
+ * Each slot carries the sequence it holds, written seqlock style, which
+ * lets lossy subscribers detect that the producer lapped them (even in
+ * the middle of a read) and skip ahead. Gating subscribers bound the
+ * producer instead: it never claims a slot a gating subscriber still
+ * has to read. The producer caches the gating bound and only rescans
+ * subscriber cursors when it reaches that bound or subscriptions change.
+ * T must be trivially copyable (lossy readers may observe a torn value,
+ * which release() then reports as overwritten).
+*/
+template <typename T>
+class broadcastRing{
+	static_assert(std::is_trivially_copyable_v<T>, "broadcastRing elements must be trivially copyable");
+
+public:
+	/**
+	 * @brief
+	 * Predicate deciding whether a subscriber wants an element
+	*/
+	typedef std::function<bool(const T&)> filter_t;
+
+	explicit broadcastRing(size_t capacity, size_t max_subscribers = BROADCAST_DEFAULT_SUBSCRIBERS)
+		: mask(round_capacity(capacity) - 1), n_subs(max_subscribers ? max_subscribers : 1),
+		slots(new slot[mask + 1]), subs(new subscriber[n_subs])
+	{
+		/**
+		 * Constructor for broadcastRing
+		 * Capacity is rounded up to the next power of two
+		 *
+		 * @param capacity	Minimum number of elements the ring holds
+		 * @param max_subscribers	Subscriptions that may be open at once
+		*/
+
+		for(size_t i=0; i<=mask; i++){
+			slots[i].seq.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	broadcastRing(const broadcastRing&) = delete;
+	broadcastRing& operator=(const broadcastRing&) = delete;
+
+	/**
+	 * @brief
+	 * Opens a subscription starting at the next published element
+	 * Returns the subscriber id, -1 if every slot is taken
+	*/
+	int subscribe(broadcastPolicy policy = broadcastPolicy::lossy, filter_t filter = nullptr){
+		std::lock_guard<std::mutex> lock(subs_mutex);
+		for(size_t i=0; i<n_subs; i++){
+			subscriber& s = subs[i];
+			if(s.active.load(std::memory_order_relaxed)) continue;
+
+			s.policy = policy;
+			s.filter = std::move(filter);
+			s.held = false;
+			s.lag.store(0, std::memory_order_relaxed);
+			s.filtered.store(0, std::memory_order_relaxed);
+			s.cursor.store(tail.load(std::memory_order_acquire), std::memory_order_relaxed);
+			s.active.store(true, std::memory_order_seq_cst);
+			generation.fetch_add(1, std::memory_order_seq_cst);
+			return (int)i;
+		}
+		return -1;
+	}
+
+	/**
+	 * @brief
+	 * Closes a subscription; a producer gated on it resumes
+	*/
+	void unsubscribe(int id){
+		if(!valid_id(id)) return;
+		std::lock_guard<std::mutex> lock(subs_mutex);
+		subscriber& s = subs[id];
+		s.active.store(false, std::memory_order_seq_cst);
+		s.filter = nullptr;
+		generation.fetch_add(1, std::memory_order_seq_cst);
+		wake_producer();
+	}
+
+	/**
+	 * @brief
+	 * Reserves the next slot for in-place writing (producer only)
+	 * Waits while a gating subscriber still has to read the slot
+	 * Every claim() must be followed by publish()
+	*/
+	T* claim(){
+		size_t pos = tail.load(std::memory_order_relaxed);
+		if(pos >= gate || generation.load(std::memory_order_acquire) != gate_generation){
+			rescan_gate();
+			uint32_t spins = 0;
+			while(pos >= gate){
+				if(++spins < SPSC_RING_SPIN_LIMIT){
+					cpu_relax();
+				}
+				else{
+					wait_for_subscribers(pos);
+				}
+				rescan_gate();
+			}
+		}
+
+		/* Mark the slot as being rewritten before touching the value */
+		slot *s = &slots[pos & mask];
+		s->seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		return &s->value;
+	}
+
+	/**
+	 * @brief
+	 * Makes the slot returned by claim() visible to every subscriber
+	*/
+	void publish(bool wake = true){
+		size_t pos = tail.load(std::memory_order_relaxed);
+		slots[pos & mask].seq.store(pos + 1, std::memory_order_release);
+		tail.store(pos + 1, std::memory_order_release);
+		if(wake) wake_subscribers();
+	}
+
+	/**
+	 * @brief
+	 * Writes a copy of v (producer only)
+	*/
+	void push(const T& v){
+		*claim() = v;
+		publish();
+	}
+
+	/**
+	 * @brief
+	 * Writes count elements with a single wake-up (producer only)
+	*/
+	void push_batch(const T *items, size_t count){
+		for(size_t i=0; i<count; i++){
+			*claim() = items[i];
+			publish(false);
+		}
+		notify();
+	}
+
+	/**
+	 * @brief
+	 * Wakes sleeping subscribers after a run of publish(false)
+	*/
+	void notify(){ wake_subscribers(); }
+
+	/**
+	 * @brief
+	 * Next element for subscriber id that passes its filter, read in place
+	 * Returns nullptr if nothing is available. The element stays valid until
+	 * release() (gating) or may be overwritten, which release() reports (lossy)
+	*/
+	const T* peek(int id){
+		subscriber& s = subs[id];
+		size_t c = s.cursor.load(std::memory_order_relaxed);
+		while(true){
+			size_t t = tail.load(std::memory_order_acquire);
+			if(c == t){
+				s.held = false;
+				return nullptr;
+			}
+
+			if(t - c > mask + 1){
+				/* Lapped (lossy only): resume at the oldest element still in the ring */
+				s.lag.fetch_add(t - (mask + 1) - c, std::memory_order_relaxed);
+				c = t - (mask + 1);
+				s.cursor.store(c, std::memory_order_release);
+			}
+
+			slot *sl = &slots[c & mask];
+			size_t seq = sl->seq.load(std::memory_order_acquire);
+			if(seq != c + 1){
+				/* Overwritten after we loaded tail */
+				s.lag.fetch_add(1, std::memory_order_relaxed);
+				s.cursor.store(++c, std::memory_order_release);
+				continue;
+			}
+
+			if(s.filter && !s.filter(sl->value)){
+				if(still_valid(sl, seq)) s.filtered.fetch_add(1, std::memory_order_relaxed);
+				else s.lag.fetch_add(1, std::memory_order_relaxed);
+				s.cursor.store(++c, std::memory_order_release);
+				if(s.policy == broadcastPolicy::gating) wake_producer();
+				continue;
+			}
+
+			s.held = true;
+			s.held_seq = seq;
+			return &sl->value;
+		}
+	}
+
+	/**
+	 * @brief
+	 * Finishes with the element returned by peek() and advances the cursor
+	 * Returns false if a lossy subscriber's element was overwritten while read
+	*/
+	bool release(int id){
+		subscriber& s = subs[id];
+		if(!s.held) return false;
+		s.held = false;
+
+		size_t c = s.cursor.load(std::memory_order_relaxed);
+		bool ok = still_valid(&slots[c & mask], s.held_seq);
+		if(!ok) s.lag.fetch_add(1, std::memory_order_relaxed);
+		s.cursor.store(c + 1, std::memory_order_release);
+		if(s.policy == broadcastPolicy::gating) wake_producer();
+		return ok;
+	}
+
+	/**
+	 * @brief
+	 * Copies the next element into out (peek() + release())
+	 * Returns false if nothing intact was available
+	*/
+	bool try_read(int id, T& out){
+		while(true){
+			const T *v = peek(id);
+			if(v == nullptr) return false;
+			out = *v;
+			if(release(id)) return true;
+		}
+	}
+
+	/**
+	 * @brief
+	 * Like peek(), spinning briefly then sleeping until an element arrives
+	 * Returns nullptr once close() was called and the subscriber caught up
+	*/
+	const T* wait(int id){
+		uint32_t spins = 0;
+		while(true){
+			const T *v = peek(id);
+			if(v != nullptr) return v;
+			if(closed.load(std::memory_order_acquire)) return nullptr;
+			if(++spins < SPSC_RING_SPIN_LIMIT){
+				cpu_relax();
+				continue;
+			}
+
+			uint32_t ticket = publish_ticket.load(std::memory_order_acquire);
+			sleepers.fetch_add(1, std::memory_order_seq_cst);
+			if(tail.load(std::memory_order_seq_cst) == subs[id].cursor.load(std::memory_order_relaxed) &&
+				!closed.load(std::memory_order_acquire)){
+				publish_ticket.wait(ticket, std::memory_order_acquire);
+			}
+			sleepers.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * @brief
+	 * Wakes every wait() for shutdown; subscribers still drain what is queued
+	*/
+	void close(){
+		closed.store(true, std::memory_order_release);
+		publish_ticket.fetch_add(1, std::memory_order_release);
+		publish_ticket.notify_all();
+	}
+
+	/**
+	 * @brief
+	 * Elements published so far
+	*/
+	uint64_t published() const{ return tail.load(std::memory_order_acquire); }
+
+	/**
+	 * @brief
+	 * Times the producer had to wait for a gating subscriber
+	*/
+	uint64_t producer_stalls() const{ return n_stalls.load(std::memory_order_relaxed); }
+
+	size_t capacity() const{ return mask + 1; }
+
+	size_t max_subscribers() const{ return n_subs; }
+
+	/**
+	 * @brief
+	 * Relaxed snapshot of subscriber id (any thread)
+	*/
+	broadcast_subscriber_t subscriber_stats(int id) const{
+		broadcast_subscriber_t out = {};
+		if(!valid_id(id)) return out;
+		const subscriber& s = subs[id];
+		out.active = s.active.load(std::memory_order_acquire);
+		out.policy = s.policy;
+		out.cursor = s.cursor.load(std::memory_order_acquire);
+		uint64_t t = tail.load(std::memory_order_acquire);
+		out.backlog = out.active && t > out.cursor ? t - out.cursor : 0;
+		out.lag = s.lag.load(std::memory_order_relaxed);
+		out.filtered = s.filtered.load(std::memory_order_relaxed);
+		return out;
+	}
+
+private:
+	struct alignas(CACHE_LINE_SIZE) slot{
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	struct alignas(CACHE_LINE_SIZE) subscriber{
+		/* Shared with the producer */
+		std::atomic<bool> active{false};
+		std::atomic<size_t> cursor{0};
+		std::atomic<uint64_t> lag{0};
+		std::atomic<uint64_t> filtered{0};
+
+		/* Subscriber thread only */
+		broadcastPolicy policy = broadcastPolicy::lossy;
+		filter_t filter;
+		bool held = false;
+		size_t held_seq = 0;
+	};
+
+	static size_t round_capacity(size_t capacity){
+		size_t c = 1;
+		while(c < capacity) c <<= 1;
+		return c;
+	}
+
+	static void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	bool valid_id(int id) const{
+		return id >= 0 && (size_t)id < n_subs;
+	}
+
+	static bool still_valid(const slot *s, size_t seq){
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return s->seq.load(std::memory_order_relaxed) == seq;
+	}
+
+	void rescan_gate(){
+		/* Producer: first sequence it may not claim yet (SIZE_MAX when nobody gates) */
+		gate_generation = generation.load(std::memory_order_acquire);
+		size_t limit = SIZE_MAX;
+		for(size_t i=0; i<n_subs; i++){
+			const subscriber& s = subs[i];
+			if(!s.active.load(std::memory_order_acquire) || s.policy != broadcastPolicy::gating) continue;
+			size_t c = s.cursor.load(std::memory_order_acquire) + mask + 1;
+			if(c < limit) limit = c;
+		}
+		gate = limit;
+	}
+
+	void wait_for_subscribers(size_t pos){
+		n_stalls.fetch_add(1, std::memory_order_relaxed);
+		uint32_t ticket = progress_ticket.load(std::memory_order_acquire);
+		producer_sleeping.store(true, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		rescan_gate();
+		if(pos >= gate) progress_ticket.wait(ticket, std::memory_order_acquire);
+		producer_sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	void wake_producer(){
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(producer_sleeping.load(std::memory_order_relaxed)){
+			progress_ticket.fetch_add(1, std::memory_order_release);
+			progress_ticket.notify_one();
+		}
+	}
+
+	void wake_subscribers(){
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleepers.load(std::memory_order_relaxed) != 0){
+			publish_ticket.fetch_add(1, std::memory_order_release);
+			publish_ticket.notify_all();
+		}
+	}
+
+	const size_t mask;
+	const size_t n_subs;
+	std::unique_ptr<slot[]> slots;
+	std::unique_ptr<subscriber[]> subs;
+	std::mutex subs_mutex;
+
+	/* Producer-owned line */
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+	size_t gate = 0;
+	uint64_t gate_generation = UINT64_MAX;
+	std::atomic<uint64_t> n_stalls{0};
+	std::atomic<uint32_t> progress_ticket{0};
+	std::atomic<bool> producer_sleeping{false};
+
+	/* Shared wake-up state */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> generation{0};
+	std::atomic<uint32_t> publish_ticket{0};
+	std::atomic<uint32_t> sleepers{0};
+	std::atomic<bool> closed{false};
+};
+
+#endif
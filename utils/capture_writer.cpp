@@ -0,0 +1,377 @@
+/**
+ * Implementation of asynchronous btsnoop/pcap capture-to-disk writer
+ * @author Owen Capell
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef BT_SNIFF_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "bluetoothdef.hpp"
+#include "capture_writer.hpp"
+#include "utils.hpp"
+
+/* btsnoop constants (see packet_source.cpp for the reader side) */
+#define BTSNOOP_DATALINK_H4     1002
+#define BTSNOOP_EPOCH_DELTA_US  0x00e03ab44a676000ull
+
+/* pcap constants */
+#define PCAP_LINKTYPE_H4_PHDR   201
+#define PCAP_SNAPLEN            65535
+
+static void store_be32(uint8_t *p, uint32_t v){
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void store_be64(uint8_t *p, uint64_t v){
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void store_u32(uint8_t *p, uint32_t v){
+	memcpy(p, &v, sizeof(v));
+}
+
+captureWriter::captureWriter(const capture_config_t& config) :
+	config(config), ring(config.queue_capacity, overflowPolicy::drop_newest),
+	running(true), writer(),
+	fd(-1), gz(nullptr), buffer(nullptr), buffered(0), file_bytes(0), file_opened(0), file_index(0),
+	open_failed(0), n_frames(0), n_written(0), n_unwritable(0), n_truncated(0), n_bytes(0), n_files(0), n_errors(0)
+{
+	/**
+	 * Constructor for captureWriter
+	 * Allocates the aligned staging buffer and starts the writer thread
+	 *
+	 * @param config	Format, rotation, compression and I/O options
+	*/
+
+#ifndef BT_SNIFF_HAVE_ZLIB
+	this->config.compress = false;
+#endif
+	if(this->config.compress) this->config.direct_io = false;
+
+	size_t size = this->config.buffer_size;
+	if(size < CAPTURE_MIN_BUFFER) size = CAPTURE_MIN_BUFFER;
+	size = (size + CAPTURE_ALIGNMENT - 1) & ~(size_t)(CAPTURE_ALIGNMENT - 1);
+	this->config.buffer_size = size;
+
+	void *mem = nullptr;
+	if(posix_memalign(&mem, CAPTURE_ALIGNMENT, size) != 0) mem = nullptr;
+	buffer = (uint8_t*)mem;
+
+	writer = std::thread(&captureWriter::run, this);
+}
+
+captureWriter::~captureWriter(){
+	/**
+	 * Destructor for captureWriter
+	 * Drains the queue, closes the file and frees the staging buffer
+	*/
+
+	stop();
+	free(buffer);
+}
+
+void captureWriter::stop(){
+	running.store(false, std::memory_order_release);
+	if(writer.joinable()) writer.join();
+}
+
+bool captureWriter::write(const hci_packet_t& pkt){
+	/**
+	 * Copies pkt into the next free frame slot (capture thread side)
+	 * Drop-and-count when the writer thread has fallen behind
+	 *
+	 * @param pkt	Raw packet with H4 type octet, timestamp and direction
+	 * @returns true if queued, false if dropped
+	*/
+
+	capture_frame_t *frame = ring.claim();
+	if(frame == nullptr) return false;
+
+	size_t len = pkt.length;
+	if(len > CAPTURE_FRAME_MAX){
+		len = CAPTURE_FRAME_MAX;
+		n_truncated.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	frame->timestamp = pkt.meta.timestamp;
+	frame->orig_length = (uint32_t)pkt.length;
+	frame->length = (uint16_t)len;
+	frame->direction = pkt.meta.direction;
+	memcpy(frame->data, pkt.data, len);
+	ring.publish(false);
+
+	n_frames.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+capture_stats_t captureWriter::stats() const{
+	/**
+	 * Relaxed snapshot of the writer counters
+	 *
+	 * @returns capture_stats_t copy
+	*/
+
+	capture_stats_t s;
+	s.frames = n_frames.load(std::memory_order_relaxed);
+	s.written = n_written.load(std::memory_order_relaxed);
+	s.dropped = ring.dropped_newest() + n_unwritable.load(std::memory_order_relaxed);
+	s.truncated = n_truncated.load(std::memory_order_relaxed);
+	s.bytes = n_bytes.load(std::memory_order_relaxed);
+	s.files = n_files.load(std::memory_order_relaxed);
+	s.errors = n_errors.load(std::memory_order_relaxed);
+	return s;
+}
+
+void captureWriter::run(){
+	/**
+	 * Writer thread: drain frames into the staging buffer, write full
+	 * buffers, rotate on size/time, sleep poll_us when idle
+	*/
+
+	if(buffer == nullptr){
+		n_errors.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	capture_frame_t frame;
+	while(true){
+		bool idle = true;
+		while(ring.try_pop(frame)){
+			idle = false;
+			if(!ensure_open()){
+				n_unwritable.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			append(frame);
+			if(config.rotate_bytes != 0 && file_bytes >= config.rotate_bytes){
+				close_current();
+			}
+		}
+
+		if(fd >= 0 && config.rotate_seconds != 0 &&
+			monotonic_ns() - file_opened >= (uint64_t)config.rotate_seconds * 1000000000ull){
+			close_current();
+		}
+
+		if(idle){
+			if(!running.load(std::memory_order_acquire) && ring.size() == 0) break;
+			std::this_thread::sleep_for(std::chrono::microseconds(config.poll_us));
+		}
+	}
+
+	close_current();
+}
+
+bool captureWriter::ensure_open(){
+	/**
+	 * Makes sure a file is open for the next frame. After a failed open,
+	 * the next attempt waits CAPTURE_OPEN_RETRY_NS, so an unwritable path
+	 * costs one open() (and one error) per interval instead of per frame
+	 *
+	 * @returns true if a file is open
+	*/
+
+	if(fd >= 0) return true;
+	uint64_t now = 0;
+	if(open_failed != 0){
+		now = monotonic_ns();
+		if(now - open_failed < CAPTURE_OPEN_RETRY_NS) return false;
+	}
+	if(open_next()){
+		open_failed = 0;
+		return true;
+	}
+	open_failed = now != 0 ? now : monotonic_ns();
+	return false;
+}
+
+bool captureWriter::open_next(){
+	/**
+	 * Opens the next file in the rotation and stages its header
+	 *
+	 * @returns true on success
+	*/
+
+	const char *ext = config.format == captureFormat::btsnoop ? "btsnoop" : "pcap";
+	char path[4096];
+	snprintf(path, sizeof(path), "%s_%05u.%s%s",
+		config.path_prefix.c_str(), file_index, ext, config.compress ? ".gz" : "");
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if(config.direct_io) flags |= O_DIRECT;
+	fd = open(path, flags, 0644);
+	if(fd < 0 && config.direct_io){
+		/* Filesystem may not support O_DIRECT (e.g. tmpfs) */
+		fd = open(path, flags & ~O_DIRECT, 0644);
+	}
+	if(fd < 0){
+		n_errors.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+#ifdef BT_SNIFF_HAVE_ZLIB
+	if(config.compress){
+		int gz_fd = dup(fd);
+		gz = gz_fd < 0 ? nullptr : gzdopen(gz_fd, "wb1");
+		if(gz == nullptr){
+			if(gz_fd >= 0) close(gz_fd);
+			n_errors.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+#endif
+
+	file_index++;
+	file_bytes = 0;
+	file_opened = monotonic_ns();
+	n_files.fetch_add(1, std::memory_order_relaxed);
+
+	uint8_t header[24];
+	size_t header_len;
+	if(config.format == captureFormat::btsnoop){
+		memcpy(header, "btsnoop\0", 8);
+		store_be32(header + 8, 1);
+		store_be32(header + 12, BTSNOOP_DATALINK_H4);
+		header_len = 16;
+	}
+	else{
+		uint16_t version[2] = {2, 4};
+		store_u32(header, 0xa1b2c3d4);
+		memcpy(header + 4, version, sizeof(version));
+		store_u32(header + 8, 0);
+		store_u32(header + 12, 0);
+		store_u32(header + 16, PCAP_SNAPLEN);
+		store_u32(header + 20, PCAP_LINKTYPE_H4_PHDR);
+		header_len = 24;
+	}
+	memcpy(buffer + buffered, header, header_len);
+	buffered += header_len;
+	file_bytes += header_len;
+	return true;
+}
+
+void captureWriter::close_current(){
+	/**
+	 * Flushes the staging buffer and closes the current file
+	*/
+
+	if(fd < 0) return;
+	flush(true);
+
+#ifdef BT_SNIFF_HAVE_ZLIB
+	if(gz != nullptr){
+		gzclose((gzFile)gz);
+		gz = nullptr;
+	}
+#endif
+
+	close(fd);
+	fd = -1;
+}
+
+void captureWriter::append(const capture_frame_t& frame){
+	/**
+	 * Serialises one frame (record header + payload) into the staging buffer
+	 *
+	 * @param frame	Frame popped from the ring
+	*/
+
+	uint8_t rec[24];
+	size_t rec_len;
+	size_t payload_len = frame.length;
+
+	if(config.format == captureFormat::btsnoop){
+		uint32_t flags = frame.direction == HCI_DIR_IN ? 0x01 : 0x00;
+		if(frame.length > 0 &&
+			(frame.data[0] == HCI_PACK_COMMAND || frame.data[0] == HCI_PACK_EVENT)) flags |= 0x02;
+		store_be32(rec, frame.orig_length);
+		store_be32(rec + 4, frame.length);
+		store_be32(rec + 8, flags);
+		store_be32(rec + 12, 0);
+		store_be64(rec + 16, frame.timestamp / 1000ull + BTSNOOP_EPOCH_DELTA_US);
+		rec_len = 24;
+	}
+	else{
+		store_u32(rec, (uint32_t)(frame.timestamp / 1000000000ull));
+		store_u32(rec + 4, (uint32_t)((frame.timestamp % 1000000000ull) / 1000ull));
+		store_u32(rec + 8, frame.length + 4);
+		store_u32(rec + 12, frame.orig_length + 4);
+		store_be32(rec + 16, frame.direction == HCI_DIR_IN ? 1 : 0);
+		rec_len = 20;
+	}
+
+	if(buffered + rec_len + payload_len > config.buffer_size) flush(false);
+
+	memcpy(buffer + buffered, rec, rec_len);
+	memcpy(buffer + buffered + rec_len, frame.data, payload_len);
+	buffered += rec_len + payload_len;
+	file_bytes += rec_len + payload_len;
+	n_written.fetch_add(1, std::memory_order_relaxed);
+}
+
+void captureWriter::flush(bool final){
+	/**
+	 * Writes the staging buffer out
+	 * With O_DIRECT only whole aligned blocks are written unless final,
+	 * in which case O_DIRECT is dropped for the unaligned tail
+	 *
+	 * @param final	Write everything (file is about to be closed)
+	*/
+
+	if(buffered == 0) return;
+
+	size_t len = buffered;
+	if(config.direct_io && !final){
+		len &= ~(size_t)(CAPTURE_ALIGNMENT - 1);
+		if(len == 0) return;
+	}
+	if(config.direct_io && final && (len % CAPTURE_ALIGNMENT) != 0){
+		int fl = fcntl(fd, F_GETFL);
+		if(fl >= 0) fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+	}
+
+	write_out(buffer, len);
+
+	if(len < buffered) memmove(buffer, buffer + len, buffered - len);
+	buffered -= len;
+}
+
+void captureWriter::write_out(const uint8_t *data, size_t len){
+	/**
+	 * Writes len bytes to the current file (through gzip if enabled)
+	 *
+	 * @param data	Bytes to write
+	 * @param len	Number of bytes
+	*/
+
+	n_bytes.fetch_add(len, std::memory_order_relaxed);
+
+#ifdef BT_SNIFF_HAVE_ZLIB
+	if(gz != nullptr){
+		if(gzwrite((gzFile)gz, data, (unsigned int)len) <= 0){
+			n_errors.fetch_add(1, std::memory_order_relaxed);
+		}
+		return;
+	}
+#endif
+
+	while(len > 0){
+		ssize_t n = ::write(fd, data, len);
+		if(n < 0){
+			if(errno == EINTR) continue;
+			n_errors.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+}
@@ -0,0 +1,171 @@
+/**
+ * Header for asynchronous btsnoop/pcap capture-to-disk writer
+ * @author Owen Capell
+*/
+#ifndef CAPTURE_WRITER
+#define CAPTURE_WRITER
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "bluetoothdef.hpp"
+#include "spsc_ring.hpp"
+#include "packet_source.hpp"
+
+/* Largest frame stored; longer frames are truncated (orig_len is kept) */
+#define CAPTURE_FRAME_MAX HCI_EVENT_BUF_SIZE
+
+/* Default staging buffer (multiple of the O_DIRECT alignment) */
+#define CAPTURE_DEFAULT_BUFFER (1 << 20)
+#define CAPTURE_ALIGNMENT 4096
+
+/* Largest serialised record (btsnoop record header + frame) */
+#define CAPTURE_RECORD_MAX (24 + CAPTURE_FRAME_MAX)
+
+/*
+ * Smallest staging buffer: an O_DIRECT flush leaves up to one unaligned
+ * block behind, and the largest record must still fit after it
+*/
+#define CAPTURE_MIN_BUFFER (2 * CAPTURE_ALIGNMENT + CAPTURE_RECORD_MAX)
+
+/* After a file fails to open, frames are dropped until the next attempt this much later */
+#define CAPTURE_OPEN_RETRY_NS 1000000000ull
+
+/**
+ * @details
+ * On-disk format written by captureWriter
+ * @param btsnoop	btsnoop v1, HCI UART (H4) datalink
+ * @param pcap		pcap, LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR, microseconds
+*/
+enum class captureFormat{
+	btsnoop,
+	pcap
+};
+
+/**
+ * @details
+ * Configuration for captureWriter
+ * @param path_prefix	Files are named <prefix>_<index>.<ext>[.gz]
+ * @param format	btsnoop or pcap
+ * @param queue_capacity	Frames buffered between capture and writer threads
+ * @param buffer_size	Aligned staging buffer; one write() per full buffer
+ * 					(raised to at least CAPTURE_MIN_BUFFER)
+ * @param rotate_bytes	Start a new file after this many bytes (0 = never)
+ * @param rotate_seconds	Start a new file after this many seconds (0 = never)
+ * @param compress	gzip the output (ignored without zlib)
+ * @param direct_io	Open files with O_DIRECT (ignored when compressing)
+ * @param poll_us	Writer sleep when idle, bounds flush/rotation latency
+*/
+typedef struct{
+	std::string path_prefix = "capture";
+	captureFormat format = captureFormat::btsnoop;
+	size_t queue_capacity = 16384;
+	size_t buffer_size = CAPTURE_DEFAULT_BUFFER;
+	uint64_t rotate_bytes = 0;
+	uint32_t rotate_seconds = 0;
+	bool compress = false;
+	bool direct_io = false;
+	uint32_t poll_us = 1000;
+} capture_config_t;
+
+/**
+ * @details
+ * Snapshot of captureWriter counters
+ * @param frames	Frames accepted from the capture thread
+ * @param written	Frames written to disk
+ * @param dropped	Frames dropped because the writer fell behind or no file could be opened
+ * @param truncated	Frames longer than CAPTURE_FRAME_MAX
+ * @param bytes		Bytes handed to the file (before compression)
+ * @param files		Files opened (1 + rotations)
+ * @param errors	Failed open/write calls
+*/
+typedef struct{
+	uint64_t frames;
+	uint64_t written;
+	uint64_t dropped;
+	uint64_t truncated;
+	uint64_t bytes;
+	uint64_t files;
+	uint64_t errors;
+} capture_stats_t;
+
+/**
+ * @details
+ * Fixed-size frame passed from capture thread to writer thread
+*/
+typedef struct{
+	uint64_t timestamp;
+	uint32_t orig_length;
+	uint16_t length;
+	uint8_t direction;
+	uint8_t data[CAPTURE_FRAME_MAX];
+} capture_frame_t;
+
+class captureWriter{
+public:
+	/**
+	 * @brief
+	 * Starts the writer thread; frames are accepted immediately
+	*/
+	explicit captureWriter(const capture_config_t& config);
+
+	/**
+	 * @brief
+	 * Flushes everything queued, closes the file and joins the thread
+	*/
+	~captureWriter();
+
+	captureWriter(const captureWriter&) = delete;
+	captureWriter& operator=(const captureWriter&) = delete;
+
+	/**
+	 * @brief
+	 * Queues a frame for writing; never blocks on disk I/O
+	 * Returns false if the frame was dropped (writer behind)
+	*/
+	bool write(const hci_packet_t& pkt);
+
+	/**
+	 * @brief
+	 * Stops the writer thread after draining the queue (idempotent)
+	*/
+	void stop();
+
+	capture_stats_t stats() const;
+
+private:
+	void run();
+	bool open_next();
+	bool ensure_open();
+	void close_current();
+	void append(const capture_frame_t& frame);
+	void flush(bool final);
+	void write_out(const uint8_t *data, size_t len);
+
+	capture_config_t config;
+	spscRing<capture_frame_t> ring;
+	std::atomic<bool> running;
+	std::thread writer;
+
+	/* Writer thread state */
+	int fd;
+	void *gz;
+	uint8_t *buffer;
+	size_t buffered;
+	uint64_t file_bytes;
+	uint64_t file_opened;
+	uint32_t file_index;
+	uint64_t open_failed;
+
+	std::atomic<uint64_t> n_frames;
+	std::atomic<uint64_t> n_written;
+	std::atomic<uint64_t> n_unwritable;
+	std::atomic<uint64_t> n_truncated;
+	std::atomic<uint64_t> n_bytes;
+	std::atomic<uint64_t> n_files;
+	std::atomic<uint64_t> n_errors;
+};
+
+#endif
@@ -0,0 +1,283 @@
+/**
+ * Implementation of the per-device aggregation table
+ * @author Owen Capell
+*/
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "device_table.hpp"
+#include "ad_parser.hpp"
+
+/* update() result for reports that are folded into the entry silently */
+#define DEVICE_SUPPRESS 0xFF
+
+/* Keep probe sequences short: stop inserting at 3/4 occupancy */
+#define DEVICE_TABLE_LOAD_NUM 3
+#define DEVICE_TABLE_LOAD_DEN 4
+
+/* Extended event_type bit set on scan responses (they hash separately) */
+#define EAR_EVT_SCAN_RESPONSE 0x0008
+
+static uint64_t fnv1a(const uint8_t *data, size_t len){
+	uint64_t h = 0xcbf29ce484222325ull;
+	for(size_t i=0; i<len; i++){
+		h ^= data[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+deviceTable::deviceTable(const device_table_config_t& config) :
+	config(config), slots(), mask(0), count(0), limit(0), next_sweep(0),
+	n_reports(0), n_emitted(0), n_new(0), n_changed(0),
+	n_summaries(0), n_evicted(0), n_overflow(0), n_devices(0)
+{
+	/**
+	 * Constructor for deviceTable
+	 * Allocates every slot up front; the footprint never changes
+	*/
+
+	size_t cap = 16;
+	while(cap < config.capacity) cap <<= 1;
+	slots.assign(cap, device_entry_t{});
+	mask = cap - 1;
+	limit = cap * DEVICE_TABLE_LOAD_NUM / DEVICE_TABLE_LOAD_DEN;
+}
+
+uint64_t deviceTable::key_of(const bt_dev_addr_t& address, uint8_t address_type){
+	/* 48-bit address, 8-bit type, plus a marker bit so no key is ever 0 */
+	uint64_t key = 0;
+	memcpy(&key, address.address, sizeof(address.address));
+	return key | ((uint64_t)address_type << 48) | (1ull << 56);
+}
+
+size_t deviceTable::home_of(uint64_t key) const{
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+}
+
+device_entry_t* deviceTable::lookup(uint64_t key, bool& created, uint64_t now){
+	/**
+	 * Finds the entry for key, inserting it if there is room
+	 *
+	 * @param key	Packed address and type
+	 * @param created	Set to true if the entry was inserted
+	 * @param now	Timestamp used to age out entries when full
+	 * @returns entry, or nullptr if the table is full
+	*/
+
+	created = false;
+	size_t i = home_of(key);
+	for(; slots[i].key != 0; i = (i + 1) & mask){
+		if(slots[i].key == key) return &slots[i];
+	}
+
+	if(count >= limit){
+		if(sweep(now) == 0) return nullptr;
+		/* Backward shifts may have moved the free slot; probe again */
+		for(i = home_of(key); slots[i].key != 0; i = (i + 1) & mask);
+	}
+
+	device_entry_t& e = slots[i];
+	e = device_entry_t{};
+	e.key = key;
+	count++;
+	created = true;
+	return &e;
+}
+
+void deviceTable::erase(size_t slot){
+	/**
+	 * Removes slot with backward-shift deletion: later members of the
+	 * probe run are moved up so lookups never need tombstones
+	 *
+	 * @param slot	Index of the entry to remove
+	*/
+
+	size_t i = slot;
+	size_t j = slot;
+	while(true){
+		j = (j + 1) & mask;
+		if(slots[j].key == 0) break;
+		size_t k = home_of(slots[j].key);
+		/* Entry at j may stay if its home lies cyclically in (i, j] */
+		bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if(stays) continue;
+		slots[i] = slots[j];
+		i = j;
+	}
+	slots[i].key = 0;
+	count--;
+}
+
+size_t deviceTable::sweep(uint64_t now){
+	/**
+	 * Aging sweep over the whole table
+	 *
+	 * @param now	Current time in the timestamp clock (CLOCK_REALTIME ns)
+	 * @returns number of devices evicted
+	*/
+
+	if(now < config.max_age_ns) return 0;
+	uint64_t cutoff = now - config.max_age_ns;
+	size_t evicted = 0;
+
+	for(size_t i=0; i<slots.size(); ){
+		if(slots[i].key != 0 && slots[i].last_seen < cutoff){
+			erase(i);
+			evicted++;
+			/* Slot i now holds a shifted entry (or is empty); re-check it */
+			continue;
+		}
+		i++;
+	}
+
+	n_evicted.store(n_evicted.load(std::memory_order_relaxed) + evicted, std::memory_order_relaxed);
+	n_devices.store(count, std::memory_order_relaxed);
+	return evicted;
+}
+
+uint8_t deviceTable::update(device_entry_t& entry, bool created, const adv_event_t& evt){
+	/**
+	 * Folds one report into its entry and decides whether to emit it
+	 *
+	 * @param entry	Device entry
+	 * @param created	True if the entry was just inserted
+	 * @param evt	Report
+	 * @returns ADV_AGG_NEW, ADV_AGG_CHANGED, ADV_AGG_SUMMARY or DEVICE_SUPPRESS
+	*/
+
+	uint8_t reason = DEVICE_SUPPRESS;
+
+	if(created){
+		entry.first_seen = evt.timestamp;
+		entry.rssi_ema = evt.rssi;
+		entry.rssi_min = evt.rssi;
+		entry.rssi_max = evt.rssi;
+		reason = ADV_AGG_NEW;
+	}
+	else{
+		entry.rssi_ema += config.ema_alpha * ((float)evt.rssi - entry.rssi_ema);
+		if(entry.pending == 0 || evt.rssi < entry.rssi_min) entry.rssi_min = evt.rssi;
+		if(entry.pending == 0 || evt.rssi > entry.rssi_max) entry.rssi_max = evt.rssi;
+	}
+	entry.last_seen = evt.timestamp;
+	entry.count++;
+	entry.pending++;
+
+	/* Fragments of a chain are folded in; only complete payloads are compared */
+	if(evt.data_status == ADV_DATA_COMPLETE){
+		uint64_t h = fnv1a(evt.data, evt.data_length);
+		uint64_t& slot_hash = entry.payload_hash[(evt.event & EAR_EVT_SCAN_RESPONSE) ? 1 : 0];
+		if(slot_hash != h){
+			if(reason == DEVICE_SUPPRESS && slot_hash != 0) reason = ADV_AGG_CHANGED;
+			slot_hash = h;
+
+			std::string_view name = ad_name(ad_range(evt));
+			if(!name.empty()){
+				entry.name_length = (uint8_t)(name.size() < DEVICE_NAME_MAX ? name.size() : DEVICE_NAME_MAX);
+				memcpy(entry.name, name.data(), entry.name_length);
+			}
+		}
+	}
+
+	if(reason == DEVICE_SUPPRESS && config.summary_interval_ns != 0 &&
+		evt.timestamp - entry.last_emit >= config.summary_interval_ns){
+		reason = ADV_AGG_SUMMARY;
+	}
+
+	return reason;
+}
+
+size_t deviceTable::coalesce(adv_event_t *records, size_t count_in){
+	/**
+	 * Deduplicates a batch of records in place
+	 *
+	 * @param records	Records from parse_hci_packet()
+	 * @param count_in	Number of records
+	 * @returns number of records kept at the front of records
+	*/
+
+	size_t kept = 0;
+	uint64_t n_new_local = 0, n_changed_local = 0, n_summary_local = 0, n_overflow_local = 0;
+
+	for(size_t i=0; i<count_in; i++){
+		adv_event_t& evt = records[i];
+
+		if(evt.subevent == SUBEVT_HCI_LE_PERIODIC_ADVERTISING_REPORT){
+			if(kept != i) records[kept] = evt;
+			kept++;
+			continue;
+		}
+
+		if(evt.timestamp >= next_sweep){
+			sweep(evt.timestamp);
+			next_sweep = evt.timestamp + (config.max_age_ns / 4 > 0 ? config.max_age_ns / 4 : 1);
+		}
+
+		bool created;
+		device_entry_t *entry = lookup(key_of(evt.address, evt.address_type), created, evt.timestamp);
+		if(entry == nullptr){
+			n_overflow_local++;
+			if(kept != i) records[kept] = evt;
+			kept++;
+			continue;
+		}
+
+		uint8_t reason = update(*entry, created, evt);
+		if(reason == DEVICE_SUPPRESS) continue;
+
+		switch(reason){
+			case ADV_AGG_NEW: n_new_local++; break;
+			case ADV_AGG_CHANGED: n_changed_local++; break;
+			default: n_summary_local++; break;
+		}
+
+		evt.aggregate = reason;
+		evt.report_count = entry->pending;
+		evt.rssi_min = entry->rssi_min;
+		evt.rssi_max = entry->rssi_max;
+		entry->last_emit = evt.timestamp;
+		entry->pending = 0;
+
+		if(kept != i) records[kept] = evt;
+		kept++;
+	}
+
+	n_reports.store(n_reports.load(std::memory_order_relaxed) + count_in, std::memory_order_relaxed);
+	n_emitted.store(n_emitted.load(std::memory_order_relaxed) + kept, std::memory_order_relaxed);
+	n_new.store(n_new.load(std::memory_order_relaxed) + n_new_local, std::memory_order_relaxed);
+	n_changed.store(n_changed.load(std::memory_order_relaxed) + n_changed_local, std::memory_order_relaxed);
+	n_summaries.store(n_summaries.load(std::memory_order_relaxed) + n_summary_local, std::memory_order_relaxed);
+	n_overflow.store(n_overflow.load(std::memory_order_relaxed) + n_overflow_local, std::memory_order_relaxed);
+	n_devices.store(count, std::memory_order_relaxed);
+	return kept;
+}
+
+const device_entry_t* deviceTable::find(const bt_dev_addr_t& address, uint8_t address_type) const{
+	uint64_t key = key_of(address, address_type);
+	for(size_t i = home_of(key); slots[i].key != 0; i = (i + 1) & mask){
+		if(slots[i].key == key) return &slots[i];
+	}
+	return nullptr;
+}
+
+size_t deviceTable::size() const{
+	return count;
+}
+
+size_t deviceTable::capacity() const{
+	return slots.size();
+}
+
+device_table_stats_t deviceTable::stats() const{
+	device_table_stats_t s;
+	s.reports = n_reports.load(std::memory_order_relaxed);
+	s.emitted = n_emitted.load(std::memory_order_relaxed);
+	s.new_devices = n_new.load(std::memory_order_relaxed);
+	s.changed = n_changed.load(std::memory_order_relaxed);
+	s.summaries = n_summaries.load(std::memory_order_relaxed);
+	s.evicted = n_evicted.load(std::memory_order_relaxed);
+	s.overflow = n_overflow.load(std::memory_order_relaxed);
+	s.devices = n_devices.load(std::memory_order_relaxed);
+	return s;
+}
@@ -0,0 +1,163 @@
+/**
+ * Header for the per-device aggregation table (deduplication and report coalescing)
+ * @author Owen Capell
+*/
+#ifndef DEVICE_TABLE
+#define DEVICE_TABLE
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+
+/* Longest device name kept per entry (longer names are truncated) */
+#define DEVICE_NAME_MAX 32
+
+/**
+ * @details
+ * Configuration for deviceTable
+ * @param capacity	Maximum tracked devices (rounded up to a power of two)
+ * @param summary_interval_ns	Emit a summary for a device at most this often (0 = never)
+ * @param max_age_ns	Evict devices not heard from for this long
+ * @param ema_alpha	Weight of the newest RSSI sample in the moving average
+*/
+typedef struct{
+	size_t capacity = 4096;
+	uint64_t summary_interval_ns = 1000000000ull;
+	uint64_t max_age_ns = 30000000000ull;
+	float ema_alpha = 0.125f;
+} device_table_config_t;
+
+/**
+ * @details
+ * State kept per device
+ * @param key	Address and address type packed by deviceTable::key_of (0 = empty slot)
+ * @param first_seen	Timestamp of the first report
+ * @param last_seen	Timestamp of the latest report
+ * @param last_emit	Timestamp of the latest record emitted for the device
+ * @param count	Reports seen in total
+ * @param pending	Reports coalesced since the latest emitted record
+ * @param payload_hash	FNV-1a hash of the latest complete AD payload
+ * 					([0] advertising data, [1] scan response data)
+ * @param rssi_ema	Exponential moving average of RSSI
+ * @param rssi_min	Lowest RSSI since the latest emitted record
+ * @param rssi_max	Highest RSSI since the latest emitted record
+ * @param name_length	Octets of name in use
+ * @param name	Latest advertised (shortened or complete) name
+*/
+typedef struct{
+	uint64_t key;
+	uint64_t first_seen;
+	uint64_t last_seen;
+	uint64_t last_emit;
+	uint64_t count;
+	uint32_t pending;
+	uint64_t payload_hash[2];
+	float rssi_ema;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	uint8_t name_length;
+	char name[DEVICE_NAME_MAX];
+} device_entry_t;
+
+/**
+ * @details
+ * Snapshot of deviceTable counters
+ * @param reports	Records offered to coalesce()
+ * @param emitted	Records kept (new, changed, summary or untracked)
+ * @param new_devices	Devices added to the table
+ * @param changed	Records emitted because the payload changed
+ * @param summaries	Periodic summary records emitted
+ * @param evicted	Devices removed by the aging sweep
+ * @param overflow	Reports passed through untracked because the table was full
+ * @param devices	Devices currently tracked
+*/
+typedef struct{
+	uint64_t reports;
+	uint64_t emitted;
+	uint64_t new_devices;
+	uint64_t changed;
+	uint64_t summaries;
+	uint64_t evicted;
+	uint64_t overflow;
+	uint64_t devices;
+} device_table_stats_t;
+
+/**
+ * @details
+ * Fixed-size open-addressing (linear probing) table keyed by the 48-bit
+ * address plus address type. All memory is allocated up front; eviction
+ * uses backward-shift deletion so there are no tombstones. Owned by the
+ * capture thread; stats() may be read from any thread.
+*/
+class deviceTable{
+public:
+	explicit deviceTable(const device_table_config_t& config = device_table_config_t{});
+
+	deviceTable(const deviceTable&) = delete;
+	deviceTable& operator=(const deviceTable&) = delete;
+
+	/**
+	 * @brief
+	 * Updates the table with records and compacts them in place so only
+	 * new-device, changed-payload or summary records remain (aggregate,
+	 * report_count and rssi_min/max are filled in). Periodic reports,
+	 * which carry no address, pass through untouched.
+	 * Returns the number of records kept
+	*/
+	size_t coalesce(adv_event_t *records, size_t count_in);
+
+	/**
+	 * @brief
+	 * Evicts devices last seen before now - max_age_ns
+	 * Returns the number of devices evicted
+	*/
+	size_t sweep(uint64_t now);
+
+	/**
+	 * @brief
+	 * Entry for address/type, nullptr if not tracked
+	*/
+	const device_entry_t* find(const bt_dev_addr_t& address, uint8_t address_type) const;
+
+	/**
+	 * @brief
+	 * Calls fn(const device_entry_t&) for every tracked device
+	*/
+	template<typename F>
+	void for_each(F fn) const{
+		for(const device_entry_t& e : slots){
+			if(e.key != 0) fn(e);
+		}
+	}
+
+	size_t size() const;
+	size_t capacity() const;
+	device_table_stats_t stats() const;
+
+private:
+	static uint64_t key_of(const bt_dev_addr_t& address, uint8_t address_type);
+	size_t home_of(uint64_t key) const;
+	device_entry_t* lookup(uint64_t key, bool& created, uint64_t now);
+	void erase(size_t slot);
+	uint8_t update(device_entry_t& entry, bool created, const adv_event_t& evt);
+
+	device_table_config_t config;
+	std::vector<device_entry_t> slots;
+	size_t mask;
+	size_t count;
+	size_t limit;
+	uint64_t next_sweep;
+
+	std::atomic<uint64_t> n_reports;
+	std::atomic<uint64_t> n_emitted;
+	std::atomic<uint64_t> n_new;
+	std::atomic<uint64_t> n_changed;
+	std::atomic<uint64_t> n_summaries;
+	std::atomic<uint64_t> n_evicted;
+	std::atomic<uint64_t> n_overflow;
+	std::atomic<uint64_t> n_devices;
+};
+
+#endif
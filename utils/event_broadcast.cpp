@@ -0,0 +1,131 @@
+/**
+ * Implementation of the multi-subscriber advertising record broadcast
+ * @author Owen Capell
+*/
+
+#include "bluetoothdef.hpp"
+#include "event_broadcast.hpp"
+#include "broadcast_ring.hpp"
+#include "adv_filter.hpp"
+#include "utils.hpp"
+#include "metrics.hpp"
+
+eventBroadcast::eventBroadcast(size_t capacity, size_t max_subscribers) :
+	ring(capacity, max_subscribers)
+{
+	/**
+	 * Constructor for eventBroadcast
+	 *
+	 * @param capacity	Minimum number of records held (rounded to power of two)
+	 * @param max_subscribers	Subscriptions that may be open at once
+	*/
+
+}
+
+int eventBroadcast::subscribe(broadcastPolicy policy, const advFilter *filter){
+	/**
+	 * Opens a subscription. The filter sees the same fields the capture
+	 * filter does, so one advFilter can serve either side
+	 *
+	 * @param policy	gating (capture waits) or lossy (lag is counted)
+	 * @param filter	Compiled filter, nullptr to receive every record
+	 * @returns subscriber id, -1 if none is free
+	*/
+
+	if(filter == nullptr) return ring.subscribe(policy);
+	return ring.subscribe(policy, [filter](const adv_event_t& evt){
+		adv_report_view_t view = {&evt.address, evt.address_type, evt.event, evt.rssi,
+			evt.data, evt.data_length};
+		return filter->matches(view);
+	});
+}
+
+void eventBroadcast::unsubscribe(int id){
+	ring.unsubscribe(id);
+}
+
+void eventBroadcast::push(const adv_event_t& evt){
+	/**
+	 * Writes evt into the next slot in place, stamping its enqueue time
+	 * May wait for a gating subscriber, never for a lossy one
+	 *
+	 * @param evt	Record to publish
+	*/
+
+	adv_event_t *slot = ring.claim();
+	*slot = evt;
+	slot->enqueue_time = realtime_ns();
+	ring.publish();
+}
+
+void eventBroadcast::push_batch(const adv_event_t *evts, size_t count){
+	/**
+	 * Publishes count records with one clock read and one wake-up
+	 *
+	 * @param evts	Records to publish
+	 * @param count	Number of records
+	*/
+
+	if(count == 0) return;
+	uint64_t now = realtime_ns();
+	for(size_t i=0; i<count; i++){
+		adv_event_t *slot = ring.claim();
+		*slot = evts[i];
+		slot->enqueue_time = now;
+		ring.publish(false);
+	}
+	ring.notify();
+}
+
+const adv_event_t* eventBroadcast::peek(int id){
+	return ring.peek(id);
+}
+
+bool eventBroadcast::release(int id){
+	return ring.release(id);
+}
+
+const adv_event_t* eventBroadcast::wait(int id){
+	return ring.wait(id);
+}
+
+bool eventBroadcast::try_read(int id, adv_event_t& evt){
+	return ring.try_read(id, evt);
+}
+
+void eventBroadcast::close(){
+	ring.close();
+}
+
+uint64_t eventBroadcast::published() const{
+	return ring.published();
+}
+
+broadcast_subscriber_t eventBroadcast::subscriber_stats(int id) const{
+	return ring.subscriber_stats(id);
+}
+
+void eventBroadcast::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics; nothing is added to the publish/read paths
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the broadcast
+	*/
+
+	registry.counter_fn("bt_sniff_broadcast_published_total", "Records published to the broadcast ring", labels,
+		[this](){ return ring.published(); });
+	registry.counter_fn("bt_sniff_broadcast_producer_stalls_total", "Times capture waited for a gating subscriber", labels,
+		[this](){ return ring.producer_stalls(); });
+
+	for(size_t i=0; i<ring.max_subscribers(); i++){
+		int id = (int)i;
+		std::string sub = (labels.empty() ? "" : labels + ",") + "subscriber=\"" + std::to_string(i) + "\"";
+		registry.gauge_fn("bt_sniff_broadcast_backlog", "Records a subscriber has not read yet", sub,
+			[this, id](){ return (double)ring.subscriber_stats(id).backlog; });
+		registry.counter_fn("bt_sniff_broadcast_lag_total", "Records a lossy subscriber missed", sub,
+			[this, id](){ return ring.subscriber_stats(id).lag; });
+		registry.counter_fn("bt_sniff_broadcast_filtered_total", "Records skipped by a subscriber's filter", sub,
+			[this, id](){ return ring.subscriber_stats(id).filtered; });
+	}
+}
@@ -0,0 +1,103 @@
+/**
+ * Header for the multi-subscriber advertising record broadcast
+ * @author Owen Capell
+*/
+#ifndef EVENT_BROADCAST
+#define EVENT_BROADCAST
+
+#include <cstdint>
+#include <string>
+
+#include "bluetoothdef.hpp"
+#include "broadcast_ring.hpp"
+#include "adv_filter.hpp"
+#include "metrics.hpp"
+
+/* Default number of records the broadcast ring holds */
+#define EVENT_BROADCAST_DEFAULT_CAPACITY 4096
+
+/**
+ * @details
+ * One capture shared by several consumers (e.g. analytics, logging and
+ * alerting). The capture thread writes every record once; each
+ * subscriber reads it in place through its own cursor, optionally
+ * through its own advFilter, and is either gating (capture waits for it)
+ * or lossy (it skips what it missed and the lag is counted).
+ * Each subscriber id must be used from a single thread.
+*/
+class eventBroadcast{
+public:
+	explicit eventBroadcast(
+		size_t capacity = EVENT_BROADCAST_DEFAULT_CAPACITY,
+		size_t max_subscribers = BROADCAST_DEFAULT_SUBSCRIBERS);
+
+	/**
+	 * @brief
+	 * Opens a subscription starting at the next record; filter (not owned,
+	 * nullptr = everything) is evaluated on the subscriber's thread
+	 * Returns the subscriber id, -1 if every slot is taken
+	*/
+	int subscribe(broadcastPolicy policy = broadcastPolicy::lossy, const advFilter *filter = nullptr);
+
+	void unsubscribe(int id);
+
+	/**
+	 * @brief
+	 * Publishes a record (capture thread), stamping its enqueue time
+	*/
+	void push(const adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Publishes count records with a single subscriber wake-up
+	*/
+	void push_batch(const adv_event_t *evts, size_t count);
+
+	/**
+	 * @brief
+	 * Next record for subscriber id, read in place (nullptr if none)
+	 * Call release() when done with it
+	*/
+	const adv_event_t* peek(int id);
+
+	/**
+	 * @brief
+	 * Advances past the record returned by peek()/wait()
+	 * Returns false if a lossy subscriber's record was overwritten meanwhile
+	*/
+	bool release(int id);
+
+	/**
+	 * @brief
+	 * Blocking peek(); returns nullptr after close() once caught up
+	*/
+	const adv_event_t* wait(int id);
+
+	/**
+	 * @brief
+	 * Copies the next intact record into evt; false if none
+	*/
+	bool try_read(int id, adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Wakes every blocked wait() for shutdown
+	*/
+	void close();
+
+	uint64_t published() const;
+
+	broadcast_subscriber_t subscriber_stats(int id) const;
+
+	/**
+	 * @brief
+	 * Exposes published records, producer stalls and per-subscriber backlog,
+	 * lag and filter counts (subscriber="<id>") for every subscriber slot
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	broadcastRing<adv_event_t> ring;
+};
+
+#endif
@@ -0,0 +1,240 @@
+/**
+ * Implementation of the epoll-based event loop
+ * @author Owen Capell
+*/
+#include <iostream>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.hpp"
+
+/* epoll_data carries fd and generation so stale events are recognised */
+static uint64_t pack_key(int fd, uint32_t generation){
+	return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+eventLoop::eventLoop() :
+	epoll_fd(-1), wake_fd(-1), next_generation(1), registrations(),
+	posted_mutex(), posted(), stop_requested(false)
+{
+	/**
+	 * Constructor for eventLoop
+	 * Creates the epoll instance and the eventfd used for wakeups
+	*/
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0){
+		std::cerr << "Error creating epoll instance" << std::endl << errno << std::endl;
+		return;
+	}
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wake_fd < 0){
+		std::cerr << "Error creating eventfd" << std::endl << errno << std::endl;
+		return;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = pack_key(wake_fd, 0);
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0){
+		std::cerr << "Error registering eventfd" << std::endl << errno << std::endl;
+	}
+}
+
+eventLoop::~eventLoop(){
+	/**
+	 * Destructor for eventLoop
+	 * Closes owned fds (timers, eventfd, epoll); registered sockets are not closed
+	*/
+
+	for(auto& r : registrations){
+		if(r.second.timer) close(r.first);
+	}
+	if(wake_fd >= 0) close(wake_fd);
+	if(epoll_fd >= 0) close(epoll_fd);
+}
+
+bool eventLoop::is_open() const{
+	return epoll_fd >= 0 && wake_fd >= 0;
+}
+
+int eventLoop::register_fd(int fd, uint32_t events, bool timer, fd_callback_t callback){
+	registration_t r;
+	r.fd = fd;
+	r.generation = next_generation++;
+	r.timer = timer;
+	r.callback = std::make_shared<fd_callback_t>(std::move(callback));
+
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.u64 = pack_key(fd, r.generation);
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+	registrations[fd] = std::move(r);
+	return 0;
+}
+
+int eventLoop::add_fd(int fd, uint32_t events, fd_callback_t callback){
+	/**
+	 * Registers a caller-owned fd
+	 *
+	 * @param fd	File descriptor (socket, pipe, ...)
+	 * @param events	epoll event mask
+	 * @param callback	Called with the ready events
+	 * @returns 0 on success, -1 on failure
+	*/
+
+	return register_fd(fd, events, false, std::move(callback));
+}
+
+int eventLoop::remove_fd(int fd){
+	auto it = registrations.find(fd);
+	if(it == registrations.end()) return -1;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	if(it->second.timer) close(fd);
+	registrations.erase(it);
+	return 0;
+}
+
+int eventLoop::add_timer(uint64_t delay_ns, uint64_t interval_ns, loop_callback_t callback){
+	/**
+	 * Creates a CLOCK_MONOTONIC timerfd and registers it
+	 *
+	 * @param delay_ns	Time to the first expiry (0 is treated as 1 ns)
+	 * @param interval_ns	Period after the first expiry, 0 for one-shot
+	 * @param callback	Called once per dispatch, however many expiries passed
+	 * @returns timer id, -1 on failure
+	*/
+
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(tfd < 0) return -1;
+
+	if(delay_ns == 0) delay_ns = 1;
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = (time_t)(delay_ns / 1000000000ull);
+	spec.it_value.tv_nsec = (long)(delay_ns % 1000000000ull);
+	spec.it_interval.tv_sec = (time_t)(interval_ns / 1000000000ull);
+	spec.it_interval.tv_nsec = (long)(interval_ns % 1000000000ull);
+	if(timerfd_settime(tfd, 0, &spec, NULL) < 0){
+		close(tfd);
+		return -1;
+	}
+
+	bool one_shot = interval_ns == 0;
+	auto fire = [this, tfd, one_shot, callback = std::move(callback)](uint32_t){
+		uint64_t expirations;
+		if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+		if(one_shot) remove_fd(tfd);
+		callback();
+	};
+
+	if(register_fd(tfd, EPOLLIN, true, std::move(fire)) < 0){
+		close(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+int eventLoop::cancel_timer(int id){
+	auto it = registrations.find(id);
+	if(it == registrations.end() || !it->second.timer) return -1;
+	return remove_fd(id);
+}
+
+void eventLoop::wake(){
+	uint64_t one = 1;
+	ssize_t r = write(wake_fd, &one, sizeof(one));
+	(void)r;
+}
+
+void eventLoop::post(loop_callback_t callback){
+	/**
+	 * Queues work for the loop thread and wakes it
+	 *
+	 * @param callback	Work to run on the loop thread
+	*/
+
+	{
+		std::lock_guard<std::mutex> lock(posted_mutex);
+		posted.push_back(std::move(callback));
+	}
+	wake();
+}
+
+void eventLoop::stop(){
+	stop_requested.store(true, std::memory_order_release);
+	wake();
+}
+
+void eventLoop::run_posted(){
+	std::vector<loop_callback_t> work;
+	{
+		std::lock_guard<std::mutex> lock(posted_mutex);
+		work.swap(posted);
+	}
+	for(loop_callback_t& cb : work) cb();
+}
+
+int eventLoop::run_once(int timeout_ms){
+	/**
+	 * One epoll_wait() and dispatch round
+	 *
+	 * @param timeout_ms	Maximum wait, -1 blocks until an event
+	 * @returns number of events dispatched, -1 on failure
+	*/
+
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int n = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+	if(n < 0){
+		if(errno == EINTR) return 0;
+		return -1;
+	}
+
+	for(int i=0; i<n; i++){
+		int fd = (int)(uint32_t)events[i].data.u64;
+		uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+
+		if(fd == wake_fd && generation == 0){
+			uint64_t count;
+			ssize_t r = read(wake_fd, &count, sizeof(count));
+			(void)r;
+			run_posted();
+			continue;
+		}
+
+		/* Skip events for registrations removed earlier in this round */
+		auto it = registrations.find(fd);
+		if(it == registrations.end() || it->second.generation != generation) continue;
+
+		std::shared_ptr<fd_callback_t> callback = it->second.callback;
+		(*callback)(events[i].events);
+	}
+
+	return n;
+}
+
+int eventLoop::run(){
+	/**
+	 * Dispatches until stop()
+	 *
+	 * @returns 0 after stop(), -1 on epoll failure
+	*/
+
+	int status = 0;
+	while(!stop_requested.load(std::memory_order_acquire)){
+		if(run_once(-1) < 0){
+			status = -1;
+			break;
+		}
+	}
+
+	/* Work posted together with stop() still runs */
+	run_posted();
+	stop_requested.store(false, std::memory_order_relaxed);
+	return status;
+}
@@ -0,0 +1,127 @@
+/**
+ * Header for the epoll-based event loop (sockets, timers, cross-thread wakeups)
+ * @author Owen Capell
+*/
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/* epoll_event slots fetched per epoll_wait() */
+#define EVENT_LOOP_MAX_EVENTS 32
+
+/**
+ * @details
+ * Callback for a readiness event on a registered fd (EPOLLIN, ...)
+*/
+typedef std::function<void(uint32_t events)> fd_callback_t;
+
+/**
+ * @details
+ * Callback for timers and posted work
+*/
+typedef std::function<void()> loop_callback_t;
+
+/**
+ * @details
+ * Level-triggered epoll loop. Timers are timerfds registered like any
+ * other fd; an eventfd carries stop() and post() from other threads.
+ * Everything except stop() and post() must be called on the loop thread
+ * (or before run()). Callbacks may add or remove registrations, including
+ * their own.
+*/
+class eventLoop{
+public:
+	eventLoop();
+	~eventLoop();
+
+	eventLoop(const eventLoop&) = delete;
+	eventLoop& operator=(const eventLoop&) = delete;
+
+	/**
+	 * @brief
+	 * True if the epoll and wake fds were created
+	*/
+	bool is_open() const;
+
+	/**
+	 * @brief
+	 * Registers fd for events (EPOLLIN, EPOLLOUT, ...); fd is not owned
+	 * Returns 0 on success, -1 on failure
+	*/
+	int add_fd(int fd, uint32_t events, fd_callback_t callback);
+
+	/**
+	 * @brief
+	 * Unregisters fd. Returns 0 on success, -1 if fd was not registered
+	*/
+	int remove_fd(int fd);
+
+	/**
+	 * @brief
+	 * Fires callback after delay_ns, then every interval_ns (0 = once)
+	 * Returns a timer id for cancel_timer(), -1 on failure
+	*/
+	int add_timer(uint64_t delay_ns, uint64_t interval_ns, loop_callback_t callback);
+
+	/**
+	 * @brief
+	 * Cancels a timer (one-shot timers cancel themselves after firing)
+	*/
+	int cancel_timer(int id);
+
+	/**
+	 * @brief
+	 * Runs callback on the loop thread (thread-safe)
+	*/
+	void post(loop_callback_t callback);
+
+	/**
+	 * @brief
+	 * Makes run() return after the current dispatch round (thread-safe)
+	 * A stop requested before run() makes the next run() return at once
+	*/
+	void stop();
+
+	/**
+	 * @brief
+	 * Dispatches events until stop(). Returns 0, or -1 on epoll failure
+	*/
+	int run();
+
+	/**
+	 * @brief
+	 * Waits up to timeout_ms (-1 = forever) and dispatches one round
+	 * Returns the number of events dispatched, -1 on failure
+	*/
+	int run_once(int timeout_ms);
+
+private:
+	typedef struct{
+		int fd;
+		uint32_t generation;
+		bool timer;
+		std::shared_ptr<fd_callback_t> callback;
+	} registration_t;
+
+	int register_fd(int fd, uint32_t events, bool timer, fd_callback_t callback);
+	void wake();
+	void run_posted();
+
+	int epoll_fd;
+	int wake_fd;
+	uint32_t next_generation;
+	std::unordered_map<int, registration_t> registrations;
+
+	std::mutex posted_mutex;
+	std::vector<loop_callback_t> posted;
+	std::atomic<bool> stop_requested;
+};
+
+#endif
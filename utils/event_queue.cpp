@@ -1,17 +1,17 @@
 /**
- * Implementation of unbounded single-producer/single-consumer queue
+ * Implementation of bounded single-producer/single-consumer queue
  * @author Owen Capell
 */
 
-#include <queue>
-#include <memory>
-#include <mutex>
-
 #include "bluetoothdef.hpp"
 #include "event_queue.hpp"
+#include "spsc_ring.hpp"
+#include "latency_histogram.hpp"
+#include "utils.hpp"
+#include "metrics.hpp"
 
 eventQueue::eventQueue() : 
-	lock(), cv(), queue()	
+	ring(EVENT_QUEUE_DEFAULT_CAPACITY, overflowPolicy::drop_newest), k2e(), e2d()
 {
 	/**
 	 * Default constructor for eventQueue
@@ -20,33 +20,165 @@ eventQueue::eventQueue() :
 
 }
 
-void eventQueue::push(std::shared_ptr<processed_adv_event> p){
+eventQueue::eventQueue(size_t capacity, overflowPolicy policy) :
+	ring(capacity, policy), k2e(), e2d()
+{
+	/**
+	 * Constructor for eventQueue with explicit bound and overflow policy
+	 *
+	 * @param capacity	Minimum number of events held (rounded to power of two)
+	 * @param policy	drop_newest, drop_oldest or block when full
+	*/
+
+}
+
+bool eventQueue::push(const adv_event_t& evt){
+	/**
+	 * Copies record evt into the queue, stamping its enqueue time
+	 * Never takes a lock or allocates; only wakes the consumer if it is asleep
+	 * 
+	 * @param evt	Record to enqueue
+	 * @returns true if enqueued, false if dropped (drop_newest)
+	*/
+
+	adv_event_t *slot = ring.claim();
+	if(slot == nullptr) return false;
+
+	uint64_t now = realtime_ns();
+	if(evt.timestamp != 0 && now > evt.timestamp) k2e.record(now - evt.timestamp);
+	*slot = evt;
+	slot->enqueue_time = now;
+	ring.publish();
+	return true;
+}
+
+size_t eventQueue::push_batch(adv_event_t *evts, size_t count){
 	/**
-	 * Enqueues pointer p to queue
+	 * Copies count records into the queue, waking the consumer once
+	 * All records share one enqueue timestamp (one clock read per batch)
 	 * 
-	 * @param p	Pointer to enqueue
+	 * @param evts	Array of records to enqueue
+	 * @param count	Number of records in evts
+	 * @returns number of records accepted
 	*/
 
-	lock.lock();
-	queue.push(p); 
-	lock.unlock();
+	uint64_t now = realtime_ns();
+	for(size_t i=0; i<count; i++){
+		evts[i].enqueue_time = now;
+		if(evts[i].timestamp != 0 && now > evts[i].timestamp) k2e.record(now - evts[i].timestamp);
+	}
 
-	cv.notify_one();
+	return ring.push_batch(evts, count);
 }
 
-std::shared_ptr<processed_adv_event> eventQueue::pop(){
+adv_event_t eventQueue::pop(){
 	/**
-	 * Dequeus front-most pointer from queue
+	 * Dequeus front-most record from queue
 	 * 
-	 * @returns std::shared_ptr<processed_adv_event> at front of queue
+	 * @returns adv_event_t at front of queue
 	*/
 
-	std::unique_lock<std::mutex> lockGuard(lock);
-	cv.wait(lockGuard, [this]{ return !queue.empty(); });
+	adv_event_t evt = ring.pop();
+	record_dequeue(evt);
+	return evt;
+}
+
+adv_event_t eventQueue::pop_spin(){
+	/**
+	 * Dequeus front-most record from queue without ever sleeping
+	 * Intended for consumers pinned to a dedicated core
+	 * 
+	 * @returns adv_event_t at front of queue
+	*/
+
+	adv_event_t evt = ring.pop_spin();
+	record_dequeue(evt);
+	return evt;
+}
 
-	std::shared_ptr<processed_adv_event> p = queue.front();
-	queue.pop();
-	
+bool eventQueue::try_pop(adv_event_t& evt){
+	/**
+	 * Dequeus front-most record from queue if present
+	 * 
+	 * @param evt	Reference to store the dequeued record in
+	 * @returns true if evt was set, false if the queue was empty
+	*/
 
-	return p;
-}
\ No newline at end of file
+	if(!ring.try_pop(evt)) return false;
+	record_dequeue(evt);
+	return true;
+}
+
+pooled_event_t eventQueue::try_pop_pooled(slabPool& pool){
+	/**
+	 * Dequeues front-most record into a pool block
+	 *
+	 * @param pool	Pool to take the block from (blocks of at least sizeof(adv_event_t))
+	 * @returns owning pointer, empty if nothing was dequeued
+	*/
+
+	if(ring.size() == 0) return pooled_event_t(nullptr, poolDeleter<adv_event_t>{&pool});
+	pooled_event_t evt = pool_make<adv_event_t>(pool);
+	if(!evt) return evt;
+	if(!try_pop(*evt)) evt.reset();
+	return evt;
+}
+
+size_t eventQueue::size() const{
+	return ring.size();
+}
+
+size_t eventQueue::capacity() const{
+	return ring.capacity();
+}
+
+uint64_t eventQueue::dropped() const{
+	return ring.dropped_newest() + ring.dropped_oldest();
+}
+
+uint64_t eventQueue::dropped_newest() const{
+	return ring.dropped_newest();
+}
+
+uint64_t eventQueue::dropped_oldest() const{
+	return ring.dropped_oldest();
+}
+
+const latencyHistogram& eventQueue::kernel_to_enqueue() const{
+	return k2e;
+}
+
+const latencyHistogram& eventQueue::enqueue_to_dequeue() const{
+	return e2d;
+}
+
+void eventQueue::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics for this queue; nothing is added to push()/pop()
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the queue, e.g. adapter="0"
+	*/
+
+	registry.gauge_fn("bt_sniff_queue_depth", "Records waiting in the event queue", labels,
+		[this](){ return (double)size(); });
+	registry.gauge_fn("bt_sniff_queue_capacity", "Records the event queue holds when full", labels,
+		[this](){ return (double)capacity(); });
+	registry.counter_fn("bt_sniff_queue_dropped_newest_total", "Records rejected because the queue was full", labels,
+		[this](){ return dropped_newest(); });
+	registry.counter_fn("bt_sniff_queue_dropped_oldest_total", "Queued records overwritten because the queue was full", labels,
+		[this](){ return dropped_oldest(); });
+	registry.histogram("bt_sniff_kernel_to_enqueue_seconds", "Kernel receive to enqueue latency", labels, k2e);
+	registry.histogram("bt_sniff_parse_to_dequeue_seconds", "Enqueue (end of parsing) to dequeue latency", labels, e2d);
+}
+
+void eventQueue::record_dequeue(const adv_event_t& evt){
+	/**
+	 * Records enqueue-to-dequeue latency of a popped record
+	 * 
+	 * @param evt	Record just removed from the ring
+	*/
+
+	uint64_t now = realtime_ns();
+	if(evt.enqueue_time != 0 && now > evt.enqueue_time) e2d.record(now - evt.enqueue_time);
+}
@@ -1,16 +1,21 @@
 /**
- * Header for unbounded, single-producer/single consumer queue
+ * Header for bounded, lock-free single-producer/single consumer queue
  * @author Owen Capell
 */
 #ifndef EVENT_QUEUE
 #define EVENT_QUEUE
 
-#include <queue>
-#include <memory>
-#include <mutex>
-#include <condition_variable>
+#include <cstdint>
+#include <string>
 
 #include "bluetoothdef.hpp"
+#include "spsc_ring.hpp"
+#include "slab_pool.hpp"
+#include "latency_histogram.hpp"
+#include "metrics.hpp"
+
+/* Default number of events the queue can hold before overflowing */
+#define EVENT_QUEUE_DEFAULT_CAPACITY 4096
 
 class eventQueue{
 public:
@@ -18,20 +23,101 @@ public:
 
 	/**
 	 * @brief
-	 * Enqueues a pointer to processed_adv_event to queue
+	 * Constructs queue holding at least capacity events
+	 * policy decides what push() does when the queue is full
+	*/
+	explicit eventQueue(size_t capacity, overflowPolicy policy = overflowPolicy::drop_newest);
+
+	/**
+	 * @brief
+	 * Enqueues a copy of the adv_event_t record to queue
+	 * Returns false if the event was dropped
+	*/
+	bool push(const adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Enqueues count records with a single consumer wake-up
+	 * Returns the number of records accepted
+	*/
+	size_t push_batch(adv_event_t *evts, size_t count);
+
+	/**
+	 * @brief
+	 * Removes and returns front element from queue
+	 * Blocks (spin, then sleep) while the queue is empty
 	*/
-	void push(std::shared_ptr<processed_adv_event> p);
+	adv_event_t pop();
 
 	/**
 	 * @brief
 	 * Removes and returns front element from queue
+	 * Busy-waits while the queue is empty
+	*/
+	adv_event_t pop_spin();
+
+	/**
+	 * @brief
+	 * Removes front element into evt if one is available
+	 * Returns false without blocking if the queue is empty
+	*/
+	bool try_pop(adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Removes front element into a block of pool, for consumers that keep
+	 * or hand off records without touching the heap; the record can be
+	 * released on any thread. Empty if the queue is empty or pool exhausted
+	 * (the record then stays queued)
+	*/
+	pooled_event_t try_pop_pooled(slabPool& pool);
+
+	/**
+	 * @brief
+	 * Approximate number of queued events
+	*/
+	size_t size() const;
+
+	/**
+	 * @brief
+	 * Number of events the queue holds when full
+	*/
+	size_t capacity() const;
+
+	/**
+	 * @brief
+	 * Number of events dropped by the overflow policy (newest + oldest)
+	*/
+	uint64_t dropped() const;
+
+	uint64_t dropped_newest() const;
+	uint64_t dropped_oldest() const;
+
+	/**
+	 * @brief
+	 * Latency from kernel receive (record timestamp) to push(), in ns
+	*/
+	const latencyHistogram& kernel_to_enqueue() const;
+
+	/**
+	 * @brief
+	 * Latency from push() to pop()/try_pop(), in ns
+	*/
+	const latencyHistogram& enqueue_to_dequeue() const;
+
+	/**
+	 * @brief
+	 * Exposes depth, drops and both latency histograms in registry
+	 * (the queue must outlive the registration)
 	*/
-	std::shared_ptr<processed_adv_event> pop();
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
 
 private:
-	std::mutex lock;
-	std::condition_variable cv;
-	std::queue<std::shared_ptr<processed_adv_event>> queue;
+	void record_dequeue(const adv_event_t& evt);
+
+	spscRing<adv_event_t> ring;
+	latencyHistogram k2e;
+	latencyHistogram e2d;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,472 @@
+/**
+ * Implementation of extended advertising fragment reassembly
+ * @author Owen Capell
+*/
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "ext_reassembly.hpp"
+
+/* AD structures considered when a payload has to be packed into a record */
+#define REASSEMBLY_MAX_FIELDS 128
+
+static uint64_t mix_key(uint64_t key){
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	return key;
+}
+
+static size_t pack_ad(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity){
+	/**
+	 * Copies a payload into a record. When it does not fit, whole AD
+	 * structures are kept in their original order and the largest are
+	 * dropped until the rest fits, so short fields (names, service data)
+	 * survive a long manufacturer blob
+	 *
+	 * @param src	Reassembled payload
+	 * @param length	Octets at src
+	 * @param dst	Record data
+	 * @param capacity	Octets available at dst
+	 * @returns octets written
+	*/
+
+	if(length <= capacity){
+		memcpy(dst, src, length);
+		return length;
+	}
+
+	uint16_t offsets[REASSEMBLY_MAX_FIELDS];
+	uint16_t sizes[REASSEMBLY_MAX_FIELDS];
+	bool keep[REASSEMBLY_MAX_FIELDS];
+	size_t n = 0;
+	size_t total = 0;
+
+	/* Zero padding or a malformed structure ends the significant part */
+	size_t i = 0;
+	while(i < length && n < REASSEMBLY_MAX_FIELDS){
+		size_t field = (size_t)src[i] + 1;
+		if(field == 1 || i + field > length) break;
+		offsets[n] = (uint16_t)i;
+		sizes[n] = (uint16_t)field;
+		keep[n] = true;
+		total += field;
+		n++;
+		i += field;
+	}
+
+	while(total > capacity){
+		size_t largest = n;
+		for(size_t k=0; k<n; k++){
+			if(keep[k] && (largest == n || sizes[k] > sizes[largest])) largest = k;
+		}
+		keep[largest] = false;
+		total -= sizes[largest];
+	}
+
+	size_t out = 0;
+	for(size_t k=0; k<n; k++){
+		if(!keep[k]) continue;
+		memcpy(dst + out, src + offsets[k], sizes[k]);
+		out += sizes[k];
+	}
+	return out;
+}
+
+static reassembly_config_t clamp_config(reassembly_config_t config){
+	/* Chain lengths are 16-bit and pack_ad() indexes at most EXT_ADV_MAX_DATA octets */
+	if(config.slots < 1) config.slots = 1;
+	if(config.max_payload > EXT_ADV_MAX_DATA) config.max_payload = EXT_ADV_MAX_DATA;
+	return config;
+}
+
+extReassembler::extReassembler(const reassembly_config_t& config) :
+	config(clamp_config(config)), accept_all(), chains(this->config.slots),
+	payloads(chains.size() * this->config.max_payload), free_chains(), index(), index_mask(0),
+	orphans(), orphans_until(0), wheel(), wheel_tail(), tick_ns(config.timeout_ns / 4 > 0 ? config.timeout_ns / 4 : 1), current_tick(0), n_open(0),
+	n_pending(0), n_completed(0), n_fragments(0), n_truncated(0), n_packed(0),
+	n_dropped_bytes(0), n_expired(0), n_evicted(0), n_orphaned(0), n_rejected(0)
+{
+	/**
+	 * Constructor for extReassembler
+	 * Allocates every payload buffer up front; the index is kept at most
+	 * half full so probes stay short. At least one slot is kept and
+	 * max_payload is capped at EXT_ADV_MAX_DATA
+	 *
+	 * @param config	Slots, payload bound and timeout
+	*/
+
+	size_t index_size = 16;
+	while(index_size < chains.size() * 2) index_size <<= 1;
+	index.assign(index_size, -1);
+	index_mask = index_size - 1;
+	orphans.assign(index_size, orphan_t{0, 0});
+
+	free_chains.reserve(chains.size());
+	for(size_t i=chains.size(); i>0; i--) free_chains.push_back((int32_t)(i - 1));
+	for(int32_t& head : wheel) head = -1;
+	for(int32_t& tail : wheel_tail) tail = -1;
+}
+
+uint64_t extReassembler::key_of(const adv_event_t& evt){
+	/* 48-bit address, address type and SID packed into one word */
+	uint64_t key = 0;
+	memcpy(&key, &evt.address, sizeof(bt_dev_addr_t));
+	return key | ((uint64_t)(evt.address_type & 0xFF) << 48) | ((uint64_t)evt.advertising_sid << 56);
+}
+
+bool extReassembler::accept(const adv_event_t& evt, const uint8_t *data, size_t length, const advFilter *filter){
+	/* Same view the decoders build, over the whole payload */
+	if(filter == nullptr) return true;
+	const bt_dev_addr_t *address = evt.subevent == SUBEVT_HCI_LE_PERIODIC_ADVERTISING_REPORT ? nullptr : &evt.address;
+	adv_report_view_t view = {address, evt.address_type, evt.event, evt.rssi, data, (uint16_t)length};
+	return filter->matches(view);
+}
+
+const advFilter* extReassembler::decode_filter(const advFilter *filter) const{
+	return filter != nullptr ? &accept_all : nullptr;
+}
+
+size_t extReassembler::reassemble(adv_event_t *records, size_t count, const advFilter *filter){
+	/**
+	 * Passes records that are not part of a chain straight through
+	 * (filtered); fragments marked incomplete start or extend a chain and
+	 * are absorbed; the final fragment of a chain becomes the one record
+	 * of the advertisement, stamped with the first fragment's time
+	 *
+	 * @param records	Records from parse_hci_packet(), in capture order
+	 * @param count	Number of records
+	 * @param filter	Report filter (nullptr = none beyond the decoder's PDU check)
+	 * @returns number of records kept at the front of records
+	*/
+
+	size_t kept = 0;
+	uint64_t fragments = 0, rejected = 0;
+
+	for(size_t i=0; i<count; i++){
+		adv_event_t& evt = records[i];
+		bool chained = evt.subevent == SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT &&
+			(evt.data_status == ADV_DATA_INCOMPLETE || n_open > 0 || evt.timestamp < orphans_until);
+
+		if(!chained){
+			if(!accept(evt, evt.data, evt.data_length, filter)){
+				rejected++;
+				continue;
+			}
+			if(kept != i) records[kept] = evt;
+			kept++;
+			continue;
+		}
+
+		advance(evt.timestamp);
+		uint64_t key = key_of(evt);
+		int32_t c = find(key);
+
+		if(c < 0 && is_orphan(key, evt.timestamp, evt.data_status != ADV_DATA_INCOMPLETE)){
+			/* The start of this advertisement was dropped; the rest begins mid-structure */
+			n_orphaned.fetch_add(1, std::memory_order_relaxed);
+			n_dropped_bytes.fetch_add(evt.data_length, std::memory_order_relaxed);
+			continue;
+		}
+
+		if(evt.data_status == ADV_DATA_INCOMPLETE){
+			if(c < 0) c = open(key, evt.timestamp);
+			append(c, evt);
+			fragments++;
+			continue;
+		}
+
+		if(c < 0){
+			/* A complete report of an advertiser with no chain open */
+			if(!accept(evt, evt.data, evt.data_length, filter)){
+				rejected++;
+				continue;
+			}
+		}
+		else{
+			append(c, evt);
+			fragments++;
+			bool keep = finish(c, evt, filter);
+			close(c);
+			if(!keep){
+				rejected++;
+				continue;
+			}
+		}
+		if(kept != i) records[kept] = evt;
+		kept++;
+	}
+
+	if(fragments > 0) n_fragments.fetch_add(fragments, std::memory_order_relaxed);
+	if(rejected > 0) n_rejected.fetch_add(rejected, std::memory_order_relaxed);
+	n_pending.store(n_open, std::memory_order_relaxed);
+	return kept;
+}
+
+void extReassembler::append(int32_t c, const adv_event_t& evt){
+	/* Bounded copy into the chain's buffer; the excess is only counted */
+	chain_t& chain = chains[c];
+	size_t room = config.max_payload - chain.length;
+	size_t n = evt.data_length;
+	if(n > room){
+		n_dropped_bytes.fetch_add(n - room, std::memory_order_relaxed);
+		n = room;
+		chain.overflow = true;
+	}
+	memcpy(payloads.data() + (size_t)c * config.max_payload + chain.length, evt.data, n);
+	chain.length += (uint16_t)n;
+	chain.fragments++;
+}
+
+bool extReassembler::finish(int32_t c, adv_event_t& evt, const advFilter *filter){
+	/**
+	 * Turns the final fragment into the advertisement's record: the
+	 * filter sees the whole payload, then the payload is packed into the
+	 * record
+	 *
+	 * @param c	Chain, final fragment already appended
+	 * @param evt	Final fragment, rewritten in place
+	 * @param filter	Report filter (nullptr = none)
+	 * @returns true if the record is kept
+	*/
+
+	const chain_t& chain = chains[c];
+	const uint8_t *payload = payloads.data() + (size_t)c * config.max_payload;
+	if(!accept(evt, payload, chain.length, filter)) return false;
+
+	bool truncated = chain.overflow || evt.data_status == ADV_DATA_TRUNCATED;
+	if(truncated) n_truncated.fetch_add(1, std::memory_order_relaxed);
+
+	size_t packed = pack_ad(payload, chain.length, evt.data, ADV_EVENT_MAX_DATA);
+	if(packed < chain.length){
+		n_packed.fetch_add(1, std::memory_order_relaxed);
+		n_dropped_bytes.fetch_add(chain.length - packed, std::memory_order_relaxed);
+		truncated = true;
+	}
+
+	evt.timestamp = chain.first_seen;
+	evt.data_length = (uint8_t)packed;
+	evt.data_status = truncated ? ADV_DATA_TRUNCATED : ADV_DATA_COMPLETE;
+	n_completed.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void extReassembler::advance(uint64_t timestamp){
+	/**
+	 * Moves the wheel to timestamp, dropping the chains of every bucket
+	 * passed. A jump of a whole revolution or more empties the wheel
+	 *
+	 * @param timestamp	Kernel time of the current record
+	*/
+
+	uint64_t now_tick = timestamp / tick_ns;
+	if(now_tick <= current_tick) return;
+	if(n_open == 0){
+		current_tick = now_tick;
+		return;
+	}
+
+	uint64_t steps = now_tick - current_tick;
+	if(steps > REASSEMBLY_WHEEL_BUCKETS) steps = REASSEMBLY_WHEEL_BUCKETS;
+	for(uint64_t s=1; s<=steps; s++){
+		int32_t& head = wheel[(current_tick + s) % REASSEMBLY_WHEEL_BUCKETS];
+		while(head >= 0){
+			abandon(head, timestamp);
+			n_expired.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	current_tick = now_tick;
+}
+
+int32_t extReassembler::find(uint64_t key) const{
+	size_t slot = mix_key(key) & index_mask;
+	while(index[slot] >= 0){
+		if(chains[index[slot]].key == key) return index[slot];
+		slot = (slot + 1) & index_mask;
+	}
+	return -1;
+}
+
+int32_t extReassembler::open(uint64_t key, uint64_t timestamp){
+	/**
+	 * Starts a chain, evicting the oldest when every slot is taken: the
+	 * head of the nearest wheel bucket (earliest deadline, then first opened)
+	 *
+	 * @param key	Advertiser key
+	 * @param timestamp	Kernel time of the first fragment
+	 * @returns chain index
+	*/
+
+	if(free_chains.empty()){
+		for(uint64_t s=1; s<=REASSEMBLY_WHEEL_BUCKETS; s++){
+			int32_t head = wheel[(current_tick + s) % REASSEMBLY_WHEEL_BUCKETS];
+			if(head < 0) continue;
+			abandon(head, timestamp);
+			n_evicted.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+	}
+
+	int32_t c = free_chains.back();
+	free_chains.pop_back();
+	chain_t& chain = chains[c];
+	chain.key = key;
+	chain.first_seen = timestamp;
+	chain.length = 0;
+	chain.fragments = 0;
+	chain.overflow = false;
+
+	/* Bucket by deadline, kept inside the wheel's revolution */
+	uint64_t deadline = (timestamp + config.timeout_ns) / tick_ns;
+	if(deadline <= current_tick) deadline = current_tick + 1;
+	if(deadline >= current_tick + REASSEMBLY_WHEEL_BUCKETS) deadline = current_tick + REASSEMBLY_WHEEL_BUCKETS - 1;
+	chain.deadline = deadline;
+	wheel_insert(c);
+
+	size_t slot = mix_key(key) & index_mask;
+	while(index[slot] >= 0) slot = (slot + 1) & index_mask;
+	index[slot] = c;
+	n_open++;
+	return c;
+}
+
+void extReassembler::close(int32_t c){
+	/**
+	 * Frees a chain; the index is repaired by backward shifting so no
+	 * tombstones accumulate under churn
+	 *
+	 * @param c	Chain to free
+	*/
+
+	wheel_remove(c);
+
+	size_t slot = mix_key(chains[c].key) & index_mask;
+	while(index[slot] != c) slot = (slot + 1) & index_mask;
+	index[slot] = -1;
+
+	size_t hole = slot;
+	size_t next = (slot + 1) & index_mask;
+	while(index[next] >= 0){
+		size_t home = mix_key(chains[index[next]].key) & index_mask;
+		/* Move the entry back unless its home lies cyclically in (hole, next] */
+		bool stays = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+		if(!stays){
+			index[hole] = index[next];
+			index[next] = -1;
+			hole = next;
+		}
+		next = (next + 1) & index_mask;
+	}
+
+	free_chains.push_back(c);
+	n_open--;
+}
+
+void extReassembler::abandon(int32_t c, uint64_t timestamp){
+	/**
+	 * Frees a chain that will never complete and remembers its key, so
+	 * fragments still on their way are dropped rather than emitted
+	 *
+	 * @param c	Chain to drop
+	 * @param timestamp	Kernel time of the record that caused the drop
+	*/
+
+	uint64_t key = chains[c].key;
+	orphan_t& o = orphans[mix_key(key) & index_mask];
+	o.key = key;
+	o.until = timestamp + config.timeout_ns;
+	if(o.until > orphans_until) orphans_until = o.until;
+	close(c);
+}
+
+bool extReassembler::is_orphan(uint64_t key, uint64_t timestamp, bool last){
+	/**
+	 * True if key belongs to a chain dropped less than timeout_ns ago. A
+	 * colliding drop overwrites the entry; that tail is then emitted as
+	 * before, it is not misattributed
+	 *
+	 * @param key	Advertiser key of a fragment with no chain open
+	 * @param timestamp	Kernel time of the fragment
+	 * @param last	Fragment ends the advertisement (the key is forgotten)
+	*/
+
+	orphan_t& o = orphans[mix_key(key) & index_mask];
+	if(o.until == 0 || o.key != key || timestamp >= o.until) return false;
+	if(last) o.until = 0;
+	return true;
+}
+
+void extReassembler::wheel_insert(int32_t c){
+	/* Appended, so each bucket stays in opening order */
+	chain_t& chain = chains[c];
+	chain.bucket = (int32_t)(chain.deadline % REASSEMBLY_WHEEL_BUCKETS);
+	chain.next = -1;
+	chain.prev = wheel_tail[chain.bucket];
+	if(chain.prev >= 0) chains[chain.prev].next = c;
+	else wheel[chain.bucket] = c;
+	wheel_tail[chain.bucket] = c;
+}
+
+void extReassembler::wheel_remove(int32_t c){
+	chain_t& chain = chains[c];
+	if(chain.prev >= 0) chains[chain.prev].next = chain.next;
+	else wheel[chain.bucket] = chain.next;
+	if(chain.next >= 0) chains[chain.next].prev = chain.prev;
+	else wheel_tail[chain.bucket] = chain.prev;
+}
+
+void extReassembler::clear(){
+	/* Chains cut off by the end of a capture count as expired */
+	if(n_open > 0) n_expired.fetch_add(n_open, std::memory_order_relaxed);
+	for(int32_t& head : wheel){
+		while(head >= 0) close(head);
+	}
+	for(orphan_t& o : orphans) o.until = 0;
+	orphans_until = 0;
+	n_pending.store(0, std::memory_order_relaxed);
+}
+
+const reassembly_config_t& extReassembler::get_config() const{
+	return config;
+}
+
+reassembly_stats_t extReassembler::stats() const{
+	reassembly_stats_t s;
+	s.pending = n_pending.load(std::memory_order_relaxed);
+	s.completed = n_completed.load(std::memory_order_relaxed);
+	s.fragments = n_fragments.load(std::memory_order_relaxed);
+	s.truncated = n_truncated.load(std::memory_order_relaxed);
+	s.packed = n_packed.load(std::memory_order_relaxed);
+	s.dropped_bytes = n_dropped_bytes.load(std::memory_order_relaxed);
+	s.expired = n_expired.load(std::memory_order_relaxed);
+	s.evicted = n_evicted.load(std::memory_order_relaxed);
+	s.orphaned = n_orphaned.load(std::memory_order_relaxed);
+	s.rejected = n_rejected.load(std::memory_order_relaxed);
+	return s;
+}
+
+void extReassembler::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics; reassemble() counts nothing extra
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the capture
+	*/
+
+	registry.gauge_fn("bt_sniff_reassembly_pending", "Extended advertisements waiting for more fragments", labels,
+		[this](){ return (double)n_pending.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_completed_total", "Fragmented advertisements emitted as one record", labels,
+		[this](){ return n_completed.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_truncated_total", "Reassembled advertisements truncated by the controller or the buffer", labels,
+		[this](){ return n_truncated.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_packed_total", "Reassembled advertisements that dropped AD structures to fit a record", labels,
+		[this](){ return n_packed.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_dropped_bytes_total", "Payload octets lost to truncation and packing", labels,
+		[this](){ return n_dropped_bytes.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_expired_total", "Fragment chains dropped after the timeout", labels,
+		[this](){ return n_expired.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_evicted_total", "Fragment chains dropped because every slot was taken", labels,
+		[this](){ return n_evicted.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_reassembly_orphaned_total", "Fragments dropped because their chain had expired or been evicted", labels,
+		[this](){ return n_orphaned.load(std::memory_order_relaxed); });
+}
@@ -0,0 +1,190 @@
+/**
+ * Header for extended advertising fragment reassembly
+ * @author Owen Capell
+*/
+#ifndef EXT_REASSEMBLY
+#define EXT_REASSEMBLY
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+#include "adv_filter.hpp"
+#include "metrics.hpp"
+
+/* Default number of advertisements reassembled at once */
+#define REASSEMBLY_DEFAULT_SLOTS 256
+
+/* Default time from the first fragment until a chain is given up (kernel time) */
+#define REASSEMBLY_DEFAULT_TIMEOUT_NS 200000000ull
+
+/* Buckets of the eviction wheel (a chain expires within timeout + timeout / 4) */
+#define REASSEMBLY_WHEEL_BUCKETS 8
+
+/**
+ * @details
+ * Configuration for extReassembler
+ * @param slots	Advertisements in progress at once; a new chain evicts the
+ * 				oldest (first to expire) when all are taken, so memory never grows
+ * @param max_payload	Octets kept per advertisement, at most EXT_ADV_MAX_DATA
+ * 				(longer chains are truncated)
+ * @param timeout_ns	Chains not finished this long after their first fragment are dropped
+*/
+typedef struct{
+	size_t slots = REASSEMBLY_DEFAULT_SLOTS;
+	size_t max_payload = EXT_ADV_MAX_DATA;
+	uint64_t timeout_ns = REASSEMBLY_DEFAULT_TIMEOUT_NS;
+} reassembly_config_t;
+
+/**
+ * @details
+ * Snapshot of extReassembler counters
+ * @param pending	Advertisements waiting for more fragments
+ * @param completed	Multi-fragment advertisements emitted as one record
+ * @param fragments	Fragments absorbed into a chain (not emitted on their own)
+ * @param truncated	Chains the controller truncated or that exceeded max_payload
+ * @param packed	Records that dropped whole AD structures to fit ADV_EVENT_MAX_DATA
+ * @param dropped_bytes	Payload octets lost to truncation and packing
+ * @param expired	Chains dropped after timeout_ns without a final fragment, or by clear()
+ * @param evicted	Chains dropped to make room for a new one
+ * @param orphaned	Later fragments of expired or evicted chains, dropped because
+ * 					they start in the middle of the advertisement
+ * @param rejected	Records rejected by the report filter after reassembly
+*/
+typedef struct{
+	uint64_t pending;
+	uint64_t completed;
+	uint64_t fragments;
+	uint64_t truncated;
+	uint64_t packed;
+	uint64_t dropped_bytes;
+	uint64_t expired;
+	uint64_t evicted;
+	uint64_t orphaned;
+	uint64_t rejected;
+} reassembly_stats_t;
+
+/**
+ * @details
+ * Joins the fragments of extended advertising reports ("incomplete, more
+ * data to come") into one record per advertisement, keyed by (address,
+ * address type, SID). Works in place on decoded records like
+ * deviceTable::coalesce(), between decoding and aggregation, and must see
+ * records in capture order from one thread at a time. The report filter
+ * moves here too: decoders run with decode_filter() and the filter is
+ * evaluated once on each whole payload. Payload buffers, the key index
+ * and the eviction wheel are preallocated; a payload longer than a
+ * record keeps as many whole AD structures as fit (largest dropped first)
+ * and is marked ADV_DATA_TRUNCATED. The keys of expired and evicted
+ * chains are remembered for timeout_ns, so the rest of such an
+ * advertisement is dropped instead of emitted as a record of its own
+*/
+class extReassembler{
+public:
+	explicit extReassembler(const reassembly_config_t& config = reassembly_config_t{});
+
+	extReassembler(const extReassembler&) = delete;
+	extReassembler& operator=(const extReassembler&) = delete;
+
+	/**
+	 * @brief
+	 * Absorbs fragments, completes chains and filters a batch of records in place
+	 * Returns number of records kept at the front of records
+	*/
+	size_t reassemble(adv_event_t *records, size_t count, const advFilter *filter);
+
+	/**
+	 * @brief
+	 * Filter to decode with: accept-all when filter is set (it is applied
+	 * after reassembly instead), nullptr keeps the built-in PDU check
+	*/
+	const advFilter* decode_filter(const advFilter *filter) const;
+
+	/**
+	 * @brief
+	 * Drops every chain in progress (counted as expired)
+	*/
+	void clear();
+
+	const reassembly_config_t& get_config() const;
+
+	reassembly_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes completion, truncation, expiry and eviction counters in registry
+	 * (the reassembler must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	typedef struct{
+		uint64_t key;
+		uint64_t first_seen;
+		uint64_t deadline;
+		uint16_t length;
+		uint16_t fragments;
+		bool overflow;
+		int32_t bucket;
+		int32_t prev;
+		int32_t next;
+	} chain_t;
+
+	/* Key of a dropped chain and the kernel time until which its fragments are discarded */
+	typedef struct{
+		uint64_t key;
+		uint64_t until;
+	} orphan_t;
+
+	static uint64_t key_of(const adv_event_t& evt);
+	static bool accept(const adv_event_t& evt, const uint8_t *data, size_t length, const advFilter *filter);
+	void advance(uint64_t timestamp);
+	int32_t find(uint64_t key) const;
+	int32_t open(uint64_t key, uint64_t timestamp);
+	void close(int32_t c);
+	void abandon(int32_t c, uint64_t timestamp);
+	bool is_orphan(uint64_t key, uint64_t timestamp, bool last);
+	void append(int32_t c, const adv_event_t& evt);
+	bool finish(int32_t c, adv_event_t& evt, const advFilter *filter);
+	void wheel_insert(int32_t c);
+	void wheel_remove(int32_t c);
+
+	reassembly_config_t config;
+	advFilter accept_all;
+
+	std::vector<chain_t> chains;
+	std::vector<uint8_t> payloads;
+	std::vector<int32_t> free_chains;
+
+	/* Open-addressing index of key -> chain (-1 = empty) */
+	std::vector<int32_t> index;
+	size_t index_mask;
+
+	/* Direct-mapped keys of dropped chains, sized like the index */
+	std::vector<orphan_t> orphans;
+	uint64_t orphans_until;
+
+	/* Eviction wheel: chains by deadline tick, oldest first in each bucket */
+	int32_t wheel[REASSEMBLY_WHEEL_BUCKETS];
+	int32_t wheel_tail[REASSEMBLY_WHEEL_BUCKETS];
+	uint64_t tick_ns;
+	uint64_t current_tick;
+
+	size_t n_open;
+
+	std::atomic<uint64_t> n_pending;
+	std::atomic<uint64_t> n_completed;
+	std::atomic<uint64_t> n_fragments;
+	std::atomic<uint64_t> n_truncated;
+	std::atomic<uint64_t> n_packed;
+	std::atomic<uint64_t> n_dropped_bytes;
+	std::atomic<uint64_t> n_expired;
+	std::atomic<uint64_t> n_evicted;
+	std::atomic<uint64_t> n_orphaned;
+	std::atomic<uint64_t> n_rejected;
+};
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ * Implementation of the host-side HCI command channel
+ * @author Owen Capell
+*/
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "bluetoothdef.hpp"
+#include "hci_schema.hpp"
+#include "hci_command.hpp"
+#include "utils.hpp"
+
+hciCommandChannel::hciCommandChannel(int fd, uint64_t timeout_ns) :
+	fd(fd), timeout_ns(timeout_ns), mutex(), waiting(), in_flight(),
+	credits(1), outstanding(0),
+	n_sent(0), n_completed(0), n_status(0), n_timeouts(0), n_unmatched(0)
+{
+	/**
+	 * Constructor for hciCommandChannel
+	 * Starts with one credit, as a controller does after reset
+	 *
+	 * @param fd	Raw HCI socket bound to the adapter
+	 * @param timeout_ns	Time to wait for a completion event
+	*/
+
+}
+
+bool hciCommandChannel::write_command(command_t& cmd){
+	/**
+	 * Writes one H4 command packet: type octet, header, parameters
+	 *
+	 * @param cmd	Command to send
+	 * @returns true if the whole packet was written
+	*/
+
+	uint8_t head[1 + sizeof(hci_pack_command_head_t)];
+	head[0] = HCI_PACK_COMMAND;
+	hci_pack_command_head_t *h = (hci_pack_command_head_t*)(head + 1);
+	h->opcode = cmd.opcode;
+	h->param_length = cmd.length;
+
+	struct iovec iov[2] = {{head, sizeof(head)}, {cmd.params, cmd.length}};
+	ssize_t n;
+	do{
+		n = writev(fd, iov, cmd.length > 0 ? 2 : 1);
+	} while(n < 0 && errno == EINTR);
+
+	if(n != (ssize_t)(sizeof(head) + cmd.length)) return false;
+	cmd.sent_at = monotonic_ns();
+	n_sent.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void hciCommandChannel::fail(command_t& cmd, uint8_t status){
+	if(!cmd.callback) return;
+	command_result_t r = {cmd.opcode, status, false, nullptr, 0};
+	cmd.callback(r);
+}
+
+void hciCommandChannel::pump(std::vector<command_t>& failed){
+	/**
+	 * Sends queued commands while credits last (mutex held)
+	 *
+	 * @param failed	Receives commands whose write failed
+	*/
+
+	while(credits > 0 && !waiting.empty()){
+		command_t cmd = std::move(waiting.front());
+		waiting.pop_front();
+		if(!write_command(cmd)){
+			failed.push_back(std::move(cmd));
+			continue;
+		}
+		credits--;
+		in_flight.push_back(std::move(cmd));
+	}
+	outstanding.store((uint32_t)(waiting.size() + in_flight.size()), std::memory_order_release);
+}
+
+int hciCommandChannel::send(uint16_t opcode, const uint8_t *params, uint8_t length, command_callback_t callback){
+	/**
+	 * Queues a command and sends it immediately if a credit is available
+	 *
+	 * @param opcode	HCI_CMD_* opcode
+	 * @param params	Command parameters (may be nullptr when length is 0)
+	 * @param length	Octets of parameters
+	 * @param callback	Called once with the outcome (optional)
+	 * @returns 0 if sent or queued, -1 on invalid parameters
+	*/
+
+	if(length > 0 && params == nullptr) return -1;
+
+	command_t cmd;
+	cmd.opcode = opcode;
+	cmd.length = length;
+	if(length > 0) memcpy(cmd.params, params, length);
+	cmd.sent_at = 0;
+	cmd.callback = std::move(callback);
+
+	std::vector<command_t> failed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		waiting.push_back(std::move(cmd));
+		pump(failed);
+	}
+	for(command_t& f : failed) fail(f, HCI_COMMAND_SEND_FAILED);
+	return 0;
+}
+
+bool hciCommandChannel::handle_event(const uint8_t *buf, size_t len){
+	/**
+	 * Matches a completion event with the oldest outstanding command of
+	 * the same opcode, updates the credit count and sends queued commands
+	 *
+	 * @param buf	Raw packet, starting with the HCI packet type octet
+	 * @param len	Octets in buf
+	 * @returns true if buf was Command Complete or Command Status
+	*/
+
+	hciView<hciEventHeader> head;
+	if(len < 1 || buf[0] != HCI_PACK_EVENT || !head.bind(buf + 1, len - 1)) return false;
+	size_t param_len = head.data_length();
+	if(head.get<"param_length">() < param_len) param_len = head.get<"param_length">();
+	const uint8_t *params = head.data();
+
+	uint16_t opcode;
+	uint8_t num_packets;
+	command_result_t result = {};
+
+	if(head.get<"event_code">() == HCI_EVENT_COMMAND_COMPLETE){
+		hciView<hciCommandComplete> cc;
+		if(!cc.bind(params, param_len)) return true;
+		opcode = cc.get<"command_opcode">();
+		num_packets = cc.get<"num_hci_command_packets">();
+		result.complete = true;
+		result.ret = cc.data();
+		result.ret_length = cc.data_length();
+		result.status = result.ret_length > 0 ? cc.data()[0] : 0x00;
+	}
+	else if(head.get<"event_code">() == HCI_EVENT_COMMAND_STATUS){
+		hciView<hciCommandStatus> cs;
+		if(!cs.bind(params, param_len)) return true;
+		opcode = cs.get<"command_opcode">();
+		num_packets = cs.get<"num_hci_command_packets">();
+		result.complete = false;
+		result.status = cs.get<"status">();
+	}
+	else{
+		return false;
+	}
+	result.opcode = opcode;
+
+	command_callback_t callback;
+	std::vector<command_t> failed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		credits = num_packets;
+
+		/* Opcode 0x0000 (NOP) only hands out credits */
+		bool matched = false;
+		if(opcode != 0x0000){
+			for(auto it = in_flight.begin(); it != in_flight.end(); ++it){
+				if(it->opcode != opcode) continue;
+				callback = std::move(it->callback);
+				in_flight.erase(it);
+				matched = true;
+				break;
+			}
+			if(!matched) n_unmatched.fetch_add(1, std::memory_order_relaxed);
+			else if(result.complete) n_completed.fetch_add(1, std::memory_order_relaxed);
+			else n_status.fetch_add(1, std::memory_order_relaxed);
+		}
+		pump(failed);
+	}
+
+	if(callback) callback(result);
+	for(command_t& f : failed) fail(f, HCI_COMMAND_SEND_FAILED);
+	return true;
+}
+
+size_t hciCommandChannel::expire(uint64_t now_ns){
+	/**
+	 * Fails in-flight commands older than the timeout and returns their
+	 * credits, so a lost event cannot wedge the channel
+	 *
+	 * @param now_ns	Current CLOCK_MONOTONIC time
+	 * @returns number of commands failed
+	*/
+
+	if(outstanding.load(std::memory_order_acquire) == 0) return 0;
+
+	std::vector<command_t> expired;
+	std::vector<command_t> failed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(auto it = in_flight.begin(); it != in_flight.end(); ){
+			if(now_ns - it->sent_at >= timeout_ns){
+				expired.push_back(std::move(*it));
+				it = in_flight.erase(it);
+				credits++;
+			}
+			else{
+				++it;
+			}
+		}
+		pump(failed);
+	}
+
+	n_timeouts.fetch_add(expired.size(), std::memory_order_relaxed);
+	for(command_t& e : expired) fail(e, HCI_COMMAND_TIMEOUT_STATUS);
+	for(command_t& f : failed) fail(f, HCI_COMMAND_SEND_FAILED);
+	return expired.size();
+}
+
+bool hciCommandChannel::busy() const{
+	return outstanding.load(std::memory_order_acquire) != 0;
+}
+
+command_stats_t hciCommandChannel::stats() const{
+	command_stats_t s;
+	s.sent = n_sent.load(std::memory_order_relaxed);
+	s.completed = n_completed.load(std::memory_order_relaxed);
+	s.status = n_status.load(std::memory_order_relaxed);
+	s.timeouts = n_timeouts.load(std::memory_order_relaxed);
+	s.unmatched = n_unmatched.load(std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(mutex));
+		s.queued = waiting.size();
+		s.in_flight = in_flight.size();
+		s.credits = credits;
+	}
+	return s;
+}
+
+int hciCommandChannel::set_extended_scan_parameters(const ext_scan_config_t& config, command_callback_t callback){
+	/**
+	 * LE Set Extended Scan Parameters; one PHY block per bit in config.phys
+	 *
+	 * @param config	Filter policy, PHYs and per-PHY interval/window
+	 * @param callback	Outcome (optional)
+	 * @returns 0 if sent or queued, -1 on failure
+	*/
+
+	uint8_t params[sizeof(hci_le_ext_scan_params_head_t) + 2 * sizeof(hci_le_ext_scan_phy_t)];
+	hci_le_ext_scan_params_head_t *head = (hci_le_ext_scan_params_head_t*)params;
+	head->own_address_type = config.own_address_type;
+	head->scanning_filter_policy = config.filter_policy;
+	head->scanning_phys = config.phys & (SCAN_PHY_1M | SCAN_PHY_CODED);
+
+	size_t length = sizeof(hci_le_ext_scan_params_head_t);
+	if(head->scanning_phys & SCAN_PHY_1M){
+		memcpy(params + length, &config.phy_1m, sizeof(hci_le_ext_scan_phy_t));
+		length += sizeof(hci_le_ext_scan_phy_t);
+	}
+	if(head->scanning_phys & SCAN_PHY_CODED){
+		memcpy(params + length, &config.phy_coded, sizeof(hci_le_ext_scan_phy_t));
+		length += sizeof(hci_le_ext_scan_phy_t);
+	}
+	return send(HCI_CMD_LE_SET_EXTENDED_SCAN_PARAMETERS, params, (uint8_t)length, std::move(callback));
+}
+
+int hciCommandChannel::set_extended_scan_enable(
+	bool enable, uint8_t filter_duplicates, uint16_t duration, uint16_t period,
+	command_callback_t callback){
+	/**
+	 * LE Set Extended Scan Enable. With filter_duplicates the controller
+	 * drops repeated reports itself (reset every period with RESET_PERIODIC)
+	 *
+	 * @param enable	Start or stop scanning
+	 * @param filter_duplicates	SCAN_DUPLICATES_*
+	 * @param duration	10 ms units, 0 = until disabled
+	 * @param period	1.28 s units, 0 = continuous
+	 * @param callback	Outcome (optional)
+	 * @returns 0 if sent or queued, -1 on failure
+	*/
+
+	hci_le_ext_scan_enable_t p = {(uint8_t)(enable ? 0x01 : 0x00), filter_duplicates, duration, period};
+	return send(HCI_CMD_LE_SET_EXTENDED_SCAN_ENABLE, (const uint8_t*)&p, sizeof(p), std::move(callback));
+}
+
+int hciCommandChannel::read_filter_accept_list_size(command_callback_t callback){
+	/* ret[0] status, ret[1] Filter_Accept_List_Size */
+	return send(HCI_CMD_LE_READ_FILTER_ACCEPT_LIST_SIZE, nullptr, 0, std::move(callback));
+}
+
+int hciCommandChannel::clear_filter_accept_list(command_callback_t callback){
+	return send(HCI_CMD_LE_CLEAR_FILTER_ACCEPT_LIST, nullptr, 0, std::move(callback));
+}
+
+int hciCommandChannel::add_to_filter_accept_list(
+	uint8_t address_type, const bt_dev_addr_t& address, command_callback_t callback){
+	hci_le_filter_accept_list_entry_t e = {address_type, address};
+	return send(HCI_CMD_LE_ADD_DEVICE_TO_FILTER_ACCEPT_LIST, (const uint8_t*)&e, sizeof(e), std::move(callback));
+}
+
+int hciCommandChannel::remove_from_filter_accept_list(
+	uint8_t address_type, const bt_dev_addr_t& address, command_callback_t callback){
+	hci_le_filter_accept_list_entry_t e = {address_type, address};
+	return send(HCI_CMD_LE_REMOVE_DEVICE_FROM_FILTER_ACCEPT_LIST, (const uint8_t*)&e, sizeof(e), std::move(callback));
+}
+
+int hciCommandChannel::periodic_advertising_create_sync(
+	const hci_le_periodic_create_sync_t& params, command_callback_t callback){
+	/**
+	 * LE Periodic Advertising Create Sync. The controller answers with
+	 * Command Status; the outcome follows as Sync Established. Only one
+	 * create may be pending at a time
+	 *
+	 * @param params	Advertiser, SID, skip and sync timeout
+	 * @param callback	Command Status outcome (optional)
+	 * @returns 0 if sent or queued, -1 on failure
+	*/
+
+	return send(HCI_CMD_LE_PERIODIC_ADVERTISING_CREATE_SYNC, (const uint8_t*)&params, sizeof(params), std::move(callback));
+}
+
+int hciCommandChannel::periodic_advertising_create_sync_cancel(command_callback_t callback){
+	/* A cancelled create reports Sync Established with HCI_STATUS_CANCELLED_BY_HOST */
+	return send(HCI_CMD_LE_PERIODIC_ADVERTISING_CREATE_SYNC_CANCEL, nullptr, 0, std::move(callback));
+}
+
+int hciCommandChannel::periodic_advertising_terminate_sync(uint16_t sync_handle, command_callback_t callback){
+	return send(HCI_CMD_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC, (const uint8_t*)&sync_handle, sizeof(sync_handle), std::move(callback));
+}
@@ -0,0 +1,183 @@
+/**
+ * Header for the host-side HCI command channel (credits, async completion)
+ * @author Owen Capell
+*/
+#ifndef HCI_COMMAND
+#define HCI_COMMAND
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+
+/* Local status reported when the controller never answered */
+#define HCI_COMMAND_TIMEOUT_STATUS 0xFF
+
+/* Local status reported when the command could not be written */
+#define HCI_COMMAND_SEND_FAILED 0xFE
+
+/* Default time to wait for Command Complete/Status */
+#define HCI_COMMAND_DEFAULT_TIMEOUT_NS 2000000000ull
+
+/**
+ * @details
+ * Outcome of one command, handed to its callback
+ * @param opcode	Command opcode
+ * @param status	HCI status (first return parameter, or Command Status status),
+ * 					HCI_COMMAND_TIMEOUT_STATUS or HCI_COMMAND_SEND_FAILED
+ * @param complete	True for Command Complete, false for Command Status or local failure
+ * @param ret	Return parameters of Command Complete (status octet included)
+ * @param ret_length	Octets at ret
+*/
+typedef struct{
+	uint16_t opcode;
+	uint8_t status;
+	bool complete;
+	const uint8_t *ret;
+	size_t ret_length;
+} command_result_t;
+
+typedef std::function<void(const command_result_t&)> command_callback_t;
+
+/**
+ * @details
+ * Scan configuration for LE Set Extended Scan Parameters
+ * @param own_address_type	Address type used in scan requests
+ * @param filter_policy	SCAN_FILTER_* (FILTERED = Filter Accept List only)
+ * @param phys	SCAN_PHY_* bits to scan on
+ * @param phy_1m	Type, interval and window on LE 1M
+ * @param phy_coded	Type, interval and window on LE Coded
+*/
+typedef struct{
+	uint8_t own_address_type = 0x00;
+	uint8_t filter_policy = SCAN_FILTER_BASIC_UNFILTERED;
+	uint8_t phys = SCAN_PHY_1M;
+	hci_le_ext_scan_phy_t phy_1m = {SCAN_TYPE_PASSIVE, 0x0010, 0x0010};
+	hci_le_ext_scan_phy_t phy_coded = {SCAN_TYPE_PASSIVE, 0x0030, 0x0030};
+} ext_scan_config_t;
+
+/**
+ * @details
+ * Snapshot of hciCommandChannel counters
+ * @param sent	Commands written to the socket
+ * @param completed	Command Complete events matched
+ * @param status	Command Status events matched
+ * @param timeouts	Commands failed locally after the timeout
+ * @param unmatched	Completion events with no outstanding command
+ * @param queued	Commands waiting for a credit
+ * @param in_flight	Commands sent and not yet answered
+ * @param credits	Commands the controller currently accepts
+*/
+typedef struct{
+	uint64_t sent;
+	uint64_t completed;
+	uint64_t status;
+	uint64_t timeouts;
+	uint64_t unmatched;
+	uint64_t queued;
+	uint64_t in_flight;
+	uint64_t credits;
+} command_stats_t;
+
+/**
+ * @details
+ * Sends HCI commands on a raw HCI socket and correlates the controller's
+ * Command Complete / Command Status events with them. Commands are
+ * paced by Num_HCI_Command_Packets credits; excess commands wait in a
+ * host queue. send() may be called from any thread; handle_event() is
+ * called from the capture path with every received packet and returns
+ * immediately when no command is outstanding. Callbacks run on the
+ * thread that delivers the event (keep them short) or, for local
+ * failures, on the calling thread.
+*/
+class hciCommandChannel{
+public:
+	/**
+	 * @brief
+	 * fd is a raw HCI socket (not owned)
+	*/
+	explicit hciCommandChannel(int fd, uint64_t timeout_ns = HCI_COMMAND_DEFAULT_TIMEOUT_NS);
+
+	hciCommandChannel(const hciCommandChannel&) = delete;
+	hciCommandChannel& operator=(const hciCommandChannel&) = delete;
+
+	/**
+	 * @brief
+	 * Sends (or queues, without credits) a command
+	 * Returns 0 if sent or queued, -1 if params is missing
+	*/
+	int send(uint16_t opcode, const uint8_t *params, uint8_t length, command_callback_t callback = nullptr);
+
+	/**
+	 * @brief
+	 * Consumes Command Complete / Command Status packets (H4 type octet first)
+	 * Returns true if buf was a completion event
+	*/
+	bool handle_event(const uint8_t *buf, size_t len);
+
+	/**
+	 * @brief
+	 * Fails commands outstanding for longer than the timeout
+	 * Returns the number of commands failed
+	*/
+	size_t expire(uint64_t now_ns);
+
+	/**
+	 * @brief
+	 * True while commands are in flight or queued (cheap, lock-free)
+	*/
+	bool busy() const;
+
+	command_stats_t stats() const;
+
+	/* LE scan control */
+	int set_extended_scan_parameters(const ext_scan_config_t& config, command_callback_t callback = nullptr);
+	int set_extended_scan_enable(
+		bool enable, uint8_t filter_duplicates = SCAN_DUPLICATES_DISABLED,
+		uint16_t duration = 0, uint16_t period = 0, command_callback_t callback = nullptr);
+
+	/* Filter Accept List (used with SCAN_FILTER_*_FILTERED) */
+	int read_filter_accept_list_size(command_callback_t callback);
+	int clear_filter_accept_list(command_callback_t callback = nullptr);
+	int add_to_filter_accept_list(uint8_t address_type, const bt_dev_addr_t& address, command_callback_t callback = nullptr);
+	int remove_from_filter_accept_list(uint8_t address_type, const bt_dev_addr_t& address, command_callback_t callback = nullptr);
+
+	/* Periodic advertising sync (establishment and loss arrive as LE Meta events) */
+	int periodic_advertising_create_sync(const hci_le_periodic_create_sync_t& params, command_callback_t callback = nullptr);
+	int periodic_advertising_create_sync_cancel(command_callback_t callback = nullptr);
+	int periodic_advertising_terminate_sync(uint16_t sync_handle, command_callback_t callback = nullptr);
+
+private:
+	typedef struct{
+		uint16_t opcode;
+		uint8_t length;
+		uint8_t params[HCI_MAX_COMMAND_PARAMS];
+		uint64_t sent_at;
+		command_callback_t callback;
+	} command_t;
+
+	bool write_command(command_t& cmd);
+	void pump(std::vector<command_t>& failed);
+	static void fail(command_t& cmd, uint8_t status);
+
+	int fd;
+	uint64_t timeout_ns;
+
+	std::mutex mutex;
+	std::deque<command_t> waiting;
+	std::deque<command_t> in_flight;
+	uint8_t credits;
+	std::atomic<uint32_t> outstanding;
+
+	std::atomic<uint64_t> n_sent;
+	std::atomic<uint64_t> n_completed;
+	std::atomic<uint64_t> n_status;
+	std::atomic<uint64_t> n_timeouts;
+	std::atomic<uint64_t> n_unmatched;
+};
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * Implementation of kernel HCI socket filter computation
+ * @author Owen Capell
+*/
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "hci_filter_spec.hpp"
+
+/* Packet types are masked to 5 bits; vendor packets (0xff) map to bit 0 */
+static int ptype_bit(uint8_t type){
+	return type == HCI_PACK_VENDOR ? 0 : (type & 31);
+}
+
+hciFilterSpec::hciFilterSpec() :
+	filter(), opcode_locked(false)
+{
+	/**
+	 * Constructor for hciFilterSpec
+	 * Starts empty: nothing passes until subscribed
+	*/
+
+	memset(&filter, 0, sizeof(filter));
+}
+
+hciFilterSpec& hciFilterSpec::packet_type(uint8_t type){
+	filter.type_mask |= 1u << ptype_bit(type);
+	return *this;
+}
+
+hciFilterSpec& hciFilterSpec::event(uint8_t event_code){
+	/**
+	 * Subscribes to one event code
+	 *
+	 * @param event_code	HCI_EVENT_* code (0-63; higher codes are not filterable)
+	 * @returns *this
+	*/
+
+	packet_type(HCI_PACK_EVENT);
+	int bit = event_code & 63;
+	filter.event_mask[bit >> 5] |= 1u << (bit & 31);
+	return *this;
+}
+
+hciFilterSpec& hciFilterSpec::le_meta(){
+	return event(HCI_EVENT_LE_META);
+}
+
+hciFilterSpec& hciFilterSpec::command_responses(uint16_t opcode){
+	/**
+	 * Subscribes to Command Complete and Command Status
+	 * A non-zero opcode lets the kernel drop responses to other commands;
+	 * subscribing with two different opcodes widens back to all opcodes
+	 *
+	 * @param opcode	Command opcode to restrict to, 0 for any
+	 * @returns *this
+	*/
+
+	event(HCI_EVENT_COMMAND_COMPLETE);
+	event(HCI_EVENT_COMMAND_STATUS);
+	if(opcode == 0 || (filter.opcode != 0 && filter.opcode != opcode)){
+		filter.opcode = 0;
+		opcode_locked = true;
+	}
+	else if(!opcode_locked){
+		filter.opcode = opcode;
+	}
+	return *this;
+}
+
+hciFilterSpec& hciFilterSpec::all(){
+	memset(&filter.type_mask, 0xff, sizeof(filter.type_mask));
+	memset(filter.event_mask, 0xff, sizeof(filter.event_mask));
+	filter.opcode = 0;
+	opcode_locked = true;
+	return *this;
+}
+
+hci_sock_filter_t hciFilterSpec::compile() const{
+	return filter;
+}
+
+hciFilterSpec hciFilterSpec::le_meta_only(){
+	hciFilterSpec spec;
+	spec.le_meta();
+	return spec;
+}
@@ -0,0 +1,100 @@
+/**
+ * Header for computing kernel HCI socket filters from subscriptions
+ * @author Owen Capell
+*/
+#ifndef HCI_FILTER_SPEC
+#define HCI_FILTER_SPEC
+
+#include <cstdint>
+
+#include "bluetoothdef.hpp"
+
+/**
+ * @details
+ * Kernel HCI socket filter (SOL_HCI / HCI_FILTER)
+ * Abandons BlueZ struct hci_filter but maintains cast compatability
+ * @param type_mask	Bit per accepted packet type (vendor packets use bit 0)
+ * @param event_mask	Bit per accepted event code (0-63)
+ * @param opcode	If non-zero, only Command Complete/Status for this opcode pass
+*/
+typedef struct{
+	uint32_t type_mask;
+	uint32_t event_mask[2];
+	uint16_t opcode;
+} hci_sock_filter_t;
+
+/**
+ * @details
+ * Traffic the kernel filter kept out of userspace since it was applied
+ * Device counters come from the adapter statistics (what an all-events
+ * filter would have delivered), delivered counters from the capture loop
+ * @param device_packets	Packets seen by the adapter (both directions)
+ * @param device_bytes		Bytes seen by the adapter
+ * @param delivered_packets	Packets that reached our socket
+ * @param delivered_bytes	Bytes that reached our socket
+ * @param saved_wakeups		device_packets - delivered_packets
+ * @param saved_bytes		device_bytes - delivered_bytes
+*/
+typedef struct{
+	uint64_t device_packets;
+	uint64_t device_bytes;
+	uint64_t delivered_packets;
+	uint64_t delivered_bytes;
+	uint64_t saved_wakeups;
+	uint64_t saved_bytes;
+} filter_savings_t;
+
+class hciFilterSpec{
+public:
+	hciFilterSpec();
+
+	/**
+	 * @brief
+	 * Accept every packet of an HCI packet type (HCI_PACK_*)
+	*/
+	hciFilterSpec& packet_type(uint8_t type);
+
+	/**
+	 * @brief
+	 * Accept an HCI event code (implies HCI_PACK_EVENT)
+	*/
+	hciFilterSpec& event(uint8_t event_code);
+
+	/**
+	 * @brief
+	 * Accept LE Meta events (advertising reports, sync events, ...)
+	*/
+	hciFilterSpec& le_meta();
+
+	/**
+	 * @brief
+	 * Accept Command Complete/Status; opcode != 0 restricts them to it
+	*/
+	hciFilterSpec& command_responses(uint16_t opcode = 0);
+
+	/**
+	 * @brief
+	 * Accept everything (the historical BT_Sniff behaviour)
+	*/
+	hciFilterSpec& all();
+
+	/**
+	 * @brief
+	 * Tightest kernel filter accepting exactly the subscriptions
+	*/
+	hci_sock_filter_t compile() const;
+
+	/**
+	 * @brief
+	 * Subscription for the advertising capture loops: LE Meta events only
+	*/
+	static hciFilterSpec le_meta_only();
+
+private:
+	hci_sock_filter_t filter;
+
+	/* Set once any subscription needs responses to every opcode */
+	bool opcode_locked;
+};
+
+#endif
@@ -0,0 +1,808 @@
+/**
+ * Header-only declarative schema of HCI events and LE Meta subevents
+ * @author Owen Capell
+*/
+#ifndef HCI_SCHEMA
+#define HCI_SCHEMA
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "bluetoothdef.hpp"
+#include "hex_format.hpp"
+
+/* data_field of a layout without a variable-length part */
+#define HCI_NO_DATA ((size_t)-1)
+
+/* data_field of a layout whose variable-length part runs to the end of the parameters */
+#define HCI_DATA_TO_END ((size_t)-2)
+
+/* Enough for the text of any event's fixed fields */
+#define HCI_DESCRIBE_MAX 512
+
+/**
+ * @details
+ * Wire encoding of a field type: octets on the wire, a little-endian
+ * load and a text form. Loads go through memcpy, so they compile to one
+ * (unaligned) load on little-endian hosts and a load plus byte swap on
+ * big-endian ones
+*/
+template <typename T>
+struct hciWire;
+
+template <typename T> requires std::is_integral_v<T>
+struct hciWire<T>{
+	static constexpr size_t size = sizeof(T);
+	static constexpr bool by_reference = false;
+
+	static T load(const uint8_t *p){
+		std::make_unsigned_t<T> v;
+		memcpy(&v, p, sizeof(v));
+		if constexpr(std::endian::native == std::endian::big){
+			if constexpr(sizeof(T) == 2) v = __builtin_bswap16(v);
+			else if constexpr(sizeof(T) == 4) v = __builtin_bswap32(v);
+			else if constexpr(sizeof(T) == 8) v = __builtin_bswap64(v);
+		}
+		return (T)v;
+	}
+
+	static int format(T v, char *out, size_t cap){
+		if constexpr(std::is_signed_v<T>) return snprintf(out, cap, "%lld", (long long)v);
+		else return snprintf(out, cap, "0x%0*llX", (int)(2 * sizeof(T)), (unsigned long long)v);
+	}
+};
+
+template <>
+struct hciWire<bt_dev_addr_t>{
+	static constexpr size_t size = sizeof(bt_dev_addr_t);
+	static constexpr bool by_reference = true;
+
+	static bt_dev_addr_t load(const uint8_t *p){
+		bt_dev_addr_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	/* bt_dev_addr_t is packed (alignment 1), so pointing into the packet is safe */
+	static const bt_dev_addr_t* ref(const uint8_t *p){
+		return (const bt_dev_addr_t*)p;
+	}
+
+	static int format(const bt_dev_addr_t& v, char *out, size_t cap){
+		if(cap <= ADDR_STR_LEN) return 0;
+		format_address(v.address, out);
+		out[ADDR_STR_LEN] = '\0';
+		return ADDR_STR_LEN;
+	}
+};
+
+/**
+ * @details
+ * Field name usable as a template argument (get<"rssi">())
+*/
+template <size_t N>
+struct hciName{
+	char text[N];
+
+	constexpr hciName(const char (&s)[N]){
+		for(size_t i=0; i<N; i++) text[i] = s[i];
+	}
+};
+
+/**
+ * @details
+ * One field of a layout: name and wire type, in packet order
+*/
+template <hciName Name, typename T>
+struct hciField{
+	typedef T type;
+	static constexpr const char *name = Name.text;
+};
+
+constexpr bool hci_same_name(const char *a, const char *b){
+	while(*a != '\0' && *a == *b){
+		a++;
+		b++;
+	}
+	return *a == *b;
+}
+
+/**
+ * @details
+ * Layout of a packed parameter block, declared once as its fields in
+ * packet order. Offsets, the fixed size and field names are computed at
+ * compile time. A layout may hide data_field (index of the octet count
+ * of the variable part that follows the fixed fields, HCI_NO_DATA or
+ * HCI_DATA_TO_END) and trailer (fixed octets after the variable part);
+ * event layouts also declare code and name
+*/
+template <typename... F>
+struct hciLayout{
+	static constexpr size_t count = sizeof...(F);
+	static constexpr std::array<const char*, count> field_names = {F::name...};
+
+	static constexpr std::array<size_t, count + 1> offsets = [](){
+		std::array<size_t, count + 1> o{};
+		const size_t sizes[] = {hciWire<typename F::type>::size..., 0};
+		for(size_t i=0; i<count; i++) o[i + 1] = o[i] + sizes[i];
+		return o;
+	}();
+
+	/* Octets of the fixed fields */
+	static constexpr size_t size = offsets[count];
+
+	static constexpr size_t data_field = HCI_NO_DATA;
+	static constexpr size_t trailer = 0;
+
+	template <size_t I>
+	using type = typename std::tuple_element_t<I, std::tuple<F...>>::type;
+
+	template <hciName Name>
+	static constexpr size_t index_of(){
+		for(size_t i=0; i<count; i++){
+			if(hci_same_name(field_names[i], Name.text)) return i;
+		}
+		return count;
+	}
+
+	/**
+	 * @brief
+	 * Calls fn(name, value) for every fixed field of the block at p
+	 * (at least size octets)
+	*/
+	template <typename Fn>
+	static void for_each(const uint8_t *p, Fn&& fn){
+		[&]<size_t... I>(std::index_sequence<I...>){
+			(fn(field_names[I], hciWire<type<I>>::load(p + offsets[I])), ...);
+		}(std::make_index_sequence<count>{});
+	}
+};
+
+/**
+ * @details
+ * Bounds-checked view of one parameter block laid out as L. bind()
+ * checks the fixed fields, the variable part and the trailer against the
+ * end of the buffer once; field reads after that are plain loads at
+ * compile-time offsets
+*/
+template <typename L>
+class hciView{
+public:
+	hciView() : base(nullptr), length(0) {}
+
+	/**
+	 * @brief
+	 * Binds to the block at p if all of it lies before end
+	 * Returns false (and stays unbound) otherwise
+	*/
+	bool bind(const uint8_t *p, const uint8_t *end){
+		if(p == nullptr || end < p || (size_t)(end - p) < L::size) return false;
+		size_t avail = (size_t)(end - p);
+		size_t total = L::size + L::trailer;
+		if constexpr(L::data_field == HCI_DATA_TO_END){
+			total = avail;
+		}
+		else if constexpr(L::data_field != HCI_NO_DATA){
+			total += (size_t)hciWire<typename L::template type<L::data_field>>::load(p + L::offsets[L::data_field]);
+		}
+		if(avail < total) return false;
+		base = p;
+		length = total;
+		return true;
+	}
+
+	bool bind(const uint8_t *p, size_t len){
+		return bind(p, p + len);
+	}
+
+	explicit operator bool() const{
+		return base != nullptr;
+	}
+
+	template <hciName Name>
+	auto get() const{
+		constexpr size_t I = L::template index_of<Name>();
+		static_assert(I < L::count, "field not declared in this layout");
+		return hciWire<typename L::template type<I>>::load(base + L::offsets[I]);
+	}
+
+	/**
+	 * @brief
+	 * Pointer to a field inside the packet (byte-array types only, such
+	 * as addresses handed to the report filter)
+	*/
+	template <hciName Name>
+	auto ref() const{
+		constexpr size_t I = L::template index_of<Name>();
+		static_assert(I < L::count, "field not declared in this layout");
+		typedef hciWire<typename L::template type<I>> wire;
+		static_assert(wire::by_reference, "only byte-array fields can be referenced");
+		return wire::ref(base + L::offsets[I]);
+	}
+
+	/* Variable part following the fixed fields */
+	const uint8_t* data() const{
+		return base + L::size;
+	}
+
+	size_t data_length() const{
+		return length - L::size - L::trailer;
+	}
+
+	/* Fixed octets following the variable part */
+	const uint8_t* trailer() const{
+		return base + length - L::trailer;
+	}
+
+	/* Octets of the whole block (fixed fields, variable part and trailer) */
+	size_t extent() const{
+		return length;
+	}
+
+	const uint8_t* raw() const{
+		return base;
+	}
+
+private:
+	const uint8_t *base;
+	size_t length;
+};
+
+template <typename L>
+size_t hci_format_fields(const uint8_t *params, size_t len, char *out, size_t cap){
+	/**
+	 * Stringifier generated from a layout: the event name followed by
+	 * name=value for every fixed field and the size of the variable part
+	 *
+	 * @param params	Parameters of the event (after the subevent code for LE Meta)
+	 * @param len	Octets at params
+	 * @param out	Destination, always terminated
+	 * @param cap	Octets available at out
+	 * @returns characters written (without the terminator)
+	*/
+
+	if(cap == 0) return 0;
+	size_t n = 0;
+	auto put = [&](int w){
+		if(w > 0) n += (size_t)w < cap - 1 - n ? (size_t)w : cap - 1 - n;
+	};
+
+	out[0] = '\0';
+	put(snprintf(out, cap, "%s", L::name));
+	hciView<L> view;
+	if(!view.bind(params, len)){
+		put(snprintf(out + n, cap - n, " (truncated, %zu octets)", len));
+		return n;
+	}
+	L::for_each(params, [&](const char *name, auto value){
+		put(snprintf(out + n, cap - n, " %s=", name));
+		put(hciWire<decltype(value)>::format(value, out + n, cap - n));
+	});
+	if constexpr(L::data_field != HCI_NO_DATA){
+		put(snprintf(out + n, cap - n, " +%zu octets", view.data_length()));
+	}
+	return n;
+}
+
+/**
+ * @details
+ * Entry of a generated event or subevent table
+ * @param name	Human-readable name from the specification
+ * @param min_params	Octets of the fixed parameters (0 when no layout is declared)
+ * @param format	Stringifier, nullptr when no layout is declared
+*/
+typedef struct{
+	const char *name;
+	size_t min_params;
+	size_t (*format)(const uint8_t *params, size_t len, char *out, size_t cap);
+} hci_schema_entry_t;
+
+/**
+ * @details
+ * Event code and table entry, the input of hci_schema_table()
+*/
+typedef struct{
+	uint8_t code;
+	hci_schema_entry_t entry;
+} hci_schema_desc_t;
+
+template <typename L>
+constexpr hci_schema_desc_t hci_describe(){
+	return {L::code, {L::name, L::size, &hci_format_fields<L>}};
+}
+
+constexpr hci_schema_desc_t hci_describe(uint8_t code, const char *name){
+	return {code, {name, 0, nullptr}};
+}
+
+template <size_t N>
+constexpr std::array<hci_schema_entry_t, 256> hci_schema_table(const hci_schema_desc_t (&descs)[N], const char *unknown){
+	/* Dense table indexed by code; codes not described keep the unknown name */
+	std::array<hci_schema_entry_t, 256> t{};
+	for(auto& e : t) e = {unknown, 0, nullptr};
+	for(const hci_schema_desc_t& d : descs) t[d.code] = d.entry;
+	return t;
+}
+
+/**
+ * @details
+ * Value and name of an enumerated parameter
+*/
+typedef struct{
+	uint16_t value;
+	const char *name;
+} hci_enum_name_t;
+
+template <size_t N>
+constexpr const char* hci_enum_lookup(const hci_enum_name_t (&names)[N], uint16_t value, const char *unknown){
+	for(const hci_enum_name_t& e : names){
+		if(e.value == value) return e.name;
+	}
+	return unknown;
+}
+
+/* Bluetooth Core Specifications, Version 5.3, Vol 4, Part E, 5.4.4 and 7.7 */
+
+struct hciEventHeader : hciLayout<
+	hciField<"event_code", uint8_t>,
+	hciField<"param_length", uint8_t>>{
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct hciDisconnectionComplete : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"reason", uint8_t>>{
+	static constexpr uint8_t code = HCI_EVENT_DISCONNECTION_COMPLETE;
+	static constexpr const char *name = "Disconnection Complete";
+};
+
+struct hciEncryptionChange : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"encryption_enabled", uint8_t>>{
+	static constexpr uint8_t code = HCI_EVENT_ENCRYPT_CHANGE_V1;
+	static constexpr const char *name = "Encryption Change";
+};
+
+struct hciCommandComplete : hciLayout<
+	hciField<"num_hci_command_packets", uint8_t>,
+	hciField<"command_opcode", uint16_t>>{
+	static constexpr uint8_t code = HCI_EVENT_COMMAND_COMPLETE;
+	static constexpr const char *name = "Command Complete";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct hciCommandStatus : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"num_hci_command_packets", uint8_t>,
+	hciField<"command_opcode", uint16_t>>{
+	static constexpr uint8_t code = HCI_EVENT_COMMAND_STATUS;
+	static constexpr const char *name = "Command Status";
+};
+
+struct hciHardwareError : hciLayout<
+	hciField<"hardware_code", uint8_t>>{
+	static constexpr uint8_t code = 0x10;
+	static constexpr const char *name = "Hardware Error";
+};
+
+struct hciNumberOfCompletedPackets : hciLayout<
+	hciField<"num_handles", uint8_t>>{
+	static constexpr uint8_t code = 0x13;
+	static constexpr const char *name = "Number Of Completed Packets";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct hciDataBufferOverflow : hciLayout<
+	hciField<"link_type", uint8_t>>{
+	static constexpr uint8_t code = 0x1A;
+	static constexpr const char *name = "Data Buffer Overflow";
+};
+
+struct hciLeMeta : hciLayout<
+	hciField<"subevent_code", uint8_t>>{
+	static constexpr uint8_t code = HCI_EVENT_LE_META;
+	static constexpr const char *name = "LE Meta";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+/* LE Meta subevents (7.7.65); parameters start after the subevent code */
+
+struct leConnectionComplete : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"role", uint8_t>,
+	hciField<"peer_address_type", uint8_t>,
+	hciField<"peer_address", bt_dev_addr_t>,
+	hciField<"connection_interval", uint16_t>,
+	hciField<"peripheral_latency", uint16_t>,
+	hciField<"supervision_timeout", uint16_t>,
+	hciField<"central_clock_accuracy", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_CONNECTION_COMPLETE;
+	static constexpr const char *name = "LE Connection Complete";
+};
+
+/* Report subevents: Num_Reports, then the reports back to back */
+
+struct leAdvertisingReport : hciLayout<
+	hciField<"num_reports", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_ADVERTISING_REPORT;
+	static constexpr const char *name = "LE Advertising Report";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct leConnectionUpdateComplete : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"connection_interval", uint16_t>,
+	hciField<"peripheral_latency", uint16_t>,
+	hciField<"supervision_timeout", uint16_t>>{
+	static constexpr uint8_t code = 0x03;
+	static constexpr const char *name = "LE Connection Update Complete";
+};
+
+struct leDataLengthChange : hciLayout<
+	hciField<"connection_handle", uint16_t>,
+	hciField<"max_tx_octets", uint16_t>,
+	hciField<"max_tx_time", uint16_t>,
+	hciField<"max_rx_octets", uint16_t>,
+	hciField<"max_rx_time", uint16_t>>{
+	static constexpr uint8_t code = 0x07;
+	static constexpr const char *name = "LE Data Length Change";
+};
+
+struct leEnhancedConnectionComplete : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"role", uint8_t>,
+	hciField<"peer_address_type", uint8_t>,
+	hciField<"peer_address", bt_dev_addr_t>,
+	hciField<"local_resolvable_private_address", bt_dev_addr_t>,
+	hciField<"peer_resolvable_private_address", bt_dev_addr_t>,
+	hciField<"connection_interval", uint16_t>,
+	hciField<"peripheral_latency", uint16_t>,
+	hciField<"supervision_timeout", uint16_t>,
+	hciField<"central_clock_accuracy", uint8_t>>{
+	static constexpr uint8_t code = 0x0A;
+	static constexpr const char *name = "LE Enhanced Connection Complete";
+};
+
+struct leDirectedAdvertisingReport : hciLayout<
+	hciField<"num_reports", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_DIRECTED_ADVERTISING_REPORT;
+	static constexpr const char *name = "LE Directed Advertising Report";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct lePhyUpdateComplete : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"tx_phy", uint8_t>,
+	hciField<"rx_phy", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_PHY_UPDATE_COMPLETE;
+	static constexpr const char *name = "LE PHY Update Complete";
+};
+
+struct leExtendedAdvertisingReport : hciLayout<
+	hciField<"num_reports", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT;
+	static constexpr const char *name = "LE Extended Advertising Report";
+	static constexpr size_t data_field = HCI_DATA_TO_END;
+};
+
+struct lePeriodicSyncEstablished : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"sync_handle", uint16_t>,
+	hciField<"advertising_sid", uint8_t>,
+	hciField<"advertiser_address_type", uint8_t>,
+	hciField<"advertiser_address", bt_dev_addr_t>,
+	hciField<"advertiser_phy", uint8_t>,
+	hciField<"periodic_advertising_interval", uint16_t>,
+	hciField<"advertiser_clock_accuracy", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED;
+	static constexpr const char *name = "LE Periodic Advertising Sync Established";
+};
+
+struct lePeriodicAdvertisingReport : hciLayout<
+	hciField<"sync_handle", uint16_t>,
+	hciField<"tx_power", int8_t>,
+	hciField<"rssi", int8_t>,
+	hciField<"cte_type", uint8_t>,
+	hciField<"data_status", uint8_t>,
+	hciField<"data_length", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_PERIODIC_ADVERTISING_REPORT;
+	static constexpr const char *name = "LE Periodic Advertising Report";
+	static constexpr size_t data_field = index_of<"data_length">();
+};
+
+struct lePeriodicSyncLost : hciLayout<
+	hciField<"sync_handle", uint16_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_PERIODIC_ADVERTISING_SYNC_LOST;
+	static constexpr const char *name = "LE Periodic Advertising Sync Lost";
+};
+
+struct leScanTimeout : hciLayout<>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_SCAN_TIMEOUT;
+	static constexpr const char *name = "LE Scan Timeout";
+};
+
+struct leAdvertisingSetTerminated : hciLayout<
+	hciField<"status", uint8_t>,
+	hciField<"advertising_handle", uint8_t>,
+	hciField<"connection_handle", uint16_t>,
+	hciField<"num_completed_extended_advertising_events", uint8_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_ADVERTISING_SET_TERMINATED;
+	static constexpr const char *name = "LE Advertising Set Terminated";
+};
+
+struct leScanRequestReceived : hciLayout<
+	hciField<"advertising_handle", uint8_t>,
+	hciField<"scanner_address_type", uint8_t>,
+	hciField<"scanner_address", bt_dev_addr_t>>{
+	static constexpr uint8_t code = SUBEVT_HCI_LE_SCAN_REQUEST_RECEIVED;
+	static constexpr const char *name = "LE Scan Request Received";
+};
+
+struct leChannelSelectionAlgorithm : hciLayout<
+	hciField<"connection_handle", uint16_t>,
+	hciField<"channel_selection_algorithm", uint8_t>>{
+	static constexpr uint8_t code = 0x14;
+	static constexpr const char *name = "LE Channel Selection Algorithm";
+};
+
+/* One report inside the report subevents */
+
+struct leLegacyReportItem : hciLayout<
+	hciField<"event_type", uint8_t>,
+	hciField<"address_type", uint8_t>,
+	hciField<"address", bt_dev_addr_t>,
+	hciField<"data_length", uint8_t>>{
+	static constexpr size_t data_field = index_of<"data_length">();
+	/* RSSI follows the data */
+	static constexpr size_t trailer = 1;
+};
+
+struct leDirectedReportItem : hciLayout<
+	hciField<"event_type", uint8_t>,
+	hciField<"address_type", uint8_t>,
+	hciField<"address", bt_dev_addr_t>,
+	hciField<"direct_address_type", uint8_t>,
+	hciField<"direct_address", bt_dev_addr_t>,
+	hciField<"rssi", int8_t>>{
+};
+
+struct leExtendedReportItem : hciLayout<
+	hciField<"event_type", uint16_t>,
+	hciField<"address_type", uint8_t>,
+	hciField<"address", bt_dev_addr_t>,
+	hciField<"primary_phy", uint8_t>,
+	hciField<"secondary_phy", uint8_t>,
+	hciField<"advertising_sid", uint8_t>,
+	hciField<"tx_power", int8_t>,
+	hciField<"rssi", int8_t>,
+	hciField<"periodic_advertising_interval", uint16_t>,
+	hciField<"direct_address_type", uint8_t>,
+	hciField<"direct_address", bt_dev_addr_t>,
+	hciField<"data_length", uint8_t>>{
+	static constexpr size_t data_field = index_of<"data_length">();
+};
+
+/* The packed structs in bluetoothdef.hpp still build packets; keep them in step */
+static_assert(hciEventHeader::size == sizeof(hci_pack_event_head_t));
+static_assert(hciCommandComplete::size == sizeof(hci_event_command_complete_t));
+static_assert(hciCommandStatus::size == sizeof(hci_event_command_status_t));
+static_assert(lePeriodicSyncEstablished::size == sizeof(hci_le_meta_periodic_sync_established_t));
+static_assert(lePeriodicAdvertisingReport::size == sizeof(hci_le_meta_periodic_report_t));
+static_assert(lePeriodicSyncLost::size == sizeof(hci_le_meta_periodic_sync_lost_t));
+static_assert(leLegacyReportItem::size == sizeof(hci_le_meta_adv_report_t));
+static_assert(leDirectedReportItem::size == sizeof(hci_le_meta_direct_report_t));
+static_assert(leExtendedReportItem::size == sizeof(hci_le_meta_ear_event_t));
+static_assert(leExtendedReportItem::offsets[leExtendedReportItem::index_of<"rssi">()] == offsetof(hci_le_meta_ear_event_t, rssi));
+
+/**
+ * @details
+ * HCI events of 7.7. Events with a declared layout get a stringifier and
+ * a minimum parameter length; the rest are named only. Covering another
+ * event is one layout (or one name) here
+*/
+inline constexpr hci_schema_desc_t hci_event_descs[] = {
+	hci_describe(HCI_EVENT_INQUIRY_COMPLETE, "Inquiry Complete"),
+	hci_describe(HCI_EVENT_INQUIRY_RESULT, "Inquiry Result"),
+	hci_describe(HCI_EVENT_CONNECTION_COMPLETE, "Connection Complete"),
+	hci_describe(HCI_EVENT_CONNECTION_REQUEST, "Connection Request"),
+	hci_describe<hciDisconnectionComplete>(),
+	hci_describe(HCI_EVENT_AUTHENTICATION_COMPLETE, "Authentication Complete"),
+	hci_describe(HCI_EVENT_REMOTE_NAMEREQUEST_COMPLETE, "Remote Name Request Complete"),
+	hci_describe<hciEncryptionChange>(),
+	hci_describe(HCI_EVENT_CHANGE_CONN_LINK_KEY_COMPLETE, "Change Connection Link Key Complete"),
+	hci_describe(HCI_EVENT_LINK_KEY_TYPE_CHANGE, "Link Key Type Changed"),
+	hci_describe(HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES, "Read Remote Supported Features Complete"),
+	hci_describe(HCI_EVENT_READ_REMOTE_VERSION_INFO_COMPLETE, "Read Remote Version Information Complete"),
+	hci_describe(HCI_EVENT_QOS_SETUP_COMPLETE, "QoS Setup Complete"),
+	hci_describe<hciCommandComplete>(),
+	hci_describe<hciCommandStatus>(),
+	hci_describe<hciHardwareError>(),
+	hci_describe(0x11, "Flush Occurred"),
+	hci_describe(0x12, "Role Change"),
+	hci_describe<hciNumberOfCompletedPackets>(),
+	hci_describe(0x14, "Mode Change"),
+	hci_describe(0x15, "Return Link Keys"),
+	hci_describe(0x16, "PIN Code Request"),
+	hci_describe(0x17, "Link Key Request"),
+	hci_describe(0x18, "Link Key Notification"),
+	hci_describe(0x19, "Loopback Command"),
+	hci_describe<hciDataBufferOverflow>(),
+	hci_describe(0x1B, "Max Slots Change"),
+	hci_describe(0x1C, "Read Clock Offset Complete"),
+	hci_describe(0x1D, "Connection Packet Type Changed"),
+	hci_describe(0x1E, "QoS Violation"),
+	hci_describe(0x20, "Page Scan Repetition Mode Change"),
+	hci_describe(0x21, "Flow Specification Complete"),
+	hci_describe(0x22, "Inquiry Result with RSSI"),
+	hci_describe(0x23, "Read Remote Extended Features Complete"),
+	hci_describe(0x2C, "Synchronous Connection Complete"),
+	hci_describe(0x2D, "Synchronous Connection Changed"),
+	hci_describe(0x2E, "Sniff Subrating"),
+	hci_describe(0x2F, "Extended Inquiry Result"),
+	hci_describe(0x30, "Encryption Key Refresh Complete"),
+	hci_describe(0x31, "IO Capability Request"),
+	hci_describe(0x32, "IO Capability Response"),
+	hci_describe(0x33, "User Confirmation Request"),
+	hci_describe(0x34, "User Passkey Request"),
+	hci_describe(0x35, "Remote OOB Data Request"),
+	hci_describe(0x36, "Simple Pairing Complete"),
+	hci_describe(0x38, "Link Supervision Timeout Changed"),
+	hci_describe(0x39, "Enhanced Flush Complete"),
+	hci_describe(0x3B, "User Passkey Notification"),
+	hci_describe(0x3C, "Keypress Notification"),
+	hci_describe(0x3D, "Remote Host Supported Features Notification"),
+	hci_describe<hciLeMeta>(),
+	hci_describe(0x48, "Number Of Completed Data Blocks"),
+	hci_describe(0x49, "Triggered Clock Capture"),
+	hci_describe(0x4A, "Synchronization Train Complete"),
+	hci_describe(0x4B, "Synchronization Train Received"),
+	hci_describe(0x4C, "Connectionless Peripheral Broadcast Receive"),
+	hci_describe(0x4D, "Connectionless Peripheral Broadcast Timeout"),
+	hci_describe(0x4E, "Truncated Page Complete"),
+	hci_describe(0x4F, "Peripheral Page Response Timeout"),
+	hci_describe(0x50, "Connectionless Peripheral Broadcast Channel Map Change"),
+	hci_describe(0x51, "Inquiry Response Notification"),
+	hci_describe(0x52, "Authenticated Payload Timeout Expired"),
+	hci_describe(0x53, "SAM Status Change"),
+	hci_describe(HCI_EVENT_ENCRYPT_CHANGE_V2, "Encryption Change [v2]"),
+	hci_describe(0xFF, "Vendor Specific")
+};
+
+/**
+ * @details
+ * LE Meta subevents of 7.7.65
+*/
+inline constexpr hci_schema_desc_t le_subevent_descs[] = {
+	hci_describe<leConnectionComplete>(),
+	hci_describe<leAdvertisingReport>(),
+	hci_describe<leConnectionUpdateComplete>(),
+	hci_describe(0x04, "LE Read Remote Features Complete"),
+	hci_describe(0x05, "LE Long Term Key Request"),
+	hci_describe(0x06, "LE Remote Connection Parameter Request"),
+	hci_describe<leDataLengthChange>(),
+	hci_describe(0x08, "LE Read Local P-256 Public Key Complete"),
+	hci_describe(0x09, "LE Generate DHKey Complete"),
+	hci_describe<leEnhancedConnectionComplete>(),
+	hci_describe<leDirectedAdvertisingReport>(),
+	hci_describe<lePhyUpdateComplete>(),
+	hci_describe<leExtendedAdvertisingReport>(),
+	hci_describe<lePeriodicSyncEstablished>(),
+	hci_describe<lePeriodicAdvertisingReport>(),
+	hci_describe<lePeriodicSyncLost>(),
+	hci_describe<leScanTimeout>(),
+	hci_describe<leAdvertisingSetTerminated>(),
+	hci_describe<leScanRequestReceived>(),
+	hci_describe<leChannelSelectionAlgorithm>(),
+	hci_describe(0x15, "LE Connectionless IQ Report"),
+	hci_describe(0x16, "LE Connection IQ Report"),
+	hci_describe(0x17, "LE CTE Request Failed"),
+	hci_describe(0x18, "LE Periodic Advertising Sync Transfer Received"),
+	hci_describe(0x19, "LE CIS Established"),
+	hci_describe(0x1A, "LE CIS Request"),
+	hci_describe(0x1B, "LE Create BIG Complete"),
+	hci_describe(0x1C, "LE Terminate BIG Complete"),
+	hci_describe(0x1D, "LE BIG Sync Established"),
+	hci_describe(0x1E, "LE BIG Sync Lost"),
+	hci_describe(0x1F, "LE Request Peer SCA Complete"),
+	hci_describe(0x20, "LE Path Loss Threshold"),
+	hci_describe(0x21, "LE Transmit Power Reporting"),
+	hci_describe(0x22, "LE BIGInfo Advertising Report"),
+	hci_describe(0x23, "LE Subrate Change")
+};
+
+inline constexpr std::array<hci_schema_entry_t, 256> hci_event_table = hci_schema_table(hci_event_descs, "UNKNOWN HCI EVENT");
+inline constexpr std::array<hci_schema_entry_t, 256> le_subevent_table = hci_schema_table(le_subevent_descs, "UNKNOWN LE SUBEVENT");
+
+constexpr const hci_schema_entry_t& hci_event_info(uint8_t event_code){
+	return hci_event_table[event_code];
+}
+
+constexpr const hci_schema_entry_t& le_subevent_info(uint8_t subevent){
+	return le_subevent_table[subevent];
+}
+
+/* Event_Type of reports, in the Extended Advertising Report legacy PDU encoding */
+inline constexpr hci_enum_name_t adv_pdu_names[] = {
+	{ADV_IND, "ADV_IND"},
+	{ADV_DIRECT_IND, "ADV_DIRECT_IND"},
+	{ADV_SCAN_IND, "ADV_SCAN_IND"},
+	{ADV_NONCONN_IND, "ADV_NONCONN_IND"},
+	{SCAN_RSP_TO_ADV_IND, "SCAN_RSP to an ADV_IND"},
+	{SCAN_RSP_TO_ADV_SCAN_IND, "SCAN_RSP to an ADV_SCAN_IND"}
+};
+
+inline constexpr hci_enum_name_t address_type_names[] = {
+	{0x00, "Public"},
+	{0x01, "Random"},
+	{0x02, "Public Identity"},
+	{0x03, "Random (static)"},
+	{0xFF, "None (anonymous)"}
+};
+
+inline constexpr hci_enum_name_t hci_status_names[] = {
+	{HCI_STATUS_SUCCESS, "Success"},
+	{HCI_STATUS_MEMORY_CAPACITY_EXCEEDED, "Memory Capacity Exceeded"},
+	{HCI_STATUS_COMMAND_DISALLOWED, "Command Disallowed"},
+	{HCI_STATUS_LIMITED_RESOURCES, "Connection Rejected due to Limited Resources"},
+	{HCI_STATUS_SYNC_TIMEOUT, "Connection Failed to be Established / Synchronization Timeout"},
+	{HCI_STATUS_CANCELLED_BY_HOST, "Operation Cancelled by Host"}
+};
+
+constexpr const char* adv_event_name(uint16_t event){
+	return hci_enum_lookup(adv_pdu_names, event, "EVENT TYPE NOT FOUND");
+}
+
+constexpr const char* address_type_name(uint8_t address_type){
+	return hci_enum_lookup(address_type_names, address_type, "UNKOWN ADDRESS TYPE");
+}
+
+constexpr const char* hci_status_name(uint8_t status){
+	return hci_enum_lookup(hci_status_names, status, "UNKNOWN STATUS");
+}
+
+inline size_t describe_hci_event(const uint8_t *buf, size_t len, char *out, size_t cap){
+	/**
+	 * Text of one raw HCI event (H4 type octet first) from the schema:
+	 * LE Meta events are described by their subevent, other events by
+	 * their own layout, undeclared ones by name and parameter length
+	 *
+	 * @param buf	Raw packet
+	 * @param len	Octets in buf
+	 * @param out	Destination, always terminated
+	 * @param cap	Octets available at out
+	 * @returns characters written, 0 if buf is not an event
+	*/
+
+	hciView<hciEventHeader> head;
+	if(cap == 0 || len < 1 || buf[0] != HCI_PACK_EVENT || !head.bind(buf + 1, len - 1)) return 0;
+	const uint8_t *params = head.data();
+	size_t param_len = head.data_length();
+	if(head.get<"param_length">() < param_len) param_len = head.get<"param_length">();
+
+	const hci_schema_entry_t *entry = &hci_event_info(head.get<"event_code">());
+	if(head.get<"event_code">() == HCI_EVENT_LE_META && param_len >= 1){
+		entry = &le_subevent_info(params[0]);
+		params++;
+		param_len--;
+	}
+	if(entry->format != nullptr) return entry->format(params, param_len, out, cap);
+
+	int w = snprintf(out, cap, "%s (%zu octets)", entry->name, param_len);
+	if(w < 0) return 0;
+	return (size_t)w < cap ? (size_t)w : cap - 1;
+}
+
+#endif
@@ -0,0 +1,275 @@
+/**
+ * Implementation of hex and Bluetooth address formatting/parsing
+ * Scalar paths use 512-byte digit-pair tables; bulk hex uses SSSE3 or
+ * AVX2 when the CPU has them (picked once at runtime)
+ * @author Owen Capell
+*/
+#include <array>
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "hex_format.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_FORMAT_X86 1
+#endif
+
+static constexpr std::array<char, 512> build_hex_lut(const char *digits){
+	std::array<char, 512> t{};
+	for(int v=0; v<256; v++){
+		t[2 * v] = digits[v >> 4];
+		t[2 * v + 1] = digits[v & 0x0F];
+	}
+	return t;
+}
+
+/* Declared extern in the header; constant-initialized, so usable during static init */
+const std::array<char, 512> hex_lut_lower = build_hex_lut("0123456789abcdef");
+const std::array<char, 512> hex_lut_upper = build_hex_lut("0123456789ABCDEF");
+
+/* Digit value of every character, -1 if it is not a hex digit */
+static constexpr std::array<int8_t, 256> build_digit_lut(){
+	std::array<int8_t, 256> t{};
+	for(int c=0; c<256; c++) t[c] = -1;
+	for(int c='0'; c<='9'; c++) t[c] = (int8_t)(c - '0');
+	for(int c='a'; c<='f'; c++) t[c] = (int8_t)(c - 'a' + 10);
+	for(int c='A'; c<='F'; c++) t[c] = (int8_t)(c - 'A' + 10);
+	return t;
+}
+
+static constexpr std::array<int8_t, 256> digit_lut = build_digit_lut();
+
+void format_address(const uint8_t *addr, char *out){
+	/**
+	 * Fixed 17-character address formatter (same text as the former
+	 * stringstream/toupper version)
+	 *
+	 * @param addr	6 octets, least significant first
+	 * @param out	Destination of ADDR_STR_LEN characters
+	*/
+
+	for(int i=0; i<6; i++){
+		memcpy(out + 3 * i, hex_lut_upper.data() + 2 * addr[5 - i], 2);
+		if(i < 5) out[3 * i + 2] = ':';
+	}
+}
+
+static size_t hex_encode_scalar(const uint8_t *data, size_t len, char *out, bool upper){
+	const char *lut = upper ? hex_lut_upper.data() : hex_lut_lower.data();
+	for(size_t i=0; i<len; i++) memcpy(out + 2 * i, lut + 2 * data[i], 2);
+	return 2 * len;
+}
+
+static size_t hex_dump_scalar(const uint8_t *data, size_t len, char *out){
+	for(size_t i=0; i<len; i++){
+		memcpy(out + 3 * i, hex_lut_lower.data() + 2 * data[i], 2);
+		out[3 * i + 2] = ' ';
+	}
+	return 3 * len;
+}
+
+#ifdef HEX_FORMAT_X86
+
+__attribute__((target("ssse3")))
+static inline void hex_pairs_ssse3(__m128i in, __m128i digits, __m128i& lo8, __m128i& hi8){
+	/* lo8 = digits of octets 0-7, hi8 = digits of octets 8-15 (high nibble first) */
+	__m128i mask = _mm_set1_epi8(0x0F);
+	__m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+	__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, mask));
+	lo8 = _mm_unpacklo_epi8(hi, lo);
+	hi8 = _mm_unpackhi_epi8(hi, lo);
+}
+
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(const uint8_t *data, size_t len, char *out, bool upper){
+	__m128i digits = upper ?
+		_mm_setr_epi8('0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F') :
+		_mm_setr_epi8('0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f');
+
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16){
+		__m128i a, b;
+		hex_pairs_ssse3(_mm_loadu_si128((const __m128i*)(data + i)), digits, a, b);
+		_mm_storeu_si128((__m128i*)(out + 2 * i), a);
+		_mm_storeu_si128((__m128i*)(out + 2 * i + 16), b);
+	}
+	hex_encode_scalar(data + i, len - i, out + 2 * i, upper);
+	return 2 * len;
+}
+
+__attribute__((target("ssse3")))
+static size_t hex_dump_ssse3(const uint8_t *data, size_t len, char *out){
+	/**
+	 * 16 octets -> 32 digits -> three 16-byte stores of "xx " groups.
+	 * Each output vector gathers digits from a and/or b with pshufb
+	 * (-1 lanes become zero) and ORs in the spaces
+	*/
+
+	const __m128i digits = _mm_setr_epi8('0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f');
+	const __m128i o0_a = _mm_setr_epi8(0,1,-1,2,3,-1,4,5,-1,6,7,-1,8,9,-1,10);
+	const __m128i o0_s = _mm_setr_epi8(0,0,' ',0,0,' ',0,0,' ',0,0,' ',0,0,' ',0);
+	const __m128i o1_a = _mm_setr_epi8(11,-1,12,13,-1,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i o1_b = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,0,1,-1,2,3,-1,4,5);
+	const __m128i o1_s = _mm_setr_epi8(0,' ',0,0,' ',0,0,' ',0,0,' ',0,0,' ',0,0);
+	const __m128i o2_b = _mm_setr_epi8(-1,6,7,-1,8,9,-1,10,11,-1,12,13,-1,14,15,-1);
+	const __m128i o2_s = _mm_setr_epi8(' ',0,0,' ',0,0,' ',0,0,' ',0,0,' ',0,0,' ');
+
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16){
+		__m128i a, b;
+		hex_pairs_ssse3(_mm_loadu_si128((const __m128i*)(data + i)), digits, a, b);
+		__m128i o0 = _mm_or_si128(_mm_shuffle_epi8(a, o0_a), o0_s);
+		__m128i o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, o1_a), _mm_shuffle_epi8(b, o1_b)), o1_s);
+		__m128i o2 = _mm_or_si128(_mm_shuffle_epi8(b, o2_b), o2_s);
+		_mm_storeu_si128((__m128i*)(out + 3 * i), o0);
+		_mm_storeu_si128((__m128i*)(out + 3 * i + 16), o1);
+		_mm_storeu_si128((__m128i*)(out + 3 * i + 32), o2);
+	}
+	hex_dump_scalar(data + i, len - i, out + 3 * i);
+	return 3 * len;
+}
+
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(const uint8_t *data, size_t len, char *out, bool upper){
+	/* vpshufb works per 128-bit lane; unpack keeps octets 0-7/16-23 and 8-15/24-31 together */
+	__m256i digits = upper ?
+		_mm256_setr_epi8('0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F',
+			'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F') :
+		_mm256_setr_epi8('0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f',
+			'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f');
+	__m256i mask = _mm256_set1_epi8(0x0F);
+
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32){
+		__m256i in = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+		__m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, mask));
+		__m256i a = _mm256_unpacklo_epi8(hi, lo);
+		__m256i b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i*)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	hex_encode_ssse3(data + i, len - i, out + 2 * i, upper);
+	return 2 * len;
+}
+
+#endif
+
+typedef size_t (*hex_encode_fn)(const uint8_t*, size_t, char*, bool);
+typedef size_t (*hex_dump_fn)(const uint8_t*, size_t, char*);
+
+typedef struct{
+	hex_encode_fn encode;
+	hex_dump_fn dump;
+	const char *name;
+} hex_backend_t;
+
+static hex_backend_t select_backend(){
+#ifdef HEX_FORMAT_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return {hex_encode_avx2, hex_dump_ssse3, "avx2"};
+	if(__builtin_cpu_supports("ssse3")) return {hex_encode_ssse3, hex_dump_ssse3, "ssse3"};
+#endif
+	return {hex_encode_scalar, hex_dump_scalar, "scalar"};
+}
+
+static const hex_backend_t& backend(){
+	static const hex_backend_t b = select_backend();
+	return b;
+}
+
+size_t hex_encode(const uint8_t *data, size_t len, char *out, bool upper){
+	/**
+	 * Bulk hex encoding with the fastest implementation for this CPU
+	 *
+	 * @param data	Octets to encode
+	 * @param len	Number of octets
+	 * @param out	Destination of 2 * len characters
+	 * @param upper	Upper case digits
+	 * @returns characters written
+	*/
+
+	/* Short inputs (addresses, small fields) never reach the vector loops */
+	if(len < 16) return hex_encode_scalar(data, len, out, upper);
+	return backend().encode(data, len, out, upper);
+}
+
+size_t hex_dump(const uint8_t *data, size_t len, char *out){
+	/**
+	 * Raw capture dump: two lower case digits and a space per octet,
+	 * byte-identical to printf("%02x ") in a loop
+	 *
+	 * @param data	Octets to dump
+	 * @param len	Number of octets
+	 * @param out	Destination of HEX_DUMP_STRIDE * len characters
+	 * @returns characters written
+	*/
+
+	if(len < 16) return hex_dump_scalar(data, len, out);
+	return backend().dump(data, len, out);
+}
+
+const char* hex_format_backend(){
+	return backend().name;
+}
+
+bool parse_address(const char *str, size_t len, bt_dev_addr_t& out){
+	/**
+	 * Parses one address; digits are looked up in a 256-entry table
+	 *
+	 * @param str	Text (not necessarily terminated)
+	 * @param len	Characters in str (must be ADDR_STR_LEN)
+	 * @param out	Receives the address, least significant octet first
+	 * @returns true on success (out is untouched on failure)
+	*/
+
+	if(len != ADDR_STR_LEN) return false;
+
+	char sep = str[2];
+	if(sep != ':' && sep != '-') return false;
+
+	bt_dev_addr_t addr;
+	for(int i=0; i<6; i++){
+		const char *p = str + 3 * i;
+		if(i < 5 && p[2] != sep) return false;
+		int hi = digit_lut[(uint8_t)p[0]];
+		int lo = digit_lut[(uint8_t)p[1]];
+		if((hi | lo) < 0) return false;
+		addr.address[5 - i] = (uint8_t)((hi << 4) | lo);
+	}
+	out = addr;
+	return true;
+}
+
+int parse_address_list(const char *str, size_t len, std::vector<bt_dev_addr_t>& out){
+	/**
+	 * Splits on commas and whitespace and parses every entry
+	 *
+	 * @param str	Text (not necessarily terminated)
+	 * @param len	Characters in str
+	 * @param out	Parsed addresses are appended here (nothing on failure)
+	 * @returns number of addresses appended, -1 if an entry is malformed
+	*/
+
+	size_t before = out.size();
+	size_t i = 0;
+	while(i < len){
+		char c = str[i];
+		if(c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+			i++;
+			continue;
+		}
+
+		size_t start = i;
+		while(i < len && str[i] != ',' && str[i] != ' ' && str[i] != '\t' && str[i] != '\n' && str[i] != '\r') i++;
+
+		bt_dev_addr_t addr;
+		if(!parse_address(str + start, i - start, addr)){
+			out.resize(before);
+			return -1;
+		}
+		out.push_back(addr);
+	}
+	return (int)(out.size() - before);
+}
@@ -0,0 +1,72 @@
+/**
+ * Header for allocation-free hex and Bluetooth address formatting/parsing
+ * @author Owen Capell
+*/
+#ifndef HEX_FORMAT
+#define HEX_FORMAT
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+
+/* Characters in "XX:XX:XX:XX:XX:XX" (no terminator) */
+#define ADDR_STR_LEN 17
+
+/* Characters hex_dump() writes per input octet ("xx ") */
+#define HEX_DUMP_STRIDE 3
+
+/**
+ * @details
+ * Two ASCII digits per octet value, indexed by 2 * value
+ * (512 octets each, one table per case)
+*/
+extern const std::array<char, 512> hex_lut_lower;
+extern const std::array<char, 512> hex_lut_upper;
+
+/**
+ * @brief
+ * Writes the 6-byte (little endian) address as "XX:XX:XX:XX:XX:XX",
+ * most significant octet first, upper case, no terminator
+*/
+void format_address(const uint8_t *addr, char *out);
+
+/**
+ * @brief
+ * Writes 2 * len hex digits (lower or upper case), no terminator
+ * Returns the number of characters written
+*/
+size_t hex_encode(const uint8_t *data, size_t len, char *out, bool upper = false);
+
+/**
+ * @brief
+ * Writes "xx " for every octet (the raw capture dump format), no terminator
+ * out must hold HEX_DUMP_STRIDE * len characters; returns the number written
+*/
+size_t hex_dump(const uint8_t *data, size_t len, char *out);
+
+/**
+ * @brief
+ * Parses "XX:XX:XX:XX:XX:XX" (either case, ':' or '-' separators) into a
+ * little-endian address. Returns false if str is not exactly one address
+*/
+bool parse_address(const char *str, size_t len, bt_dev_addr_t& out);
+
+/**
+ * @brief
+ * Parses addresses separated by commas and/or whitespace (e.g. a filter
+ * config value) and appends them to out
+ * Returns the number of addresses appended, -1 on a malformed entry
+*/
+int parse_address_list(const char *str, size_t len, std::vector<bt_dev_addr_t>& out);
+
+/**
+ * @brief
+ * Name of the hex_encode()/hex_dump() implementation picked for this CPU
+ * ("avx2", "ssse3" or "scalar")
+*/
+const char* hex_format_backend();
+
+#endif
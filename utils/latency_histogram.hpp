@@ -0,0 +1,159 @@
+/**
+ * Header-only, HDR-style latency histogram with lock-free recording
+ * @author Owen Capell
+*/
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+#include <atomic>
+#include <cstdint>
+
+/* Sub-buckets per power of two (2^3 = 8, ~12.5% relative precision) */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * @details
+ * Read-side summary of a latencyHistogram
+ * @param count	Number of recorded values
+ * @param min	Smallest recorded value
+ * @param max	Largest recorded value
+ * @param mean	Arithmetic mean of recorded values
+ * @param p50	Median (bucket upper bound)
+ * @param p90	90th percentile (bucket upper bound)
+ * @param p99	99th percentile (bucket upper bound)
+ * @param p999	99.9th percentile (bucket upper bound)
+*/
+typedef struct{
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+} histogram_summary_t;
+
+/**
+ * @details
+ * Log-linear histogram: values are bucketed by their highest set bit and
+ * the next HISTOGRAM_SUB_BITS bits. Recording is a handful of bit
+ * operations and relaxed atomic adds, so it is safe to call on the
+ * capture path; readers on other threads see a (slightly racy) snapshot.
+*/
+class latencyHistogram{
+public:
+	latencyHistogram(){ reset(); }
+
+	latencyHistogram(const latencyHistogram&) = delete;
+	latencyHistogram& operator=(const latencyHistogram&) = delete;
+
+	/**
+	 * @brief
+	 * Records one value (nanoseconds by convention)
+	*/
+	void record(uint64_t v){
+		buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+		n.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(v, std::memory_order_relaxed);
+
+		uint64_t cur = lo.load(std::memory_order_relaxed);
+		while(v < cur && !lo.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+		cur = hi.load(std::memory_order_relaxed);
+		while(v > cur && !hi.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+	}
+
+	/**
+	 * @brief
+	 * Clears all recorded values
+	*/
+	void reset(){
+		for(int i=0; i<HISTOGRAM_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+		n.store(0, std::memory_order_relaxed);
+		sum.store(0, std::memory_order_relaxed);
+		lo.store(UINT64_MAX, std::memory_order_relaxed);
+		hi.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const{ return n.load(std::memory_order_relaxed); }
+
+	/**
+	 * @brief
+	 * Number of values recorded in bucket i
+	*/
+	uint64_t bucket_count(int i) const{ return buckets[i].load(std::memory_order_relaxed); }
+
+	/**
+	 * @brief
+	 * Value at quantile q (0.0 - 1.0), reported as the bucket upper bound
+	*/
+	uint64_t percentile(double q) const{
+		uint64_t total = count();
+		if(total == 0) return 0;
+		uint64_t rank = (uint64_t)(q * (double)total);
+		if(rank >= total) rank = total - 1;
+
+		uint64_t seen = 0;
+		for(int i=0; i<HISTOGRAM_BUCKETS; i++){
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if(seen > rank){
+				uint64_t top = bucket_upper(i);
+				uint64_t max = hi.load(std::memory_order_relaxed);
+				return top < max ? top : max;
+			}
+		}
+		return hi.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief
+	 * Count, min, max, mean and common percentiles
+	*/
+	histogram_summary_t summary() const{
+		histogram_summary_t s = {};
+		s.count = count();
+		if(s.count == 0) return s;
+		s.min = lo.load(std::memory_order_relaxed);
+		s.max = hi.load(std::memory_order_relaxed);
+		s.mean = (double)sum.load(std::memory_order_relaxed) / (double)s.count;
+		s.p50 = percentile(0.50);
+		s.p90 = percentile(0.90);
+		s.p99 = percentile(0.99);
+		s.p999 = percentile(0.999);
+		return s;
+	}
+
+	/**
+	 * @brief
+	 * Bucket index for value v
+	*/
+	static int bucket_of(uint64_t v){
+		if(v < HISTOGRAM_SUB_BUCKETS) return (int)v;
+		int msb = 63 - __builtin_clzll(v);
+		int sub = (int)((v >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+		return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+	}
+
+	/**
+	 * @brief
+	 * Largest value that maps to bucket i
+	*/
+	static uint64_t bucket_upper(int i){
+		if(i < HISTOGRAM_SUB_BUCKETS) return (uint64_t)i;
+		int msb = i / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+		uint64_t sub = (uint64_t)(i % HISTOGRAM_SUB_BUCKETS);
+		uint64_t base = (1ull << msb) | (sub << (msb - HISTOGRAM_SUB_BITS));
+		return base + ((1ull << (msb - HISTOGRAM_SUB_BITS)) - 1);
+	}
+
+private:
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> n;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> lo;
+	std::atomic<uint64_t> hi;
+};
+
+#endif
@@ -0,0 +1,283 @@
+/**
+ * Table-driven LE Meta event dispatch and report decoders
+ * @author Owen Capell
+*/
+#include <array>
+#include <cstring>
+#include <iostream>
+
+#include "bluetoothdef.hpp"
+#include "hci_schema.hpp"
+#include "le_meta.hpp"
+#include "utils.hpp"
+#include "metrics.hpp"
+
+/* Subevent codes are 6 bits wide in practice; larger codes go to entry 0 */
+#define LE_META_TABLE_SIZE 64
+
+static constexpr std::array<le_meta_entry_t, LE_META_TABLE_SIZE> build_le_meta_table(){
+	/* Names and minimum lengths come from the schema; only decoders are registered here */
+	std::array<le_meta_entry_t, LE_META_TABLE_SIZE> t{};
+	for(size_t i=0; i<LE_META_TABLE_SIZE; i++){
+		t[i] = {nullptr, le_subevent_info((uint8_t)i).name, le_subevent_info((uint8_t)i).min_params};
+	}
+
+	t[leAdvertisingReport::code].handler = decode_legacy_reports;
+	t[leDirectedAdvertisingReport::code].handler = decode_directed_reports;
+	t[leExtendedAdvertisingReport::code].handler = decode_extended_reports;
+	t[lePeriodicAdvertisingReport::code].handler = decode_periodic_report;
+	return t;
+}
+
+static constexpr std::array<le_meta_entry_t, LE_META_TABLE_SIZE> le_meta_table = build_le_meta_table();
+
+/* Legacy report event types mapped onto the Extended Report legacy PDU encoding */
+static constexpr uint16_t legacy_to_pdu[5] = {
+	ADV_IND, ADV_DIRECT_IND, ADV_SCAN_IND, ADV_NONCONN_IND, SCAN_RSP_TO_ADV_IND
+};
+
+static bool pass_pdu_filter(uint16_t evt){
+	/* Built-in filter of event PDU, used when no advFilter is configured */
+	return evt!=ADV_NONCONN_IND && evt!=ADV_DIRECT_IND;
+}
+
+/* Sharded: adapter threads decode concurrently */
+static metricCounter reports_seen;
+static metricCounter reports_rejected;
+
+static bool keep_report(const advFilter *filter, const adv_report_view_t& view, bool pdu_check){
+	/* A configured filter replaces the built-in PDU check entirely */
+	bool keep = filter != nullptr ? filter->matches(view) : (!pdu_check || pass_pdu_filter(view.event));
+	reports_seen.add();
+	if(!keep) reports_rejected.add();
+	return keep;
+}
+
+le_meta_stats_t get_le_meta_stats(){
+	return le_meta_stats_t{reports_seen.value(), reports_rejected.value()};
+}
+
+static void stamp(adv_event_t& evt, const hci_packet_meta_t& pkt_meta, uint8_t subevent){
+	evt.timestamp = pkt_meta.timestamp;
+	evt.direction = pkt_meta.direction;
+	evt.subevent = subevent;
+	evt.aggregate = ADV_AGG_RAW;
+	evt.report_count = 1;
+	evt.rssi_min = 0;
+	evt.rssi_max = 0;
+	evt.adapter_id = 0;
+	evt.adapter_mask = 0;
+}
+
+const le_meta_entry_t& le_meta_lookup(uint8_t subevent){
+	return le_meta_table[subevent < LE_META_TABLE_SIZE ? subevent : 0];
+}
+
+size_t dispatch_le_meta(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter){
+	/**
+	 * Looks up the subevent decoder in the dispatch table and runs it
+	 *
+	 * @param params	LE Meta parameters, starting at the subevent code
+	 * @param len	Octets available at params
+	 * @param pkt_meta	Kernel timestamp and direction of the packet
+	 * @param out	Records to fill
+	 * @param max_out	Capacity of out
+	 * @param verbose	Boolean flag to print decoded reports
+	 * @param filter	Compiled report filter (nullptr = built-in PDU check)
+	 * @returns number of records written
+	*/
+
+	if(len < 1) return 0;
+	const le_meta_entry_t& entry = le_meta_lookup(params[0]);
+	if(len - 1 < entry.min_params) return 0;
+	if(entry.handler == nullptr){
+		/* Subevents without reports are only described */
+		if(verbose){
+			char text[HCI_DESCRIBE_MAX];
+			const hci_schema_entry_t& info = le_subevent_info(params[0]);
+			if(info.format != nullptr && info.format(params + 1, len - 1, text, sizeof(text)) > 0) std::cout << text << std::endl;
+		}
+		return 0;
+	}
+	return entry.handler(params + 1, len - 1, pkt_meta, out, max_out, verbose, filter);
+}
+
+size_t decode_legacy_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter){
+	/**
+	 * Walks Num_Reports legacy reports, each 9 + data_length + 1 octets
+	 * Reports claiming more than LEGACY_ADV_MAX_DATA octets are skipped
+	 *
+	 * @returns number of records written
+	*/
+
+	hciView<leAdvertisingReport> event;
+	if(!event.bind(params, len)) return 0;
+	uint8_t num_reports = event.get<"num_reports">();
+	const uint8_t *p = event.data();
+	const uint8_t *end = params + len;
+	size_t n_out = 0;
+
+	for(uint8_t i=0; i<num_reports && n_out<max_out; ++i){
+		hciView<leLegacyReportItem> report;
+		if(!report.bind(p, end)) break;
+		p += report.extent();
+		if(report.data_length() > LEGACY_ADV_MAX_DATA) continue;
+
+		uint8_t event_type = report.get<"event_type">();
+		uint16_t evt = event_type < 5 ? legacy_to_pdu[event_type] : event_type;
+		int8_t rssi = (int8_t)report.trailer()[0];
+		uint8_t data_length = (uint8_t)report.data_length();
+		adv_report_view_t view = {report.ref<"address">(), report.get<"address_type">(), evt, rssi, report.data(), data_length};
+		if(!keep_report(filter, view, true)) continue;
+
+		adv_event_t& rec = out[n_out++];
+		stamp(rec, pkt_meta, SUBEVT_HCI_LE_ADVERTISING_REPORT);
+		rec.data_status = ADV_DATA_COMPLETE;
+		rec.sync_handle = 0;
+		rec.address = report.get<"address">();
+		rec.address_type = report.get<"address_type">();
+		rec.event = evt;
+		rec.rssi = rssi;
+		rec.tx_power = 127;
+		rec.primary_phy = 0x01;
+		rec.secondary_phy = 0x00;
+		rec.advertising_sid = 0xFF;
+		rec.periodic_advertising_interval = 0;
+		rec.data_length = data_length;
+		memcpy(rec.data, report.data(), data_length);
+
+		if(verbose) print_adv_event(rec);
+	}
+
+	return n_out;
+}
+
+size_t decode_directed_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter){
+	/**
+	 * Walks Num_Reports fixed-size (16 octet) directed reports
+	 *
+	 * @returns number of records written
+	*/
+
+	hciView<leDirectedAdvertisingReport> event;
+	if(!event.bind(params, len)) return 0;
+	uint8_t num_reports = event.get<"num_reports">();
+	const uint8_t *p = event.data();
+	const uint8_t *end = params + len;
+	size_t n_out = 0;
+
+	for(uint8_t i=0; i<num_reports && n_out<max_out; ++i){
+		hciView<leDirectedReportItem> report;
+		if(!report.bind(p, end)) break;
+		p += report.extent();
+
+		int8_t rssi = report.get<"rssi">();
+		adv_report_view_t view = {report.ref<"address">(), report.get<"address_type">(), ADV_DIRECT_IND, rssi, nullptr, 0};
+		if(!keep_report(filter, view, false)) continue;
+
+		adv_event_t& rec = out[n_out++];
+		stamp(rec, pkt_meta, SUBEVT_HCI_LE_DIRECTED_ADVERTISING_REPORT);
+		rec.data_status = ADV_DATA_COMPLETE;
+		rec.sync_handle = 0;
+		rec.address = report.get<"address">();
+		rec.address_type = report.get<"address_type">();
+		rec.event = ADV_DIRECT_IND;
+		rec.rssi = rssi;
+		rec.tx_power = 127;
+		rec.primary_phy = 0x01;
+		rec.secondary_phy = 0x00;
+		rec.advertising_sid = 0xFF;
+		rec.periodic_advertising_interval = 0;
+		rec.data_length = 0;
+
+		if(verbose) print_adv_event(rec);
+	}
+
+	return n_out;
+}
+
+size_t decode_extended_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter){
+	/**
+	 * Walks Num_Reports variable-length extended reports; each report is
+	 * 24 octets of fixed fields followed by its own data_length octets
+	 *
+	 * @returns number of records written
+	*/
+
+	hciView<leExtendedAdvertisingReport> event;
+	if(!event.bind(params, len)) return 0;
+	uint8_t num_reports = event.get<"num_reports">();
+	const uint8_t *p = event.data();
+	const uint8_t *end = params + len;
+	size_t n_out = 0;
+
+	for(uint8_t i=0; i<num_reports && n_out<max_out; ++i){
+		hciView<leExtendedReportItem> report;
+		if(!report.bind(p, end)) break;
+		p += report.extent();
+
+		uint16_t evt = report.get<"event_type">();
+		adv_report_view_t view = {report.ref<"address">(), report.get<"address_type">(), evt, report.get<"rssi">(),
+			report.data(), (uint16_t)report.data_length()};
+		if(!keep_report(filter, view, true)) continue;
+
+		adv_event_t& rec = out[n_out++];
+		stamp(rec, pkt_meta, SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT);
+		rec.data_status = (uint8_t)EAR_EVT_DATA_STATUS(evt);
+		rec.sync_handle = 0;
+		process_extended_advertising_report(report, rec, verbose);
+	}
+
+	return n_out;
+}
+
+size_t decode_periodic_report(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter){
+	/**
+	 * Decodes the single report of a periodic advertising event
+	 * The advertiser address is not part of the report; sync_handle
+	 * identifies the train
+	 *
+	 * @returns number of records written (0 or 1)
+	*/
+
+	hciView<lePeriodicAdvertisingReport> report;
+	if(max_out < 1 || !report.bind(params, len)) return 0;
+
+	size_t data_length = report.data_length();
+	adv_report_view_t view = {nullptr, 0xFF, 0, report.get<"rssi">(), report.data(), (uint16_t)data_length};
+	if(!keep_report(filter, view, false)) return 0;
+
+	adv_event_t& rec = out[0];
+	stamp(rec, pkt_meta, SUBEVT_HCI_LE_PERIODIC_ADVERTISING_REPORT);
+	rec.data_status = report.get<"data_status">();
+	rec.sync_handle = report.get<"sync_handle">();
+	rec.address = bt_dev_addr_t{};
+	rec.address_type = 0xFF;
+	rec.event = 0;
+	rec.rssi = report.get<"rssi">();
+	rec.tx_power = report.get<"tx_power">();
+	rec.primary_phy = 0;
+	rec.secondary_phy = 0;
+	rec.advertising_sid = 0xFF;
+	rec.periodic_advertising_interval = 0;
+	rec.data_length = (uint8_t)(data_length < ADV_EVENT_MAX_DATA ? data_length : ADV_EVENT_MAX_DATA);
+	memcpy(rec.data, report.data(), rec.data_length);
+
+	if(verbose) print_adv_event(rec);
+	return 1;
+}
@@ -0,0 +1,109 @@
+/**
+ * Header for table-driven LE Meta event dispatch
+ * @author Owen Capell
+*/
+#ifndef LE_META
+#define LE_META
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bluetoothdef.hpp"
+#include "adv_filter.hpp"
+
+/**
+ * @details
+ * Decoder for one LE Meta subevent
+ * params points at the octet following the subevent code, len counts
+ * the octets from there to the end of the packet. Reports rejected by
+ * filter (or by the built-in PDU check when filter is nullptr) are
+ * skipped before anything is copied into out
+*/
+typedef size_t (*le_meta_handler_t)(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+/**
+ * @details
+ * Entry of the LE Meta dispatch table
+ * @param handler	Decoder, nullptr for subevents that carry no reports
+ * @param name	Human-readable subevent name (from hci_schema.hpp)
+ * @param min_params	Shortest parameter block (after the subevent code) the handler is given
+*/
+typedef struct{
+	le_meta_handler_t handler;
+	const char *name;
+	size_t min_params;
+} le_meta_entry_t;
+
+/**
+ * @details
+ * Report counters of the decoders, summed over every capture thread
+ * @param reports	Advertising reports decoded
+ * @param rejected	Reports dropped by the filter or the built-in PDU check
+*/
+typedef struct{
+	uint64_t reports;
+	uint64_t rejected;
+} le_meta_stats_t;
+
+/**
+ * @brief
+ * Snapshot of the decoder counters (safe from any thread)
+*/
+le_meta_stats_t get_le_meta_stats();
+
+/**
+ * @brief
+ * Dispatch table entry for subevent (never null)
+*/
+const le_meta_entry_t& le_meta_lookup(uint8_t subevent);
+
+/**
+ * @brief
+ * Decodes the parameters of an LE Meta event (starting at the subevent
+ * code) into records. Returns the number of records written to out
+*/
+size_t dispatch_le_meta(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+/**
+ * @brief
+ * LE Advertising Report (0x02)
+*/
+size_t decode_legacy_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+/**
+ * @brief
+ * LE Directed Advertising Report (0x0B)
+*/
+size_t decode_directed_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+/**
+ * @brief
+ * LE Extended Advertising Report (0x0D)
+*/
+size_t decode_extended_reports(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+/**
+ * @brief
+ * LE Periodic Advertising Report (0x0F)
+*/
+size_t decode_periodic_report(
+	const uint8_t *params, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter);
+
+#endif
@@ -0,0 +1,228 @@
+/**
+ * Implementation of the capture pipeline metrics registry
+ * @author Owen Capell
+*/
+#include <algorithm>
+#include <cstdio>
+
+#include "metrics.hpp"
+#include "latency_histogram.hpp"
+
+/* Quantiles exported for every histogram */
+static const double exported_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+metricCounter::metricCounter(){
+	for(int i=0; i<METRIC_SHARDS; i++) shards[i].value.store(0, std::memory_order_relaxed);
+}
+
+unsigned int metricCounter::shard_index(){
+	/* Assigned once per thread; threads beyond METRIC_SHARDS share shards */
+	static std::atomic<unsigned int> next(0);
+	thread_local unsigned int index = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+	return index;
+}
+
+uint64_t metricCounter::value() const{
+	uint64_t total = 0;
+	for(int i=0; i<METRIC_SHARDS; i++) total += shards[i].value.load(std::memory_order_relaxed);
+	return total;
+}
+
+metricsRegistry::metricsRegistry() : mutex(), entries()
+{
+	/**
+	 * Constructor for metricsRegistry
+	*/
+
+}
+
+metricsRegistry::entry_t& metricsRegistry::upsert(
+	const std::string& name, const std::string& help, const std::string& labels, metricType type){
+	/**
+	 * Finds the entry for name and labels or appends a new one (mutex held)
+	 * An existing entry of another type is reset to type
+	 *
+	 * @param name	Metric name
+	 * @param help	HELP text
+	 * @param labels	Label pairs without braces
+	 * @param type	Metric type
+	 * @returns the entry
+	*/
+
+	for(auto& e : entries){
+		if(e->name != name || e->labels != labels) continue;
+		e->help = help;
+		if(e->type != type){
+			e->type = type;
+			e->counter.reset();
+			e->gauge.reset();
+		}
+		e->sample = nullptr;
+		e->hist = nullptr;
+		return *e;
+	}
+
+	auto e = std::make_unique<entry_t>();
+	e->name = name;
+	e->help = help;
+	e->labels = labels;
+	e->type = type;
+	e->hist = nullptr;
+	entries.push_back(std::move(e));
+	return *entries.back();
+}
+
+metricCounter& metricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels){
+	std::lock_guard<std::mutex> lock(mutex);
+	entry_t& e = upsert(name, help, labels, metricType::counter);
+	if(!e.counter) e.counter = std::make_unique<metricCounter>();
+	return *e.counter;
+}
+
+metricGauge& metricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels){
+	std::lock_guard<std::mutex> lock(mutex);
+	entry_t& e = upsert(name, help, labels, metricType::gauge);
+	if(!e.gauge) e.gauge = std::make_unique<metricGauge>();
+	return *e.gauge;
+}
+
+void metricsRegistry::counter_fn(const std::string& name, const std::string& help, const std::string& labels,
+	std::function<uint64_t()> sample){
+	std::lock_guard<std::mutex> lock(mutex);
+	entry_t& e = upsert(name, help, labels, metricType::counter);
+	e.counter.reset();
+	e.sample = [sample = std::move(sample)](){ return (double)sample(); };
+}
+
+void metricsRegistry::gauge_fn(const std::string& name, const std::string& help, const std::string& labels,
+	std::function<double()> sample){
+	std::lock_guard<std::mutex> lock(mutex);
+	entry_t& e = upsert(name, help, labels, metricType::gauge);
+	e.gauge.reset();
+	e.sample = std::move(sample);
+}
+
+void metricsRegistry::histogram(const std::string& name, const std::string& help, const std::string& labels,
+	const latencyHistogram& hist){
+	std::lock_guard<std::mutex> lock(mutex);
+	entry_t& e = upsert(name, help, labels, metricType::histogram);
+	e.hist = &hist;
+}
+
+size_t metricsRegistry::remove(const std::string& labels){
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t before = entries.size();
+	entries.erase(std::remove_if(entries.begin(), entries.end(),
+		[&labels](const std::unique_ptr<entry_t>& e){ return e->labels == labels; }), entries.end());
+	return before - entries.size();
+}
+
+size_t metricsRegistry::size() const{
+	std::lock_guard<std::mutex> lock(mutex);
+	return entries.size();
+}
+
+std::vector<metric_sample_t> metricsRegistry::snapshot() const{
+	/**
+	 * Samples every metric under the registry lock
+	 *
+	 * @returns one metric_sample_t per registered metric, in registration order
+	*/
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<metric_sample_t> out;
+	out.reserve(entries.size());
+
+	for(const auto& e : entries){
+		metric_sample_t s;
+		s.name = e->name;
+		s.help = e->help;
+		s.labels = e->labels;
+		s.type = e->type;
+		s.value = 0.0;
+		s.histogram = histogram_summary_t{};
+
+		if(e->counter) s.value = (double)e->counter->value();
+		else if(e->gauge) s.value = (double)e->gauge->value();
+		else if(e->sample) s.value = e->sample();
+		else if(e->hist) s.histogram = e->hist->summary();
+		out.push_back(std::move(s));
+	}
+	return out;
+}
+
+static void append_series(std::string& out, const std::string& name, const std::string& labels,
+	const char *extra, double value){
+	/**
+	 * Appends one "name{labels} value" line
+	 *
+	 * @param out	Exposition text
+	 * @param name	Series name (with _sum/_count suffix if any)
+	 * @param labels	Label pairs without braces
+	 * @param extra	Additional label pair (e.g. quantile="0.5") or nullptr
+	 * @param value	Sample value
+	*/
+
+	out += name;
+	if(!labels.empty() || extra != nullptr){
+		out += '{';
+		out += labels;
+		if(extra != nullptr){
+			if(!labels.empty()) out += ',';
+			out += extra;
+		}
+		out += '}';
+	}
+
+	char num[32];
+	snprintf(num, sizeof(num), " %.10g\n", value);
+	out += num;
+}
+
+std::string metricsRegistry::prometheus() const{
+	/**
+	 * Renders the registry in the Prometheus text format (version 0.0.4).
+	 * Series sharing a name are grouped under one HELP/TYPE header;
+	 * histograms are exported as summaries in seconds
+	 *
+	 * @returns exposition text
+	*/
+
+	std::vector<metric_sample_t> samples = snapshot();
+
+	std::vector<size_t> order(samples.size());
+	for(size_t i=0; i<order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(),
+		[&samples](size_t a, size_t b){ return samples[a].name < samples[b].name; });
+
+	std::string out;
+	out.reserve(samples.size() * 96);
+	const std::string *current = nullptr;
+
+	for(size_t i : order){
+		const metric_sample_t& s = samples[i];
+		if(current == nullptr || *current != s.name){
+			current = &s.name;
+			const char *type = s.type == metricType::counter ? "counter" :
+				s.type == metricType::gauge ? "gauge" : "summary";
+			out += "# HELP " + s.name + " " + s.help + "\n";
+			out += "# TYPE " + s.name + " " + type + "\n";
+		}
+
+		if(s.type != metricType::histogram){
+			append_series(out, s.name, s.labels, nullptr, s.value);
+			continue;
+		}
+
+		const histogram_summary_t& h = s.histogram;
+		const uint64_t values[] = {h.p50, h.p90, h.p99, h.p999};
+		for(size_t q=0; q<sizeof(exported_quantiles)/sizeof(exported_quantiles[0]); q++){
+			char extra[32];
+			snprintf(extra, sizeof(extra), "quantile=\"%g\"", exported_quantiles[q]);
+			append_series(out, s.name, s.labels, extra, (double)values[q] * 1e-9);
+		}
+		append_series(out, s.name + "_sum", s.labels, nullptr, h.mean * (double)h.count * 1e-9);
+		append_series(out, s.name + "_count", s.labels, nullptr, (double)h.count);
+	}
+	return out;
+}
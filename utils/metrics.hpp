@@ -0,0 +1,175 @@
+/**
+ * Header for the capture pipeline metrics registry (counters, gauges, latency histograms)
+ * @author Owen Capell
+*/
+#ifndef METRICS
+#define METRICS
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.hpp"
+
+/* Counter shards; threads are spread over them round-robin */
+#define METRIC_SHARDS 16
+
+/**
+ * @details
+ * Monotonic counter split into cache-line sized per-thread shards so
+ * several capture threads can count into the same metric without
+ * bouncing a cache line. add() is one relaxed atomic add on the
+ * caller's shard; value() sums the shards.
+*/
+class metricCounter{
+public:
+	metricCounter();
+
+	metricCounter(const metricCounter&) = delete;
+	metricCounter& operator=(const metricCounter&) = delete;
+
+	void add(uint64_t n = 1){
+		shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t value() const;
+
+private:
+	typedef struct alignas(64){
+		std::atomic<uint64_t> value;
+	} shard_t;
+
+	static unsigned int shard_index();
+
+	shard_t shards[METRIC_SHARDS];
+};
+
+/**
+ * @details
+ * Instantaneous value (e.g. a depth or a size), set by one owner
+*/
+class metricGauge{
+public:
+	metricGauge() : v(0) {}
+
+	metricGauge(const metricGauge&) = delete;
+	metricGauge& operator=(const metricGauge&) = delete;
+
+	void set(int64_t value){ v.store(value, std::memory_order_relaxed); }
+	void add(int64_t delta){ v.fetch_add(delta, std::memory_order_relaxed); }
+	int64_t value() const{ return v.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<int64_t> v;
+};
+
+enum class metricType{
+	counter,
+	gauge,
+	histogram
+};
+
+/**
+ * @details
+ * One metric as read by snapshot()
+ * @param name	Metric name (Prometheus conventions, e.g. bt_sniff_packets_total)
+ * @param help	Description
+ * @param labels	Label pairs without braces, e.g. adapter="0" (may be empty)
+ * @param type	Counter, gauge or histogram
+ * @param value	Current value (counters and gauges)
+ * @param histogram	Summary in nanoseconds (histograms)
+*/
+typedef struct{
+	std::string name;
+	std::string help;
+	std::string labels;
+	metricType type;
+	double value;
+	histogram_summary_t histogram;
+} metric_sample_t;
+
+/**
+ * @details
+ * Named collection of metrics. Registration takes a lock and may
+ * allocate; recording never touches the registry (callers hold the
+ * metricCounter/metricGauge they were handed, or the registry samples
+ * the counters components already keep when it is read).
+ * Registering the same name and labels again replaces the metric
+ * (counter()/gauge() hand back the one already registered).
+ * Objects behind sampled metrics must outlive the registry or be
+ * removed first with remove().
+*/
+class metricsRegistry{
+public:
+	metricsRegistry();
+
+	metricsRegistry(const metricsRegistry&) = delete;
+	metricsRegistry& operator=(const metricsRegistry&) = delete;
+
+	/**
+	 * @brief
+	 * Counter/gauge owned by the registry (reference stays valid until remove())
+	*/
+	metricCounter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+	metricGauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+
+	/**
+	 * @brief
+	 * Metrics read through a callback when the registry is sampled
+	*/
+	void counter_fn(const std::string& name, const std::string& help, const std::string& labels,
+		std::function<uint64_t()> sample);
+	void gauge_fn(const std::string& name, const std::string& help, const std::string& labels,
+		std::function<double()> sample);
+
+	/**
+	 * @brief
+	 * Latency histogram recorded in nanoseconds (not owned)
+	*/
+	void histogram(const std::string& name, const std::string& help, const std::string& labels,
+		const latencyHistogram& hist);
+
+	/**
+	 * @brief
+	 * Removes every metric carrying exactly these labels
+	 * Returns the number of metrics removed
+	*/
+	size_t remove(const std::string& labels);
+
+	size_t size() const;
+
+	/**
+	 * @brief
+	 * Reads every metric
+	*/
+	std::vector<metric_sample_t> snapshot() const;
+
+	/**
+	 * @brief
+	 * Prometheus text exposition format (histograms as summaries, in seconds)
+	*/
+	std::string prometheus() const;
+
+private:
+	typedef struct{
+		std::string name;
+		std::string help;
+		std::string labels;
+		metricType type;
+		std::unique_ptr<metricCounter> counter;
+		std::unique_ptr<metricGauge> gauge;
+		std::function<double()> sample;
+		const latencyHistogram *hist;
+	} entry_t;
+
+	entry_t& upsert(const std::string& name, const std::string& help, const std::string& labels, metricType type);
+
+	mutable std::mutex mutex;
+	std::vector<std::unique_ptr<entry_t>> entries;
+};
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * Implementation of the Prometheus text-format exporter
+ * @author Owen Capell
+*/
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.hpp"
+#include "metrics_exporter.hpp"
+#include "event_loop.hpp"
+#include "utils.hpp"
+
+metricsExporter::metricsExporter(const metricsRegistry& registry) :
+	registry(registry), listen_fds(), unix_path(), loop(nullptr), own_loop(), thread(), expiry_timer(-1),
+	clients(), n_scrapes(0)
+{
+	/**
+	 * Constructor for metricsExporter
+	 * No sockets are opened until listen_tcp()/listen_unix()
+	 *
+	 * @param registry	Registry rendered on every scrape (must outlive the exporter)
+	*/
+
+}
+
+metricsExporter::~metricsExporter(){
+	/**
+	 * Destructor for metricsExporter
+	 * Unregisters from the loop before closing, so no callback outlives this
+	*/
+
+	stop();
+	detach();
+	for(int fd : listen_fds) close(fd);
+	if(!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+int metricsExporter::listen_tcp(uint16_t port, bool loopback_only){
+	/**
+	 * Opens a non-blocking TCP listener
+	 *
+	 * @param port	Port to bind
+	 * @param loopback_only	Bind 127.0.0.1 instead of every interface
+	 * @returns 0 on success, -1 on failure
+	*/
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+
+	int opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, METRICS_EXPORTER_MAX_CLIENTS) < 0){
+		std::cerr << "Error opening metrics port" << std::endl << errno << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	listen_fds.push_back(fd);
+	return 0;
+}
+
+int metricsExporter::listen_unix(const std::string& path){
+	/**
+	 * Opens a non-blocking Unix stream listener
+	 *
+	 * @param path	Filesystem path of the socket
+	 * @returns 0 on success, -1 on failure
+	*/
+
+	struct sockaddr_un addr = {};
+	if(path.empty() || path.size() >= sizeof(addr.sun_path)) return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	unlink(path.c_str());
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, METRICS_EXPORTER_MAX_CLIENTS) < 0){
+		std::cerr << "Error opening metrics socket" << std::endl << errno << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	listen_fds.push_back(fd);
+	unix_path = path;
+	return 0;
+}
+
+int metricsExporter::attach(eventLoop& target){
+	/**
+	 * Registers every listener on target
+	 *
+	 * @param target	Loop that accepts and answers scrapes
+	 * @returns 0 on success, -1 if already attached or on failure
+	*/
+
+	if(loop != nullptr || listen_fds.empty()) return -1;
+	for(int fd : listen_fds){
+		if(target.add_fd(fd, EPOLLIN, [this, fd](uint32_t){ accept_clients(fd); }) < 0){
+			for(int added : listen_fds) target.remove_fd(added);
+			return -1;
+		}
+	}
+
+	/* Check a few times per timeout instead of arming a timer per connection */
+	uint64_t tick = (uint64_t)METRICS_EXPORTER_IDLE_TIMEOUT_MS * 1000000ull / 4;
+	expiry_timer = target.add_timer(tick, tick, [this](){ expire_clients(); });
+	if(expiry_timer < 0){
+		for(int fd : listen_fds) target.remove_fd(fd);
+		return -1;
+	}
+	loop = &target;
+	return 0;
+}
+
+void metricsExporter::detach(){
+	if(loop == nullptr) return;
+	for(int fd : listen_fds) loop->remove_fd(fd);
+	for(auto& c : clients){
+		loop->remove_fd(c.first);
+		close(c.first);
+	}
+	clients.clear();
+	if(expiry_timer >= 0) loop->cancel_timer(expiry_timer);
+	expiry_timer = -1;
+	loop = nullptr;
+}
+
+int metricsExporter::start(){
+	/**
+	 * Creates a private loop and serves it on a new thread
+	 *
+	 * @returns 0 on success, -1 if already running or on failure
+	*/
+
+	if(loop != nullptr) return -1;
+	own_loop = std::make_unique<eventLoop>();
+	if(!own_loop->is_open() || attach(*own_loop) < 0){
+		own_loop.reset();
+		return -1;
+	}
+
+	thread = std::thread([this](){
+		own_loop->run();
+		detach();
+	});
+	return 0;
+}
+
+void metricsExporter::stop(){
+	if(!own_loop) return;
+	own_loop->stop();
+	if(thread.joinable()) thread.join();
+	own_loop.reset();
+}
+
+uint64_t metricsExporter::scrapes() const{
+	return n_scrapes.load(std::memory_order_relaxed);
+}
+
+void metricsExporter::accept_clients(int listen_fd){
+	/**
+	 * Accepts every pending connection; each waits for its request on the loop
+	 *
+	 * @param listen_fd	Listener that became readable
+	*/
+
+	for(;;){
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) return;
+
+		if(clients.size() >= METRICS_EXPORTER_MAX_CLIENTS ||
+			loop->add_fd(fd, EPOLLIN, [this, fd](uint32_t){ read_request(fd); }) < 0){
+			close(fd);
+			continue;
+		}
+		clients.emplace(fd, client_t{std::string(), monotonic_ns() + (uint64_t)METRICS_EXPORTER_IDLE_TIMEOUT_MS * 1000000ull});
+	}
+}
+
+void metricsExporter::expire_clients(){
+	/**
+	 * Closes connections that have not sent a complete request in time,
+	 * so idle sockets cannot hold every client slot
+	*/
+
+	uint64_t now = monotonic_ns();
+	std::vector<int> expired;
+	for(auto& c : clients){
+		if(now >= c.second.deadline) expired.push_back(c.first);
+	}
+	for(int fd : expired) close_client(fd);
+}
+
+void metricsExporter::read_request(int fd){
+	/**
+	 * Collects the request until the end of its headers (or the size
+	 * limit), then answers. The request itself is not interpreted
+	 *
+	 * @param fd	Scrape connection
+	*/
+
+	auto it = clients.find(fd);
+	if(it == clients.end()) return;
+	std::string& request = it->second.request;
+
+	char buf[1024];
+	for(;;){
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if(n > 0){
+			request.append(buf, (size_t)n);
+			if(request.size() >= METRICS_EXPORTER_MAX_REQUEST) break;
+			continue;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			if(request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) return;
+			break;
+		}
+		if(n < 0 && errno == EINTR) continue;
+
+		/* Peer closed or failed; answer only if something was asked */
+		if(request.empty()){
+			close_client(fd);
+			return;
+		}
+		break;
+	}
+
+	respond(fd);
+	close_client(fd);
+}
+
+void metricsExporter::respond(int fd){
+	/**
+	 * Sends the exposition with a bounded blocking write (the body is a
+	 * few kB, so one scrape never holds the loop for long)
+	 *
+	 * @param fd	Scrape connection
+	*/
+
+	std::string body = registry.prometheus();
+	std::string response = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " + std::to_string(body.size()) + "\r\n"
+		"Connection: close\r\n\r\n" + body;
+
+	int flags = fcntl(fd, F_GETFL);
+	if(flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	struct timeval tv = {METRICS_EXPORTER_SEND_TIMEOUT_MS / 1000, (METRICS_EXPORTER_SEND_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	size_t sent = 0;
+	while(sent < response.size()){
+		ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return;
+		sent += (size_t)n;
+	}
+	n_scrapes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void metricsExporter::close_client(int fd){
+	if(loop != nullptr) loop->remove_fd(fd);
+	clients.erase(fd);
+	close(fd);
+}
@@ -0,0 +1,122 @@
+/**
+ * Header for the Prometheus text-format exporter (local TCP port or Unix socket)
+ * @author Owen Capell
+*/
+#ifndef METRICS_EXPORTER
+#define METRICS_EXPORTER
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.hpp"
+#include "event_loop.hpp"
+
+/* Scrape connections served at once; further connections are closed */
+#define METRICS_EXPORTER_MAX_CLIENTS 16
+
+/* Request bytes read before the response is sent regardless */
+#define METRICS_EXPORTER_MAX_REQUEST 8192
+
+/* Send timeout for one response */
+#define METRICS_EXPORTER_SEND_TIMEOUT_MS 1000
+
+/* Connections without a complete request after this long are closed */
+#define METRICS_EXPORTER_IDLE_TIMEOUT_MS 5000
+
+/**
+ * @details
+ * Minimal HTTP/1.0 responder: every request gets the registry in the
+ * Prometheus text format and the connection is closed. Runs either on
+ * an application's eventLoop (attach()) or on its own thread (start()),
+ * never on the capture threads.
+*/
+class metricsExporter{
+public:
+	explicit metricsExporter(const metricsRegistry& registry);
+
+	/**
+	 * @brief
+	 * Stops the exporter thread, detaches from a caller's loop, closes
+	 * sockets and unlinks the Unix socket
+	*/
+	~metricsExporter();
+
+	metricsExporter(const metricsExporter&) = delete;
+	metricsExporter& operator=(const metricsExporter&) = delete;
+
+	/**
+	 * @brief
+	 * Listens on TCP port (loopback only unless loopback_only is false)
+	 * Returns 0 on success, -1 on failure
+	*/
+	int listen_tcp(uint16_t port, bool loopback_only = true);
+
+	/**
+	 * @brief
+	 * Listens on a Unix stream socket at path (replaced if it exists)
+	 * Returns 0 on success, -1 on failure
+	*/
+	int listen_unix(const std::string& path);
+
+	/**
+	 * @brief
+	 * Serves the listening sockets on loop (loop thread only)
+	*/
+	int attach(eventLoop& loop);
+
+	/**
+	 * @brief
+	 * Unregisters from the loop and closes open scrape connections (loop thread only)
+	*/
+	void detach();
+
+	/**
+	 * @brief
+	 * Serves on a private thread until stop()
+	*/
+	int start();
+	void stop();
+
+	/**
+	 * @brief
+	 * Responses sent so far
+	*/
+	uint64_t scrapes() const;
+
+private:
+	/**
+	 * @details
+	 * Scrape connection waiting for its request
+	 * @param request	Bytes received so far
+	 * @param deadline	Monotonic time after which the connection is closed
+	*/
+	typedef struct{
+		std::string request;
+		uint64_t deadline;
+	} client_t;
+
+	void accept_clients(int listen_fd);
+	void read_request(int fd);
+	void respond(int fd);
+	void close_client(int fd);
+	void expire_clients();
+
+	const metricsRegistry& registry;
+	std::vector<int> listen_fds;
+	std::string unix_path;
+
+	eventLoop *loop;
+	std::unique_ptr<eventLoop> own_loop;
+	std::thread thread;
+	int expiry_timer;
+
+	std::unordered_map<int, client_t> clients;
+	std::atomic<uint64_t> n_scrapes;
+};
+
+#endif
@@ -0,0 +1,644 @@
+/**
+ * Implementation of the record output sinks and asynchronous sink writer
+ * @author Owen Capell
+*/
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "bluetoothdef.hpp"
+#include "hci_schema.hpp"
+#include "output_sink.hpp"
+#include "ad_parser.hpp"
+#include "hex_format.hpp"
+#include "utils.hpp"
+
+/* How long a write may wait for a non-blocking descriptor to drain */
+#define SINK_WRITE_WAIT_MS 1000
+
+static char* put(char *out, std::string_view s){
+	memcpy(out, s.data(), s.size());
+	return out + s.size();
+}
+
+template <typename T>
+static char* put_num(char *out, T value){
+	/* Longest value printed is a uint64_t (20 digits) */
+	return std::to_chars(out, out + 24, value).ptr;
+}
+
+static char* put_address(char *out, const bt_dev_addr_t& addr){
+	format_address(addr.address, out);
+	return out + ADDR_STR_LEN;
+}
+
+static char* put_json_string(char *out, std::string_view s){
+	/**
+	 * Writes s as a quoted JSON string (control characters escaped)
+	 * Worst case 6 octets per input octet plus the quotes
+	*/
+
+	*out++ = '"';
+	for(char c : s){
+		unsigned char u = (unsigned char)c;
+		if(c == '"' || c == '\\'){
+			*out++ = '\\';
+			*out++ = c;
+		}
+		else if(u < 0x20){
+			out = put(out, "\\u00");
+			*out++ = hex_lut_lower[2 * u];
+			*out++ = hex_lut_lower[2 * u + 1];
+		}
+		else{
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+static char* put_csv_string(char *out, std::string_view s){
+	/* RFC 4180 quoting: always quoted, embedded quotes doubled */
+	*out++ = '"';
+	for(char c : s){
+		if(c == '"') *out++ = '"';
+		*out++ = c;
+	}
+	*out++ = '"';
+	return out;
+}
+
+outputSink::outputSink(int fd, bool owns_fd) : fd(fd), owns_fd(owns_fd), socket(false){
+	/**
+	 * Constructor for outputSink
+	 *
+	 * @param fd	Descriptor formatted records are written to
+	 * @param owns_fd	Close fd when the sink is destroyed
+	*/
+
+	struct stat st;
+	if(fd >= 0 && fstat(fd, &st) == 0) socket = S_ISSOCK(st.st_mode);
+}
+
+outputSink::~outputSink(){
+	if(owns_fd && fd >= 0) close(fd);
+}
+
+size_t outputSink::preamble(char *out){
+	(void)out;
+	return 0;
+}
+
+size_t outputSink::format_raw(const sink_raw_packet_t& pkt, char *out){
+	(void)pkt;
+	(void)out;
+	return 0;
+}
+
+int outputSink::get_fd() const{
+	return fd;
+}
+
+bool outputSink::is_socket() const{
+	return socket;
+}
+
+size_t textSink::format(const adv_event_t& evt, char *out){
+	/**
+	 * Human-readable report, line for line what print_adv_event() prints
+	 *
+	 * @param evt	Record to format
+	 * @param out	Destination (SINK_MAX_RECORD octets)
+	 * @returns octets written
+	*/
+
+	char *p = out;
+	p = put(p, "Event type: ");
+	p = put(p, adv_event_name(evt.event));
+	p = put(p, "\nAddress: ");
+	p = put_address(p, evt.address);
+	p = put(p, "\nAddress Type: ");
+	p = put(p, address_type_name(evt.address_type));
+	p = put(p, "\n\n");
+
+	adRange range = ad_range(evt);
+	std::optional<uint8_t> flags = ad_flags(range);
+	if(flags){
+		uint8_t flag = *flags;
+		p = put(p, "FLAGS: \n");
+		if(flag & 0x01) p = put(p, "LE Limited Discoverable Mode\n");
+		if(flag & 0x02) p = put(p, "LE General Discoverable Mode\n");
+		if(flag & 0x04) p = put(p, "BR/EDR Not Supported\n");
+		if(flag & 0x08) p = put(p, "Simultaneous LE and BR/EDR\n");
+		if(flag & 0x10) p = put(p, "Previously Used\n");
+	}
+
+	std::string_view name = ad_name(range);
+	if(!name.empty()){
+		p = put(p, "DEVICE NAME: ");
+		p = put(p, name);
+		*p++ = '\n';
+	}
+	if(range.malformed()) p = put(p, "MALFORMED AD DATA\n");
+
+	return (size_t)(p - out);
+}
+
+size_t textSink::format_raw(const sink_raw_packet_t& pkt, char *out){
+	/**
+	 * Raw capture dump: a heading, then "xx " for every octet
+	 *
+	 * @param pkt	Packet to dump
+	 * @param out	Destination (SINK_MAX_RECORD octets)
+	 * @returns octets written
+	*/
+
+	char *p = out;
+	p = put(p, "\nRaw packet data: \n");
+	p += hex_dump(pkt.data, pkt.length, p);
+	*p++ = '\n';
+	return (size_t)(p - out);
+}
+
+size_t ndjsonSink::format(const adv_event_t& evt, char *out){
+	/**
+	 * One JSON object per line; the AD payload is lower case hex
+	 *
+	 * @param evt	Record to format
+	 * @param out	Destination (SINK_MAX_RECORD octets)
+	 * @returns octets written
+	*/
+
+	char *p = out;
+	p = put(p, "{\"timestamp\":");
+	p = put_num(p, evt.timestamp);
+	p = put(p, ",\"address\":\"");
+	p = put_address(p, evt.address);
+	p = put(p, "\",\"address_type\":");
+	p = put_num(p, evt.address_type);
+	p = put(p, ",\"event_type\":");
+	p = put_num(p, evt.event);
+	p = put(p, ",\"subevent\":");
+	p = put_num(p, evt.subevent);
+	p = put(p, ",\"rssi\":");
+	p = put_num(p, evt.rssi);
+	p = put(p, ",\"tx_power\":");
+	p = put_num(p, evt.tx_power);
+	p = put(p, ",\"primary_phy\":");
+	p = put_num(p, evt.primary_phy);
+	p = put(p, ",\"secondary_phy\":");
+	p = put_num(p, evt.secondary_phy);
+	p = put(p, ",\"sid\":");
+	p = put_num(p, evt.advertising_sid);
+	p = put(p, ",\"adapter\":");
+	p = put_num(p, evt.adapter_id);
+	p = put(p, ",\"aggregate\":");
+	p = put_num(p, evt.aggregate);
+	p = put(p, ",\"report_count\":");
+	p = put_num(p, evt.report_count);
+	p = put(p, ",\"name\":");
+	p = put_json_string(p, ad_name(ad_range(evt)));
+	p = put(p, ",\"data\":\"");
+	p += hex_encode(evt.data, evt.data_length, p);
+	p = put(p, "\"}\n");
+
+	return (size_t)(p - out);
+}
+
+size_t csvSink::preamble(char *out){
+	return (size_t)(put(out,
+		"timestamp,address,address_type,event_type,subevent,rssi,tx_power,"
+		"primary_phy,secondary_phy,sid,adapter,aggregate,report_count,name,data\n") - out);
+}
+
+size_t csvSink::format(const adv_event_t& evt, char *out){
+	/**
+	 * One row per record, columns as in preamble()
+	 *
+	 * @param evt	Record to format
+	 * @param out	Destination (SINK_MAX_RECORD octets)
+	 * @returns octets written
+	*/
+
+	char *p = out;
+	p = put_num(p, evt.timestamp);
+	*p++ = ',';
+	p = put_address(p, evt.address);
+	*p++ = ',';
+	p = put_num(p, evt.address_type);
+	*p++ = ',';
+	p = put_num(p, evt.event);
+	*p++ = ',';
+	p = put_num(p, evt.subevent);
+	*p++ = ',';
+	p = put_num(p, evt.rssi);
+	*p++ = ',';
+	p = put_num(p, evt.tx_power);
+	*p++ = ',';
+	p = put_num(p, evt.primary_phy);
+	*p++ = ',';
+	p = put_num(p, evt.secondary_phy);
+	*p++ = ',';
+	p = put_num(p, evt.advertising_sid);
+	*p++ = ',';
+	p = put_num(p, evt.adapter_id);
+	*p++ = ',';
+	p = put_num(p, evt.aggregate);
+	*p++ = ',';
+	p = put_num(p, evt.report_count);
+	*p++ = ',';
+	p = put_csv_string(p, ad_name(ad_range(evt)));
+	*p++ = ',';
+	p += hex_encode(evt.data, evt.data_length, p);
+	*p++ = '\n';
+
+	return (size_t)(p - out);
+}
+
+size_t binarySink::preamble(char *out){
+	sink_binary_header_t header = {};
+	memcpy(header.magic, SINK_BINARY_MAGIC, sizeof(SINK_BINARY_MAGIC));
+	header.version = SINK_BINARY_VERSION;
+	header.record_header = sizeof(sink_binary_record_t);
+	memcpy(out, &header, sizeof(header));
+	return sizeof(header);
+}
+
+size_t binarySink::format(const adv_event_t& evt, char *out){
+	/**
+	 * Fixed header plus the AD payload, no padding
+	 *
+	 * @param evt	Record to format
+	 * @param out	Destination (SINK_MAX_RECORD octets)
+	 * @returns octets written
+	*/
+
+	sink_binary_record_t *rec = (sink_binary_record_t*)out;
+	size_t length = sizeof(sink_binary_record_t) + evt.data_length;
+	rec->length = (uint16_t)length;
+	rec->subevent = evt.subevent;
+	rec->data_status = evt.data_status;
+	rec->timestamp = evt.timestamp;
+	rec->address = evt.address;
+	rec->address_type = evt.address_type;
+	rec->advertising_sid = evt.advertising_sid;
+	rec->event = evt.event;
+	rec->rssi = evt.rssi;
+	rec->tx_power = evt.tx_power;
+	rec->primary_phy = evt.primary_phy;
+	rec->secondary_phy = evt.secondary_phy;
+	rec->periodic_advertising_interval = evt.periodic_advertising_interval;
+	rec->sync_handle = evt.sync_handle;
+	rec->aggregate = evt.aggregate;
+	rec->adapter_id = evt.adapter_id;
+	rec->direction = evt.direction;
+	rec->data_length = evt.data_length;
+	rec->report_count = evt.report_count;
+	memcpy(rec->data, evt.data, evt.data_length);
+	return length;
+}
+
+std::unique_ptr<outputSink> make_sink(sinkFormat format, int fd, bool owns_fd){
+	/**
+	 * Factory for the built-in sinks
+	 *
+	 * @param format	Output format
+	 * @param fd	Descriptor to write to
+	 * @param owns_fd	Close fd with the sink
+	 * @returns the sink
+	*/
+
+	switch(format){
+		case sinkFormat::ndjson:
+			return std::make_unique<ndjsonSink>(fd, owns_fd);
+		case sinkFormat::csv:
+			return std::make_unique<csvSink>(fd, owns_fd);
+		case sinkFormat::binary:
+			return std::make_unique<binarySink>(fd, owns_fd);
+		case sinkFormat::text:
+		default:
+			return std::make_unique<textSink>(fd, owns_fd);
+	}
+}
+
+std::unique_ptr<outputSink> open_file_sink(sinkFormat format, const std::string& path, bool append){
+	/**
+	 * Opens path for writing and wraps it in a built-in sink
+	 *
+	 * @param format	Output format
+	 * @param path	File to write
+	 * @param append	Append instead of truncating
+	 * @returns the sink, nullptr on failure
+	*/
+
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+	int fd = open(path.c_str(), flags, 0644);
+	if(fd < 0) return nullptr;
+	return make_sink(format, fd, true);
+}
+
+std::unique_ptr<outputSink> open_unix_sink(sinkFormat format, const std::string& path){
+	/**
+	 * Connects to a Unix stream socket and wraps it in a built-in sink
+	 *
+	 * @param format	Output format
+	 * @param path	Socket path of the listening consumer
+	 * @returns the sink, nullptr on failure
+	*/
+
+	struct sockaddr_un addr = {};
+	if(path.size() >= sizeof(addr.sun_path)) return nullptr;
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) return nullptr;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		close(fd);
+		return nullptr;
+	}
+	return make_sink(format, fd, true);
+}
+
+sinkWriter::sinkWriter(std::vector<std::unique_ptr<outputSink>> sinks, const sink_config_t& config) :
+	config(config), sinks(), ring(config.queue_capacity, overflowPolicy::drop_newest),
+	running(true), writer(),
+	n_records(0), n_bytes(0), n_writes(0), n_errors(0)
+{
+	/**
+	 * Constructor for sinkWriter
+	 * Allocates the staging chunks, stages each preamble and starts the thread
+	 *
+	 * @param sinks	Destinations; every record is written to all of them
+	 * @param config	Queue size and flush timing
+	*/
+
+	for(std::unique_ptr<outputSink>& sink : sinks){
+		if(!sink) continue;
+		sink_state_t s;
+		s.sink = std::move(sink);
+		s.chunks.resize(SINK_MAX_CHUNKS);
+		for(std::unique_ptr<char[]>& chunk : s.chunks) chunk = std::make_unique<char[]>(SINK_CHUNK_SIZE);
+		s.lengths.assign(SINK_MAX_CHUNKS, 0);
+		s.chunk = 0;
+		s.fill = s.sink->preamble(s.chunks[0].get());
+		s.failed = s.sink->get_fd() < 0;
+		this->sinks.push_back(std::move(s));
+	}
+
+	writer = std::thread(&sinkWriter::run, this);
+}
+
+sinkWriter::~sinkWriter(){
+	stop();
+}
+
+void sinkWriter::stop(){
+	running.store(false, std::memory_order_release);
+	if(writer.joinable()) writer.join();
+}
+
+bool sinkWriter::push(const adv_event_t& evt){
+	/**
+	 * Copies evt into the next free slot (capture thread side)
+	 * The sink thread polls, so no wake-up is issued
+	 *
+	 * @param evt	Record to write
+	 * @returns true if queued, false if dropped
+	*/
+
+	entry_t *slot = ring.claim();
+	if(slot == nullptr) return false;
+	slot->raw = false;
+	slot->evt = evt;
+	ring.publish(false);
+	n_records.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+size_t sinkWriter::push_batch(const adv_event_t *evts, size_t count){
+	/**
+	 * Queues count records; every record that finds the ring full is
+	 * dropped and counted on its own
+	 *
+	 * @param evts	Records to write
+	 * @param count	Number of records
+	 * @returns number of records queued
+	*/
+
+	size_t accepted = 0;
+	for(size_t i=0; i<count; i++){
+		entry_t *slot = ring.claim();
+		if(slot == nullptr) continue;
+		slot->raw = false;
+		slot->evt = evts[i];
+		ring.publish(false);
+		accepted++;
+	}
+	n_records.fetch_add(accepted, std::memory_order_relaxed);
+	return accepted;
+}
+
+bool sinkWriter::push_raw(const uint8_t *data, size_t len){
+	/**
+	 * Copies a raw packet into the next free slot (capture thread side)
+	 *
+	 * @param data	Packet, H4 type octet first
+	 * @param len	Packet length (truncated to SINK_RAW_MAX)
+	 * @returns true if queued, false if dropped
+	*/
+
+	entry_t *slot = ring.claim();
+	if(slot == nullptr) return false;
+	if(len > SINK_RAW_MAX) len = SINK_RAW_MAX;
+	slot->raw = true;
+	slot->packet.length = (uint16_t)len;
+	memcpy(slot->packet.data, data, len);
+	ring.publish(false);
+	return true;
+}
+
+size_t sinkWriter::sink_count() const{
+	return sinks.size();
+}
+
+sink_stats_t sinkWriter::stats() const{
+	/**
+	 * Relaxed snapshot of the writer counters
+	 *
+	 * @returns sink_stats_t copy
+	*/
+
+	sink_stats_t s;
+	s.records = n_records.load(std::memory_order_relaxed);
+	s.dropped = ring.dropped_newest();
+	s.bytes = n_bytes.load(std::memory_order_relaxed);
+	s.writes = n_writes.load(std::memory_order_relaxed);
+	s.errors = n_errors.load(std::memory_order_relaxed);
+	return s;
+}
+
+void sinkWriter::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics for this writer; nothing is added to push()
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the writer
+	*/
+
+	registry.gauge_fn("bt_sniff_sink_queue_depth", "Records waiting for the sink thread", labels,
+		[this](){ return (double)ring.size(); });
+	registry.counter_fn("bt_sniff_sink_records_total", "Records handed to the sink thread", labels,
+		[this](){ return n_records.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_sink_dropped_total", "Records and raw packets dropped because the sink thread fell behind", labels,
+		[this](){ return ring.dropped_newest(); });
+	registry.counter_fn("bt_sniff_sink_bytes_total", "Formatted bytes written over all sinks", labels,
+		[this](){ return n_bytes.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_sink_write_errors_total", "Failed sink writes", labels,
+		[this](){ return n_errors.load(std::memory_order_relaxed); });
+}
+
+void sinkWriter::run(){
+	/**
+	 * Sink thread: format queued records into every sink's chunks, write
+	 * a sink when its chunks are full, and everything once output has
+	 * waited flush_ms or the writer is stopping
+	*/
+
+	const uint64_t flush_ns = (uint64_t)config.flush_ms * 1000000ull;
+	uint64_t pending_since = 0;
+	for(sink_state_t& s : sinks){
+		if(s.fill > 0) pending_since = monotonic_ns();
+	}
+
+	entry_t entry;
+	while(true){
+		bool idle = true;
+		while(ring.try_pop(entry)){
+			idle = false;
+			if(pending_since == 0) pending_since = monotonic_ns();
+			for(sink_state_t& s : sinks) append(s, entry);
+		}
+
+		bool stopping = !running.load(std::memory_order_acquire);
+		if(pending_since != 0 && (stopping || monotonic_ns() - pending_since >= flush_ns)){
+			for(sink_state_t& s : sinks) flush(s);
+			pending_since = 0;
+		}
+
+		if(idle){
+			if(stopping && ring.size() == 0) break;
+			std::this_thread::sleep_for(std::chrono::microseconds(config.poll_us));
+		}
+	}
+
+	for(sink_state_t& s : sinks) flush(s);
+}
+
+void sinkWriter::append(sink_state_t& s, const entry_t& entry){
+	/**
+	 * Formats a record or raw packet at the end of the sink's chunks,
+	 * writing them first when the last chunk cannot hold another record
+	 *
+	 * @param s	Sink state
+	 * @param entry	Entry popped from the ring
+	*/
+
+	if(s.failed) return;
+	if(SINK_CHUNK_SIZE - s.fill < SINK_MAX_RECORD){
+		if(s.chunk + 1 < s.chunks.size()){
+			s.lengths[s.chunk] = s.fill;
+			s.chunk++;
+			s.fill = 0;
+		}
+		else{
+			flush(s);
+			if(s.failed) return;
+		}
+	}
+	char *out = s.chunks[s.chunk].get() + s.fill;
+	s.fill += entry.raw ? s.sink->format_raw(entry.packet, out) : s.sink->format(entry.evt, out);
+}
+
+void sinkWriter::flush(sink_state_t& s){
+	/**
+	 * Writes and resets the sink's chunks
+	 *
+	 * @param s	Sink state
+	*/
+
+	if(!s.failed && (s.chunk > 0 || s.fill > 0) && !write_chunks(s)){
+		s.failed = true;
+		n_errors.fetch_add(1, std::memory_order_relaxed);
+	}
+	s.chunk = 0;
+	s.fill = 0;
+}
+
+bool sinkWriter::write_chunks(sink_state_t& s){
+	/**
+	 * Hands every filled chunk to the kernel, one writev() (sendmsg() with
+	 * MSG_NOSIGNAL on sockets) per attempt, resuming after short writes
+	 *
+	 * @param s	Sink state
+	 * @returns false on a write error (e.g. the reader went away)
+	*/
+
+	struct iovec iov[SINK_MAX_CHUNKS];
+	size_t n_iov = 0;
+	for(size_t i=0; i<=s.chunk; i++){
+		size_t len = i == s.chunk ? s.fill : s.lengths[i];
+		if(len == 0) continue;
+		iov[n_iov].iov_base = s.chunks[i].get();
+		iov[n_iov].iov_len = len;
+		n_iov++;
+	}
+
+	int fd = s.sink->get_fd();
+	struct iovec *cur = iov;
+	while(n_iov > 0){
+		ssize_t n;
+		if(s.sink->is_socket()){
+			struct msghdr msg = {};
+			msg.msg_iov = cur;
+			msg.msg_iovlen = n_iov;
+			n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		}
+		else{
+			n = writev(fd, cur, (int)n_iov);
+		}
+		n_writes.fetch_add(1, std::memory_order_relaxed);
+
+		if(n < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				struct pollfd pfd = {fd, POLLOUT, 0};
+				if(poll(&pfd, 1, SINK_WRITE_WAIT_MS) > 0) continue;
+			}
+			return false;
+		}
+		n_bytes.fetch_add((uint64_t)n, std::memory_order_relaxed);
+
+		size_t done = (size_t)n;
+		while(n_iov > 0 && done >= cur->iov_len){
+			done -= cur->iov_len;
+			cur++;
+			n_iov--;
+		}
+		if(n_iov > 0){
+			cur->iov_base = (char*)cur->iov_base + done;
+			cur->iov_len -= done;
+		}
+	}
+	return true;
+}
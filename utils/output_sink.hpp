@@ -0,0 +1,332 @@
+/**
+ * Header for pluggable record output sinks and the asynchronous sink writer
+ * @author Owen Capell
+*/
+#ifndef OUTPUT_SINK
+#define OUTPUT_SINK
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+#include "spsc_ring.hpp"
+#include "metrics.hpp"
+
+/* Largest output a built-in sink produces for one record (text/JSON with full AD) */
+#define SINK_MAX_RECORD 4096
+
+/* Largest raw packet queued for dumping; longer packets are truncated */
+#define SINK_RAW_MAX HCI_EVENT_BUF_SIZE
+
+/* Size of the staging chunks formatted records are appended to */
+#define SINK_CHUNK_SIZE (64 * 1024)
+
+/* Chunks per sink; a full set is handed to the kernel with one writev() */
+#define SINK_MAX_CHUNKS 16
+
+/* Magic and version at the start of a binary sink stream */
+#define SINK_BINARY_MAGIC "BTSNREC"
+#define SINK_BINARY_VERSION 1
+
+/**
+ * @details
+ * Output formats of the built-in sinks
+ * @param text	Human-readable report, same layout as print_adv_event()
+ * @param ndjson	One JSON object per line
+ * @param csv	Header line, then one row per record
+ * @param binary	sink_binary_header_t, then one sink_binary_record_t per record
+*/
+enum class sinkFormat{
+	text,
+	ndjson,
+	csv,
+	binary
+};
+
+/**
+ * @details
+ * Stream header written once by the binary sink (host byte order)
+ * @param magic	SINK_BINARY_MAGIC, NUL terminated
+ * @param version	SINK_BINARY_VERSION
+ * @param record_header	sizeof(sink_binary_record_t), lets readers skip unknown fields
+*/
+typedef struct{
+	char magic[8];
+	uint16_t version;
+	uint16_t record_header;
+	uint32_t reserved;
+} __attribute__ ((packed)) sink_binary_header_t;
+
+/**
+ * @details
+ * Binary sink record: fixed header followed by data_length AD octets
+ * (host byte order; see adv_event_t for the field meanings)
+ * @param length	Total record length including the AD payload
+*/
+typedef struct{
+	uint16_t length;
+	uint8_t subevent;
+	uint8_t data_status;
+	uint64_t timestamp;
+	bt_dev_addr_t address;
+	uint8_t address_type;
+	uint8_t advertising_sid;
+	uint16_t event;
+	int8_t rssi;
+	int8_t tx_power;
+	uint8_t primary_phy;
+	uint8_t secondary_phy;
+	uint16_t periodic_advertising_interval;
+	uint16_t sync_handle;
+	uint8_t aggregate;
+	uint8_t adapter_id;
+	uint8_t direction;
+	uint8_t data_length;
+	uint32_t report_count;
+	uint8_t data[];
+} __attribute__ ((packed)) sink_binary_record_t;
+
+/**
+ * @details
+ * Raw HCI packet queued for sinks that dump packets (raw capture mode)
+ * @param length	Octets in data
+ * @param data	Packet, H4 type octet first
+*/
+typedef struct{
+	uint16_t length;
+	uint8_t data[SINK_RAW_MAX];
+} sink_raw_packet_t;
+
+/**
+ * @details
+ * Destination and format of formatted records. Sinks are only used from
+ * the sinkWriter thread; subclass and override format() for new formats
+*/
+class outputSink{
+public:
+	/**
+	 * @brief
+	 * Writes to fd (file, pipe, tty or connected socket); closed on
+	 * destruction when owns_fd is set
+	*/
+	outputSink(int fd, bool owns_fd);
+	virtual ~outputSink();
+
+	outputSink(const outputSink&) = delete;
+	outputSink& operator=(const outputSink&) = delete;
+
+	/**
+	 * @brief
+	 * Formats evt into out (SINK_MAX_RECORD octets); returns the length
+	*/
+	virtual size_t format(const adv_event_t& evt, char *out) = 0;
+
+	/**
+	 * @brief
+	 * Formats a raw packet into out (SINK_MAX_RECORD octets); returns the
+	 * length. Sinks that do not dump packets write nothing
+	*/
+	virtual size_t format_raw(const sink_raw_packet_t& pkt, char *out);
+
+	/**
+	 * @brief
+	 * Written once before the first record (e.g. CSV header); returns the length
+	*/
+	virtual size_t preamble(char *out);
+
+	int get_fd() const;
+
+	/**
+	 * @brief
+	 * True if fd is a socket (written with MSG_NOSIGNAL)
+	*/
+	bool is_socket() const;
+
+private:
+	int fd;
+	bool owns_fd;
+	bool socket;
+};
+
+class textSink : public outputSink{
+public:
+	using outputSink::outputSink;
+	size_t format(const adv_event_t& evt, char *out) override;
+	size_t format_raw(const sink_raw_packet_t& pkt, char *out) override;
+};
+
+class ndjsonSink : public outputSink{
+public:
+	using outputSink::outputSink;
+	size_t format(const adv_event_t& evt, char *out) override;
+};
+
+class csvSink : public outputSink{
+public:
+	using outputSink::outputSink;
+	size_t format(const adv_event_t& evt, char *out) override;
+	size_t preamble(char *out) override;
+};
+
+class binarySink : public outputSink{
+public:
+	using outputSink::outputSink;
+	size_t format(const adv_event_t& evt, char *out) override;
+	size_t preamble(char *out) override;
+};
+
+/**
+ * @brief
+ * Built-in sink of the given format on an existing descriptor
+*/
+std::unique_ptr<outputSink> make_sink(sinkFormat format, int fd, bool owns_fd = false);
+
+/**
+ * @brief
+ * Built-in sink writing to a file (created, truncated unless append)
+ * Returns nullptr if the file cannot be opened
+*/
+std::unique_ptr<outputSink> open_file_sink(sinkFormat format, const std::string& path, bool append = false);
+
+/**
+ * @brief
+ * Built-in sink streaming to a listening Unix stream socket
+ * Returns nullptr if the connection fails
+*/
+std::unique_ptr<outputSink> open_unix_sink(sinkFormat format, const std::string& path);
+
+/**
+ * @details
+ * Configuration for sinkWriter
+ * @param queue_capacity	Records buffered between capture and sink threads
+ * @param poll_us	Sink thread sleep when idle
+ * @param flush_ms	Longest formatted output waits before it is written
+*/
+typedef struct{
+	size_t queue_capacity = 16384;
+	uint32_t poll_us = 1000;
+	uint32_t flush_ms = 50;
+} sink_config_t;
+
+/**
+ * @details
+ * Snapshot of sinkWriter counters
+ * @param records	Records accepted from the capture thread
+ * @param dropped	Records and raw packets dropped because the sink thread fell behind
+ * @param bytes		Bytes written over all sinks
+ * @param writes	writev()/sendmsg() calls
+ * @param errors	Failed writes (a sink is disabled after its first error)
+*/
+typedef struct{
+	uint64_t records;
+	uint64_t dropped;
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t errors;
+} sink_stats_t;
+
+/**
+ * @details
+ * Fans records out to any number of sinks from a dedicated thread. The
+ * capture thread only copies fixed-size records into an SPSC ring
+ * (drop-and-count when full), so slow consumers such as a terminal never
+ * stall packet intake. The sink thread formats into per-sink chunks and
+ * writes each sink's chunks with a single writev()
+*/
+class sinkWriter{
+public:
+	/**
+	 * @brief
+	 * Takes ownership of sinks and starts the sink thread
+	*/
+	explicit sinkWriter(std::vector<std::unique_ptr<outputSink>> sinks,
+		const sink_config_t& config = sink_config_t{});
+
+	/**
+	 * @brief
+	 * Writes everything queued and joins the thread
+	*/
+	~sinkWriter();
+
+	sinkWriter(const sinkWriter&) = delete;
+	sinkWriter& operator=(const sinkWriter&) = delete;
+
+	/**
+	 * @brief
+	 * Queues a copy of evt (single producer); never blocks
+	 * Returns false if the record was dropped
+	*/
+	bool push(const adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Queues count records; returns the number accepted
+	*/
+	size_t push_batch(const adv_event_t *evts, size_t count);
+
+	/**
+	 * @brief
+	 * Queues a copy of a raw packet for the sinks' format_raw() (same
+	 * producer as push()); never blocks
+	 * Returns false if the packet was dropped
+	*/
+	bool push_raw(const uint8_t *data, size_t len);
+
+	/**
+	 * @brief
+	 * Stops the sink thread after draining the queue (idempotent)
+	*/
+	void stop();
+
+	size_t sink_count() const;
+
+	sink_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes queue depth, record, drop, byte and error counters in registry
+	 * (the writer must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	/* Ring entry: a record, or a raw packet when raw is set */
+	typedef struct{
+		bool raw;
+		union{
+			adv_event_t evt;
+			sink_raw_packet_t packet;
+		};
+	} entry_t;
+
+	typedef struct{
+		std::unique_ptr<outputSink> sink;
+		std::vector<std::unique_ptr<char[]>> chunks;
+		std::vector<size_t> lengths;
+		size_t chunk;
+		size_t fill;
+		bool failed;
+	} sink_state_t;
+
+	void run();
+	void append(sink_state_t& s, const entry_t& entry);
+	void flush(sink_state_t& s);
+	bool write_chunks(sink_state_t& s);
+
+	sink_config_t config;
+	std::vector<sink_state_t> sinks;
+	spscRing<entry_t> ring;
+	std::atomic<bool> running;
+	std::thread writer;
+
+	std::atomic<uint64_t> n_records;
+	std::atomic<uint64_t> n_bytes;
+	std::atomic<uint64_t> n_writes;
+	std::atomic<uint64_t> n_errors;
+};
+
+#endif
@@ -0,0 +1,346 @@
+/**
+ * Implementation of raw HCI packet sources (live socket, capture files)
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "bluetoothdef.hpp"
+#include "packet_source.hpp"
+#include "event_queue.hpp"
+#include "utils.hpp"
+
+/* btsnoop file layout (all fields big endian) */
+#define BTSNOOP_HEADER_SIZE     16
+#define BTSNOOP_RECORD_SIZE     24
+#define BTSNOOP_FLAG_RECEIVED   0x01
+#define BTSNOOP_FLAG_CMD_EVT    0x02
+/* Microseconds between the btsnoop epoch (0 AD) and the Unix epoch */
+#define BTSNOOP_EPOCH_DELTA_US  0x00e03ab44a676000ull
+
+/* pcap file layout */
+#define PCAP_HEADER_SIZE        24
+#define PCAP_RECORD_SIZE        16
+#define PCAP_MAGIC_US           0xa1b2c3d4
+#define PCAP_MAGIC_NS           0xa1b23c4d
+#define PCAP_PHDR_SIZE          4
+
+static uint32_t load_be32(const uint8_t *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return be32toh(v);
+}
+
+static uint64_t load_be64(const uint8_t *p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+static uint32_t load_u32(const uint8_t *p, bool swapped){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+hciSocketSource::hciSocketSource(int fd) :
+	fd(fd), buf(), control(), iov(), msg()
+{
+	/**
+	 * Constructor for hciSocketSource
+	 *
+	 * @param fd	Bound raw HCI socket (not owned)
+	*/
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+}
+
+int hciSocketSource::next(hci_packet_t& pkt){
+	/**
+	 * Blocks until the socket delivers a packet
+	 * Non-blocking sockets are waited on with poll()
+	 *
+	 * @param pkt	Packet view to fill; valid until the next call
+	 * @returns 1 on packet, 0 on orderly shutdown, -1 on error
+	*/
+
+	ssize_t len;
+	while(true){
+		msg.msg_controllen = sizeof(control);
+		len = recvmsg(fd, &msg, 0);
+		if(len >= 0) break;
+		if(errno == EINTR) continue;
+		if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if(poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+	}
+	if(len == 0) return 0;
+
+	pkt.data = buf;
+	pkt.length = (size_t)len;
+	parse_hci_cmsg(&msg, pkt.meta);
+	return 1;
+}
+
+captureFileSource::captureFileSource(const std::string& path, replayMode mode, double speed) :
+	map(nullptr), map_size(0), offset(0), first_offset(0),
+	btsnoop(false), link_type(0), swapped(false), nanosecond(false),
+	mode(mode), speed(speed > 0.0 ? speed : 1.0), first_timestamp(0), wall_start(0),
+	scratch()
+{
+	/**
+	 * Constructor for captureFileSource
+	 * Maps the whole file read-only and validates its header
+	 *
+	 * @param path	btsnoop or pcap file
+	 * @param mode	original, scaled or fast pacing
+	 * @param speed	Speed factor used by replayMode::scaled
+	*/
+
+	if(mode == replayMode::original) this->speed = 1.0;
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < PCAP_HEADER_SIZE){
+		close(fd);
+		return;
+	}
+
+	void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED) return;
+	madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	const uint8_t *base = (const uint8_t*)m;
+	if(memcmp(base, "btsnoop\0", 8) == 0){
+		btsnoop = true;
+		link_type = load_be32(base + 12);
+		first_offset = BTSNOOP_HEADER_SIZE;
+		if(load_be32(base + 8) != 1 ||
+			(link_type != BTSNOOP_TYPE_HCI_UNENCAP && link_type != BTSNOOP_TYPE_HCI_UART)){
+			munmap(m, (size_t)st.st_size);
+			return;
+		}
+	}
+	else{
+		uint32_t magic;
+		memcpy(&magic, base, sizeof(magic));
+		if(magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS){
+			swapped = false;
+		}
+		else if(__builtin_bswap32(magic) == PCAP_MAGIC_US || __builtin_bswap32(magic) == PCAP_MAGIC_NS){
+			swapped = true;
+			magic = __builtin_bswap32(magic);
+		}
+		else{
+			munmap(m, (size_t)st.st_size);
+			return;
+		}
+		nanosecond = (magic == PCAP_MAGIC_NS);
+		link_type = load_u32(base + 20, swapped);
+		first_offset = PCAP_HEADER_SIZE;
+		if(link_type != LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR && link_type != LINKTYPE_BLUETOOTH_HCI_H4){
+			munmap(m, (size_t)st.st_size);
+			return;
+		}
+	}
+
+	map = base;
+	map_size = (size_t)st.st_size;
+	offset = first_offset;
+}
+
+captureFileSource::~captureFileSource(){
+	/**
+	 * Destructor for captureFileSource
+	 * Unmaps the file
+	*/
+
+	if(map != nullptr) munmap((void*)map, map_size);
+}
+
+bool captureFileSource::is_open() const{
+	return map != nullptr;
+}
+
+bool captureFileSource::is_btsnoop() const{
+	return btsnoop;
+}
+
+void captureFileSource::rewind(){
+	offset = first_offset;
+	first_timestamp = 0;
+	wall_start = 0;
+}
+
+int captureFileSource::next(hci_packet_t& pkt){
+	/**
+	 * Hands out the next record of the mapping, pacing if requested
+	 *
+	 * @param pkt	Packet view to fill; points into the mapping
+	 * @returns 1 on packet, 0 at end of file, -1 on truncated/corrupt file
+	*/
+
+	if(map == nullptr) return -1;
+
+	int status = btsnoop ? next_btsnoop(pkt) : next_pcap(pkt);
+	if(status == 1 && mode != replayMode::fast) pace(pkt.meta.timestamp);
+	return status;
+}
+
+int captureFileSource::next_btsnoop(hci_packet_t& pkt){
+	/**
+	 * Decodes one btsnoop record
+	 * H4 (1002) records already start with the packet type octet; H1 (1001)
+	 * records have it rebuilt from the flags into scratch
+	*/
+
+	if(offset == map_size) return 0;
+	if(map_size - offset < BTSNOOP_RECORD_SIZE) return -1;
+
+	const uint8_t *rec = map + offset;
+	uint32_t incl_len = load_be32(rec + 4);
+	uint32_t flags = load_be32(rec + 8);
+	uint64_t ts_us = load_be64(rec + 16);
+	if(map_size - offset - BTSNOOP_RECORD_SIZE < incl_len) return -1;
+
+	const uint8_t *payload = rec + BTSNOOP_RECORD_SIZE;
+	offset += BTSNOOP_RECORD_SIZE + incl_len;
+
+	pkt.meta.direction = (flags & BTSNOOP_FLAG_RECEIVED) ? HCI_DIR_IN : HCI_DIR_OUT;
+	pkt.meta.timestamp = ts_us > BTSNOOP_EPOCH_DELTA_US ?
+		(ts_us - BTSNOOP_EPOCH_DELTA_US) * 1000ull : 0;
+
+	if(link_type == BTSNOOP_TYPE_HCI_UART){
+		pkt.data = payload;
+		pkt.length = incl_len;
+		return 1;
+	}
+
+	/* HCI_UNENCAP: prepend the H4 type octet */
+	size_t len = incl_len < sizeof(scratch) - 1 ? incl_len : sizeof(scratch) - 1;
+	if(flags & BTSNOOP_FLAG_CMD_EVT){
+		scratch[0] = (flags & BTSNOOP_FLAG_RECEIVED) ? HCI_PACK_EVENT : HCI_PACK_COMMAND;
+	}
+	else{
+		scratch[0] = HCI_PACK_ACLDATA;
+	}
+	memcpy(scratch + 1, payload, len);
+	pkt.data = scratch;
+	pkt.length = len + 1;
+	return 1;
+}
+
+int captureFileSource::next_pcap(hci_packet_t& pkt){
+	/**
+	 * Decodes one pcap record, stripping the 4 octet direction
+	 * pseudo-header of LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR
+	*/
+
+	if(offset == map_size) return 0;
+	if(map_size - offset < PCAP_RECORD_SIZE) return -1;
+
+	const uint8_t *rec = map + offset;
+	uint64_t ts_sec = load_u32(rec, swapped);
+	uint64_t ts_frac = load_u32(rec + 4, swapped);
+	uint32_t incl_len = load_u32(rec + 8, swapped);
+	if(map_size - offset - PCAP_RECORD_SIZE < incl_len) return -1;
+
+	const uint8_t *payload = rec + PCAP_RECORD_SIZE;
+	offset += PCAP_RECORD_SIZE + incl_len;
+
+	pkt.meta.timestamp = ts_sec * 1000000000ull + (nanosecond ? ts_frac : ts_frac * 1000ull);
+	pkt.meta.direction = HCI_DIR_UNKNOWN;
+
+	if(link_type == LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR){
+		if(incl_len < PCAP_PHDR_SIZE) return -1;
+		pkt.meta.direction = (load_be32(payload) & 0x01) ? HCI_DIR_IN : HCI_DIR_OUT;
+		payload += PCAP_PHDR_SIZE;
+		incl_len -= PCAP_PHDR_SIZE;
+	}
+
+	pkt.data = payload;
+	pkt.length = incl_len;
+	return 1;
+}
+
+void captureFileSource::pace(uint64_t timestamp){
+	/**
+	 * Sleeps until the packet is due relative to the first packet
+	 *
+	 * @param timestamp	Recorded packet time in nanoseconds
+	*/
+
+	if(wall_start == 0){
+		wall_start = monotonic_ns();
+		first_timestamp = timestamp;
+		return;
+	}
+	if(timestamp <= first_timestamp) return;
+
+	uint64_t due = wall_start + (uint64_t)((double)(timestamp - first_timestamp) / speed);
+	if(due <= monotonic_ns()) return;
+
+	struct timespec ts;
+	ts.tv_sec = (time_t)(due / 1000000000ull);
+	ts.tv_nsec = (long)(due % 1000000000ull);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int drain_source(
+	packetSource& source, eventQueue& usr_queue, const bool& verbose,
+	source_stats_t& stats, uint64_t max_packets,
+	const advFilter *filter, deviceTable *devices, extReassembler *reassembler){
+	/**
+	 * Generic capture/replay loop: parse every packet of source and
+	 * publish the records. Use a block-policy queue for lossless replay.
+	 *
+	 * @param source	Live socket or capture file
+	 * @param usr_queue	Queue to publish records into
+	 * @param verbose	Boolean flag to print decoded reports
+	 * @param stats	Packet, byte and event counts plus elapsed time
+	 * @param max_packets	Stop after this many packets (0 = unlimited)
+	 * @param filter	Compiled report filter (nullptr = built-in PDU check)
+	 * @param devices	Aggregation table (nullptr = publish every report)
+	 * @param reassembler	Fragment reassembly (nullptr = publish fragments as they come)
+	 * @returns 0 at end of stream (or max_packets), -1 on error
+	*/
+
+	adv_event_t records[HCI_MAX_REPORTS_PER_EVENT];
+	const advFilter *decode_filter = reassembler != nullptr ? reassembler->decode_filter(filter) : filter;
+	hci_packet_t pkt;
+	uint64_t start = monotonic_ns();
+	int status;
+
+	stats = source_stats_t{};
+	while((status = source.next(pkt)) == 1){
+		stats.packets++;
+		stats.bytes += pkt.length;
+
+		size_t n = parse_hci_packet(
+			pkt.data, pkt.length, pkt.meta, records, HCI_MAX_REPORTS_PER_EVENT, verbose, decode_filter);
+		if(reassembler != nullptr) n = reassembler->reassemble(records, n, filter);
+		if(devices != nullptr) n = devices->coalesce(records, n);
+		if(n > 0) stats.events += usr_queue.push_batch(records, n);
+
+		if(max_packets != 0 && stats.packets >= max_packets) break;
+	}
+
+	stats.elapsed_ns = monotonic_ns() - start;
+	return status < 0 ? -1 : 0;
+}
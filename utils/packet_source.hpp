@@ -0,0 +1,170 @@
+/**
+ * Header for pluggable raw HCI packet sources (live socket, capture files)
+ * @author Owen Capell
+*/
+#ifndef PACKET_SOURCE
+#define PACKET_SOURCE
+
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+#include "adv_filter.hpp"
+#include "device_table.hpp"
+#include "ext_reassembly.hpp"
+
+/* btsnoop datalink types (RFC 1761 derived format) */
+#define BTSNOOP_TYPE_HCI_UNENCAP    1001
+#define BTSNOOP_TYPE_HCI_UART       1002
+
+/* pcap link types */
+#define LINKTYPE_BLUETOOTH_HCI_H4           187
+#define LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR 201
+
+/**
+ * @details
+ * One raw HCI packet handed out by a packetSource
+ * The data pointer stays valid until the next call to next()
+ * @param data	Packet bytes, starting with the H4 packet type octet
+ * @param length	Number of valid octets at data
+ * @param meta	Timestamp and direction of the packet
+*/
+typedef struct{
+	const uint8_t *data;
+	size_t length;
+	hci_packet_meta_t meta;
+} hci_packet_t;
+
+/**
+ * @details
+ * Pacing applied by file sources
+ * @param original	Sleep so packets are delivered at their recorded timing
+ * @param scaled	Recorded timing divided by a speed factor
+ * @param fast		No pacing; as fast as the consumer allows
+*/
+enum class replayMode{
+	original,
+	scaled,
+	fast
+};
+
+/**
+ * @details
+ * Statistics of a drain_source() run
+ * @param packets	Packets read from the source
+ * @param bytes		Bytes read from the source
+ * @param events	Records accepted by the queue
+ * @param elapsed_ns	Wall time spent in drain_source()
+*/
+typedef struct{
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t events;
+	uint64_t elapsed_ns;
+} source_stats_t;
+
+class packetSource{
+public:
+	virtual ~packetSource() = default;
+
+	/**
+	 * @brief
+	 * Produces the next packet
+	 * Returns 1 on packet, 0 on end of stream, -1 on error
+	*/
+	virtual int next(hci_packet_t& pkt) = 0;
+};
+
+/**
+ * @details
+ * Live source over a bound raw HCI socket (or any packet-preserving
+ * stand-in such as a socketpair). The fd is not owned.
+*/
+class hciSocketSource : public packetSource{
+public:
+	explicit hciSocketSource(int fd);
+
+	int next(hci_packet_t& pkt) override;
+
+private:
+	int fd;
+	uint8_t buf[HCI_EVENT_BUF_SIZE];
+	uint8_t control[64];
+	struct iovec iov;
+	struct msghdr msg;
+};
+
+/**
+ * @details
+ * Memory-mapped btsnoop or pcap capture file. Packets point straight into
+ * the mapping (zero copy), except btsnoop H1 files whose missing packet
+ * type octet is rebuilt in a scratch buffer.
+*/
+class captureFileSource : public packetSource{
+public:
+	/**
+	 * @brief
+	 * Opens and maps path; check is_open() for success
+	*/
+	captureFileSource(const std::string& path, replayMode mode = replayMode::fast, double speed = 1.0);
+	~captureFileSource() override;
+
+	captureFileSource(const captureFileSource&) = delete;
+	captureFileSource& operator=(const captureFileSource&) = delete;
+
+	int next(hci_packet_t& pkt) override;
+
+	/**
+	 * @brief
+	 * Restarts from the first packet
+	*/
+	void rewind();
+
+	bool is_open() const;
+
+	/**
+	 * @brief
+	 * True for btsnoop files, false for pcap
+	*/
+	bool is_btsnoop() const;
+
+private:
+	int next_btsnoop(hci_packet_t& pkt);
+	int next_pcap(hci_packet_t& pkt);
+	void pace(uint64_t timestamp);
+
+	const uint8_t *map;
+	size_t map_size;
+	size_t offset;
+	size_t first_offset;
+
+	bool btsnoop;
+	uint32_t link_type;
+	bool swapped;
+	bool nanosecond;
+
+	replayMode mode;
+	double speed;
+	uint64_t first_timestamp;
+	uint64_t wall_start;
+
+	uint8_t scratch[HCI_EVENT_BUF_SIZE + 1024];
+};
+
+/**
+ * @brief
+ * Pulls every packet from source, parses it and publishes the records
+ * Stops at end of stream, on error, or after max_packets (0 = unlimited)
+ * filter and devices optionally drop and coalesce reports before publishing,
+ * reassembler joins fragmented extended reports first
+ * Returns 0 at end of stream, -1 on error
+*/
+int drain_source(
+	packetSource& source, eventQueue& usr_queue, const bool& verbose,
+	source_stats_t& stats, uint64_t max_packets = 0,
+	const advFilter *filter = nullptr, deviceTable *devices = nullptr,
+	extReassembler *reassembler = nullptr);
+
+#endif
@@ -0,0 +1,541 @@
+/**
+ * Implementation of the multi-threaded HCI parse pipeline
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+#include "parse_pipeline.hpp"
+#include "utils.hpp"
+
+/* Records reserved per frame in the arena; denser batches spill to a per-slot buffer that is kept */
+#define PIPELINE_RECORDS_PER_FRAME 4
+
+static void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+static void pin_thread(int cpu){
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+		std::cerr << "Error pinning parser thread to CPU " << cpu << std::endl;
+	}
+}
+
+parsePipeline::parsePipeline(
+	const pipeline_config_t& config, eventQueue& usr_queue,
+	const advFilter *filter, deviceTable *devices, const publish_taps_t *taps,
+	extReassembler *reassembler) :
+	config(config), usr_queue(usr_queue), filter(filter), devices(devices), reassembler(reassembler),
+	decode_filter(reassembler != nullptr ? reassembler->decode_filter(filter) : filter),
+	taps(taps != nullptr ? *taps : publish_taps_t{}), use_taps(taps != nullptr),
+	h_read_to_parse(nullptr), h_parse_time(nullptr), record_capacity(0), arena(), slots(), workers(),
+	filling(nullptr), next_seq(0), next_worker(0),
+	publishing(false), next_publish(0), unordered_mutex(),
+	n_published(0), capture_waiting(false),
+	work_ticket(0), sleepers(0), stopping(false), stopped(false),
+	n_frames(0), n_dropped(0), n_truncated(0), n_dispatched(0), n_parsed(0), n_events(0), n_held(0),
+	n_max_in_flight(0), n_overflowed(0)
+{
+	/**
+	 * Constructor for parsePipeline
+	 * Carves every slot's frames and records from one arena and starts the workers
+	 *
+	 * @param config	Workers, pinning, arena size and ordering
+	 * @param usr_queue	Queue to publish records into
+	 * @param filter	Compiled report filter (nullptr = built-in PDU check)
+	 * @param devices	Aggregation table (nullptr = publish every report)
+	 * @param taps	Sinks and rings fed the same records (copied; nullptr = none)
+	 * @param reassembler	Fragment reassembly in the publish stage (nullptr = none)
+	*/
+
+	if(this->config.workers == 0) this->config.workers = 1;
+	if(this->config.slots < 2) this->config.slots = 2;
+	if(this->config.frames_per_slot == 0) this->config.frames_per_slot = 1;
+	if(this->config.frame_size == 0) this->config.frame_size = HCI_EVENT_BUF_SIZE;
+
+	size_t frames = this->config.frames_per_slot;
+	record_capacity = frames * PIPELINE_RECORDS_PER_FRAME + HCI_MAX_REPORTS_PER_EVENT;
+	size_t frame_bytes = (frames * this->config.frame_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+	size_t slot_bytes = frame_bytes + record_capacity * sizeof(adv_event_t);
+	arena = std::make_unique<memoryRegion>(slot_bytes * this->config.slots, this->config.hugepages);
+
+	slots = std::make_unique<frame_slot_t[]>(this->config.slots);
+	for(size_t i=0; i<this->config.slots; i++){
+		frame_slot_t& s = slots[i];
+		uint8_t *base = (uint8_t*)arena->data() + i * slot_bytes;
+		s.state.store(slot_free, std::memory_order_relaxed);
+		s.seq = 0;
+		s.count = 0;
+		s.frames = base;
+		s.lengths.resize(frames);
+		s.metas.resize(frames);
+		s.records = (adv_event_t*)(base + frame_bytes);
+		s.n_records = 0;
+		s.n_overflow = 0;
+	}
+
+	for(unsigned int i=0; i<this->config.workers; i++){
+		auto w = std::make_unique<worker_t>();
+		w->ring = std::make_unique<spscRing<uint32_t>>(this->config.slots);
+		w->busy.store(false, std::memory_order_relaxed);
+		w->n_slots.store(0, std::memory_order_relaxed);
+		w->n_stolen.store(0, std::memory_order_relaxed);
+		workers.push_back(std::move(w));
+	}
+	for(unsigned int i=0; i<this->config.workers; i++){
+		workers[i]->thread = std::thread(&parsePipeline::run, this, i);
+	}
+}
+
+parsePipeline::~parsePipeline(){
+	/**
+	 * Destructor for parsePipeline
+	 * Nothing submitted is lost: stop() publishes it first
+	*/
+
+	stop();
+}
+
+void parsePipeline::set_latency(latencyHistogram *read_to_parse, latencyHistogram *parse_time){
+	h_read_to_parse = read_to_parse;
+	h_parse_time = parse_time;
+}
+
+const pipeline_config_t& parsePipeline::get_config() const{
+	return config;
+}
+
+parsePipeline::frame_slot_t* parsePipeline::open_slot(){
+	/**
+	 * Slot the capture thread is filling, taking the next one in sequence
+	 * if none is open. That slot is free unless the arena is full
+	 *
+	 * @returns slot, nullptr if the arena is full and frames must be dropped
+	*/
+
+	if(filling != nullptr) return filling;
+
+	frame_slot_t *s = &slots[next_seq % config.slots];
+	if(s->state.load(std::memory_order_acquire) != slot_free){
+		if(!config.block_when_full) return nullptr;
+		wait_capture(0, s);
+	}
+	s->count = 0;
+	filling = s;
+	return s;
+}
+
+void parsePipeline::copy_frame(frame_slot_t *slot, const uint8_t *data, size_t length, const hci_packet_meta_t& meta){
+	/**
+	 * Appends one frame to slot and queues the slot once it is full
+	 *
+	 * @param slot	Open slot
+	 * @param data	Raw packet
+	 * @param length	Octets in data
+	 * @param meta	Kernel timestamp and direction
+	*/
+
+	if(length > config.frame_size){
+		length = config.frame_size;
+		n_truncated.fetch_add(1, std::memory_order_relaxed);
+	}
+	uint32_t i = slot->count;
+	memcpy(slot->frames + (size_t)i * config.frame_size, data, length);
+	slot->lengths[i] = (uint32_t)length;
+	slot->metas[i] = meta;
+	slot->count = i + 1;
+	if(slot->count == config.frames_per_slot) dispatch();
+}
+
+size_t parsePipeline::submit(const batchReader& reader){
+	/**
+	 * Capture stage for the batched reader: one copy per frame, then the
+	 * (partial) slot is queued so a batch never waits for the next read
+	 *
+	 * @param reader	Reader whose last batch to take
+	 * @returns frames accepted
+	*/
+
+	size_t count = reader.batch_count();
+	size_t accepted = 0;
+	for(; accepted<count; accepted++){
+		frame_slot_t *slot = open_slot();
+		if(slot == nullptr) break;
+		copy_frame(slot, reader.packet(accepted), reader.packet_length(accepted), reader.packet_meta(accepted));
+	}
+	dispatch();
+
+	n_frames.fetch_add(accepted, std::memory_order_relaxed);
+	if(accepted < count) n_dropped.fetch_add(count - accepted, std::memory_order_relaxed);
+	return accepted;
+}
+
+size_t parsePipeline::submit(const hci_packet_t *packets, size_t count){
+	/**
+	 * Capture stage for frames from any source
+	 *
+	 * @param packets	Frames to copy
+	 * @param count	Number of frames
+	 * @returns frames accepted
+	*/
+
+	size_t accepted = 0;
+	for(; accepted<count; accepted++){
+		frame_slot_t *slot = open_slot();
+		if(slot == nullptr) break;
+		copy_frame(slot, packets[accepted].data, packets[accepted].length, packets[accepted].meta);
+	}
+	dispatch();
+
+	n_frames.fetch_add(accepted, std::memory_order_relaxed);
+	if(accepted < count) n_dropped.fetch_add(count - accepted, std::memory_order_relaxed);
+	return accepted;
+}
+
+void parsePipeline::dispatch(){
+	/**
+	 * Queues the open slot on the next worker's ring (round robin) and
+	 * wakes a worker only if one is asleep
+	*/
+
+	frame_slot_t *s = filling;
+	if(s == nullptr || s->count == 0) return;
+	filling = nullptr;
+
+	s->seq = next_seq++;
+	s->state.store(slot_queued, std::memory_order_release);
+
+	/* A ring holds every slot, so claim() cannot fail */
+	spscRing<uint32_t>& ring = *workers[next_worker]->ring;
+	*ring.claim() = (uint32_t)(s - slots.get());
+	ring.publish(false);
+	next_worker = next_worker + 1 == config.workers ? 0 : next_worker + 1;
+	n_dispatched.store(next_seq, std::memory_order_relaxed);
+	uint64_t in_flight = next_seq - n_published.load(std::memory_order_relaxed);
+	if(in_flight > n_max_in_flight.load(std::memory_order_relaxed)) n_max_in_flight.store(in_flight, std::memory_order_relaxed);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(sleepers.load(std::memory_order_relaxed) == 0) return;
+	work_ticket.fetch_add(1, std::memory_order_release);
+	if(config.work_stealing) work_ticket.notify_one();
+	else work_ticket.notify_all();
+}
+
+void parsePipeline::wait_capture(uint64_t target, const frame_slot_t *slot){
+	/**
+	 * Blocks the capture thread until slot is free (slot != nullptr) or
+	 * target slots have been published; publishers only notify while the
+	 * capture thread is waiting
+	 *
+	 * @param target	Published slot count to wait for
+	 * @param slot	Slot to wait for, nullptr to wait for target
+	*/
+
+	auto done = [&](){
+		if(slot != nullptr) return slot->state.load(std::memory_order_acquire) == slot_free;
+		return n_published.load(std::memory_order_acquire) >= target;
+	};
+
+	while(!done()){
+		uint64_t seen = n_published.load(std::memory_order_seq_cst);
+		capture_waiting.store(true, std::memory_order_seq_cst);
+		if(!done()) n_published.wait(seen, std::memory_order_acquire);
+		capture_waiting.store(false, std::memory_order_relaxed);
+	}
+}
+
+void parsePipeline::flush(){
+	/**
+	 * Queues the open slot and waits for the workers to publish everything
+	*/
+
+	dispatch();
+	wait_capture(next_seq, nullptr);
+}
+
+void parsePipeline::stop(){
+	/**
+	 * Publishes what was submitted and joins the workers (capture thread only)
+	*/
+
+	if(stopped) return;
+	stopped = true;
+	flush();
+
+	stopping.store(true, std::memory_order_seq_cst);
+	work_ticket.fetch_add(1, std::memory_order_release);
+	work_ticket.notify_all();
+	for(auto& w : workers){
+		if(w->thread.joinable()) w->thread.join();
+	}
+}
+
+void parsePipeline::run(unsigned int self){
+	/**
+	 * Worker loop: parse own slots, steal when idle, spin briefly and then
+	 * sleep on the work ticket
+	 *
+	 * @param self	Worker index
+	*/
+
+	if(!config.cpus.empty()){
+		int cpu = config.cpus[self % config.cpus.size()];
+		if(cpu >= 0) pin_thread(cpu);
+	}
+
+	uint32_t spins = 0;
+	while(true){
+		uint32_t index;
+		if(find_work(self, index)){
+			frame_slot_t& s = slots[index];
+			parse_slot(s);
+			complete(s);
+			spins = 0;
+			continue;
+		}
+
+		if(stopping.load(std::memory_order_acquire)) break;
+		if(++spins < SPSC_RING_SPIN_LIMIT){
+			cpu_relax();
+			continue;
+		}
+
+		uint32_t ticket = work_ticket.load(std::memory_order_acquire);
+		sleepers.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(!has_work(self) && !stopping.load(std::memory_order_seq_cst)){
+			work_ticket.wait(ticket, std::memory_order_acquire);
+		}
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+		spins = 0;
+	}
+}
+
+bool parsePipeline::take(unsigned int from, uint32_t& index){
+	/**
+	 * Pops a slot index from worker from's ring. The ring's consumer side
+	 * is guarded by a flag so thieves and the owner never pop concurrently
+	 *
+	 * @param from	Ring owner
+	 * @param index	Popped slot index
+	 * @returns true if a slot was taken
+	*/
+
+	worker_t& w = *workers[from];
+	if(w.ring->size() == 0) return false;
+	if(w.busy.exchange(true, std::memory_order_acquire)) return false;
+	bool ok = w.ring->try_pop(index);
+	w.busy.store(false, std::memory_order_release);
+	return ok;
+}
+
+bool parsePipeline::find_work(unsigned int self, uint32_t& index){
+	/**
+	 * Own ring first, then (with work stealing) the other rings in turn
+	 *
+	 * @param self	Worker index
+	 * @param index	Slot to parse
+	 * @returns true if a slot was found
+	*/
+
+	if(take(self, index)){
+		workers[self]->n_slots.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+	if(!config.work_stealing) return false;
+
+	for(unsigned int k=1; k<config.workers; k++){
+		unsigned int victim = self + k < config.workers ? self + k : self + k - config.workers;
+		if(take(victim, index)){
+			workers[self]->n_slots.fetch_add(1, std::memory_order_relaxed);
+			workers[self]->n_stolen.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool parsePipeline::has_work(unsigned int self) const{
+	if(!config.work_stealing) return workers[self]->ring->size() > 0;
+	for(const auto& w : workers){
+		if(w->ring->size() > 0) return true;
+	}
+	return false;
+}
+
+void parsePipeline::parse_slot(frame_slot_t& slot){
+	/**
+	 * Decodes every frame of slot into the slot's own records
+	 *
+	 * @param slot	Slot taken from a ring
+	*/
+
+	bool timed = h_read_to_parse != nullptr || h_parse_time != nullptr;
+	uint64_t parse_start = timed ? realtime_ns() : 0;
+
+	size_t n = 0;
+	size_t spill = 0;
+	for(uint32_t i=0; i<slot.count; i++){
+		const uint8_t *frame = slot.frames + (size_t)i * config.frame_size;
+		if(spill == 0 && record_capacity - n >= HCI_MAX_REPORTS_PER_EVENT){
+			n += parse_hci_packet(frame, slot.lengths[i], slot.metas[i],
+				slot.records + n, record_capacity - n, false, decode_filter);
+			continue;
+		}
+
+		/* Only a slot of unusually dense reports gets here; the buffer is kept for reuse */
+		if(spill == 0) n_overflowed.fetch_add(1, std::memory_order_relaxed);
+		if(slot.overflow.size() - spill < HCI_MAX_REPORTS_PER_EVENT){
+			slot.overflow.resize(slot.overflow.empty() ? record_capacity : slot.overflow.size() * 2);
+		}
+		spill += parse_hci_packet(frame, slot.lengths[i], slot.metas[i],
+			slot.overflow.data() + spill, slot.overflow.size() - spill, false, decode_filter);
+	}
+	slot.n_records = n;
+	slot.n_overflow = spill;
+	n_parsed.fetch_add(n + spill, std::memory_order_relaxed);
+
+	if(timed){
+		uint64_t parse_end = realtime_ns();
+		if(h_parse_time != nullptr && parse_end > parse_start){
+			h_parse_time->record((parse_end - parse_start) / slot.count);
+		}
+		if(h_read_to_parse != nullptr){
+			for(uint32_t i=0; i<slot.count; i++){
+				uint64_t stamp = slot.metas[i].timestamp;
+				if(stamp != 0 && parse_end > stamp) h_read_to_parse->record(parse_end - stamp);
+			}
+		}
+	}
+}
+
+void parsePipeline::complete(frame_slot_t& slot){
+	/**
+	 * Publication of a parsed slot: immediately under the mutex without
+	 * reorder, otherwise through the in-order combining stage
+	 *
+	 * @param slot	Parsed slot
+	*/
+
+	if(!config.reorder){
+		std::lock_guard<std::mutex> lock(unordered_mutex);
+		publish_slot(slot);
+		return;
+	}
+
+	/* n_published is the next sequence to publish in reorder mode */
+	if(slot.seq != n_published.load(std::memory_order_relaxed)) n_held.fetch_add(1, std::memory_order_relaxed);
+	slot.state.store(slot_parsed, std::memory_order_seq_cst);
+	publish_ready();
+}
+
+void parsePipeline::publish_ready(){
+	/**
+	 * Combining publisher: the worker that gets the flag publishes every
+	 * consecutive parsed slot; others leave theirs for it. After dropping
+	 * the flag the holder looks again, so a slot parsed meanwhile is never
+	 * stranded
+	*/
+
+	while(true){
+		if(publishing.exchange(true, std::memory_order_seq_cst)) return;
+
+		while(true){
+			frame_slot_t& s = slots[next_publish % config.slots];
+			if(s.state.load(std::memory_order_acquire) != slot_parsed) break;
+			next_publish++;
+			publish_slot(s);
+		}
+		uint64_t next = next_publish;
+		publishing.store(false, std::memory_order_seq_cst);
+
+		if(slots[next % config.slots].state.load(std::memory_order_seq_cst) != slot_parsed) return;
+	}
+}
+
+void parsePipeline::publish_slot(frame_slot_t& slot){
+	/**
+	 * Reassembles, aggregates and publishes slot's records, then frees the slot
+	 * (publisher only)
+	 *
+	 * @param slot	Parsed slot
+	*/
+
+	adv_event_t *parts[2] = {slot.records, slot.overflow.data()};
+	size_t counts[2] = {slot.n_records, slot.n_overflow};
+	for(int k=0; k<2; k++){
+		size_t n = counts[k];
+		if(reassembler != nullptr && n > 0) n = reassembler->reassemble(parts[k], n, filter);
+		if(devices != nullptr && n > 0) n = devices->coalesce(parts[k], n);
+		if(n == 0) continue;
+		size_t accepted = publish_records(usr_queue, parts[k], n, use_taps ? &taps : nullptr);
+		n_events.fetch_add(accepted, std::memory_order_relaxed);
+	}
+
+	slot.state.store(slot_free, std::memory_order_release);
+	n_published.fetch_add(1, std::memory_order_seq_cst);
+	if(capture_waiting.load(std::memory_order_seq_cst)) n_published.notify_all();
+}
+
+pipeline_stats_t parsePipeline::stats() const{
+	/**
+	 * Relaxed snapshot of the pipeline counters
+	 *
+	 * @returns pipeline_stats_t copy
+	*/
+
+	pipeline_stats_t s = {};
+	s.frames = n_frames.load(std::memory_order_relaxed);
+	s.dropped = n_dropped.load(std::memory_order_relaxed);
+	s.truncated = n_truncated.load(std::memory_order_relaxed);
+	s.slots = n_dispatched.load(std::memory_order_relaxed);
+	for(const auto& w : workers) s.stolen += w->n_stolen.load(std::memory_order_relaxed);
+	s.parsed = n_parsed.load(std::memory_order_relaxed);
+	s.events = n_events.load(std::memory_order_relaxed);
+	s.held = n_held.load(std::memory_order_relaxed);
+	uint64_t published = n_published.load(std::memory_order_relaxed);
+	s.in_flight = s.slots > published ? s.slots - published : 0;
+	s.max_in_flight = n_max_in_flight.load(std::memory_order_relaxed);
+	s.overflowed = n_overflowed.load(std::memory_order_relaxed);
+	return s;
+}
+
+void parsePipeline::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics; nothing is added to the capture or parse paths
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the pipeline
+	*/
+
+	registry.counter_fn("bt_sniff_pipeline_frames_total", "Frames handed to the parse pipeline", labels,
+		[this](){ return n_frames.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_pipeline_dropped_total", "Frames dropped because every pipeline slot was in flight", labels,
+		[this](){ return n_dropped.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_pipeline_held_total", "Parsed slots held back to keep capture order", labels,
+		[this](){ return n_held.load(std::memory_order_relaxed); });
+	registry.gauge_fn("bt_sniff_pipeline_in_flight", "Pipeline slots queued or being parsed", labels,
+		[this](){ return (double)stats().in_flight; });
+	registry.gauge_fn("bt_sniff_pipeline_max_in_flight", "Most pipeline slots in flight at once", labels,
+		[this](){ return (double)n_max_in_flight.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_pipeline_overflowed_total", "Pipeline slots whose records spilled out of the arena", labels,
+		[this](){ return n_overflowed.load(std::memory_order_relaxed); });
+
+	for(size_t i=0; i<workers.size(); i++){
+		const worker_t *w = workers[i].get();
+		std::string worker = (labels.empty() ? "" : labels + ",") + "worker=\"" + std::to_string(i) + "\"";
+		registry.counter_fn("bt_sniff_pipeline_worker_slots_total", "Slots parsed by a pipeline worker", worker,
+			[w](){ return w->n_slots.load(std::memory_order_relaxed); });
+		registry.counter_fn("bt_sniff_pipeline_worker_stolen_total", "Slots a pipeline worker took from another", worker,
+			[w](){ return w->n_stolen.load(std::memory_order_relaxed); });
+	}
+}
@@ -0,0 +1,260 @@
+/**
+ * Header for the multi-threaded HCI parse pipeline
+ * @author Owen Capell
+*/
+#ifndef PARSE_PIPELINE
+#define PARSE_PIPELINE
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+#include "spsc_ring.hpp"
+#include "slab_pool.hpp"
+#include "event_queue.hpp"
+#include "adv_filter.hpp"
+#include "device_table.hpp"
+#include "ext_reassembly.hpp"
+#include "batch_reader.hpp"
+#include "packet_source.hpp"
+#include "latency_histogram.hpp"
+#include "metrics.hpp"
+
+/* Default number of parser threads */
+#define PIPELINE_DEFAULT_WORKERS 2
+
+/* Default number of frame slots in the arena (each holds one read batch) */
+#define PIPELINE_DEFAULT_SLOTS 64
+
+/**
+ * @details
+ * Configuration for parsePipeline
+ * @param workers	Parser threads
+ * @param cpus	CPU for worker i is cpus[i % cpus.size()] (empty = not pinned)
+ * @param work_stealing	Idle workers take slots queued for busy ones
+ * @param reorder	Publish slots in capture order (keeps every device's reports
+ * 					in order); otherwise slots are published as they finish
+ * @param slots	Frame slots in the arena (bounds frames in flight)
+ * @param frames_per_slot	Frames copied into one slot (match the read batch size)
+ * @param frame_size	Largest frame kept (longer frames are truncated)
+ * @param block_when_full	Make the capture thread wait for a free slot instead of
+ * 					dropping frames when every slot is in flight
+ * @param hugepages	Back the frame and record arena with hugepages
+*/
+typedef struct{
+	unsigned int workers = PIPELINE_DEFAULT_WORKERS;
+	std::vector<int> cpus;
+	bool work_stealing = true;
+	bool reorder = true;
+	size_t slots = PIPELINE_DEFAULT_SLOTS;
+	unsigned int frames_per_slot = BATCH_DEFAULT_SIZE;
+	size_t frame_size = HCI_EVENT_BUF_SIZE;
+	bool block_when_full = false;
+	bool hugepages = false;
+} pipeline_config_t;
+
+/**
+ * @details
+ * Snapshot of parsePipeline counters
+ * @param frames	Frames copied into the arena
+ * @param dropped	Frames dropped because every slot was in flight
+ * @param truncated	Frames longer than frame_size
+ * @param slots	Slots handed to the workers
+ * @param stolen	Slots parsed by a worker other than the one they were queued for
+ * @param parsed	Records decoded (after filtering, before aggregation)
+ * @param events	Records accepted by the queue
+ * @param held	Slots that finished ahead of an older slot and waited to be published
+ * @param in_flight	Slots dispatched but not yet published
+ * @param max_in_flight	Most slots in flight at once (size slots from this)
+ * @param overflowed	Slots whose records did not fit the arena and spilled to the heap
+*/
+typedef struct{
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t truncated;
+	uint64_t slots;
+	uint64_t stolen;
+	uint64_t parsed;
+	uint64_t events;
+	uint64_t held;
+	uint64_t in_flight;
+	uint64_t max_in_flight;
+	uint64_t overflowed;
+} pipeline_stats_t;
+
+/**
+ * @details
+ * Staged capture: the capture thread only copies raw frames into a
+ * preallocated (optionally hugepage backed) arena of slots and queues slot indices on per-worker SPSC
+ * rings; a pool of (optionally pinned) workers decodes the slots in
+ * parallel. Whichever worker finishes a slot publishes every slot that is
+ * ready, in capture order when reorder is set, under a combining lock so
+ * the queue, aggregation table and taps keep a single producer at a time
+ * (without reorder a mutex serialises publication instead). A reassembler
+ * joins fragmented extended reports in the publish stage and needs
+ * reorder to see fragments in capture order. Nothing on the steady-state
+ * path allocates.
+*/
+class parsePipeline{
+public:
+	/**
+	 * @brief
+	 * Starts the workers. usr_queue, filter, devices, the taps and the
+	 * reassembler must outlive the pipeline (nullptr = unused)
+	*/
+	parsePipeline(
+		const pipeline_config_t& config, eventQueue& usr_queue,
+		const advFilter *filter = nullptr, deviceTable *devices = nullptr,
+		const publish_taps_t *taps = nullptr, extReassembler *reassembler = nullptr);
+
+	/**
+	 * @brief
+	 * Publishes everything submitted, then stops the workers
+	*/
+	~parsePipeline();
+
+	parsePipeline(const parsePipeline&) = delete;
+	parsePipeline& operator=(const parsePipeline&) = delete;
+
+	/**
+	 * @brief
+	 * Copies the last batch of reader into the arena and queues it
+	 * Returns number of frames accepted (capture thread only)
+	*/
+	size_t submit(const batchReader& reader);
+
+	/**
+	 * @brief
+	 * Same as submit(reader) for frames from any other source
+	*/
+	size_t submit(const hci_packet_t *packets, size_t count);
+
+	/**
+	 * @brief
+	 * Waits until every submitted frame has been published (capture thread only)
+	*/
+	void flush();
+
+	/**
+	 * @brief
+	 * flush(), then joins the workers (idempotent)
+	*/
+	void stop();
+
+	/**
+	 * @brief
+	 * Histograms the workers record into (nullptr disables; not owned):
+	 * kernel receive to end of parsing, and parse time per packet.
+	 * Set before submitting
+	*/
+	void set_latency(latencyHistogram *read_to_parse, latencyHistogram *parse_time);
+
+	const pipeline_config_t& get_config() const;
+
+	pipeline_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes frame, drop, steal and per-worker slot counters in registry
+	 * (the pipeline must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	/* Slot life cycle: filled by capture, parsed by a worker, published and freed */
+	enum slotState : uint32_t{
+		slot_free,
+		slot_queued,
+		slot_parsed
+	};
+
+	struct alignas(CACHE_LINE_SIZE) frame_slot_t{
+		std::atomic<uint32_t> state;
+		uint64_t seq;
+		uint32_t count;
+		uint8_t *frames;
+		std::vector<uint32_t> lengths;
+		std::vector<hci_packet_meta_t> metas;
+
+		/* Records in the arena, then (rare, dense batches) in overflow */
+		adv_event_t *records;
+		size_t n_records;
+		std::vector<adv_event_t> overflow;
+		size_t n_overflow;
+	};
+
+	struct alignas(CACHE_LINE_SIZE) worker_t{
+		std::unique_ptr<spscRing<uint32_t>> ring;
+		std::atomic<bool> busy;
+		std::atomic<uint64_t> n_slots;
+		std::atomic<uint64_t> n_stolen;
+		std::thread thread;
+	};
+
+	frame_slot_t* open_slot();
+	void copy_frame(frame_slot_t *slot, const uint8_t *data, size_t length, const hci_packet_meta_t& meta);
+	void dispatch();
+	void wait_capture(uint64_t target, const frame_slot_t *slot);
+
+	void run(unsigned int self);
+	bool take(unsigned int from, uint32_t& index);
+	bool find_work(unsigned int self, uint32_t& index);
+	bool has_work(unsigned int self) const;
+	void parse_slot(frame_slot_t& slot);
+	void complete(frame_slot_t& slot);
+	void publish_ready();
+	void publish_slot(frame_slot_t& slot);
+
+	pipeline_config_t config;
+	eventQueue& usr_queue;
+	const advFilter *filter;
+	deviceTable *devices;
+	extReassembler *reassembler;
+	const advFilter *decode_filter;
+	publish_taps_t taps;
+	bool use_taps;
+	latencyHistogram *h_read_to_parse;
+	latencyHistogram *h_parse_time;
+
+	size_t record_capacity;
+	std::unique_ptr<memoryRegion> arena;
+	std::unique_ptr<frame_slot_t[]> slots;
+	std::vector<std::unique_ptr<worker_t>> workers;
+
+	/* Capture thread state */
+	frame_slot_t *filling;
+	uint64_t next_seq;
+	unsigned int next_worker;
+
+	/* Publish stage (combining lock; reorder: next slot to publish) */
+	alignas(CACHE_LINE_SIZE) std::atomic<bool> publishing;
+	uint64_t next_publish;
+	std::mutex unordered_mutex;
+
+	/* Slots published so far, and whether the capture thread waits on it */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> n_published;
+	std::atomic<bool> capture_waiting;
+
+	/* Worker wake-ups */
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> work_ticket;
+	std::atomic<uint32_t> sleepers;
+	std::atomic<bool> stopping;
+	bool stopped;
+
+	std::atomic<uint64_t> n_frames;
+	std::atomic<uint64_t> n_dropped;
+	std::atomic<uint64_t> n_truncated;
+	std::atomic<uint64_t> n_dispatched;
+	std::atomic<uint64_t> n_parsed;
+	std::atomic<uint64_t> n_events;
+	std::atomic<uint64_t> n_held;
+	std::atomic<uint64_t> n_max_in_flight;
+	std::atomic<uint64_t> n_overflowed;
+};
+
+#endif
@@ -0,0 +1,582 @@
+/**
+ * Implementation of the periodic advertising sync manager
+ * @author Owen Capell
+*/
+#include <algorithm>
+#include <cstring>
+
+#include "bluetoothdef.hpp"
+#include "periodic_sync.hpp"
+#include "utils.hpp"
+
+/* Sync_Timeout range (7.8.67, 10 ms units) */
+#define PERIODIC_SYNC_TIMEOUT_MIN 0x000A
+#define PERIODIC_SYNC_TIMEOUT_MAX 0x4000
+
+/* Advertising_SID values 0x00-0x0F identify a set; 0xFF means none */
+#define PERIODIC_SID_MAX 0x0F
+
+periodicSyncManager::periodicSyncManager(
+	hciCommandChannel& channel, const periodic_sync_config_t& config, periodic_callback_t callback) :
+	channel(channel), config(config), callback(std::move(callback)),
+	mutex(), trains(config.max_trains), buffers(config.max_syncs), free_buffers(),
+	creating(-1), create_started(0), limit(config.max_syncs), n_synced(0), n_tracked(0),
+	n_established(0), n_failed(0), n_lost(0), n_parked(0), n_untracked(0),
+	n_payloads(0), n_fragments(0), n_truncated(0), n_discarded(0)
+{
+	/**
+	 * Constructor for periodicSyncManager
+	 * Reassembly buffers for max_syncs trains are allocated here, so
+	 * following trains never allocates
+	 *
+	 * @param channel	Command channel of the capture socket
+	 * @param config	Sync limits, timeouts and retry policy
+	 * @param callback	Receives every reassembled payload (optional)
+	*/
+
+	for(train_t& t : trains){
+		t = train_t{};
+		t.state = trainState::unused;
+		t.buffer = -1;
+	}
+	free_buffers.reserve(buffers.size());
+	for(size_t i=0; i<buffers.size(); i++){
+		buffers[i].train = -1;
+		buffers[i].data = std::make_unique<uint8_t[]>(PERIODIC_ADV_MAX_DATA);
+		free_buffers.push_back((int)(buffers.size() - 1 - i));
+	}
+}
+
+bool periodicSyncManager::handle_event(const uint8_t *buf, size_t len, const hci_packet_meta_t& meta){
+	/**
+	 * Looks at LE Meta events only; everything else returns after two
+	 * compares. Extended reports are only read for their periodic
+	 * interval, and are left to the normal decode path
+	 *
+	 * @param buf	Raw packet, starting with the HCI packet type octet
+	 * @param len	Octets in buf
+	 * @param meta	Kernel receive time of the packet
+	 * @returns true if buf was a periodic report or a sync event
+	*/
+
+	hciView<hciEventHeader> head;
+	if(len < 1 || buf[0] != HCI_PACK_EVENT || !head.bind(buf + 1, len - 1)) return false;
+	if(head.get<"event_code">() != HCI_EVENT_LE_META) return false;
+
+	size_t param_len = head.data_length();
+	if(head.get<"param_length">() < param_len) param_len = head.get<"param_length">();
+	if(param_len < 1) return false;
+	const uint8_t *params = head.data() + 1;
+	size_t n = param_len - 1;
+
+	switch(head.data()[0]){
+	case SUBEVT_HCI_LE_EXTENDED_ADVERTISING_REPORT:
+		observe(params, n);
+		return false;
+	case SUBEVT_HCI_LE_PERIODIC_ADVERTISING_REPORT:{
+		hciView<lePeriodicAdvertisingReport> report;
+		if(report.bind(params, n)) on_report(report, meta);
+		return true;
+	}
+	case SUBEVT_HCI_LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED:{
+		hciView<lePeriodicSyncEstablished> ev;
+		if(ev.bind(params, n)) on_established(ev);
+		return true;
+	}
+	case SUBEVT_HCI_LE_PERIODIC_ADVERTISING_SYNC_LOST:{
+		hciView<lePeriodicSyncLost> ev;
+		if(ev.bind(params, n)) on_lost(ev.get<"sync_handle">());
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+void periodicSyncManager::observe(const uint8_t *params, size_t len){
+	/**
+	 * Registers advertisers whose extended reports carry a periodic
+	 * interval. The lock is only taken for reports that do
+	 *
+	 * @param params	Octets after the subevent code
+	 * @param len	Octets at params
+	*/
+
+	if(len < 1) return;
+	uint8_t num_reports = params[0];
+	const uint8_t *p = params + 1;
+	const uint8_t *end = params + len;
+
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	uint64_t now = 0;
+	bool added = false;
+
+	for(uint8_t i=0; i<num_reports; ++i){
+		hciView<leExtendedReportItem> report;
+		if(!report.bind(p, end)) break;
+		p += report.extent();
+
+		uint16_t interval = report.get<"periodic_advertising_interval">();
+		uint8_t sid = report.get<"advertising_sid">();
+		if(interval == 0 || sid > PERIODIC_SID_MAX) continue;
+		if(config.filter != nullptr){
+			adv_report_view_t view = {report.ref<"address">(), report.get<"address_type">(), report.get<"event_type">(),
+				report.get<"rssi">(), report.data(), (uint16_t)report.data_length()};
+			if(!config.filter->matches(view)) continue;
+		}
+		bt_dev_addr_t address = report.get<"address">();
+
+		if(!lock.owns_lock()){
+			lock.lock();
+			now = monotonic_ns();
+		}
+
+		int index = find_train(address, sid);
+		if(index >= 0){
+			trains[index].last_seen = now;
+			if(trains[index].state != trainState::synced) trains[index].interval = interval;
+			continue;
+		}
+		if(n_tracked >= trains.size()){
+			n_untracked.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		for(train_t& t : trains){
+			if(t.state != trainState::unused) continue;
+			t.state = trainState::candidate;
+			t.address = address;
+			t.address_type = report.get<"address_type">();
+			t.sid = sid;
+			t.interval = interval;
+			t.sync_handle = 0;
+			t.attempts = 0;
+			t.last_seen = now;
+			t.next_attempt = now;
+			t.buffer = -1;
+			break;
+		}
+		n_tracked++;
+		added = true;
+	}
+
+	if(!added) return;
+	action_t action = schedule_locked(now);
+	lock.unlock();
+	run(action);
+}
+
+void periodicSyncManager::on_report(const hciView<lePeriodicAdvertisingReport>& report, const hci_packet_meta_t& meta){
+	/**
+	 * Appends one fragment to its train's buffer and delivers the payload
+	 * when the data status ends the advertising event. The buffer is only
+	 * written here (capture thread), so the callback reads it unlocked
+	 *
+	 * @param report	Periodic report (data_length already bounds-checked)
+	 * @param meta	Kernel receive time of the fragment
+	*/
+
+	periodic_payload_t payload;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		int b = find_synced(report.get<"sync_handle">());
+		if(b < 0) return;
+		reassembly_t& r = buffers[b];
+		const train_t& t = trains[r.train];
+		n_fragments.fetch_add(1, std::memory_order_relaxed);
+
+		if(r.fragments == 0) r.timestamp = meta.timestamp;
+		r.fragments++;
+		size_t room = PERIODIC_ADV_MAX_DATA - r.length;
+		size_t n = report.data_length();
+		if(n > room){
+			n = room;
+			r.overflow = true;
+		}
+		memcpy(r.data.get() + r.length, report.data(), n);
+		r.length += (uint16_t)n;
+
+		uint8_t data_status = report.get<"data_status">();
+		if(data_status == ADV_DATA_INCOMPLETE) return;
+
+		payload.timestamp = r.timestamp;
+		payload.sync_handle = t.sync_handle;
+		payload.address = t.address;
+		payload.address_type = t.address_type;
+		payload.advertising_sid = t.sid;
+		payload.periodic_advertising_interval = t.interval;
+		payload.rssi = report.get<"rssi">();
+		payload.tx_power = report.get<"tx_power">();
+		payload.data_status = (data_status == ADV_DATA_COMPLETE && !r.overflow) ? ADV_DATA_COMPLETE : ADV_DATA_TRUNCATED;
+		payload.fragments = r.fragments;
+		payload.data_length = r.length;
+		payload.data = r.data.get();
+
+		r.length = 0;
+		r.fragments = 0;
+		r.overflow = false;
+	}
+
+	n_payloads.fetch_add(1, std::memory_order_relaxed);
+	if(payload.data_status != ADV_DATA_COMPLETE) n_truncated.fetch_add(1, std::memory_order_relaxed);
+	if(callback) callback(payload);
+}
+
+void periodicSyncManager::on_established(const hciView<lePeriodicSyncEstablished>& ev){
+	/**
+	 * Completes the pending create. Running out of controller resources
+	 * lowers the limit to the trains already synced
+	 *
+	 * @param ev	Sync Established parameters
+	*/
+
+	uint8_t status = ev.get<"status">();
+	uint16_t sync_handle = ev.get<"sync_handle">();
+	action_t action = {};
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t now = monotonic_ns();
+		int index = find_train(ev.get<"advertiser_address">(), ev.get<"advertising_sid">());
+		bool pending = index >= 0 && (trains[index].state == trainState::creating ||
+			trains[index].state == trainState::cancelling);
+
+		if(!pending){
+			/*
+			 * A create this manager abandoned (stop(), or a candidate since
+			 * expired) synced anyway; let it go so the controller stops
+			 * reporting it. Never terminate a handle already adopted
+			*/
+			if(status == HCI_STATUS_SUCCESS && find_synced(sync_handle) < 0){
+				action.kind = action_t::terminate;
+				action.sync_handle = sync_handle;
+			}
+		}
+		else{
+			train_t& t = trains[index];
+			if(index == creating) creating = -1;
+
+			if(status == HCI_STATUS_SUCCESS && !free_buffers.empty()){
+				t.state = trainState::synced;
+				t.sync_handle = sync_handle;
+				t.address_type = ev.get<"advertiser_address_type">();
+				t.interval = ev.get<"periodic_advertising_interval">();
+				t.attempts = 0;
+				t.buffer = free_buffers.back();
+				free_buffers.pop_back();
+				reassembly_t& r = buffers[t.buffer];
+				r.train = index;
+				r.length = 0;
+				r.fragments = 0;
+				r.overflow = false;
+				n_synced++;
+				n_established.fetch_add(1, std::memory_order_relaxed);
+			}
+			else if(status == HCI_STATUS_SUCCESS){
+				/* More trains than buffers (limit was raised elsewhere); give it back */
+				action.kind = action_t::terminate;
+				action.sync_handle = sync_handle;
+				attempt_failed(t, now);
+			}
+			else{
+				if(status == HCI_STATUS_MEMORY_CAPACITY_EXCEEDED || status == HCI_STATUS_LIMITED_RESOURCES){
+					limit = std::max(1u, n_synced);
+				}
+				attempt_failed(t, now);
+			}
+			if(action.kind == action_t::none) action = schedule_locked(now);
+		}
+	}
+	run(action);
+}
+
+void periodicSyncManager::on_lost(uint16_t sync_handle){
+	/**
+	 * Drops the partial payload of a lost train and schedules a resync
+	 *
+	 * @param sync_handle	Handle from Sync Lost
+	*/
+
+	action_t action = {};
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		int b = find_synced(sync_handle);
+		if(b < 0) return;
+		uint64_t now = monotonic_ns();
+		train_t& t = trains[buffers[b].train];
+		release_buffer(t);
+		n_synced--;
+		n_lost.fetch_add(1, std::memory_order_relaxed);
+
+		t.state = trainState::backoff;
+		t.attempts = 0;
+		t.next_attempt = now + config.retry_delay_ns;
+		t.last_seen = now;
+		action = schedule_locked(now);
+	}
+	run(action);
+}
+
+void periodicSyncManager::on_create_status(const command_result_t& result){
+	/**
+	 * Command Status of Create Sync (or a local failure). Success only
+	 * means the controller is looking; Sync Established follows
+	 *
+	 * @param result	Outcome from the command channel
+	*/
+
+	if(result.status == HCI_STATUS_SUCCESS) return;
+
+	action_t action = {};
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(creating < 0) return;
+		uint64_t now = monotonic_ns();
+		train_t& t = trains[creating];
+		creating = -1;
+		if(result.status == HCI_STATUS_MEMORY_CAPACITY_EXCEEDED || result.status == HCI_STATUS_LIMITED_RESOURCES){
+			limit = std::max(1u, n_synced);
+		}
+		attempt_failed(t, now);
+		action = schedule_locked(now);
+	}
+	run(action);
+}
+
+void periodicSyncManager::tick(uint64_t now_ns){
+	/**
+	 * Cancels a create that has not synced within create_timeout_ns (the
+	 * controller would otherwise look forever), fails one whose cancel
+	 * was never answered, releases parked advertisers, forgets those not
+	 * seen for candidate_ttl_ns and starts the next create
+	 *
+	 * @param now_ns	Current CLOCK_MONOTONIC time (may trail stamps taken by
+	 * 					handle_event(), so differences are only taken forward)
+	*/
+
+	action_t action = {};
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(creating >= 0 && now_ns > create_started && now_ns - create_started >= config.create_timeout_ns){
+			train_t& t = trains[creating];
+			if(t.state == trainState::creating){
+				t.state = trainState::cancelling;
+				create_started = now_ns;
+				action.kind = action_t::cancel;
+			}
+			else{
+				creating = -1;
+				attempt_failed(t, now_ns);
+			}
+		}
+
+		for(train_t& t : trains){
+			if(t.state == trainState::candidate || t.state == trainState::backoff || t.state == trainState::parked){
+				if(now_ns > t.last_seen && now_ns - t.last_seen >= config.candidate_ttl_ns){
+					t.state = trainState::unused;
+					n_tracked--;
+					continue;
+				}
+			}
+			if(t.state == trainState::parked && now_ns >= t.next_attempt){
+				t.state = trainState::candidate;
+				t.attempts = 0;
+			}
+		}
+
+		if(action.kind == action_t::none) action = schedule_locked(now_ns);
+	}
+	run(action);
+}
+
+void periodicSyncManager::stop(){
+	/**
+	 * Terminates every sync so the controller stops reporting, and
+	 * cancels a pending create. Trains return to candidates with their
+	 * retry history cleared
+	*/
+
+	std::vector<action_t> actions;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(train_t& t : trains){
+			if(t.state == trainState::synced){
+				action_t a = {};
+				a.kind = action_t::terminate;
+				a.sync_handle = t.sync_handle;
+				actions.push_back(a);
+				release_buffer(t);
+				n_synced--;
+			}
+			else if(t.state == trainState::creating){
+				action_t a = {};
+				a.kind = action_t::cancel;
+				actions.push_back(a);
+			}
+			else if(t.state != trainState::cancelling){
+				continue;
+			}
+			t.state = trainState::candidate;
+			t.attempts = 0;
+			t.next_attempt = 0;
+		}
+		creating = -1;
+	}
+	for(const action_t& a : actions) run(a);
+}
+
+int periodicSyncManager::find_train(const bt_dev_addr_t& address, uint8_t sid) const{
+	/* Keyed by (address, SID); the type may change once the controller resolves it */
+	for(size_t i=0; i<trains.size(); i++){
+		const train_t& t = trains[i];
+		if(t.state != trainState::unused && t.sid == sid && memcmp(&t.address, &address, sizeof(bt_dev_addr_t)) == 0){
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+int periodicSyncManager::find_synced(uint16_t sync_handle) const{
+	/* Only max_syncs buffers to look through, not the whole table */
+	for(size_t i=0; i<buffers.size(); i++){
+		if(buffers[i].train >= 0 && trains[buffers[i].train].sync_handle == sync_handle) return (int)i;
+	}
+	return -1;
+}
+
+void periodicSyncManager::attempt_failed(train_t& train, uint64_t now){
+	/**
+	 * Backs off exponentially; after max_retries the advertiser is parked
+	 * until candidate_ttl_ns has passed (mutex held)
+	*/
+
+	n_failed.fetch_add(1, std::memory_order_relaxed);
+	train.attempts++;
+	if(train.attempts > config.max_retries){
+		train.state = trainState::parked;
+		train.attempts = 0;
+		train.next_attempt = now + config.candidate_ttl_ns;
+		n_parked.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	unsigned int shift = std::min(train.attempts - 1, 20u);
+	uint64_t delay = std::min(config.retry_delay_ns << shift, config.max_retry_delay_ns);
+	train.state = trainState::backoff;
+	train.next_attempt = now + delay;
+}
+
+void periodicSyncManager::release_buffer(train_t& train){
+	/* Returns the train's reassembly buffer, counting a partial payload (mutex held) */
+	if(train.buffer < 0) return;
+	reassembly_t& r = buffers[train.buffer];
+	if(r.fragments > 0) n_discarded.fetch_add(1, std::memory_order_relaxed);
+	r.train = -1;
+	r.length = 0;
+	r.fragments = 0;
+	r.overflow = false;
+	free_buffers.push_back(train.buffer);
+	train.buffer = -1;
+}
+
+periodicSyncManager::action_t periodicSyncManager::schedule_locked(uint64_t now){
+	/**
+	 * Picks the advertiser that has waited longest for its next attempt,
+	 * if no create is pending and the limit allows another train (mutex held)
+	 *
+	 * @param now	Current CLOCK_MONOTONIC time
+	 * @returns create action, or none
+	*/
+
+	action_t action = {};
+	if(creating >= 0 || n_synced >= limit || free_buffers.empty()) return action;
+
+	int best = -1;
+	for(size_t i=0; i<trains.size(); i++){
+		const train_t& t = trains[i];
+		if(t.state != trainState::candidate && t.state != trainState::backoff) continue;
+		if(t.next_attempt > now) continue;
+		if(best < 0 || t.next_attempt < trains[best].next_attempt) best = (int)i;
+	}
+	if(best < 0) return action;
+
+	train_t& t = trains[best];
+	t.state = trainState::creating;
+	creating = best;
+	create_started = now;
+
+	/* The timeout must outlast a few missed events of this train */
+	uint32_t timeout = ((uint32_t)t.interval * config.timeout_intervals + 7) / 8;
+	timeout = std::max<uint32_t>(timeout, config.min_sync_timeout);
+	timeout = std::clamp<uint32_t>(timeout, PERIODIC_SYNC_TIMEOUT_MIN, PERIODIC_SYNC_TIMEOUT_MAX);
+
+	action.kind = action_t::create;
+	action.create_params.options = 0x00;
+	action.create_params.advertising_sid = t.sid;
+	action.create_params.advertiser_address_type = t.address_type & 0x01;
+	action.create_params.advertiser_address = t.address;
+	action.create_params.skip = config.skip;
+	action.create_params.sync_timeout = (uint16_t)timeout;
+	action.create_params.sync_cte_type = PERIODIC_SYNC_CTE_ANY;
+	return action;
+}
+
+void periodicSyncManager::run(const action_t& action){
+	/* Sends outside the lock: a failed write calls back into on_create_status() */
+	switch(action.kind){
+	case action_t::create:
+		channel.periodic_advertising_create_sync(action.create_params,
+			[this](const command_result_t& r){ on_create_status(r); });
+		break;
+	case action_t::cancel:
+		channel.periodic_advertising_create_sync_cancel();
+		break;
+	case action_t::terminate:
+		channel.periodic_advertising_terminate_sync(action.sync_handle);
+		break;
+	default:
+		break;
+	}
+}
+
+periodic_sync_stats_t periodicSyncManager::stats() const{
+	periodic_sync_stats_t s;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		s.tracked = n_tracked;
+		s.synced = n_synced;
+		s.limit = limit;
+		s.creating = creating >= 0 ? 1 : 0;
+	}
+	s.established = n_established.load(std::memory_order_relaxed);
+	s.failed = n_failed.load(std::memory_order_relaxed);
+	s.lost = n_lost.load(std::memory_order_relaxed);
+	s.parked = n_parked.load(std::memory_order_relaxed);
+	s.untracked = n_untracked.load(std::memory_order_relaxed);
+	s.payloads = n_payloads.load(std::memory_order_relaxed);
+	s.fragments = n_fragments.load(std::memory_order_relaxed);
+	s.truncated = n_truncated.load(std::memory_order_relaxed);
+	s.discarded = n_discarded.load(std::memory_order_relaxed);
+	return s;
+}
+
+void periodicSyncManager::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the adapter
+	*/
+
+	registry.gauge_fn("bt_sniff_periodic_syncs", "Periodic advertising trains currently synced", labels,
+		[this](){ return (double)stats().synced; });
+	registry.gauge_fn("bt_sniff_periodic_sync_limit", "Trains followed at once (configured or learned from the controller)", labels,
+		[this](){ return (double)stats().limit; });
+	registry.counter_fn("bt_sniff_periodic_sync_failures_total", "Create Sync attempts that failed, timed out or were cancelled", labels,
+		[this](){ return n_failed.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_periodic_sync_lost_total", "Established syncs lost", labels,
+		[this](){ return n_lost.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_periodic_payloads_total", "Reassembled periodic advertising payloads", labels,
+		[this](){ return n_payloads.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_periodic_truncated_total", "Periodic payloads delivered truncated", labels,
+		[this](){ return n_truncated.load(std::memory_order_relaxed); });
+}
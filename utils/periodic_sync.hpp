@@ -0,0 +1,257 @@
+/**
+ * Header for the periodic advertising sync manager
+ * @author Owen Capell
+*/
+#ifndef PERIODIC_SYNC
+#define PERIODIC_SYNC
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+#include "adv_filter.hpp"
+#include "hci_command.hpp"
+#include "hci_schema.hpp"
+#include "metrics.hpp"
+
+/* Default number of trains followed at once (the controller may allow fewer) */
+#define PERIODIC_SYNC_DEFAULT_MAX_SYNCS 4
+
+/* Default number of periodic advertisers tracked (synced or waiting) */
+#define PERIODIC_SYNC_DEFAULT_TRAINS 64
+
+/**
+ * @details
+ * Configuration for periodicSyncManager
+ * @param max_syncs	Trains followed at once; lowered to what the controller
+ * 					accepts when it runs out of resources
+ * @param max_trains	Advertisers tracked (further ones are ignored until a slot frees)
+ * @param skip	Periodic events the controller may skip after a good receive
+ * @param min_sync_timeout	Shortest sync timeout (10 ms units)
+ * @param timeout_intervals	Sync timeout covers at least this many periodic intervals
+ * @param create_timeout_ns	Cancel a Create Sync that has not synced after this long
+ * @param retry_delay_ns	First retry after a failed or lost sync (doubles per attempt)
+ * @param max_retry_delay_ns	Longest retry delay
+ * @param max_retries	Failed attempts before an advertiser is parked for candidate_ttl_ns
+ * @param candidate_ttl_ns	Forget advertisers not seen in extended reports for this long
+ * @param filter	Only sync to advertisers whose extended reports match (nullptr = all)
+*/
+typedef struct{
+	unsigned int max_syncs = PERIODIC_SYNC_DEFAULT_MAX_SYNCS;
+	size_t max_trains = PERIODIC_SYNC_DEFAULT_TRAINS;
+	uint16_t skip = 0;
+	uint16_t min_sync_timeout = 0x0064;
+	unsigned int timeout_intervals = 6;
+	uint64_t create_timeout_ns = 10000000000ull;
+	uint64_t retry_delay_ns = 1000000000ull;
+	uint64_t max_retry_delay_ns = 60000000000ull;
+	unsigned int max_retries = 5;
+	uint64_t candidate_ttl_ns = 60000000000ull;
+	const advFilter *filter = nullptr;
+} periodic_sync_config_t;
+
+/**
+ * @details
+ * One reassembled periodic advertising payload, handed to the callback
+ * @param timestamp	Kernel receive time of the first fragment (CLOCK_REALTIME)
+ * @param sync_handle	Handle of the train
+ * @param address	Advertiser address
+ * @param address_type	Advertiser address type (as reported in Sync Established)
+ * @param advertising_sid	Advertising set identifier
+ * @param periodic_advertising_interval	Interval (1.25 ms units)
+ * @param rssi	RSSI of the last fragment (dBm)
+ * @param tx_power	Transmit power (dBm, 127 if unavailable)
+ * @param data_status	ADV_DATA_COMPLETE, or ADV_DATA_TRUNCATED if the controller
+ * 					gave up on the chain or it exceeded PERIODIC_ADV_MAX_DATA
+ * @param fragments	Periodic reports the payload arrived in
+ * @param data_length	Octets at data
+ * @param data	Payload (valid during the callback only)
+*/
+typedef struct{
+	uint64_t timestamp;
+	uint16_t sync_handle;
+	bt_dev_addr_t address;
+	uint8_t address_type;
+	uint8_t advertising_sid;
+	uint16_t periodic_advertising_interval;
+	int8_t rssi;
+	int8_t tx_power;
+	uint8_t data_status;
+	uint16_t fragments;
+	uint16_t data_length;
+	const uint8_t *data;
+} periodic_payload_t;
+
+typedef std::function<void(const periodic_payload_t&)> periodic_callback_t;
+
+/**
+ * @details
+ * Snapshot of periodicSyncManager state and counters
+ * @param tracked	Advertisers tracked
+ * @param synced	Trains currently synced
+ * @param limit	Trains the manager will follow at once (max_syncs or the learned controller limit)
+ * @param creating	1 while a Create Sync is pending
+ * @param established	Syncs established
+ * @param failed	Create Sync attempts that failed, timed out or were cancelled
+ * @param lost	Syncs lost after being established
+ * @param parked	Advertisers parked after max_retries failed attempts
+ * @param untracked	Periodic advertisers seen while the table was full
+ * @param payloads	Payloads delivered
+ * @param fragments	Periodic reports consumed
+ * @param truncated	Payloads delivered with ADV_DATA_TRUNCATED
+ * @param discarded	Partial payloads dropped because their sync was lost or terminated
+*/
+typedef struct{
+	uint64_t tracked;
+	uint64_t synced;
+	uint64_t limit;
+	uint64_t creating;
+	uint64_t established;
+	uint64_t failed;
+	uint64_t lost;
+	uint64_t parked;
+	uint64_t untracked;
+	uint64_t payloads;
+	uint64_t fragments;
+	uint64_t truncated;
+	uint64_t discarded;
+} periodic_sync_stats_t;
+
+/**
+ * @details
+ * Follows periodic advertising trains through the controller instead of
+ * catching their payloads by scanning. Extended reports that announce a
+ * periodic interval register the advertiser (address, SID); the manager
+ * issues one LE Periodic Advertising Create Sync at a time on the command
+ * channel, up to max_syncs trains, cancels creates that do not sync, and
+ * retries failed or lost syncs with exponential backoff. Periodic reports
+ * of synced trains are reassembled per data status into one payload per
+ * advertising event, in buffers preallocated for max_syncs trains.
+ * handle_event() and tick() run on the capture thread; the callback runs
+ * there too, without the manager's lock held. Must outlive the commands
+ * it has outstanding on the channel (stop() and wait for !busy())
+*/
+class periodicSyncManager{
+public:
+	periodicSyncManager(
+		hciCommandChannel& channel, const periodic_sync_config_t& config = periodic_sync_config_t{},
+		periodic_callback_t callback = nullptr);
+
+	periodicSyncManager(const periodicSyncManager&) = delete;
+	periodicSyncManager& operator=(const periodicSyncManager&) = delete;
+
+	/**
+	 * @brief
+	 * Consumes extended reports, periodic reports and sync events (H4 type
+	 * octet first). Returns true if buf was a periodic advertising event
+	*/
+	bool handle_event(const uint8_t *buf, size_t len, const hci_packet_meta_t& meta);
+
+	/**
+	 * @brief
+	 * Cancels stalled creates, schedules retries and forgets stale
+	 * advertisers (call a few times per second)
+	*/
+	void tick(uint64_t now_ns);
+
+	/**
+	 * @brief
+	 * Cancels a pending create and terminates every sync; advertisers stay
+	 * tracked and are synced again on the next sighting or tick()
+	*/
+	void stop();
+
+	periodic_sync_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes sync counts, failures, losses and payload counters in registry
+	 * (the manager must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	enum class trainState : uint8_t{
+		unused,
+		candidate,
+		creating,
+		cancelling,
+		synced,
+		backoff,
+		parked
+	};
+
+	typedef struct{
+		trainState state;
+		bt_dev_addr_t address;
+		uint8_t address_type;
+		uint8_t sid;
+		uint16_t interval;
+		uint16_t sync_handle;
+		uint32_t attempts;
+		uint64_t last_seen;
+		uint64_t next_attempt;
+		int buffer;
+	} train_t;
+
+	/* Reassembly state of one synced train (train = -1 while free) */
+	typedef struct{
+		int train;
+		uint64_t timestamp;
+		uint16_t length;
+		uint16_t fragments;
+		bool overflow;
+		std::unique_ptr<uint8_t[]> data;
+	} reassembly_t;
+
+	/* Command to send once the lock is released */
+	typedef struct{
+		enum { none, create, cancel, terminate } kind;
+		hci_le_periodic_create_sync_t create_params;
+		uint16_t sync_handle;
+	} action_t;
+
+	void observe(const uint8_t *params, size_t len);
+	void on_established(const hciView<lePeriodicSyncEstablished>& ev);
+	void on_lost(uint16_t sync_handle);
+	void on_report(const hciView<lePeriodicAdvertisingReport>& report, const hci_packet_meta_t& meta);
+	void on_create_status(const command_result_t& result);
+
+	int find_train(const bt_dev_addr_t& address, uint8_t sid) const;
+	int find_synced(uint16_t sync_handle) const;
+	void attempt_failed(train_t& train, uint64_t now);
+	void release_buffer(train_t& train);
+	action_t schedule_locked(uint64_t now);
+	void run(const action_t& action);
+
+	hciCommandChannel& channel;
+	periodic_sync_config_t config;
+	periodic_callback_t callback;
+
+	mutable std::mutex mutex;
+	std::vector<train_t> trains;
+	std::vector<reassembly_t> buffers;
+	std::vector<int> free_buffers;
+	int creating;
+	uint64_t create_started;
+	unsigned int limit;
+	unsigned int n_synced;
+	size_t n_tracked;
+
+	std::atomic<uint64_t> n_established;
+	std::atomic<uint64_t> n_failed;
+	std::atomic<uint64_t> n_lost;
+	std::atomic<uint64_t> n_parked;
+	std::atomic<uint64_t> n_untracked;
+	std::atomic<uint64_t> n_payloads;
+	std::atomic<uint64_t> n_fragments;
+	std::atomic<uint64_t> n_truncated;
+	std::atomic<uint64_t> n_discarded;
+};
+
+#endif
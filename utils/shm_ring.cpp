@@ -0,0 +1,326 @@
+/**
+ * Implementation of the shared-memory record ring producer
+ * @author Owen Capell
+*/
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bluetoothdef.hpp"
+#include "shm_ring.hpp"
+#include "shm_ring_layout.h"
+#include "utils.hpp"
+#include "metrics.hpp"
+
+template <typename T>
+static std::atomic_ref<T> shared(T& field){
+	return std::atomic_ref<T>(field);
+}
+
+static void futex_wake_all(uint32_t *word){
+	/* Shared (not FUTEX_PRIVATE) wake: readers live in other processes */
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static bool process_alive(uint32_t pid){
+	return pid != 0 && (kill((pid_t)pid, 0) == 0 || errno != ESRCH);
+}
+
+shmRingWriter::shmRingWriter(const shm_ring_config_t& config) :
+	config(config), fd(-1), base(nullptr), length(0), control(nullptr), records(nullptr), mask(0),
+	tail(0), closed(false), n_wakeups(0), n_reaped(0),
+	keeper_mutex(), keeper_cv(), keeper_stop(false), keeper()
+{
+	/**
+	 * Constructor for shmRingWriter
+	 * Creates (or reattaches to) the segment and starts the heartbeat thread
+	 *
+	 * @param config	Segment name, capacity and permissions
+	*/
+
+	uint32_t c = 1;
+	while(c < this->config.capacity && c < (1u << 30)) c <<= 1;
+	this->config.capacity = c;
+
+	if(!map_segment()) return;
+	keeper = std::thread(&shmRingWriter::housekeeping, this);
+}
+
+shmRingWriter::~shmRingWriter(){
+	/**
+	 * Destructor for shmRingWriter
+	 * Readers see BT_SHM_STATE_CLOSED and return once they drained the ring
+	*/
+
+	close();
+	{
+		std::lock_guard<std::mutex> lock(keeper_mutex);
+		keeper_stop = true;
+	}
+	keeper_cv.notify_all();
+	if(keeper.joinable()) keeper.join();
+
+	if(base != nullptr) munmap(base, length);
+	if(fd >= 0) ::close(fd);
+	if(config.unlink_on_close && !config.name.empty()) shm_unlink(config.name.c_str());
+}
+
+bool shmRingWriter::map_segment(){
+	/**
+	 * Opens the segment. A compatible segment is reused (continuing its
+	 * sequence) unless another live producer owns it; an incompatible one
+	 * is marked closed and replaced by a fresh segment under the same name
+	 *
+	 * @returns true if mapped and owned by this process
+	*/
+
+	size_t data_offset = (sizeof(bt_shm_control_t) + BT_SHM_PAGE_SIZE - 1) & ~(size_t)(BT_SHM_PAGE_SIZE - 1);
+	size_t want = data_offset + (size_t)config.capacity * BT_SHM_RECORD_SIZE;
+	bool anonymous = config.name.empty();
+
+	for(int attempt=0; attempt<2; attempt++){
+		if(anonymous) fd = memfd_create("bt_sniff", MFD_CLOEXEC);
+		else fd = shm_open(config.name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, (mode_t)config.mode);
+		if(fd < 0) return false;
+
+		struct stat st;
+		if(fstat(fd, &st) < 0) break;
+		bool fresh = (size_t)st.st_size < sizeof(bt_shm_control_t);
+		if(fresh && ftruncate(fd, (off_t)want) < 0) break;
+		length = fresh ? want : (size_t)st.st_size;
+
+		base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if(base == MAP_FAILED){
+			base = nullptr;
+			break;
+		}
+		control = (bt_shm_control_t*)base;
+
+		if(!fresh){
+			bool compatible = shared(control->magic).load(std::memory_order_acquire) == BT_SHM_MAGIC &&
+				control->version == BT_SHM_VERSION &&
+				control->record_size == BT_SHM_RECORD_SIZE &&
+				control->capacity == config.capacity &&
+				control->data_offset == data_offset &&
+				length >= want;
+
+			if(compatible){
+				uint32_t owner = shared(control->producer_pid).load(std::memory_order_acquire);
+				uint64_t beat = shared(control->heartbeat_ns).load(std::memory_order_acquire);
+				if(shared(control->state).load(std::memory_order_acquire) == BT_SHM_STATE_RUNNING &&
+					monotonic_ns() - beat < BT_SHM_PRODUCER_TIMEOUT_NS && process_alive(owner) &&
+					owner != (uint32_t)getpid()){
+					/* Someone else is producing; one writer per ring */
+					break;
+				}
+				tail = shared(control->tail).load(std::memory_order_acquire);
+			}
+			else{
+				/* Let readers of the old layout notice, then start over under a new inode */
+				if(length >= sizeof(bt_shm_control_t)){
+					shared(control->state).store(BT_SHM_STATE_CLOSED, std::memory_order_release);
+					shared(control->futex).fetch_add(1, std::memory_order_release);
+					futex_wake_all(&control->futex);
+				}
+				munmap(base, length);
+				base = nullptr;
+				control = nullptr;
+				::close(fd);
+				fd = -1;
+				shm_unlink(config.name.c_str());
+				continue;
+			}
+		}
+		else{
+			control->version = BT_SHM_VERSION;
+			control->header_size = sizeof(bt_shm_control_t);
+			control->record_size = BT_SHM_RECORD_SIZE;
+			control->capacity = config.capacity;
+			control->data_offset = data_offset;
+			shared(control->magic).store(BT_SHM_MAGIC, std::memory_order_release);
+		}
+
+		records = (uint8_t*)base + data_offset;
+		mask = config.capacity - 1;
+		shared(control->producer_pid).store((uint32_t)getpid(), std::memory_order_relaxed);
+		shared(control->generation).fetch_add(1, std::memory_order_relaxed);
+		shared(control->heartbeat_ns).store(monotonic_ns(), std::memory_order_relaxed);
+		shared(control->state).store(BT_SHM_STATE_RUNNING, std::memory_order_release);
+		return true;
+	}
+
+	if(base != nullptr) munmap(base, length);
+	if(fd >= 0) ::close(fd);
+	base = nullptr;
+	control = nullptr;
+	fd = -1;
+	return false;
+}
+
+bool shmRingWriter::is_open() const{
+	return control != nullptr;
+}
+
+int shmRingWriter::get_fd() const{
+	return fd;
+}
+
+const std::string& shmRingWriter::get_name() const{
+	return config.name;
+}
+
+void shmRingWriter::write_record(uint64_t pos, const adv_event_t& evt){
+	/**
+	 * Fills slot pos under its seqlock
+	 *
+	 * @param pos	Sequence number of the record
+	 * @param evt	Record to copy
+	*/
+
+	bt_shm_record_t *rec = (bt_shm_record_t*)(records + (pos & mask) * BT_SHM_RECORD_SIZE);
+	shared(rec->seq).store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	rec->timestamp = evt.timestamp;
+	memcpy(rec->address, evt.address.address, sizeof(rec->address));
+	rec->address_type = evt.address_type;
+	rec->subevent = evt.subevent;
+	rec->event_type = evt.event;
+	rec->rssi = evt.rssi;
+	rec->tx_power = evt.tx_power;
+	rec->primary_phy = evt.primary_phy;
+	rec->secondary_phy = evt.secondary_phy;
+	rec->advertising_sid = evt.advertising_sid;
+	rec->data_status = evt.data_status;
+	rec->periodic_advertising_interval = evt.periodic_advertising_interval;
+	rec->sync_handle = evt.sync_handle;
+	rec->aggregate = evt.aggregate;
+	rec->adapter_id = evt.adapter_id;
+	rec->direction = evt.direction;
+	uint8_t length = evt.data_length > BT_SHM_MAX_DATA ? BT_SHM_MAX_DATA : evt.data_length;
+	rec->data_length = length;
+	rec->report_count = evt.report_count;
+	memcpy(rec->data, evt.data, length);
+
+	shared(rec->seq).store(pos + 1, std::memory_order_release);
+}
+
+void shmRingWriter::push(const adv_event_t& evt){
+	push_batch(&evt, 1);
+}
+
+void shmRingWriter::push_batch(const adv_event_t *evts, size_t count){
+	/**
+	 * Writes count records, publishes the new tail once and wakes
+	 * readers only if one is asleep
+	 *
+	 * @param evts	Records to write
+	 * @param count	Number of records
+	*/
+
+	if(control == nullptr || count == 0) return;
+	for(size_t i=0; i<count; i++) write_record(tail++, evts[i]);
+	shared(control->tail).store(tail, std::memory_order_release);
+	wake_readers();
+}
+
+void shmRingWriter::wake_readers(){
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(shared(control->sleepers).load(std::memory_order_relaxed) == 0) return;
+	shared(control->futex).fetch_add(1, std::memory_order_release);
+	futex_wake_all(&control->futex);
+	n_wakeups.fetch_add(1, std::memory_order_relaxed);
+}
+
+void shmRingWriter::close(){
+	/**
+	 * Marks the ring closed and wakes every sleeping reader
+	*/
+
+	if(control == nullptr || closed.exchange(true)) return;
+	shared(control->state).store(BT_SHM_STATE_CLOSED, std::memory_order_release);
+	shared(control->futex).fetch_add(1, std::memory_order_release);
+	futex_wake_all(&control->futex);
+}
+
+void shmRingWriter::housekeeping(){
+	/**
+	 * Heartbeat thread: refreshes heartbeat_ns and reaps dead readers
+	 * every BT_SHM_HEARTBEAT_NS until the writer is destroyed
+	*/
+
+	std::unique_lock<std::mutex> lock(keeper_mutex);
+	while(!keeper_stop){
+		if(!closed.load(std::memory_order_acquire)){
+			shared(control->heartbeat_ns).store(monotonic_ns(), std::memory_order_release);
+		}
+		reap_consumers();
+		keeper_cv.wait_for(lock, std::chrono::nanoseconds(BT_SHM_HEARTBEAT_NS));
+	}
+}
+
+void shmRingWriter::reap_consumers(){
+	/**
+	 * Frees the slots of readers whose process exited (possibly while
+	 * asleep, which would otherwise leave sleepers permanently raised)
+	*/
+
+	for(size_t i=0; i<BT_SHM_MAX_CONSUMERS; i++){
+		bt_shm_consumer_t& c = control->consumers[i];
+		uint32_t pid = shared(c.pid).load(std::memory_order_acquire);
+		if(pid == 0 || process_alive(pid)) continue;
+		if(!shared(c.pid).compare_exchange_strong(pid, 0, std::memory_order_acq_rel)) continue;
+		if(shared(c.sleeping).exchange(0, std::memory_order_acq_rel) != 0){
+			shared(control->sleepers).fetch_sub(1, std::memory_order_acq_rel);
+		}
+		n_reaped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+shm_ring_stats_t shmRingWriter::stats() const{
+	/**
+	 * Relaxed snapshot of the ring counters
+	 *
+	 * @returns shm_ring_stats_t copy (zeros if the ring is not open)
+	*/
+
+	shm_ring_stats_t s = {};
+	if(control == nullptr) return s;
+	s.published = shared(control->tail).load(std::memory_order_relaxed);
+	for(size_t i=0; i<BT_SHM_MAX_CONSUMERS; i++){
+		if(shared(control->consumers[i].pid).load(std::memory_order_relaxed) != 0) s.consumers++;
+	}
+	s.sleepers = shared(control->sleepers).load(std::memory_order_relaxed);
+	s.wakeups = n_wakeups.load(std::memory_order_relaxed);
+	s.reaped = n_reaped.load(std::memory_order_relaxed);
+	return s;
+}
+
+void shmRingWriter::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics for this ring; nothing is added to push()
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the ring
+	*/
+
+	registry.counter_fn("bt_sniff_shm_published_total", "Records written to the shared-memory ring", labels,
+		[this](){ return stats().published; });
+	registry.gauge_fn("bt_sniff_shm_readers", "Reader processes attached to the shared-memory ring", labels,
+		[this](){ return (double)stats().consumers; });
+	registry.gauge_fn("bt_sniff_shm_sleepers", "Readers blocked waiting for records", labels,
+		[this](){ return (double)stats().sleepers; });
+	registry.counter_fn("bt_sniff_shm_wakeups_total", "futex wake-ups issued to readers", labels,
+		[this](){ return n_wakeups.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_shm_readers_reaped_total", "Reader slots freed after the reader died", labels,
+		[this](){ return n_reaped.load(std::memory_order_relaxed); });
+}
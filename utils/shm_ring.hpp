@@ -0,0 +1,149 @@
+/**
+ * Header for the shared-memory record ring feeding other local processes
+ * @author Owen Capell
+*/
+#ifndef SHM_RING
+#define SHM_RING
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bluetoothdef.hpp"
+#include "shm_ring_layout.h"
+#include "metrics.hpp"
+
+/* Default number of records in the shared ring (5 MiB of records) */
+#define SHM_RING_DEFAULT_CAPACITY 16384
+
+/**
+ * @details
+ * Configuration for shmRingWriter
+ * @param name	POSIX shared memory name ("/bt_sniff"); empty for an anonymous
+ * 				memfd whose descriptor is passed to readers (e.g. SCM_RIGHTS)
+ * @param capacity	Records in the ring (rounded up to a power of two)
+ * @param unlink_on_close	shm_unlink() the name when the writer is destroyed
+ * @param mode	Permissions of a newly created segment
+*/
+typedef struct{
+	std::string name = "/bt_sniff";
+	uint32_t capacity = SHM_RING_DEFAULT_CAPACITY;
+	bool unlink_on_close = false;
+	uint32_t mode = 0600;
+} shm_ring_config_t;
+
+/**
+ * @details
+ * Snapshot of shmRingWriter counters
+ * @param published	Records written since the segment was created
+ * @param consumers	Reader slots currently claimed
+ * @param sleepers	Readers blocked waiting for records
+ * @param wakeups	futex wake calls issued
+ * @param reaped	Reader slots released after their process died
+*/
+typedef struct{
+	uint64_t published;
+	uint32_t consumers;
+	uint32_t sleepers;
+	uint64_t wakeups;
+	uint64_t reaped;
+} shm_ring_stats_t;
+
+/**
+ * @details
+ * Single producer of a shared-memory ring of fixed-size bt_shm_record_t
+ * (see shm_ring_layout.h). The producer never waits for readers: every
+ * reader keeps its own cursor and skips ahead (counting the lag) when it
+ * is lapped, so any number of processes can read and a stuck or crashed
+ * reader costs nothing. Readers sleep on a shared futex that is only
+ * touched when somebody sleeps. A housekeeping thread publishes a
+ * heartbeat (readers detect a crashed producer by its age) and frees the
+ * slots of readers that died. A restarted producer reattaches to a
+ * compatible segment and continues the sequence, so readers just resume.
+*/
+class shmRingWriter{
+public:
+	explicit shmRingWriter(const shm_ring_config_t& config = shm_ring_config_t{});
+
+	/**
+	 * @brief
+	 * Marks the ring closed, wakes readers and unmaps it
+	*/
+	~shmRingWriter();
+
+	shmRingWriter(const shmRingWriter&) = delete;
+	shmRingWriter& operator=(const shmRingWriter&) = delete;
+
+	/**
+	 * @brief
+	 * True if the segment is mapped and this process is its producer
+	*/
+	bool is_open() const;
+
+	/**
+	 * @brief
+	 * Descriptor of the segment (pass to readers of a memfd ring)
+	*/
+	int get_fd() const;
+
+	const std::string& get_name() const;
+
+	/**
+	 * @brief
+	 * Writes one record; never blocks
+	*/
+	void push(const adv_event_t& evt);
+
+	/**
+	 * @brief
+	 * Writes count records with a single reader wake-up
+	*/
+	void push_batch(const adv_event_t *evts, size_t count);
+
+	/**
+	 * @brief
+	 * Marks the ring closed so readers return once drained (idempotent)
+	*/
+	void close();
+
+	shm_ring_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes published records, readers, sleepers and wake-ups in registry
+	 * (the writer must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+private:
+	bool map_segment();
+	void write_record(uint64_t pos, const adv_event_t& evt);
+	void wake_readers();
+	void housekeeping();
+	void reap_consumers();
+
+	shm_ring_config_t config;
+	int fd;
+	void *base;
+	size_t length;
+	bt_shm_control_t *control;
+	uint8_t *records;
+	uint64_t mask;
+
+	/* Producer-side copy of control->tail */
+	uint64_t tail;
+
+	std::atomic<bool> closed;
+	std::atomic<uint64_t> n_wakeups;
+	std::atomic<uint64_t> n_reaped;
+
+	std::mutex keeper_mutex;
+	std::condition_variable keeper_cv;
+	bool keeper_stop;
+	std::thread keeper;
+};
+
+#endif
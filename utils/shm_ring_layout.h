@@ -0,0 +1,148 @@
+/**
+ * Shared-memory layout of the cross-process advertising record ring
+ * (C and C++; shared by shmRingWriter and the bt_shm_reader library)
+ * @author Owen Capell
+*/
+#ifndef SHM_RING_LAYOUT
+#define SHM_RING_LAYOUT
+
+#include <stdint.h>
+
+/* "BTSNSHM1" read as a little-endian uint64_t */
+#define BT_SHM_MAGIC 0x314d48534e535442ull
+
+/* Bumped on any incompatible change to the structures below */
+#define BT_SHM_VERSION 1
+
+/* Octets of one bt_shm_record_t (five cache lines) */
+#define BT_SHM_RECORD_SIZE 320
+
+/* AD payload carried inline by a record (one extended report) */
+#define BT_SHM_MAX_DATA 229
+
+/* Consumer slots in the control block */
+#define BT_SHM_MAX_CONSUMERS 64
+
+/* Records start on this boundary after the control block */
+#define BT_SHM_PAGE_SIZE 4096
+
+/* Producer heartbeat period, and the age after which readers presume it dead */
+#define BT_SHM_HEARTBEAT_NS 100000000ull
+#define BT_SHM_PRODUCER_TIMEOUT_NS 2000000000ull
+
+/* bt_shm_control_t.state */
+#define BT_SHM_STATE_EMPTY   0
+#define BT_SHM_STATE_RUNNING 1
+#define BT_SHM_STATE_CLOSED  2
+
+#ifdef __cplusplus
+#define BT_SHM_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define BT_SHM_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
+
+/**
+ * @details
+ * One advertising report (host byte order). seq is a seqlock: the
+ * producer stores 0 before rewriting the slot and sequence + 1 once the
+ * record is complete, so readers copy (or read in place) and then check
+ * seq is unchanged
+ * @param seq	Sequence number + 1 of the record in this slot, 0 while being written
+ * @param timestamp	Kernel receive time in nanoseconds (CLOCK_REALTIME)
+ * @param address	Advertiser address, least significant octet first (as on air)
+ * @param data_length	Valid octets in data
+ * (remaining fields as in adv_event_t)
+*/
+typedef struct{
+	uint64_t seq;
+	uint64_t timestamp;
+	uint8_t address[6];
+	uint8_t address_type;
+	uint8_t subevent;
+	uint16_t event_type;
+	int8_t rssi;
+	int8_t tx_power;
+	uint8_t primary_phy;
+	uint8_t secondary_phy;
+	uint8_t advertising_sid;
+	uint8_t data_status;
+	uint16_t periodic_advertising_interval;
+	uint16_t sync_handle;
+	uint8_t aggregate;
+	uint8_t adapter_id;
+	uint8_t direction;
+	uint8_t data_length;
+	uint32_t report_count;
+	uint8_t data[BT_SHM_MAX_DATA];
+	uint8_t reserved[BT_SHM_RECORD_SIZE - 44 - BT_SHM_MAX_DATA];
+} bt_shm_record_t;
+
+BT_SHM_STATIC_ASSERT(sizeof(bt_shm_record_t) == BT_SHM_RECORD_SIZE, "bt_shm_record_t size");
+
+/**
+ * @details
+ * Per-reader slot, claimed by storing the reader's pid with a CAS.
+ * The producer clears slots of processes that no longer exist
+ * @param pid	Owning process, 0 if free
+ * @param sleeping	Reader is blocked in a futex wait (counted in sleepers)
+ * @param cursor	Next sequence number the reader will read
+ * @param lag	Records the reader missed because the producer lapped it
+ * @param attached_ns	CLOCK_REALTIME time the slot was claimed
+*/
+typedef struct{
+	uint32_t pid;
+	uint32_t sleeping;
+	uint64_t cursor;
+	uint64_t lag;
+	uint64_t attached_ns;
+	uint8_t pad[32];
+} bt_shm_consumer_t;
+
+BT_SHM_STATIC_ASSERT(sizeof(bt_shm_consumer_t) == 64, "bt_shm_consumer_t size");
+
+/**
+ * @details
+ * Control block at offset 0 of the mapping; records follow at data_offset.
+ * Fields written after creation are accessed with atomic loads/stores
+ * @param magic	BT_SHM_MAGIC
+ * @param version	BT_SHM_VERSION
+ * @param header_size	sizeof(bt_shm_control_t)
+ * @param record_size	BT_SHM_RECORD_SIZE
+ * @param capacity	Records in the ring (power of two)
+ * @param data_offset	Offset of the first record (page aligned)
+ * @param tail	Records published so far; record n lives in slot n % capacity
+ * @param state	BT_SHM_STATE_*
+ * @param producer_pid	Process currently writing
+ * @param generation	Bumped every time a producer (re)attaches
+ * @param heartbeat_ns	CLOCK_MONOTONIC time of the producer's last heartbeat
+ * @param futex	Wake-up word; incremented before waking sleepers (shared futex)
+ * @param sleepers	Readers currently blocked on futex
+*/
+typedef struct{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t data_offset;
+	uint8_t pad0[32];
+
+	/* Producer line */
+	uint64_t tail;
+	uint32_t state;
+	uint32_t producer_pid;
+	uint64_t generation;
+	uint64_t heartbeat_ns;
+	uint8_t pad1[32];
+
+	/* Wake-up line */
+	uint32_t futex;
+	uint32_t sleepers;
+	uint8_t pad2[56];
+
+	bt_shm_consumer_t consumers[BT_SHM_MAX_CONSUMERS];
+} bt_shm_control_t;
+
+BT_SHM_STATIC_ASSERT(sizeof(bt_shm_control_t) == 192 + 64 * BT_SHM_MAX_CONSUMERS, "bt_shm_control_t size");
+
+#endif
@@ -0,0 +1,422 @@
+/**
+ * Implementation of fixed-size slab pools and memory regions
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <new>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "slab_pool.hpp"
+
+/* Pools one thread can hold a cache in at the same time */
+#define SLAB_POOL_THREAD_ENTRIES 8
+
+/* owner[] value of blocks handed out from the shared list */
+#define SLAB_POOL_NO_OWNER 0xFFFF
+
+memoryRegion::memoryRegion(size_t bytes, bool hugepages) :
+	base(nullptr), length(bytes > 0 ? bytes : 1), huge(false)
+{
+	/**
+	 * Constructor for memoryRegion
+	 * Maps and prefaults bytes of anonymous memory
+	 *
+	 * @param bytes	Size of the region
+	 * @param hugepages	Prefer explicit hugepages, else ask for transparent ones
+	*/
+
+	if(hugepages){
+		size_t rounded = (length + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+		void *p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if(p != MAP_FAILED){
+			base = p;
+			length = rounded;
+			huge = true;
+			return;
+		}
+	}
+
+	void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) throw std::bad_alloc();
+	base = p;
+
+	/* No hugetlbfs pages reserved: fall back to THP, requested before the pages are touched */
+	if(hugepages) madvise(base, length, MADV_HUGEPAGE);
+
+	long page = sysconf(_SC_PAGESIZE);
+	if(page <= 0) page = 4096;
+	for(size_t off=0; off<length; off+=(size_t)page) ((volatile uint8_t*)base)[off] = 0;
+}
+
+memoryRegion::~memoryRegion(){
+	if(base != nullptr) munmap(base, length);
+}
+
+/* Live pools by id, so a thread's exit never touches a destroyed pool */
+static std::mutex& live_mutex(){
+	static std::mutex m;
+	return m;
+}
+
+static std::unordered_map<uint64_t, slabPool*>& live_pools(){
+	static std::unordered_map<uint64_t, slabPool*> pools;
+	return pools;
+}
+
+static std::atomic<uint64_t> next_pool_id(1);
+
+/**
+ * @details
+ * Caches the calling thread holds, by pool id; released at thread exit
+*/
+struct thread_pools_t{
+	struct entry_t{
+		uint64_t id;
+		int index;
+	};
+
+	entry_t entries[SLAB_POOL_THREAD_ENTRIES];
+	size_t n = 0;
+
+	~thread_pools_t(){
+		std::lock_guard<std::mutex> lock(live_mutex());
+		for(size_t i=0; i<n; i++){
+			auto it = live_pools().find(entries[i].id);
+			if(it != live_pools().end() && entries[i].index >= 0) it->second->release_cache((unsigned int)entries[i].index);
+		}
+	}
+};
+
+static thread_local thread_pools_t thread_pools;
+
+static int lookup_cache(uint64_t id){
+	const thread_pools_t& tp = thread_pools;
+	for(size_t i=0; i<tp.n; i++){
+		if(tp.entries[i].id == id) return tp.entries[i].index;
+	}
+	return -1;
+}
+
+slabPool::slabPool(const slab_pool_config_t& config) :
+	config(config), id(next_pool_id.fetch_add(1, std::memory_order_relaxed)),
+	stride((config.block_size + 15) & ~(size_t)15),
+	region((config.capacity > 0 ? config.capacity : 1) * ((config.block_size + 15) & ~(size_t)15), config.hugepages),
+	blocks((uint8_t*)region.data()), owner(), caches(), attach_mutex(),
+	shared_mutex(), shared_head(nullptr), n_shared(0),
+	n_in_use(0), n_high_water(0), n_allocs(0), n_remote_frees(0), n_exhausted(0)
+{
+	/**
+	 * Constructor for slabPool
+	 * Maps every block up front and threads them onto the shared list
+	 *
+	 * @param config	Block size, capacity, hugepages and cache size
+	*/
+
+	if(this->config.capacity == 0) this->config.capacity = 1;
+	if(this->config.cache_size == 0) this->config.cache_size = 1;
+	if(stride < sizeof(free_block_t)) stride = sizeof(free_block_t);
+
+	owner = std::make_unique<uint16_t[]>(this->config.capacity);
+	caches = std::make_unique<thread_cache_t[]>(SLAB_POOL_MAX_THREADS);
+	for(size_t i=0; i<SLAB_POOL_MAX_THREADS; i++){
+		caches[i].local = nullptr;
+		caches[i].n_local = 0;
+		caches[i].remote.store(nullptr, std::memory_order_relaxed);
+		caches[i].attached.store(false, std::memory_order_relaxed);
+	}
+
+	for(size_t i=this->config.capacity; i-- > 0;){
+		free_block_t *b = (free_block_t*)(blocks + i * stride);
+		b->next = shared_head;
+		shared_head = b;
+		owner[i] = SLAB_POOL_NO_OWNER;
+	}
+	n_shared = this->config.capacity;
+
+	std::lock_guard<std::mutex> lock(live_mutex());
+	live_pools()[id] = this;
+}
+
+slabPool::~slabPool(){
+	/**
+	 * Destructor for slabPool
+	 * Every block must have been freed; threads keep no reference to the pool
+	*/
+
+	std::lock_guard<std::mutex> lock(live_mutex());
+	live_pools().erase(id);
+}
+
+int slabPool::cache_index(){
+	/**
+	 * Cache of the calling thread, claiming a free one on first use
+	 *
+	 * @returns cache index, -1 if the thread uses the shared list
+	*/
+
+	int idx = lookup_cache(id);
+	if(idx >= 0) return idx;
+
+	thread_pools_t& tp = thread_pools;
+	for(size_t i=0; i<tp.n; i++){
+		if(tp.entries[i].id == id) return -1;
+	}
+
+	/* Find an entry for this pool, reusing those of destroyed pools */
+	size_t slot = tp.n;
+	if(slot == SLAB_POOL_THREAD_ENTRIES){
+		std::lock_guard<std::mutex> lock(live_mutex());
+		for(size_t i=0; i<tp.n; i++){
+			if(live_pools().count(tp.entries[i].id) == 0){
+				slot = i;
+				break;
+			}
+		}
+		if(slot == SLAB_POOL_THREAD_ENTRIES) return -1;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(attach_mutex);
+		for(int c=0; c<SLAB_POOL_MAX_THREADS; c++){
+			if(!caches[c].attached.load(std::memory_order_acquire)){
+				caches[c].attached.store(true, std::memory_order_release);
+				idx = c;
+				break;
+			}
+		}
+	}
+
+	tp.entries[slot] = thread_pools_t::entry_t{id, idx};
+	if(slot == tp.n) tp.n++;
+	return idx;
+}
+
+void slabPool::count_alloc(){
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	int64_t v = n_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+	int64_t hw = n_high_water.load(std::memory_order_relaxed);
+	while(v > hw && !n_high_water.compare_exchange_weak(hw, v, std::memory_order_relaxed)){}
+}
+
+void* slabPool::alloc(){
+	/**
+	 * Pops a block from the calling thread's cache, refilling it from its
+	 * remote frees or the shared list when empty
+	 *
+	 * @returns block, nullptr if the pool is exhausted
+	*/
+
+	int idx = cache_index();
+	if(idx < 0){
+		void *p = alloc_shared();
+		if(p == nullptr){
+			n_exhausted.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		owner[((uint8_t*)p - blocks) / stride] = SLAB_POOL_NO_OWNER;
+		count_alloc();
+		return p;
+	}
+
+	thread_cache_t& c = caches[idx];
+	if(c.local == nullptr && !refill(c)){
+		n_exhausted.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	free_block_t *b = c.local;
+	c.local = b->next;
+	c.n_local--;
+	owner[((uint8_t*)b - blocks) / stride] = (uint16_t)idx;
+	count_alloc();
+	return b;
+}
+
+bool slabPool::refill(thread_cache_t& cache){
+	/**
+	 * Refills an empty cache: first the blocks other threads returned to
+	 * it, then a batch from the shared list, then blocks stranded in the
+	 * remote lists of caches whose thread exited
+	 *
+	 * @param cache	Calling thread's cache
+	 * @returns true if the cache holds a block
+	*/
+
+	free_block_t *r = cache.remote.exchange(nullptr, std::memory_order_acquire);
+	if(r == nullptr){
+		std::lock_guard<std::mutex> lock(shared_mutex);
+		uint32_t n = 0;
+		while(shared_head != nullptr && n < config.cache_size){
+			free_block_t *b = shared_head;
+			shared_head = b->next;
+			b->next = r;
+			r = b;
+			n++;
+		}
+		n_shared -= n;
+	}
+	if(r == nullptr){
+		for(size_t i=0; i<SLAB_POOL_MAX_THREADS && r == nullptr; i++){
+			if(&caches[i] == &cache || caches[i].attached.load(std::memory_order_acquire)) continue;
+			r = caches[i].remote.exchange(nullptr, std::memory_order_acquire);
+		}
+	}
+	if(r == nullptr) return false;
+
+	uint32_t n = 0;
+	for(free_block_t *b = r; b != nullptr; b = b->next) n++;
+	cache.local = r;
+	cache.n_local = n;
+	return true;
+}
+
+void slabPool::free(void *block){
+	/**
+	 * Returns block to the cache of the thread that allocated it: directly
+	 * when that is the calling thread, else through the owner's remote list
+	 *
+	 * @param block	Block from alloc() (nullptr is ignored)
+	*/
+
+	if(block == nullptr) return;
+	free_block_t *b = (free_block_t*)block;
+	uint16_t o = owner[((uint8_t*)block - blocks) / stride];
+	n_in_use.fetch_sub(1, std::memory_order_relaxed);
+
+	if(o == SLAB_POOL_NO_OWNER){
+		free_shared(b);
+		return;
+	}
+
+	thread_cache_t& c = caches[o];
+	if((int)o == lookup_cache(id)){
+		b->next = c.local;
+		c.local = b;
+		c.n_local++;
+		if(c.n_local > 2 * config.cache_size) flush_local(c, config.cache_size);
+		return;
+	}
+
+	n_remote_frees.fetch_add(1, std::memory_order_relaxed);
+	free_block_t *head = c.remote.load(std::memory_order_relaxed);
+	do{
+		b->next = head;
+	} while(!c.remote.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void slabPool::flush_local(thread_cache_t& cache, uint32_t keep){
+	/**
+	 * Moves all but keep of the cache's blocks to the shared list
+	 *
+	 * @param cache	Calling thread's cache
+	 * @param keep	Blocks to leave in the cache
+	*/
+
+	if(cache.n_local <= keep) return;
+	std::lock_guard<std::mutex> lock(shared_mutex);
+	while(cache.n_local > keep){
+		free_block_t *b = cache.local;
+		cache.local = b->next;
+		cache.n_local--;
+		b->next = shared_head;
+		shared_head = b;
+		n_shared++;
+	}
+}
+
+void* slabPool::alloc_shared(){
+	std::lock_guard<std::mutex> lock(shared_mutex);
+	free_block_t *b = shared_head;
+	if(b == nullptr) return nullptr;
+	shared_head = b->next;
+	n_shared--;
+	return b;
+}
+
+void slabPool::free_shared(free_block_t *block){
+	std::lock_guard<std::mutex> lock(shared_mutex);
+	block->next = shared_head;
+	shared_head = block;
+	n_shared++;
+}
+
+void slabPool::release_cache(unsigned int index){
+	/**
+	 * Hands an exiting thread's cache back: its blocks (and any returned
+	 * to it) go to the shared list and the cache can be claimed again
+	 *
+	 * @param index	Cache of the exiting thread
+	*/
+
+	thread_cache_t& c = caches[index];
+	flush_local(c, 0);
+	free_block_t *r = c.remote.exchange(nullptr, std::memory_order_acquire);
+	while(r != nullptr){
+		free_block_t *next = r->next;
+		free_shared(r);
+		r = next;
+	}
+	c.attached.store(false, std::memory_order_release);
+}
+
+bool slabPool::owns(const void *p) const{
+	const uint8_t *b = (const uint8_t*)p;
+	return b >= blocks && b < blocks + config.capacity * stride;
+}
+
+size_t slabPool::block_size() const{
+	return stride;
+}
+
+slab_pool_stats_t slabPool::stats() const{
+	/**
+	 * Snapshot of pool occupancy (cached is derived, hence approximate
+	 * while other threads allocate)
+	 *
+	 * @returns slab_pool_stats_t copy
+	*/
+
+	slab_pool_stats_t s = {};
+	s.capacity = config.capacity;
+	int64_t in_use = n_in_use.load(std::memory_order_relaxed);
+	s.in_use = in_use > 0 ? (uint64_t)in_use : 0;
+	s.high_water = (uint64_t)n_high_water.load(std::memory_order_relaxed);
+	s.allocs = n_allocs.load(std::memory_order_relaxed);
+	s.remote_frees = n_remote_frees.load(std::memory_order_relaxed);
+	s.exhausted = n_exhausted.load(std::memory_order_relaxed);
+	s.hugepages = region.is_huge();
+
+	uint64_t shared;
+	{
+		std::lock_guard<std::mutex> lock(shared_mutex);
+		shared = n_shared;
+	}
+	s.cached = s.capacity > s.in_use + shared ? s.capacity - s.in_use - shared : 0;
+	for(size_t i=0; i<SLAB_POOL_MAX_THREADS; i++){
+		if(caches[i].attached.load(std::memory_order_relaxed)) s.threads++;
+	}
+	return s;
+}
+
+void slabPool::register_metrics(metricsRegistry& registry, const std::string& labels) const{
+	/**
+	 * Registers sampled metrics; alloc() and free() count nothing extra
+	 *
+	 * @param registry	Registry to add to
+	 * @param labels	Label pairs identifying the pool
+	*/
+
+	registry.gauge_fn("bt_sniff_pool_capacity_blocks", "Blocks in the slab pool", labels,
+		[this](){ return (double)config.capacity; });
+	registry.gauge_fn("bt_sniff_pool_in_use_blocks", "Slab pool blocks currently allocated", labels,
+		[this](){ return (double)stats().in_use; });
+	registry.gauge_fn("bt_sniff_pool_high_water_blocks", "Most slab pool blocks allocated at once", labels,
+		[this](){ return (double)n_high_water.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_pool_remote_frees_total", "Blocks freed on a thread other than their owner", labels,
+		[this](){ return n_remote_frees.load(std::memory_order_relaxed); });
+	registry.counter_fn("bt_sniff_pool_exhausted_total", "Allocations that failed because the pool was full", labels,
+		[this](){ return n_exhausted.load(std::memory_order_relaxed); });
+}
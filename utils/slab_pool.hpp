@@ -0,0 +1,238 @@
+/**
+ * Header for fixed-size slab pools and (optionally hugepage backed) memory regions
+ * @author Owen Capell
+*/
+#ifndef SLAB_POOL
+#define SLAB_POOL
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+
+#include "bluetoothdef.hpp"
+#include "spsc_ring.hpp"
+#include "metrics.hpp"
+
+/* Default number of blocks in a slabPool */
+#define SLAB_POOL_DEFAULT_CAPACITY 65536
+
+/* Default free blocks a thread keeps before returning some to the shared list */
+#define SLAB_POOL_DEFAULT_CACHE 64
+
+/* Threads that get their own cache; further threads use the shared list */
+#define SLAB_POOL_MAX_THREADS 64
+
+/* Explicit hugepage size (MAP_HUGETLB regions are rounded up to it) */
+#define HUGEPAGE_SIZE (2u * 1024u * 1024u)
+
+/**
+ * @details
+ * Anonymous mapping, prefaulted so first use does not page-fault. With
+ * hugepages it tries explicit 2 MiB pages (MAP_HUGETLB) and falls back to
+ * transparent hugepages (MADV_HUGEPAGE). Throws std::bad_alloc if the
+ * mapping fails
+*/
+class memoryRegion{
+public:
+	memoryRegion(size_t bytes, bool hugepages = false);
+	~memoryRegion();
+
+	memoryRegion(const memoryRegion&) = delete;
+	memoryRegion& operator=(const memoryRegion&) = delete;
+
+	void* data() const{ return base; }
+	size_t size() const{ return length; }
+
+	/**
+	 * @brief
+	 * True if backed by explicit hugepages (not only a THP hint)
+	*/
+	bool is_huge() const{ return huge; }
+
+private:
+	void *base;
+	size_t length;
+	bool huge;
+};
+
+/**
+ * @details
+ * Configuration for slabPool
+ * @param block_size	Bytes per block (rounded up to 16)
+ * @param capacity	Number of blocks; the pool never grows
+ * @param hugepages	Back the blocks with hugepages (see memoryRegion)
+ * @param cache_size	Free blocks a thread refills/keeps at a time
+*/
+typedef struct{
+	size_t block_size = sizeof(adv_event_t);
+	size_t capacity = SLAB_POOL_DEFAULT_CAPACITY;
+	bool hugepages = false;
+	uint32_t cache_size = SLAB_POOL_DEFAULT_CACHE;
+} slab_pool_config_t;
+
+/**
+ * @details
+ * Snapshot of slabPool occupancy
+ * @param capacity	Blocks in the pool
+ * @param in_use	Blocks allocated and not yet freed
+ * @param high_water	Largest in_use seen (size deployments from this)
+ * @param cached	Free blocks parked in thread caches
+ * @param allocs	Successful allocations
+ * @param remote_frees	Blocks freed by a thread other than the one that allocated them
+ * @param exhausted	Allocations that failed because every block was in use
+ * @param threads	Threads holding a cache
+ * @param hugepages	Blocks are backed by explicit hugepages
+*/
+typedef struct{
+	uint64_t capacity;
+	uint64_t in_use;
+	uint64_t high_water;
+	uint64_t cached;
+	uint64_t allocs;
+	uint64_t remote_frees;
+	uint64_t exhausted;
+	uint32_t threads;
+	bool hugepages;
+} slab_pool_stats_t;
+
+/**
+ * @details
+ * Fixed-capacity pool of equal-sized blocks carved from one memoryRegion.
+ * Each thread allocates from and frees into its own cache without locks.
+ * A block freed on another thread goes back to the cache of the thread
+ * that allocated it through a lock-free list, which the owner takes over
+ * in one exchange when its cache runs dry, so blocks do not migrate
+ * between threads. Caches trade
+ * surplus blocks with a shared list in batches. Nothing calls malloc after
+ * construction, except registering a thread's first use of the pool.
+ * alloc() returns nullptr when every block is in use.
+*/
+class slabPool{
+public:
+	explicit slabPool(const slab_pool_config_t& config = slab_pool_config_t{});
+	~slabPool();
+
+	slabPool(const slabPool&) = delete;
+	slabPool& operator=(const slabPool&) = delete;
+
+	/**
+	 * @brief
+	 * One block of block_size() bytes, nullptr if the pool is exhausted
+	*/
+	void* alloc();
+
+	/**
+	 * @brief
+	 * Returns a block from alloc() (any thread; nullptr is ignored)
+	*/
+	void free(void *block);
+
+	/**
+	 * @brief
+	 * True if p points into this pool
+	*/
+	bool owns(const void *p) const;
+
+	size_t block_size() const;
+
+	slab_pool_stats_t stats() const;
+
+	/**
+	 * @brief
+	 * Exposes occupancy, high-water, remote frees and exhaustion in registry
+	 * (the pool must outlive the registration)
+	*/
+	void register_metrics(metricsRegistry& registry, const std::string& labels = "") const;
+
+	/**
+	 * @brief
+	 * Called when a thread that used the pool exits (internal)
+	*/
+	void release_cache(unsigned int index);
+
+private:
+	typedef struct free_block{
+		struct free_block *next;
+	} free_block_t;
+
+	struct alignas(CACHE_LINE_SIZE) thread_cache_t{
+		/* Owner only */
+		free_block_t *local;
+		uint32_t n_local;
+
+		/* Pushed by other threads, taken over by the owner */
+		alignas(CACHE_LINE_SIZE) std::atomic<free_block_t*> remote;
+		std::atomic<bool> attached;
+	};
+
+	int cache_index();
+	bool refill(thread_cache_t& cache);
+	void flush_local(thread_cache_t& cache, uint32_t keep);
+	void* alloc_shared();
+	void free_shared(free_block_t *block);
+	void count_alloc();
+
+	slab_pool_config_t config;
+	uint64_t id;
+	size_t stride;
+	memoryRegion region;
+	uint8_t *blocks;
+
+	/* Cache index of the thread that allocated each block */
+	std::unique_ptr<uint16_t[]> owner;
+
+	std::unique_ptr<thread_cache_t[]> caches;
+	std::mutex attach_mutex;
+
+	/* Shared list (refills, surplus, threads without a cache) */
+	mutable std::mutex shared_mutex;
+	free_block_t *shared_head;
+	uint64_t n_shared;
+
+	std::atomic<int64_t> n_in_use;
+	std::atomic<int64_t> n_high_water;
+	std::atomic<uint64_t> n_allocs;
+	std::atomic<uint64_t> n_remote_frees;
+	std::atomic<uint64_t> n_exhausted;
+};
+
+/**
+ * @details
+ * Deleter returning an object to the slabPool it was built in
+*/
+template <typename T>
+struct poolDeleter{
+	slabPool *pool = nullptr;
+
+	void operator()(T *p) const{
+		if(p == nullptr) return;
+		p->~T();
+		pool->free(p);
+	}
+};
+
+template <typename T>
+using pool_ptr = std::unique_ptr<T, poolDeleter<T>>;
+
+/**
+ * @brief
+ * Constructs a T in a block of pool; empty pointer if the pool is exhausted
+ * or its blocks are too small for T
+*/
+template <typename T, typename... Args>
+pool_ptr<T> pool_make(slabPool& pool, Args&&... args){
+	if(sizeof(T) > pool.block_size() || alignof(T) > 16) return pool_ptr<T>(nullptr, poolDeleter<T>{&pool});
+	void *mem = pool.alloc();
+	if(mem == nullptr) return pool_ptr<T>(nullptr, poolDeleter<T>{&pool});
+	return pool_ptr<T>(new (mem) T(std::forward<Args>(args)...), poolDeleter<T>{&pool});
+}
+
+/* A record owned by a slabPool, freed back to it from any thread */
+typedef pool_ptr<adv_event_t> pooled_event_t;
+
+#endif
@@ -0,0 +1,315 @@
+/**
+ * Header-only, bounded, lock-free single-producer/single-consumer ring
+ * @author Owen Capell
+*/
+#ifndef SPSC_RING
+#define SPSC_RING
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/* Size of a cache line; used to pad shared indices and slots */
+#define CACHE_LINE_SIZE 64
+
+/* Number of empty polls a blocking pop() spins before sleeping */
+#define SPSC_RING_SPIN_LIMIT 256
+
+/**
+ * @details
+ * Policy applied by push() when the ring is full
+ * @param drop_newest	Discard the element being pushed
+ * @param drop_oldest	Discard the oldest queued element to make room
+ * @param block		Wait until the consumer frees a slot
+*/
+enum class overflowPolicy{
+	drop_newest,
+	drop_oldest,
+	block
+};
+
+/**
+ * @details
+ * Fixed-capacity ring with one sequence number per slot (Vyukov style).
+ * The producer publishes a slot by storing pos+1 into its sequence, the
+ * consumer releases it by storing pos+capacity. Neither side ever takes a
+ * lock; sleeping is only used by the blocking variants and the other side
+ * only issues a wake-up when somebody is actually asleep.
+ * Under drop_oldest the producer may discard the head element, so the head
+ * index is claimed with a CAS instead of a plain store.
+*/
+template <typename T>
+class spscRing{
+public:
+	explicit spscRing(size_t capacity, overflowPolicy policy = overflowPolicy::drop_newest)
+		: mask(round_capacity(capacity) - 1), policy(policy),
+		slots(new slot[mask + 1])
+	{
+		/**
+		 * Constructor for spscRing
+		 * Capacity is rounded up to the next power of two
+		 *
+		 * @param capacity	Minimum number of elements the ring can hold
+		 * @param policy	Behaviour of push() when the ring is full
+		*/
+
+		for(size_t i=0; i<=mask; i++){
+			slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	spscRing(const spscRing&) = delete;
+	spscRing& operator=(const spscRing&) = delete;
+
+	/**
+	 * @brief
+	 * Enqueues v, applying the overflow policy if full
+	 * Returns false if v itself was dropped
+	*/
+	bool push(T&& v){ return push_value(std::move(v)); }
+	bool push(const T& v){ return push_value(v); }
+
+	/**
+	 * @brief
+	 * Enqueues up to count elements from items with a single wake-up
+	 * Returns the number of elements accepted
+	*/
+	size_t push_batch(T *items, size_t count){
+		size_t accepted = 0;
+		for(size_t i=0; i<count; i++){
+			T *dst = claim();
+			if(dst == nullptr) continue;
+			*dst = std::move(items[i]);
+			publish(false);
+			accepted++;
+		}
+		wake_consumer();
+		return accepted;
+	}
+
+	/**
+	 * @brief
+	 * Reserves the next slot for in-place writing, applying the overflow
+	 * policy if full. Returns nullptr if the element must be dropped.
+	 * Every non-null claim() must be followed by publish().
+	*/
+	T* claim(){
+		size_t pos = tail.load(std::memory_order_relaxed);
+		slot *s = &slots[pos & mask];
+		uint32_t spins = 0;
+
+		while(s->seq.load(std::memory_order_acquire) != pos){
+			/* Ring is full */
+			if(policy == overflowPolicy::drop_newest){
+				n_dropped_newest.store(
+					n_dropped_newest.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			if(policy == overflowPolicy::drop_oldest){
+				/* Only discard the element occupying our slot; if the consumer
+				 * already claimed it, wait for it to finish reading */
+				if(discard_head(pos - (mask + 1))){
+					n_dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+				}
+				else{
+					cpu_relax();
+				}
+				continue;
+			}
+			if(++spins < SPSC_RING_SPIN_LIMIT) continue;
+			wake_consumer();
+			wait_for_space(s, pos);
+		}
+
+		return &s->value;
+	}
+
+	/**
+	 * @brief
+	 * Makes the slot returned by claim() visible to the consumer
+	*/
+	void publish(bool wake = true){
+		size_t pos = tail.load(std::memory_order_relaxed);
+		slots[pos & mask].seq.store(pos + 1, std::memory_order_release);
+		tail.store(pos + 1, std::memory_order_relaxed);
+		if(wake) wake_consumer();
+	}
+
+	/**
+	 * @brief
+	 * Dequeues front element into out without blocking
+	 * Returns false if the ring is empty
+	*/
+	bool try_pop(T& out){
+		size_t pos = head.load(std::memory_order_relaxed);
+		while(true){
+			slot *s = &slots[pos & mask];
+			size_t seq = s->seq.load(std::memory_order_acquire);
+			if(seq != pos + 1) return false;
+
+			if(policy == overflowPolicy::drop_oldest){
+				/* Producer may race us for the head */
+				if(!head.compare_exchange_weak(pos, pos + 1,
+					std::memory_order_relaxed, std::memory_order_relaxed)) continue;
+			}
+			else{
+				head.store(pos + 1, std::memory_order_relaxed);
+			}
+
+			out = std::move(s->value);
+			s->seq.store(pos + mask + 1, std::memory_order_release);
+			wake_producer();
+			return true;
+		}
+	}
+
+	/**
+	 * @brief
+	 * Dequeues front element, busy-waiting while empty
+	*/
+	T pop_spin(){
+		T out{};
+		while(!try_pop(out)) cpu_relax();
+		return out;
+	}
+
+	/**
+	 * @brief
+	 * Dequeues front element, spinning briefly then sleeping while empty
+	*/
+	T pop(){
+		T out{};
+		uint32_t spins = 0;
+		while(!try_pop(out)){
+			if(++spins < SPSC_RING_SPIN_LIMIT){
+				cpu_relax();
+				continue;
+			}
+
+			uint32_t ticket = consumer_wake.load(std::memory_order_acquire);
+			consumer_sleeping.store(true, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(try_pop(out)){
+				consumer_sleeping.store(false, std::memory_order_relaxed);
+				break;
+			}
+			consumer_wake.wait(ticket, std::memory_order_acquire);
+			consumer_sleeping.store(false, std::memory_order_relaxed);
+		}
+		return out;
+	}
+
+	/**
+	 * @brief
+	 * Approximate number of queued elements
+	*/
+	size_t size() const{
+		size_t t = tail.load(std::memory_order_acquire);
+		size_t h = head.load(std::memory_order_acquire);
+		return t > h ? t - h : 0;
+	}
+
+	size_t capacity() const{ return mask + 1; }
+
+	overflowPolicy get_policy() const{ return policy; }
+
+	/**
+	 * @brief
+	 * Number of elements rejected under drop_newest
+	*/
+	uint64_t dropped_newest() const{ return n_dropped_newest.load(std::memory_order_relaxed); }
+
+	/**
+	 * @brief
+	 * Number of queued elements discarded under drop_oldest
+	*/
+	uint64_t dropped_oldest() const{ return n_dropped_oldest.load(std::memory_order_relaxed); }
+
+private:
+	template <typename U>
+	bool push_value(U&& v){
+		T *dst = claim();
+		if(dst == nullptr) return false;
+		*dst = std::forward<U>(v);
+		publish();
+		return true;
+	}
+
+	struct alignas(CACHE_LINE_SIZE) slot{
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	static size_t round_capacity(size_t capacity){
+		size_t c = 1;
+		while(c < capacity) c <<= 1;
+		return c;
+	}
+
+	static void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	bool discard_head(size_t pos){
+		/* Consumer-side pop performed by the producer (drop_oldest only) */
+		slot *s = &slots[pos & mask];
+		if(s->seq.load(std::memory_order_acquire) != pos + 1) return false;
+		if(!head.compare_exchange_strong(pos, pos + 1,
+			std::memory_order_relaxed, std::memory_order_relaxed)) return false;
+
+		[[maybe_unused]] T discarded = std::move(s->value);
+		s->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	void wait_for_space(slot *s, size_t pos){
+		uint32_t ticket = producer_wake.load(std::memory_order_acquire);
+		producer_sleeping.store(true, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(s->seq.load(std::memory_order_acquire) != pos){
+			producer_wake.wait(ticket, std::memory_order_acquire);
+		}
+		producer_sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	void wake_consumer(){
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(consumer_sleeping.load(std::memory_order_relaxed)){
+			consumer_wake.fetch_add(1, std::memory_order_release);
+			consumer_wake.notify_one();
+		}
+	}
+
+	void wake_producer(){
+		if(policy != overflowPolicy::block) return;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(producer_sleeping.load(std::memory_order_relaxed)){
+			producer_wake.fetch_add(1, std::memory_order_release);
+			producer_wake.notify_one();
+		}
+	}
+
+	const size_t mask;
+	const overflowPolicy policy;
+	std::unique_ptr<slot[]> slots;
+
+	/* Producer-owned line */
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+	std::atomic<uint64_t> n_dropped_newest{0};
+	std::atomic<uint64_t> n_dropped_oldest{0};
+	std::atomic<uint32_t> producer_wake{0};
+	std::atomic<bool> producer_sleeping{false};
+
+	/* Consumer-owned line */
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+	std::atomic<uint32_t> consumer_wake{0};
+	std::atomic<bool> consumer_sleeping{false};
+};
+
+#endif
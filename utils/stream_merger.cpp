@@ -0,0 +1,219 @@
+/**
+ * Implementation of the per-adapter stream merger
+ * @author Owen Capell
+*/
+#include <cstring>
+#include <thread>
+#include <chrono>
+
+#include "bluetoothdef.hpp"
+#include "stream_merger.hpp"
+#include "utils.hpp"
+
+static uint64_t report_hash(const adv_event_t& evt){
+	/* FNV-1a over the fields that identify one over-the-air report */
+	uint64_t h = 0xcbf29ce484222325ull;
+	auto mix = [&h](const uint8_t *p, size_t len){
+		for(size_t i=0; i<len; i++){
+			h ^= p[i];
+			h *= 0x100000001b3ull;
+		}
+	};
+	mix(evt.address.address, sizeof(evt.address.address));
+	mix(&evt.address_type, 1);
+	mix((const uint8_t*)&evt.event, sizeof(evt.event));
+	mix(&evt.advertising_sid, 1);
+	mix(evt.data, evt.data_length);
+	return h;
+}
+
+streamMerger::streamMerger(const merge_config_t& config) :
+	config(config), inputs(), pending(), pending_head(0), pending_count(0),
+	last_emitted(0), published(0),
+	n_merged(0), n_folded(0), n_late(0), n_dropped(0)
+{
+	/**
+	 * Constructor for streamMerger
+	*/
+
+	inputs.reserve(ADV_MAX_ADAPTERS);
+	if(config.dedup) pending.resize(config.dedup_capacity > 0 ? config.dedup_capacity : 1);
+}
+
+int streamMerger::add_input(eventQueue& queue, uint8_t adapter_id){
+	/**
+	 * Adds a per-adapter queue. Call before the merger starts running
+	 *
+	 * @param queue	Queue filled by one capture thread
+	 * @param adapter_id	Tag stamped on records from this queue
+	 * @returns input slot, -1 if ADV_MAX_ADAPTERS inputs already exist
+	*/
+
+	if(inputs.size() >= ADV_MAX_ADAPTERS) return -1;
+	merge_input_t in;
+	in.queue = &queue;
+	in.adapter_id = adapter_id;
+	in.has_head = false;
+	inputs.push_back(in);
+	return (int)inputs.size() - 1;
+}
+
+void streamMerger::publish(const adv_event_t& evt, eventQueue& out){
+	if(out.push(evt)){
+		published++;
+	}
+	else{
+		n_dropped.store(n_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+size_t streamMerger::release(uint64_t watermark, eventQueue& out){
+	/**
+	 * Publishes held-back records whose dedup window has closed
+	 *
+	 * @param watermark	No report older than this can still arrive
+	 * @param out	Output queue
+	 * @returns records released
+	*/
+
+	size_t n = 0;
+	while(pending_count > 0){
+		pending_t& p = pending[pending_head];
+		if(watermark != UINT64_MAX && p.evt.timestamp + config.dedup_window_ns > watermark) break;
+		publish(p.evt, out);
+		pending_head = (pending_head + 1) % pending.size();
+		pending_count--;
+		n++;
+	}
+	return n;
+}
+
+void streamMerger::emit(adv_event_t& evt, int slot, eventQueue& out){
+	/**
+	 * Tags a record with its adapter and either publishes it or, with
+	 * dedup enabled, folds it into a held-back copy of the same report
+	 *
+	 * @param evt	Record taken from input slot
+	 * @param slot	Input slot
+	 * @param out	Output queue
+	*/
+
+	evt.adapter_id = inputs[slot].adapter_id;
+	evt.adapter_mask = (uint8_t)(1u << slot);
+	for(int i=0; i<ADV_MAX_ADAPTERS; i++) evt.adapter_rssi[i] = ADV_RSSI_UNAVAILABLE;
+	evt.adapter_rssi[slot] = evt.rssi;
+
+	if(evt.timestamp < last_emitted){
+		n_late.store(n_late.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	else{
+		last_emitted = evt.timestamp;
+	}
+
+	if(!config.dedup){
+		publish(evt, out);
+		return;
+	}
+
+	uint64_t h = report_hash(evt);
+	size_t cap = pending.size();
+	for(size_t k=0; k<pending_count; k++){
+		/* Newest first: duplicates arrive close together */
+		pending_t& p = pending[(pending_head + pending_count - 1 - k) % cap];
+		if(evt.timestamp > p.evt.timestamp + config.dedup_window_ns) break;
+		if(p.hash != h || (p.evt.adapter_mask & evt.adapter_mask)) continue;
+
+		p.evt.adapter_mask |= evt.adapter_mask;
+		p.evt.adapter_rssi[slot] = evt.rssi;
+		if(evt.rssi > p.evt.rssi){
+			/* The strongest adapter becomes the record's primary source */
+			p.evt.rssi = evt.rssi;
+			p.evt.adapter_id = evt.adapter_id;
+		}
+		n_folded.store(n_folded.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	if(pending_count == cap){
+		publish(pending[pending_head].evt, out);
+		pending_head = (pending_head + 1) % cap;
+		pending_count--;
+	}
+	pending_t& slot_p = pending[(pending_head + pending_count) % cap];
+	slot_p.hash = h;
+	slot_p.evt = evt;
+	pending_count++;
+}
+
+size_t streamMerger::step(eventQueue& out, uint64_t now){
+	/**
+	 * One merge pass. The oldest head is emitted once every input has a
+	 * head to compare against, or once it is older than the reorder
+	 * window (a silent adapter cannot hold the stream back forever)
+	 *
+	 * @param out	Output queue
+	 * @param now	Current CLOCK_REALTIME in ns, UINT64_MAX to flush
+	 * @returns records published to out
+	*/
+
+	published = 0;
+	uint64_t horizon = now == UINT64_MAX ? UINT64_MAX :
+		(now > config.reorder_window_ns ? now - config.reorder_window_ns : 0);
+
+	while(true){
+		int min_slot = -1;
+		bool all_ready = true;
+		for(size_t i=0; i<inputs.size(); i++){
+			merge_input_t& in = inputs[i];
+			if(!in.has_head) in.has_head = in.queue->try_pop(in.head);
+			if(!in.has_head){
+				all_ready = false;
+				continue;
+			}
+			if(min_slot < 0 || in.head.timestamp < inputs[min_slot].head.timestamp) min_slot = (int)i;
+		}
+		if(min_slot < 0) break;
+
+		merge_input_t& in = inputs[min_slot];
+		if(!all_ready && in.head.timestamp > horizon) break;
+
+		in.has_head = false;
+		emit(in.head, min_slot, out);
+	}
+
+	if(config.dedup){
+		release(now == UINT64_MAX ? UINT64_MAX : (last_emitted > horizon ? last_emitted : horizon), out);
+	}
+
+	n_merged.store(n_merged.load(std::memory_order_relaxed) + published, std::memory_order_relaxed);
+	return published;
+}
+
+void streamMerger::run(eventQueue& out, const std::atomic<bool>& running){
+	/**
+	 * Merge loop for a dedicated thread
+	 *
+	 * @param out	Output queue
+	 * @param running	Cleared by the owner to stop the loop
+	*/
+
+	while(running.load(std::memory_order_acquire)){
+		if(step(out, realtime_ns()) == 0){
+			std::this_thread::sleep_for(std::chrono::microseconds(config.poll_us));
+		}
+	}
+	step(out, UINT64_MAX);
+}
+
+size_t streamMerger::input_count() const{
+	return inputs.size();
+}
+
+merge_stats_t streamMerger::stats() const{
+	merge_stats_t s;
+	s.merged = n_merged.load(std::memory_order_relaxed);
+	s.folded = n_folded.load(std::memory_order_relaxed);
+	s.late = n_late.load(std::memory_order_relaxed);
+	s.dropped = n_dropped.load(std::memory_order_relaxed);
+	return s;
+}
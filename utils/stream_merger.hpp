@@ -0,0 +1,116 @@
+/**
+ * Header for merging per-adapter event queues into one time-ordered stream
+ * @author Owen Capell
+*/
+#ifndef STREAM_MERGER
+#define STREAM_MERGER
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "bluetoothdef.hpp"
+#include "event_queue.hpp"
+
+/**
+ * @details
+ * Configuration for streamMerger
+ * @param reorder_window_ns	How long to wait for a slower adapter before
+ * 							emitting the oldest available record
+ * @param dedup	Fold the same report heard by several adapters into one record
+ * @param dedup_window_ns	Maximum timestamp distance of folded reports
+ * @param dedup_capacity	Records held back while waiting for duplicates
+ * @param poll_us	Merger sleep when every input is empty
+*/
+typedef struct{
+	uint64_t reorder_window_ns = 2000000ull;
+	bool dedup = false;
+	uint64_t dedup_window_ns = 10000000ull;
+	size_t dedup_capacity = 1024;
+	uint32_t poll_us = 100;
+} merge_config_t;
+
+/**
+ * @details
+ * Snapshot of streamMerger counters
+ * @param merged	Records published to the output queue
+ * @param folded	Duplicate reports folded into an earlier record
+ * @param late	Records older than one already emitted (outside the window)
+ * @param dropped	Records the output queue rejected
+*/
+typedef struct{
+	uint64_t merged;
+	uint64_t folded;
+	uint64_t late;
+	uint64_t dropped;
+} merge_stats_t;
+
+/**
+ * @details
+ * k-way merge of up to ADV_MAX_ADAPTERS per-adapter queues by kernel
+ * timestamp. Each input is a single-producer queue owned by one capture
+ * thread; the merger is their single consumer. Records are tagged with
+ * the input's adapter_id; adapter_mask/adapter_rssi are indexed by input
+ * slot (the order of add_input()).
+*/
+class streamMerger{
+public:
+	explicit streamMerger(const merge_config_t& config = merge_config_t{});
+
+	streamMerger(const streamMerger&) = delete;
+	streamMerger& operator=(const streamMerger&) = delete;
+
+	/**
+	 * @brief
+	 * Registers an input queue; returns its slot or -1 if all slots are used
+	*/
+	int add_input(eventQueue& queue, uint8_t adapter_id);
+
+	/**
+	 * @brief
+	 * Moves every record that is safe to emit at time now into out
+	 * (now = UINT64_MAX flushes everything). Returns records published
+	*/
+	size_t step(eventQueue& out, uint64_t now);
+
+	/**
+	 * @brief
+	 * Calls step() until running becomes false, then flushes
+	*/
+	void run(eventQueue& out, const std::atomic<bool>& running);
+
+	size_t input_count() const;
+	merge_stats_t stats() const;
+
+private:
+	typedef struct{
+		eventQueue *queue;
+		uint8_t adapter_id;
+		bool has_head;
+		adv_event_t head;
+	} merge_input_t;
+
+	typedef struct{
+		uint64_t hash;
+		adv_event_t evt;
+	} pending_t;
+
+	void emit(adv_event_t& evt, int slot, eventQueue& out);
+	size_t release(uint64_t watermark, eventQueue& out);
+	void publish(const adv_event_t& evt, eventQueue& out);
+
+	merge_config_t config;
+	std::vector<merge_input_t> inputs;
+	std::vector<pending_t> pending;
+	size_t pending_head;
+	size_t pending_count;
+	uint64_t last_emitted;
+	size_t published;
+
+	std::atomic<uint64_t> n_merged;
+	std::atomic<uint64_t> n_folded;
+	std::atomic<uint64_t> n_late;
+	std::atomic<uint64_t> n_dropped;
+};
+
+#endif
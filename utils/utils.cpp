@@ -4,183 +4,240 @@
 */
 #include <iostream>
 #include <string>
-#include <iomanip>
-#include <sstream>
-#include <algorithm>
 #include <memory>
+#include <optional>
+#include <cstring>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #include "bluetoothdef.hpp"
 #include "utils.hpp"
+#include "ad_parser.hpp"
+#include "le_meta.hpp"
+#include "hex_format.hpp"
 
 std::string addr_to_str(const uint8_t *addr){
     /**
      * Utility function to convert the address array into
-     * human-readable string (big endian)
+     * human-readable string (big endian, upper case)
      * 
      * @param addr  The uint8_t address array
     */
 
-    std::stringstream ss;
-
-    ss << std::hex << std::setfill('0');
-
-    for(int i=5; i>=0; i--){
-        ss << std::hex << std::setw(2) << static_cast<int>(addr[i]);
-        ss << ":";
-    }
-
-    std::string address = ss.str();
-    address.pop_back();
-    std::transform(address.begin(), address.end(), address.begin(), toupper);
-    
-    return address;
+    char buf[ADDR_STR_LEN];
+    format_address(addr, buf);
+    return std::string(buf, ADDR_STR_LEN);
 }
 
 std::string event_type(uint16_t event_type){
     /**
      * Utility funciton to convert event_type field
-     * into human readable string
+     * into human readable string (names from hci_schema.hpp)
      * 
      * @param event_type    the uint16_t event_type field
     */
 
-    std::string event_str;
-    switch(event_type){
-        case ADV_IND:
-            event_str = "ADV_IND";
-            break;
-        case ADV_DIRECT_IND:
-            event_str = "ADV_DIRECT_IND";
-            break;
-        case ADV_SCAN_IND:
-            event_str = "ADV_SCAN_IND";
-            break;
-        case ADV_NONCONN_IND:
-            event_str = "ADV_NONCONN_IND";
-            break;
-        case SCAN_RSP_TO_ADV_IND:
-            event_str = "SCAN_RSP to an ADV_IND";
-            break;
-        case SCAN_RSP_TO_ADV_SCAN_IND:
-            event_str = "SCAN_RSP to an ADV_SCAN_IND";
-            break;
-        default:
-            event_str = "EVENT TYPE NOT FOUND";
-            break;
-    }
-
-    return event_str;
+    return adv_event_name(event_type);
 }
 
 std::string addr_type(uint8_t addr_type){
     /**
      * Utility function to convert address type field
-     * into human-readable string
+     * into human-readable string (names from hci_schema.hpp)
      * 
      * @param addr_type     uint8_t representing the address type
     */
 
-    std::string addr_type_str;
-
-    switch(addr_type){
-        case 0x00:
-            addr_type_str = "Public";
-            break;
-        case 0x01:
-            addr_type_str = "Random";
-            break;
-        case 0x02:
-            addr_type_str = "Public Identity";
-            break;
-        case 0x03:
-            addr_type_str = "Random (static)";
-            break;
-        case 0xFF:
-            addr_type_str = "None (anonymous)";
-            break;
-        default:
-            addr_type_str = "UNKOWN ADDRESS TYPE";
-            break;
-    }
-    
-    return addr_type_str;
+    return address_type_name(addr_type);
 }
 
-void process_ad(
-    hci_le_meta_ear_event_t *event, std::shared_ptr<processed_adv_event> usr_evt, const bool& verbose){
+uint64_t realtime_ns(){
     /**
-     * Utility funciton to process the advertising data porition of
-     * the packet
+     * Utility function to read the realtime clock
      * 
-     * @param event Pointer to the hci_le_meta_era_event_t
-     * @param usr_evt   Pointer to user-space event struct to add name to
-     * @param verbose Boolean flag indicating whether to print AD details
+     * @returns nanoseconds since the epoch
     */
 
-    int data_size = (int) event->data_length;
-    if(data_size <= 0) return;
-
-    std::string name = "";
-
-    /* Iterate over all AD payloads */
-    ad_data_t *ad_data = (ad_data_t*)event->data;
-    while(data_size > 0){
-        /* Flags */
-        /* For now, only worry about flags in verbose mode */
-        if(ad_data->type == 0x01 && verbose){
-            uint8_t flag = event->data[0];
-            std::cout << "FLAGS: " << std::endl;
-            if(flag & 0x01) std::cout << "LE Limited Discoverable Mode" << std::endl;
-            flag >>= 1;
-            if(flag & 0x01) std::cout << "LE General Discoverable Mode" << std::endl;
-            flag >>= 1;
-            if(flag & 0x01) std::cout << "BR/EDR Not Supported" << std::endl;
-            flag >>= 1;
-            if(flag & 0x01) std::cout << "Simultaneous LE and BR/EDR" << std::endl;
-            flag >>= 1;
-            if(flag & 0x01) std::cout << "Previously Used" << std::endl;
-        }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-		/* Important: there is a name */
-        if(ad_data->type == 0x09){
-            int name_length = (int)(ad_data->length - 1);
-            for(int i=0; i<name_length; i++){
-                name.push_back((char)ad_data->data[i]);
-            }
-            if(verbose) std::cout << "DEVICE NAME: " << name << std::endl;
-        }
+uint64_t monotonic_ns(){
+    /**
+     * Utility function to read the monotonic clock (for pacing/intervals)
+     * 
+     * @returns nanoseconds since an arbitrary fixed point
+    */
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+std::string_view process_ad(
+    const uint8_t *data, uint8_t data_length, const bool& verbose){
+    /**
+     * Utility funciton to process the advertising data porition of
+     * the packet. Walks the AD structures with the bounds-checked
+     * adRange iterator; no copies are made
+     * 
+     * @param data  Pointer to the first AD structure
+     * @param data_length   Number of octets of AD data
+     * @param verbose Boolean flag indicating whether to print AD details
+     * @returns view of the device name within data, empty if not present
+    */
 
-        data_size -= (int)((ad_data->length) + 1);
-        ad_data = (ad_data_t*)((char*)ad_data + (int)(ad_data->length + 1)); // OMG UGLY!!
+    adRange range(data, data_length);
+    std::string_view name = ad_name(range);
+    if(!verbose) return name;
+
+    /* Flags */
+    std::optional<uint8_t> flags = ad_flags(range);
+    if(flags){
+        uint8_t flag = *flags;
+        std::cout << "FLAGS: " << std::endl;
+        if(flag & 0x01) std::cout << "LE Limited Discoverable Mode" << std::endl;
+        flag >>= 1;
+        if(flag & 0x01) std::cout << "LE General Discoverable Mode" << std::endl;
+        flag >>= 1;
+        if(flag & 0x01) std::cout << "BR/EDR Not Supported" << std::endl;
+        flag >>= 1;
+        if(flag & 0x01) std::cout << "Simultaneous LE and BR/EDR" << std::endl;
+        flag >>= 1;
+        if(flag & 0x01) std::cout << "Previously Used" << std::endl;
     }
 
-    usr_evt->name = name;
+    if(!name.empty()) std::cout << "DEVICE NAME: " << name << std::endl;
+    if(range.malformed()) std::cout << "MALFORMED AD DATA" << std::endl;
+
+    return name;
 }
 
 void process_extended_advertising_report(
-    hci_le_meta_ear_event_t *event, std::shared_ptr<processed_adv_event> usr_evt, const bool& verbose){
+    const hciView<leExtendedReportItem>& report, adv_event_t& usr_evt, const bool& verbose){
     /**
-     * Uitlity funciton to print information about the extended advertising report
-     * Updates the provided user-space struct with relevant information (name, address) 
+     * Uitlity funciton to copy the extended advertising report into a record
+     * Only raw fields are copied; no strings are built unless verbose
      * 
-     * @param event Pointer to the hci_le_meta_era_event_t
-     * @param usr_evt   Pointer to user-space event struct to populate with relevant information
+     * @param report    Bound view of one extended report (data already bounds-checked)
+     * @param usr_evt   Reference to user-space record to populate
      * @param verbose   Boolean flag indicating whether advertising report info should be printed to stdout
     */
 
-    std::string evt_type = event_type(event->event_type);
-    std::string addr = addr_to_str(event->address.address);
+    usr_evt.address = report.get<"address">();
+    usr_evt.address_type = report.get<"address_type">();
+    usr_evt.event = report.get<"event_type">();
+    usr_evt.rssi = report.get<"rssi">();
+    usr_evt.tx_power = report.get<"tx_power">();
+    usr_evt.primary_phy = report.get<"primary_phy">();
+    usr_evt.secondary_phy = report.get<"secondary_phy">();
+    usr_evt.advertising_sid = report.get<"advertising_sid">();
+    usr_evt.periodic_advertising_interval = report.get<"periodic_advertising_interval">();
+
+    size_t length = report.data_length();
+    if(length > ADV_EVENT_MAX_DATA) length = ADV_EVENT_MAX_DATA;
+    memcpy(usr_evt.data, report.data(), length);
+    usr_evt.data_length = (uint8_t)length;
+
+    if(verbose) print_adv_event(usr_evt);
+}
+
+void print_adv_event(const adv_event_t& evt){
+    /**
+     * Uitlity funciton to print a record to stdout (verbose mode)
+     * 
+     * @param evt   The record to print
+    */
+
+    std::cout << "Event type: " << event_type(evt.event) << std::endl;
+    std::cout << "Address: " << addr_to_str(evt.address.address) << std::endl;
+    std::cout << "Address Type: " << addr_type(evt.address_type) << std::endl;
+    
+    std::cout << std::endl;
+
+    process_ad(evt.data, evt.data_length, true);
+}
 
-    if(verbose){
-        std::cout << "Event type: " << evt_type << std::endl;
-        std::cout << "Address: " << addr << std::endl;
-        std::cout << "Address Type: " << addr_type(event->address_type) << std::endl;
-        
-        std::cout << std::endl;
+void parse_hci_cmsg(const struct msghdr *msg, hci_packet_meta_t& meta){
+    /**
+     * Utility function to walk the control messages attached by the HCI
+     * socket when HCI_DATA_DIR / HCI_TIME_STAMP are enabled
+     * 
+     * @param msg   The msghdr filled in by recvmsg()/recvmmsg()
+     * @param meta  Metadata to fill with timestamp and direction
+    */
+
+    meta.timestamp = 0;
+    meta.direction = HCI_DIR_UNKNOWN;
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR((struct msghdr*)msg, cmsg)){
+        if(cmsg->cmsg_level != HCI_SOCKOPT_LEVEL) continue;
+
+        if(cmsg->cmsg_type == HCI_SOCKOPT_CMSG_DIR &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(int))){
+            int incoming;
+            memcpy(&incoming, CMSG_DATA(cmsg), sizeof(incoming));
+            meta.direction = incoming ? HCI_DIR_IN : HCI_DIR_OUT;
+        }
+        else if(cmsg->cmsg_type == HCI_SOCKOPT_CMSG_TSTAMP &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(struct timeval))){
+            struct timeval tv;
+            memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            meta.timestamp = (uint64_t)tv.tv_sec * 1000000000ull + (uint64_t)tv.tv_usec * 1000ull;
+        }
     }
 
-    usr_evt->event_s = evt_type;
-    usr_evt->address = addr;
+    if(meta.timestamp == 0) meta.timestamp = realtime_ns();
+}
 
-    process_ad(event, usr_evt, verbose);
-}
\ No newline at end of file
+size_t parse_hci_packet(
+    const uint8_t *buf, size_t len, const hci_packet_meta_t& pkt_meta,
+    adv_event_t *out, size_t max_out, const bool& verbose,
+    const advFilter *filter){
+    /**
+     * Utility function to turn a raw HCI packet into advertising records
+     * Shared by the single-read and batched capture loops
+     * 
+     * @param buf   Raw packet, starting with the HCI packet type octet
+     * @param len   Number of valid octets in buf
+     * @param pkt_meta    Kernel timestamp and direction stamped on every record
+     * @param out   Array of records to fill
+     * @param max_out   Capacity of out
+     * @param verbose   Boolean flag to print decoded reports
+     * @param filter    Compiled report filter (nullptr = built-in PDU check)
+     * @returns number of records written to out
+    */
+
+    /* Only HCI_EVENT_LE_META carries reports; per-report filtering happens in the decoders */
+    hciView<hciEventHeader> packet;
+    if(len < 1 || (unsigned int)buf[0] != HCI_PACK_EVENT || !packet.bind(buf + 1, len - 1)) return 0;
+    if(packet.get<"event_code">() != HCI_EVENT_LE_META) return 0;
+
+    /* Trust the shorter of the received length and the header's length */
+    size_t param_len = packet.data_length();
+    if(packet.get<"param_length">() < param_len) param_len = packet.get<"param_length">();
+
+    /* Subevent specific decoding (legacy, directed, extended, periodic) */
+    return dispatch_le_meta(packet.data(), param_len, pkt_meta, out, max_out, verbose, filter);
+}
+
+processed_adv_event format_adv_event(const adv_event_t& evt){
+    /**
+     * Utility function to build the human-readable form of a record
+     * Intended to be called by consumers, off the capture path
+     * 
+     * @param evt   The captured record
+     * @returns processed_adv_event with event, address and name strings
+    */
+
+    processed_adv_event out;
+    out.event = (uint8_t)evt.event;
+    out.event_s = event_type(evt.event);
+    out.address = addr_to_str(evt.address.address);
+    out.name = std::string(process_ad(evt.data, evt.data_length, false));
+
+    return out;
+}
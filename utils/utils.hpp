@@ -6,9 +6,13 @@
 #define BT_UTILS
 
 #include <string>
+#include <string_view>
 #include <memory>
+#include <sys/socket.h>
 
 #include "bluetoothdef.hpp"
+#include "hci_schema.hpp"
+#include "adv_filter.hpp"
 
 /**
  * @brief
@@ -30,18 +34,62 @@ std::string addr_type(uint8_t addr_type);
 
 /**
  * @brief
- * Processes AD data in HCI_LE_META_EXTENDED_ADVERTISEMENT_RESPONSE_EVENT packet
+ * Current CLOCK_REALTIME time in nanoseconds
 */
-void process_ad(
-	hci_le_meta_ear_event_t *event, std::shared_ptr<processed_adv_event> usr_evt, const bool& verbose);
+uint64_t realtime_ns();
+
+/**
+ * @brief
+ * Current CLOCK_MONOTONIC time in nanoseconds
+*/
+uint64_t monotonic_ns();
+
+/**
+ * @brief
+ * Processes AD data of an advertising record
+ * Returns a view of the device name inside data (empty if not present)
+ * Option to enable printing (verbose)
+*/
+std::string_view process_ad(
+	const uint8_t *data, uint8_t data_length, const bool& verbose);
 
 /**
  * @brief
  * Process HCI_LE_META_EXTENDED_ADVERTSEMENT_RESPOSNE_EVENT packet
- * Pack processed data into user-space struc
+ * Pack raw fields into fixed-size user-space record (no allocation)
  * Option to enable printing (verbose)
 */
 void process_extended_advertising_report(
-	hci_le_meta_ear_event_t *event, std::shared_ptr<processed_adv_event> usr_evt, const bool& verbose);
+	const hciView<leExtendedReportItem>& report, adv_event_t& usr_evt, const bool& verbose);
+
+/**
+ * @brief
+ * Print a record to stdout (verbose mode)
+*/
+void print_adv_event(const adv_event_t& evt);
+
+/**
+ * @brief
+ * Extract kernel timestamp and direction from recvmsg() ancillary data
+ * Falls back to the current time and HCI_DIR_UNKNOWN when absent
+*/
+void parse_hci_cmsg(const struct msghdr *msg, hci_packet_meta_t& meta);
+
+/**
+ * @brief
+ * Parse one raw HCI packet (H4 type octet first) into records
+ * Returns the number of records written to out (at most max_out)
+ * filter selects the reports to keep (nullptr = built-in PDU check)
+*/
+size_t parse_hci_packet(
+	const uint8_t *buf, size_t len, const hci_packet_meta_t& pkt_meta,
+	adv_event_t *out, size_t max_out, const bool& verbose,
+	const advFilter *filter = nullptr);
+
+/**
+ * @brief
+ * Build the string representation of a record on consumer request
+*/
+processed_adv_event format_adv_event(const adv_event_t& evt);
 
-#endif
\ No newline at end of file
+#endif